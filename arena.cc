@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "arena.h"
+
+using namespace std;
+
+arena command_arena;
+
+void* arenaAlloc(arena& mem, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    // Move on to the next block that can hold it. Blocks after the current one come from a
+    // previous line, and are reused before anything new is allocated
+    while (mem.current < mem.blocks.size()) {
+        if (mem.used + size <= mem.sizes[mem.current]) {
+            void* ptr = mem.blocks[mem.current] + mem.used;
+            mem.used += size;
+            mem.peak = max(mem.peak, mem.before + mem.used);
+            return ptr;
+        }
+        mem.before += mem.sizes[mem.current];
+        mem.current++;
+        mem.used = 0;
+    }
+
+    size_t blockSize = max(size, (size_t)ARENA_BLOCK_SIZE);
+    char* block = (char*)aligned_alloc(ARENA_ALIGN, blockSize);
+    if (!block) {
+        perror("arena: out of memory");
+        exit(EXIT_FAILURE);
+    }
+    mem.blocks.push_back(block);
+    mem.sizes.push_back(blockSize);
+    mem.current = mem.blocks.size() - 1;
+    mem.used = size;
+    mem.peak = max(mem.peak, mem.before + mem.used);
+    return block;
+}
+
+arenaMark arenaSave(const arena& mem) { return arenaMark{mem.current, mem.used}; }
+
+void arenaRestore(arena& mem, arenaMark mark) {
+    // Marks are taken in the current block or an earlier one, so this only goes back
+    for (size_t i = mark.block; i < mem.current && i < mem.sizes.size(); i++)
+        mem.before -= mem.sizes[i];
+    mem.current = mark.block;
+    mem.used = mark.used;
+}
+
+void arenaReset(arena& mem) {
+    mem.current = 0;
+    mem.used = 0;
+    mem.before = 0;
+}
+
+size_t arenaCapacity(const arena& mem) {
+    size_t total = 0;
+    for (size_t i = 0; i < mem.sizes.size(); i++)
+        total += mem.sizes[i];
+    return total;
+}
+
+size_t arenaUsed(const arena& mem) { return mem.before + mem.used; }
+
+void arenaFree(arena& mem) {
+    for (size_t i = 0; i < mem.blocks.size(); i++)
+        free(mem.blocks[i]);
+    mem.blocks.clear();
+    mem.sizes.clear();
+    mem.current = 0;
+    mem.used = 0;
+    mem.before = 0;
+}
@@ -0,0 +1,106 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+#include <vector>
+
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN 16
+
+/*
+	struct arena
+	A bump allocator for memory that lives as long as one command line. Allocations are carved out
+	of large blocks, and are never freed one by one: `arenaRestore` rewinds to an earlier mark and
+	the blocks are reused by the next allocations. Blocks are only returned by `arenaFree`
+	------------------
+	Members:
+		blocks: vector<char *> -> The blocks, in the order they are used
+		sizes: vector<size_t> -> Size of each block. Usually ARENA_BLOCK_SIZE, more for a single
+			allocation larger than that
+		current: size_t -> Index of the block allocations come from
+		used: size_t -> Bytes used in the current block
+		before: size_t -> Total size of the blocks before the current one
+		peak: size_t -> Most bytes ever in use at once (see `arenaUsed`), for `memstat`
+	------------------
+*/
+struct arena {
+    std::vector<char*> blocks;
+    std::vector<size_t> sizes;
+    size_t current = 0;
+    size_t used = 0;
+    size_t before = 0;
+    size_t peak = 0;
+};
+
+/*
+	command_arena: arena
+		Memory for one command: the token spans of its line, argv arrays and the scratch buffers of
+		builtins. The loops that read commands (`runBatch`, and readline's line handler) reset it
+		after each one, so a long session allocates nothing new from one command to the next. A
+		line run from inside a command allocates after it and is released with it
+*/
+extern arena command_arena;
+
+/*
+	struct arenaMark
+	A position in an arena, saved with `arenaSave`
+*/
+struct arenaMark {
+    size_t block;
+    size_t used;
+};
+
+/*
+	void *arenaAlloc(arena &mem, size_t size)
+	------------------
+	Allocate size bytes aligned to ARENA_ALIGN. The memory is uninitialized
+	Exits the shell if the system is out of memory, like `new` would
+*/
+void* arenaAlloc(arena& mem, size_t size);
+
+/*
+	T *arenaArray<T>(arena &mem, size_t count)
+	------------------
+	Allocate an uninitialized array of count trivial objects
+*/
+template <typename T>
+T* arenaArray(arena& mem, size_t count) {
+    return (T*)arenaAlloc(mem, count * sizeof(T));
+}
+
+/*
+	arenaMark arenaSave(const arena &mem)
+	void arenaRestore(arena &mem, arenaMark mark)
+	------------------
+	Save the current position, and later release everything allocated after it. Marks nest, so
+	a line run from inside another one (e.g. a command substitution) does not disturb its caller
+*/
+arenaMark arenaSave(const arena& mem);
+void arenaRestore(arena& mem, arenaMark mark);
+
+/*
+	void arenaReset(arena &mem)
+	------------------
+	Release everything allocated in mem, keeping its blocks for the next allocations
+*/
+void arenaReset(arena& mem);
+
+/*
+	size_t arenaCapacity(const arena &mem)
+	size_t arenaUsed(const arena &mem)
+	------------------
+	Total size of the blocks held by the arena, and the bytes from the start of its first block to
+	the last allocation (including what was skipped at the end of full blocks)
+*/
+size_t arenaCapacity(const arena& mem);
+size_t arenaUsed(const arena& mem);
+
+/*
+	void arenaFree(arena &mem)
+	------------------
+	Return every block to the system
+*/
+void arenaFree(arena& mem);
+
+#endif // ARENA_H_
@@ -0,0 +1,74 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "batch.h"
+
+using namespace std;
+
+void batchFromFD(batchReader& reader, int fd) {
+    reader.fd = fd;
+    reader.buffer.clear();
+    reader.start = 0;
+    reader.eof = false;
+}
+
+void batchFromString(batchReader& reader, const char* text) {
+    reader.fd = -1;
+    reader.buffer = text;
+    reader.start = 0;
+    reader.eof = true;
+}
+
+// Append one more chunk of input to the buffer. Returns false at end of input
+static bool fillBuffer(batchReader& reader) {
+    if (reader.eof)
+        return false;
+
+    // Drop the lines already returned, so the buffer does not keep growing on long scripts
+    if (reader.start > 0) {
+        reader.buffer.erase(0, reader.start);
+        reader.start = 0;
+    }
+
+    size_t used = reader.buffer.size();
+    reader.buffer.resize(used + BATCH_BUFSIZE);
+
+    ssize_t n;
+    do {
+        n = read(reader.fd, &reader.buffer[used], BATCH_BUFSIZE);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        if (n < 0)
+            perror("read() failed");
+        reader.buffer.resize(used);
+        reader.eof = true;
+        return false;
+    }
+    reader.buffer.resize(used + n);
+    return true;
+}
+
+bool batchReadLine(batchReader& reader, string& line) {
+    while (true) {
+        size_t newline = reader.buffer.find('\n', reader.start);
+        if (newline != string::npos) {
+            line.assign(reader.buffer, reader.start, newline - reader.start);
+            reader.start = newline + 1;
+            return true;
+        }
+
+        if (!fillBuffer(reader)) {
+            // Last line of the input without a trailing newline
+            if (reader.start < reader.buffer.size()) {
+                line.assign(reader.buffer, reader.start, string::npos);
+                reader.start = reader.buffer.size();
+                return true;
+            }
+            return false;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <string>
+
+#define BATCH_BUFSIZE 65536
+
+/*
+	struct batchReader
+	Line reader for non-interactive input (`-c` strings, script files and piped stdin)
+	Input is read in BATCH_BUFSIZE chunks with `read`, instead of going through readline or stdio
+	------------------
+	Members:
+		fd: int -> Descriptor lines are read from, -1 when reading from a fixed string
+		buffer: string -> Bytes read but not yet returned as lines
+		start: size_t -> Offset of the next unread byte in buffer
+		eof: bool -> Set once `read` has returned 0, or from the start for a fixed string
+	------------------
+*/
+struct batchReader {
+    int fd;
+    std::string buffer;
+    size_t start;
+    bool eof;
+};
+
+/*
+	void batchFromFD(batchReader &reader, int fd)
+	void batchFromString(batchReader &reader, const char *text)
+	------------------
+	Set up reader to return the lines read from fd, or the lines of text (used for `-c`)
+*/
+void batchFromFD(batchReader& reader, int fd);
+void batchFromString(batchReader& reader, const char* text);
+
+/*
+	bool batchReadLine(batchReader &reader, std::string &line)
+	------------------
+	Store the next line (without its newline) in line. Returns false once the input is exhausted
+*/
+bool batchReadLine(batchReader& reader, std::string& line);
+
+#endif // BATCH_H_
@@ -0,0 +1,426 @@
+/*
+	Benchmark suite
+	------------------
+	Measures the parts of the shell every command goes through:
+		tokenize.*   tokenizing a command line into tokens and pipeline stages, in MB/s
+		dispatch.*   telling whether a command is a builtin, in ns per lookup
+		spawn.*      starting and reaping `true`, with each launch engine, p50/p99 in us
+		pipeline.*   bytes pushed through N `cat` stages joined by the shell's pipes, in MB/s
+		prompt.*     rendering the prompt, in us
+
+	The harness is linked against every object of the shell but shell.o, so it times the same code
+	the shell runs. Results are printed as a table on stderr and, with -o, written as JSON with one
+	result per line:
+		{"name": "dispatch.hit", "value": 12.5, "unit": "ns", "better": "lower"}
+
+	`bench --compare old.json new.json` prints the change of every result found in both files, and
+	exits with 1 if any got worse by more than the threshold (5% unless -t is given)
+
+	Build and run with `make bench`, which writes bench/results.json
+*/
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../arena.h"
+#include "../builtins.h"
+#include "../pipes.h"
+#include "../prompt.h"
+#include "../registry.h"
+#include "../spawner.h"
+#include "../tokenizer.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define BENCH_PIPELINE_BYTES (64 << 20) // Size of the file pushed through the pipelines
+#define BENCH_THRESHOLD 5.0              // Default regression threshold of --compare, in percent
+
+using namespace std;
+
+/*
+	struct benchResult
+	One measurement, as written to the JSON file
+	------------------
+	Members:
+		name: string -> Dotted name, stable across versions so results can be compared
+		value: double -> The measurement, in unit
+		unit: string -> "MB/s", "ns" or "us"
+		lower: bool -> Whether a lower value is better
+	------------------
+*/
+struct benchResult {
+    string name;
+    double value;
+    string unit;
+    bool lower;
+};
+
+static vector<benchResult> results;
+
+// Where results that are otherwise unused go, so the compiler keeps the code computing them
+static volatile long sink;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record(const string& name, double value, const char* unit, bool lower) {
+    results.push_back({name, value, unit, lower});
+    fprintf(stderr, "%-28s %12.2f %s\n", name.c_str(), value, unit);
+}
+
+// Value at fraction q of sorted samples
+static double percentile(vector<double>& samples, double q) {
+    sort(samples.begin(), samples.end());
+    return samples[min(samples.size() - 1, (size_t)(q * samples.size()))];
+}
+
+/*
+	Tokenizer
+*/
+
+// A command line of about size bytes, with quoting, escapes and a pipe every few arguments
+static string commandLine(size_t size) {
+    const char* words[] = {
+        "grep", "-F", "'some quoted text'", "src/shell.cc", "\"$HOME/a dir\"",
+        "--name=with\\ escaped\\ spaces", "|", "sort", "-k2,2n", "|", "head", "-n", "20",
+    };
+    size_t count = sizeof(words) / sizeof(words[0]);
+    string line = "cat";
+    for (size_t i = 0; line.size() < size; i++)
+        line.append(" ").append(words[i % count]);
+    return line;
+}
+
+static void benchTokenizer() {
+    size_t sizes[] = {64, 4096, 1 << 20};
+    arena mem;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        string line = commandLine(sizes[s]);
+        vector<char> buffer(line.size() + 1);
+        int iterations = max(20, (int)((16 << 20) / line.size()));
+        tokenizedLine parsed;
+
+        // The tokenizer rewrites the line, so each run starts from a fresh copy, as the shell's
+        // own buffer would be. The copy is timed on its own and taken out
+        double start = now();
+        for (int i = 0; i < iterations; i++)
+            memcpy(buffer.data(), line.c_str(), line.size() + 1);
+        double copy = now() - start;
+
+        start = now();
+        size_t tokens = 0;
+        for (int i = 0; i < iterations; i++) {
+            memcpy(buffer.data(), line.c_str(), line.size() + 1);
+            arenaMark mark = arenaSave(mem);
+            tokens += tokenizeLine(buffer.data(), line.size(), mem, parsed);
+            arenaRestore(mem, mark);
+        }
+        double spans = max(now() - start - copy, 1e-9);
+
+        // What executeLine does with the spans: strings for the whole line and for each stage
+        start = now();
+        for (int i = 0; i < iterations; i++) {
+            memcpy(buffer.data(), line.c_str(), line.size() + 1);
+            arenaMark mark = arenaSave(mem);
+            tokenizeLine(buffer.data(), line.size(), mem, parsed);
+            vector<string> all = tokenStrings(parsed);
+            vector<vector<string>> stages = stageStrings(parsed);
+            tokens += all.size() + stages.size();
+            arenaRestore(mem, mark);
+        }
+        double strings = max(now() - start - copy, 1e-9);
+
+        sink = tokens;
+        double megabytes = (double)line.size() * iterations / (1 << 20);
+        record("tokenize.spans." + to_string(sizes[s]) + "B", megabytes / spans, "MB/s", false);
+        record("tokenize.strings." + to_string(sizes[s]) + "B", megabytes / strings, "MB/s", false);
+    }
+    arenaFree(mem);
+}
+
+/*
+	Builtin dispatch
+*/
+
+static void benchDispatch() {
+    vector<string> hits;
+    for (size_t i = 0; i < builtins.size(); i++)
+        hits.push_back(builtins[i].command);
+    vector<string> misses = {"ls", "git", "make", "python3", "sed", "awk", "find", "ssh"};
+    const int rounds = 200000;
+
+    vector<string>* sets[] = {&hits, &misses};
+    const char* names[] = {"dispatch.hit", "dispatch.miss"};
+    for (int k = 0; k < 2; k++) {
+        const vector<string>& commands = *sets[k];
+        long found = 0;
+        double start = now();
+        for (int r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < commands.size(); i++)
+                found += checkBuiltin(commands[i]);
+        }
+        double elapsed = now() - start;
+        sink = found;
+        record(names[k], elapsed * 1e9 / ((double)rounds * commands.size()), "ns", true);
+    }
+}
+
+/*
+	Spawn latency
+*/
+
+static void benchSpawn() {
+    int modes[] = {SPAWN_POSIX, SPAWN_FORK};
+    const char* names[] = {"posix", "fork"};
+    int saved = spawn_mode;
+    const int iterations = 1000;
+
+    for (int m = 0; m < 2; m++) {
+        spawn_mode = modes[m];
+        vector<double> samples;
+        spawnAttributes attr;
+        for (int i = 0; i < iterations; i++) {
+            double start = now();
+            pid_t pid = metash_spawn({"true"}, attr);
+            if (pid < 0)
+                return;
+            int status;
+            waitpid(pid, &status, 0);
+            samples.push_back((now() - start) * 1e6);
+        }
+        record(string("spawn.") + names[m] + ".p50", percentile(samples, 0.50), "us", true);
+        record(string("spawn.") + names[m] + ".p99", percentile(samples, 0.99), "us", true);
+    }
+    spawn_mode = saved;
+}
+
+/*
+	Pipeline throughput
+*/
+
+// Push the file at input through stages `cat` processes into /dev/null. Returns MB/s
+static double runPipeline(int input, int stages) {
+    int output = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    vector<pid_t> pids;
+    int previous = -1;
+
+    lseek(input, 0, SEEK_SET);
+    double start = now();
+    for (int i = 0; i < stages; i++) {
+        int fds[2] = {-1, -1};
+        if (i + 1 < stages && makePipe(fds) < 0)
+            break;
+        spawnAttributes attr;
+        attr.inputFD = i == 0 ? input : previous;
+        attr.outputFD = i + 1 < stages ? fds[1] : output;
+        pid_t pid = metash_spawn({"cat"}, attr);
+        if (pid > 0)
+            pids.push_back(pid);
+        if (previous >= 0)
+            close(previous);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        previous = fds[0];
+    }
+    for (size_t i = 0; i < pids.size(); i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+    }
+    double elapsed = now() - start;
+    close(output);
+    return (double)BENCH_PIPELINE_BYTES / (1 << 20) / elapsed;
+}
+
+static void benchPipeline() {
+    char path[] = "/tmp/metash-bench-XXXXXX";
+    int input = mkstemp(path);
+    if (input < 0) {
+        perror("mkstemp");
+        return;
+    }
+    unlink(path);
+
+    string block(1 << 16, 'x');
+    for (size_t i = 63; i < block.size(); i += 64)
+        block[i] = '\n';
+    for (size_t written = 0; written < BENCH_PIPELINE_BYTES; written += block.size()) {
+        if (write(input, block.data(), block.size()) != (ssize_t)block.size()) {
+            perror("write");
+            close(input);
+            return;
+        }
+    }
+
+    // Best of three, so a hiccup of the machine does not count as a regression
+    long saved = pipe_size;
+    int stageCounts[] = {1, 2, 4, 8};
+    for (size_t s = 0; s < sizeof(stageCounts) / sizeof(stageCounts[0]); s++) {
+        double best = 0;
+        for (int run = 0; run < 3; run++)
+            best = max(best, runPipeline(input, stageCounts[s]));
+        record("pipeline." + to_string(stageCounts[s]), best, "MB/s", false);
+    }
+
+    pipe_size = min(1L << 20, pipeMaxSize());
+    double best = 0;
+    for (int run = 0; run < 3; run++)
+        best = max(best, runPipeline(input, 4));
+    record("pipeline.4.1MiB", best, "MB/s", false);
+    pipe_size = saved;
+    close(input);
+}
+
+/*
+	Prompt
+*/
+
+static void benchPrompt() {
+    initPrompt();
+    const int iterations = 2000;
+
+    // Same directory every time: served from the cached rendering
+    getShellPrompt();
+    double start = now();
+    for (int i = 0; i < iterations; i++)
+        getShellPrompt();
+    record("prompt.cached", (now() - start) * 1e6 / iterations, "us", true);
+
+    // A new directory on every prompt rebuilds it, and asks the slow thread for the branch
+    char cwd[BUFSIZE];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return;
+    const char* dirs[] = {"/", "/tmp"};
+    const int changes = 200;
+    start = now();
+    for (int i = 0; i < changes; i++) {
+        metash_cd({"cd", dirs[i % 2]});
+        getShellPrompt();
+    }
+    record("prompt.chdir", (now() - start) * 1e6 / changes, "us", true);
+    metash_cd({"cd", cwd});
+}
+
+/*
+	JSON
+*/
+
+static int writeResults(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return -1;
+    }
+    fprintf(out, "{\n  \"version\": \"%s\",\n  \"results\": [\n", BENCH_VERSION);
+    for (size_t i = 0; i < results.size(); i++) {
+        const benchResult& r = results[i];
+        fprintf(out,
+                "    {\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\", \"better\": \"%s\"}%s\n",
+                r.name.c_str(), r.value, r.unit.c_str(), r.lower ? "lower" : "higher",
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+// Read the results of a file written by writeResults. Lines that are not a result are skipped
+static int readResults(const char* path, vector<benchResult>& out) {
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return -1;
+    }
+    char line[512], name[128], unit[16], better[16];
+    double value;
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line,
+                   " {\"name\": \"%127[^\"]\", \"value\": %lf, \"unit\": \"%15[^\"]\", "
+                   "\"better\": \"%15[^\"]\"}",
+                   name, &value, unit, better) == 4)
+            out.push_back({name, value, unit, strcmp(better, "lower") == 0});
+    }
+    fclose(in);
+    return 0;
+}
+
+static int compareResults(const char* oldPath, const char* newPath, double threshold) {
+    vector<benchResult> before, after;
+    if (readResults(oldPath, before) < 0 || readResults(newPath, after) < 0)
+        return 2;
+
+    int regressions = 0;
+    printf("%-28s %12s %12s %8s\n", "benchmark", "old", "new", "change");
+    for (size_t i = 0; i < after.size(); i++) {
+        const benchResult& b = after[i];
+        size_t j = 0;
+        while (j < before.size() && before[j].name != b.name)
+            j++;
+        if (j == before.size()) {
+            printf("%-28s %12s %12.2f %8s  %s\n", b.name.c_str(), "-", b.value, "", b.unit.c_str());
+            continue;
+        }
+
+        const benchResult& a = before[j];
+        double change = a.value != 0 ? (b.value - a.value) * 100 / a.value : 0;
+        double worse = b.lower ? change : -change;
+        const char* verdict = "";
+        if (worse > threshold) {
+            verdict = "  regression";
+            regressions++;
+        } else if (worse < -threshold) {
+            verdict = "  better";
+        }
+        printf("%-28s %12.2f %12.2f %+7.1f%%  %s%s\n", b.name.c_str(), a.value, b.value, change,
+               b.unit.c_str(), verdict);
+    }
+    return regressions > 0 ? 1 : 0;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: bench [-o results.json]\n"
+                    "       bench --compare old.json new.json [-t percent]\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "--compare") == 0) {
+        if (argc != 4 && !(argc == 6 && strcmp(argv[4], "-t") == 0)) {
+            usage();
+            return 2;
+        }
+        double threshold = argc == 6 ? atof(argv[5]) : BENCH_THRESHOLD;
+        return compareResults(argv[2], argv[3], threshold);
+    }
+
+    const char* output = NULL;
+    if (argc == 3 && strcmp(argv[1], "-o") == 0) {
+        output = argv[2];
+    } else if (argc != 1) {
+        usage();
+        return 2;
+    }
+
+    fprintf(stderr, "meta.sh %s\n", BENCH_VERSION);
+    benchTokenizer();
+    benchDispatch();
+    benchSpawn();
+    benchPipeline();
+    benchPrompt();
+
+    if (output && writeResults(output) < 0)
+        return 1;
+    return 0;
+}
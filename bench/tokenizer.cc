@@ -0,0 +1,192 @@
+/*
+	Tokenizer microbenchmark
+	------------------
+	Times the span tokenizer against the one it replaced (copied below as `legacyTokenize` and
+	`legacyParsePipeTokens`) on long pasted command lines, and checks that both give the same tokens
+
+	Build and run with `make bench/tokenizer && ./bench/tokenizer`
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../tokenizer.h"
+
+using namespace std;
+
+#define LEGACY_MAXTOKEN 1024
+
+static vector<string> legacyTokenize(char* line) {
+    vector<string> tokens;
+    if (line == NULL) {
+        return {};
+    }
+
+    static char token[LEGACY_MAXTOKEN];
+    memset(token, '\0', LEGACY_MAXTOKEN);
+    size_t n = 0;
+    size_t len = strlen(line);
+
+    const int MODE_NORMAL = 0, MODE_SQUOTE = 1, MODE_DQUOTE = 2;
+    int mode = MODE_NORMAL;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = line[i];
+        if (mode == MODE_NORMAL) {
+            if (c == '\'') {
+                mode = MODE_SQUOTE;
+            } else if (c == '"') {
+                mode = MODE_DQUOTE;
+            } else if (c == '\\') {
+                if (i + 1 < len) {
+                    token[n++] = line[++i];
+                }
+            } else if (isspace(c)) {
+                if (n > 0) {
+                    token[n] = '\0';
+                    char* temp = (char*)malloc(n + 1);
+                    memcpy(temp, token, n + 1);
+                    string word = temp;
+                    tokens.push_back(word);
+                    n = 0;
+                    memset(token, '\0', LEGACY_MAXTOKEN);
+                }
+            } else {
+                token[n++] = c;
+            }
+        } else if (mode == MODE_SQUOTE) {
+            if (c == '\'') {
+                mode = MODE_NORMAL;
+            } else if (c == '\\') {
+                if (i + 1 < len) {
+                    token[n++] = line[++i];
+                }
+            } else {
+                token[n++] = c;
+            }
+        } else if (mode == MODE_DQUOTE) {
+            if (c == '"') {
+                mode = MODE_NORMAL;
+            } else if (c == '\\') {
+                if (i + 1 < len) {
+                    token[n++] = line[++i];
+                }
+            } else {
+                token[n++] = c;
+            }
+        }
+        if (n + 1 >= LEGACY_MAXTOKEN)
+            abort();
+    }
+
+    if (n > 0) {
+        string temp = token;
+        tokens.push_back(temp);
+        n = 0;
+    }
+    return tokens;
+}
+
+static vector<vector<string>> legacyParsePipeTokens(vector<string> tokens) {
+    vector<vector<string>> parsedTokens;
+    vector<string> temp;
+    size_t num_tokens = tokens.size();
+
+    for (size_t i = 0; i < num_tokens; i++) {
+        if (tokens[i] != "|") {
+            temp.push_back(tokens[i]);
+        } else {
+            parsedTokens.push_back(temp);
+            temp.clear();
+        }
+    }
+    parsedTokens.push_back(temp);
+
+    return parsedTokens;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A pasted line of about size bytes: long arguments, quoting, escapes and a few pipes
+static string makeLine(size_t size) {
+    const char* pieces[] = {
+        "find /usr/share/doc -name '*.txt' -newer /var/log/dpkg.log ",
+        "--exclude=\"build output/**\" --include=src/\\*.cc ",
+        "\"a fairly long double quoted argument, with 'nested' quotes\" ",
+        "/home/user/projects/metash/some/deeply/nested/path/to/a/file.cc ",
+        "| grep -F 'needle in a haystack' ",
+        "--define=KEY_NUMBER_1=value-with-dashes\\ and\\ escaped\\ spaces ",
+    };
+    string line;
+    for (size_t i = 0; line.size() < size; i++)
+        line += pieces[i % (sizeof(pieces) / sizeof(pieces[0]))];
+    return line;
+}
+
+int main() {
+    size_t sizes[] = {256, 4096, 65536, 1 << 20};
+    arena mem;
+
+    printf("%10s %14s %14s %14s %8s\n", "line", "legacy", "spans", "spans+stages", "speedup");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        string line = makeLine(sizes[s]);
+        vector<char> buffer(line.size() + 1);
+        int iterations = max(10, (int)((16 << 20) / line.size()));
+
+        // Same tokens from both, before timing anything
+        memcpy(buffer.data(), line.c_str(), line.size() + 1);
+        vector<vector<string>> expected = legacyParsePipeTokens(legacyTokenize(buffer.data()));
+        memcpy(buffer.data(), line.c_str(), line.size() + 1);
+        tokenizedLine parsed;
+        tokenizeLine(buffer.data(), line.size(), mem, parsed);
+        if (stageStrings(parsed) != expected) {
+            printf("token mismatch for a %zu byte line\n", line.size());
+            return 1;
+        }
+        arenaRestore(mem, arenaMark{0, 0});
+
+        // Each run tokenizes a fresh copy, since the span tokenizer rewrites the line. The legacy
+        // tokenizer leaks a copy of each token, hence the small iteration budget
+        double start = now();
+        for (int i = 0; i < iterations; i++) {
+            memcpy(buffer.data(), line.c_str(), line.size() + 1);
+            vector<vector<string>> stages = legacyParsePipeTokens(legacyTokenize(buffer.data()));
+        }
+        double legacy = (now() - start) / iterations;
+
+        start = now();
+        size_t count = 0;
+        for (int i = 0; i < iterations; i++) {
+            memcpy(buffer.data(), line.c_str(), line.size() + 1);
+            arenaMark mark = arenaSave(mem);
+            count += tokenizeLine(buffer.data(), line.size(), mem, parsed);
+            arenaRestore(mem, mark);
+        }
+        double spans = (now() - start) / iterations;
+
+        start = now();
+        for (int i = 0; i < iterations; i++) {
+            memcpy(buffer.data(), line.c_str(), line.size() + 1);
+            arenaMark mark = arenaSave(mem);
+            tokenizeLine(buffer.data(), line.size(), mem, parsed);
+            vector<vector<string>> stages = stageStrings(parsed);
+            arenaRestore(mem, mark);
+        }
+        double stages = (now() - start) / iterations;
+
+        if (count == 0)
+            return 1;
+        printf("%9zuB %12.2fus %12.2fus %12.2fus %7.1fx\n", line.size(), legacy * 1e6,
+               spans * 1e6, stages * 1e6, legacy / stages);
+    }
+    return 0;
+}
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <pwd.h>
 #include <string.h>
 #include <fcntl.h>
@@ -6,6 +7,7 @@
 
 #include <algorithm>
 
+#include <malloc.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
@@ -16,39 +18,41 @@
 #include <sys/utsname.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "builtins.h"
+#include "dirs.h"
+#include "histindex.h"
+#include "histstore.h"
+#include "monitor.h"
+#include "pathcache.h"
 #include "utils.h"
+#include "vars.h"
 
 using namespace std;
 
 char __CWD[BUFSIZE];
 
-int metash_exit(unused vector<string> tokens) { exit(EXIT_SUCCESS); }
+int metash_exit(unused const vector<string>& tokens) { exit(EXIT_SUCCESS); }
+
+int metash_help(const vector<string>& tokens) {
+    size_t num_builtins = builtins.size();
+
+    // The banner is 73 columns wide, with 61 columns between the ++++++ borders
+    char title[64];
+    int title_len = snprintf(title, sizeof(title), "Hi there. There are %zu builtin commands",
+                             num_builtins);
+    int left = (55 - title_len) / 2;
+    int right = 55 - title_len - left;
 
-int metash_help(vector<string> tokens) {
     printf("%s+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++%s\n",
            PURPLE, NORM);
-    printf("%s++++++%s /\\        %sHi there. There are \033[4mfive%s %sbuiltin commands%s     /\\ "
-           " %s++++++%s\n",
-           PURPLE, NORM, CYAN, NORM, CYAN, NORM, PURPLE, NORM);
-    printf("%s++++++%s cd%s:       Changes working directory to the one specified    %s++++++%s\n",
-           PURPLE, YELLOW, NORM, PURPLE, NORM);
-    printf("%s++++++%s pwd%s:      Shows current working directory                   %s++++++%s\n",
-           PURPLE, YELLOW, NORM, PURPLE, NORM);
-    printf("%s++++++%s help%s:     Shows this help text                              %s++++++%s\n",
-           PURPLE, YELLOW, NORM, PURPLE, NORM);
-    printf("%s++++++%s exit%s:     Cleanly exits the shell                           %s++++++%s\n",
-           PURPLE, YELLOW, NORM, PURPLE, NORM);
-    printf("%s++++++%s fetch%s:    Show system information                           %s++++++%s\n",
-           PURPLE, YELLOW, NORM, PURPLE, NORM);
-    printf("%s++++++%s history%s:  Show all commands executed on the shell           %s++++++%s\n",
-           PURPLE, YELLOW, NORM, PURPLE, NORM);
-    printf("%s++++++%s getenv%s:   Set an environment variable to specified value    %s++++++%s\n",
-           PURPLE, YELLOW, NORM, PURPLE, NORM);
-    printf("%s++++++%s setenv%s:   Fetch the value of the given environment variable %s++++++%s\n",
-           PURPLE, YELLOW, NORM, PURPLE, NORM);
-    printf("%s++++++%s unsetenv%s: Unset the given environment variable              %s++++++%s\n",
-           PURPLE, YELLOW, NORM, PURPLE, NORM);
+    printf("%s++++++%s /\\%*s%s%s%s%*s/\\ %s++++++%s\n", PURPLE, NORM, left, "", CYAN, title, NORM,
+           right, "", PURPLE, NORM);
+    for (size_t i = 0; i < num_builtins; i++) {
+        string command = string(builtins[i].command) + ":";
+        printf("%s++++++%s %-10s%s %-49.49s%s++++++%s\n", PURPLE, YELLOW, command.c_str(), NORM,
+               builtins[i].help, PURPLE, NORM);
+    }
     printf("%s++++++%s Anything else is considered as an executable, and should    %s++++++%s\n",
            PURPLE, BLUE, PURPLE, NORM);
     printf("%s++++++%s be present in your PATH. \033[1;3;34mEnjoy!%s                             "
@@ -60,56 +64,48 @@ int metash_help(vector<string> tokens) {
     return 0;
 }
 
-int metash_pwd(vector<string> tokens) {
+int metash_pwd(const vector<string>& tokens) {
     size_t num_tokens = tokens.size();
     if (num_tokens >= 2) {
         printf("pwd: too many arguments\n");
         return -1;
     }
 
-    char* current_directory = (char*)malloc(BUFSIZE * sizeof(char));
-    string pwd = getcwd(current_directory, BUFSIZE);
-    if (!pwd.empty()) {
-        printf("%s\n", pwd.c_str());
+    char* current_directory = arenaArray<char>(command_arena, BUFSIZE);
+    if (getcwd(current_directory, BUFSIZE) != NULL) {
+        printf("%s\n", current_directory);
         return 0;
     }
     perror("Error in fetching current working directory");
     return -1;
 }
 
-int metash_cd(vector<string> tokens) {
-    size_t num_tokens = tokens.size();
-    if (num_tokens >= 3) {
-        printf("cd: too many arguments\n");
+int metash_cd(const vector<string>& tokens) {
+    string path;
+    if (tokens.size() == 1) {
+        path = getHomeDirectory();
+    } else if (tokens.size() == 2 && tokens[1] == "-") {
+        const string* previous = findVariable("OLDPWD");
+        if (!previous) {
+            printf("cd: OLDPWD not set\n");
+            return -1;
+        }
+        path = *previous;
+    } else if (resolveDirectory(vector<string>(tokens.begin() + 1, tokens.end()), path) < 0) {
         return -1;
     }
 
-    string new_directory_rel;
-    char* new_directory = (char*)malloc(BUFSIZE * sizeof(char));
-    // If no argument is passed, assume cd to home directory of user. Fetch home directory path
-    if (num_tokens == 1) {
-        uid_t uid = getuid();
-        struct passwd* pw = getpwuid(uid);
-        new_directory_rel =
-            pw->pw_dir; // Stores the home direcoty path of the user executing the program
-    } else {
-        new_directory_rel = tokens[1];
-    }
-    // In case of links, or if a relative path is specified, generate the real path
-    char* temp = realpath(new_directory_rel.c_str(), new_directory);
-    if (!temp)
-        perror("Couldn't get realpath");
-
-    int ret = chdir(new_directory);
-    if (ret < 0) {
-        printf("Error in changing current directory. pwd not changed");
+    if (changeDirectory(path) < 0)
         return -1;
-    }
-    strcpy(__CWD, new_directory);
+    if (tokens.size() == 2 && tokens[1] == "-")
+        printf("%s\n", __CWD);
     return 0;
 }
 
-int metash_fetch(unused vector<string> tokens) {
+int metash_fetch(const vector<string>& tokens) {
+    if (tokens.size() > 1)
+        return metash_watch(tokens);
+
     // Fetch username, hostname and OS Name
     unused string username = getUsername();
     unused string hostname = getHostname();
@@ -137,17 +133,15 @@ int metash_fetch(unused vector<string> tokens) {
     if (sysinfo(&info) < 0)
         perror("sysinfo() error");
     else {
-        total_memory = info.totalram;
-        free_memory = info.freeram;
+        total_memory = (long)info.totalram * info.mem_unit;
+        free_memory = (long)info.freeram * info.mem_unit;
         consumed_memory = total_memory - free_memory;
         uptime = info.uptime;
     }
 
-    char* user_host_string = (char*)malloc(BUFSIZE * sizeof(char));
-    sprintf(user_host_string, "%s%s@%s%s\n", BLUE, username.c_str(), hostname.c_str(), NORM);
     size_t len = username.size() + hostname.size();
 
-    printf("%s", user_host_string);
+    printf("%s%s@%s%s\n", BLUE, username.c_str(), hostname.c_str(), NORM);
     for (size_t i = 0; i <= len; i++)
         printf("-");
     printf("\n");
@@ -155,9 +149,9 @@ int metash_fetch(unused vector<string> tokens) {
     printf("%sOS%s:       %s\n", BLUE, NORM, OSname.c_str());
     printf("%sKernel%s:   %s %s\n", BLUE, NORM, kernel_name.c_str(), kernel_version.c_str());
     printf("%sPlatform%s: %s\n", BLUE, NORM, machine.c_str());
-    printf("%sMemory%s:   %s / %s\n", BLUE, NORM, parse_memory(consumed_memory),
-           parse_memory(total_memory));
-    printf("%sUptime%s:   %s\n", BLUE, NORM, parse_time(uptime));
+    printf("%sMemory%s:   %s / %s\n", BLUE, NORM, parse_memory(consumed_memory).c_str(),
+           parse_memory(total_memory).c_str());
+    printf("%sUptime%s:   %s\n", BLUE, NORM, parse_time(uptime).c_str());
     printf("%sShell%s:    %s %s\n", BLUE, NORM, SHELL, VERSION);
     printf("%sAuthors%s:  %s\n", BLUE, NORM, AUTHORS);
 
@@ -167,7 +161,7 @@ int metash_fetch(unused vector<string> tokens) {
 int metash_execute(vector<string> tokens) {
     /*
 		Check if there is a < token in the token vector. If found, the next token of < will be the filename
-		Remove this token and the filename since the execvp call needs only the arguments passed
+		Remove this token and the filename since the execv call needs only the arguments passed
 		Open the file and use the `dup2` system call to set appropriate file descriptor entry
 	*/
 
@@ -195,33 +189,88 @@ int metash_execute(vector<string> tokens) {
     }
 
     size_t num_tokens = tokens.size();
-    // `execvp` requires a char array with the last element set to NULL
-    char* args[num_tokens + 1];
+    // `execv` requires a char array with the last element set to NULL
+    char** args = arenaArray<char*>(command_arena, num_tokens + 1);
     for (size_t i = 0; i < tokens.size(); i++)
         args[i] = (char*)(tokens[i].c_str());
 
     args[num_tokens] = NULL;
 
-    int ret = execvp(tokens[0].c_str(), args);
+    // The path is normally already in the cache, resolved by the parent before forking
+    string path = resolveCommand(tokens[0]);
+    if (path.empty()) {
+        printf("%s: command not found: %s\n", SHELL, tokens[0].c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    int ret = execv(path.c_str(), args);
     if (ret == -1) {
-        printf("execvp() failed: Command not found: %s\n", tokens[0].c_str());
+        printf("execv() failed: %s: %s\n", tokens[0].c_str(), strerror(errno));
     }
     exit(EXIT_FAILURE);
 }
 
-int metash_history(unused vector<string> tokens) {
-    HIST_ENTRY** hist_list = history_list();
+// history search [-f] [-n N] query...
+static int searchHistoryEntries(const vector<string>& tokens) {
+    bool fuzzy = false;
+    long limit = HISTINDEX_RESULTS;
+    size_t i = 2;
+    for (; i < tokens.size(); i++) {
+        if (tokens[i] == "-f") {
+            fuzzy = true;
+        } else if (tokens[i] == "-n" && i + 1 < tokens.size()) {
+            limit = atol(tokens[++i].c_str());
+        } else {
+            break;
+        }
+    }
 
-    if (!hist_list)
+    string query;
+    for (; i < tokens.size(); i++)
+        query += (query.empty() ? "" : " ") + tokens[i];
+    if (query.empty() || limit <= 0) {
+        printf("history: expected `history search [-f] [-n N] query`\n");
         return 1;
+    }
+
+    vector<historyMatch> matches;
+    if (searchHistory(query, fuzzy, limit, matches) < 0)
+        return 1;
+    for (size_t j = 0; j < matches.size(); j++) {
+        printf("%s%lu%s: %s", RED, matches[j].last, NORM, matches[j].command.c_str());
+        if (matches[j].count > 1)
+            printf(" %s(x%lu)%s", GRAY, matches[j].count, NORM);
+        printf("\n");
+    }
+    return matches.empty() ? 1 : 0;
+}
 
-    for (int i = 0; i < history_length; i++)
-        printf("%s%d%s: %s\n", RED, i + history_base, NORM, hist_list[i]->line);
+int metash_history(const vector<string>& tokens) {
+    if (tokens.size() > 1 && tokens[1] == "search")
+        return searchHistoryEntries(tokens);
+
+    vector<string> entries;
+    if (readHistory(entries) < 0)
+        return 1;
+
+    size_t first = 0;
+    if (tokens.size() > 1) {
+        long count = atol(tokens[1].c_str());
+        if (count <= 0) {
+            printf("history: expected a positive number of entries\n");
+            return 1;
+        }
+        if ((size_t)count < entries.size())
+            first = entries.size() - count;
+    }
+
+    for (size_t i = first; i < entries.size(); i++)
+        printf("%s%zu%s: %s\n", RED, i + 1, NORM, entries[i].c_str());
 
     return 0;
 }
 
-int metash_setenv(vector<string> tokens) {
+int metash_setenv(const vector<string>& tokens) {
     size_t num_tokens = tokens.size();
     if (num_tokens >= 4) {
         printf("setenv: too many arguments\n");
@@ -240,15 +289,18 @@ int metash_setenv(vector<string> tokens) {
         value = tokens[num_tokens - 1];
 
     string key = tokens[1];
-
-    int status = setenv(key.c_str(), value.c_str(), 69);
-    if (status == -1)
+    if (!isAssignment(key + "=")) {
+        printf("setenv: not a valid name: %s\n", key.c_str());
         return -1;
+    }
+
+    // Also clears the cached command paths if PATH changed
+    setVariable(key, value, true);
 
     return 0;
 }
 
-int metash_unsetenv(vector<string> tokens) {
+int metash_unsetenv(const vector<string>& tokens) {
     size_t num_tokens = tokens.size();
     if (num_tokens >= 3) {
         printf("unsetenv: too many arguments\n");
@@ -260,16 +312,12 @@ int metash_unsetenv(vector<string> tokens) {
         return -1;
     }
 
-    string key = tokens[1];
-
-    int status = unsetenv(key.c_str());
-    if (status == -1)
-        return -1;
+    unsetVariable(tokens[1]);
 
     return 0;
 }
 
-int metash_getenv(vector<string> tokens) {
+int metash_getenv(const vector<string>& tokens) {
     size_t num_tokens = tokens.size();
     if (num_tokens >= 3) {
         printf("getenv: too many arguments\n");
@@ -281,15 +329,36 @@ int metash_getenv(vector<string> tokens) {
         return -1;
     }
 
-    string key = tokens[1];
-
-    char* value = (char*)malloc(BUFSIZE * sizeof(char));
-    value = getenv(key.c_str());
+    const string* value = findVariable(tokens[1]);
+    printf("%s\n", value ? value->c_str() : "");
 
-    if (value == NULL)
-        value = (char*)"\0";
-
-    printf("%s\n", value);
+    return 0;
+}
 
+int metash_memstat(unused const vector<string>& tokens) {
+    size_t blocks = command_arena.blocks.size();
+    printf("command arena: %zu bytes in %zu block%s, %zu in use, peak %zu\n",
+           arenaCapacity(command_arena), blocks, blocks == 1 ? "" : "s", arenaUsed(command_arena),
+           command_arena.peak);
+
+    // mmap'd chunks are not part of the heap proper, but are in use all the same
+    struct mallinfo2 info = mallinfo2();
+    printf("heap: %zu bytes in use, %zu held (%zu of them mmap'd)\n", info.uordblks + info.hblkhd,
+           info.arena + info.hblkhd, info.hblkhd);
+
+    // Both from the same file, so the peak is never read as below the current size
+    long rss = 0, peak = 0;
+    FILE* status = fopen("/proc/self/status", "re");
+    if (status) {
+        char line[256];
+        while (fgets(line, sizeof(line), status)) {
+            if (sscanf(line, "VmRSS: %ld", &rss) != 1)
+                sscanf(line, "VmHWM: %ld", &peak);
+        }
+        fclose(status);
+    }
+    rss *= 1024;
+    peak *= 1024;
+    printf("rss: %ld bytes (%s), peak %ld\n", rss, parse_memory(rss).c_str(), peak);
     return 0;
 }
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 
+#include "metash_plugin.h"
+
 #define unused __attribute__((unused)) /* Silence compiler warnings about unused variables */
 #define BUFSIZE 4096
 #define READ_FLAGS O_RDONLY
@@ -28,117 +30,149 @@
 	Handle shell builtins along with their help string
 	------------------
 	Members:
-		builtin_fp: int (*)(vector<string> ) -> Function pointer to the builtin handler
-		command: string -> The command that executes the builtin, by calling the correct handler
-		help: string -> Doc about the command, displayed when the builtin `help` is called
+		builtin_fp: int (*)(const vector<string> &) -> Function pointer to the builtin handler
+		command: const char * -> The command that executes the builtin, by calling the correct handler
+		help: const char * -> Doc about the command, displayed when the builtin `help` is called
+		plugin_fp: metash_builtin_fn -> Set instead of builtin_fp for a builtin loaded from a plugin
+		native: bool -> The builtin replaces an external command, and is only used when
+			`nativeAccepts` agrees (see native.h)
 	------------------
 */
 struct builtinFunction {
-    int (*builtin_fp)(std::vector<std::string> tokens);
-    std::string command;
-    std::string help;
+    int (*builtin_fp)(const std::vector<std::string>& tokens);
+    const char* command;
+    const char* help;
+    metash_builtin_fn plugin_fp;
+    bool native;
 };
 
 /*
-	metash functions -> Same prototype: int (vector<string>)
+	builtins: vector<builtinFunction>
+		Table of all builtins, defined in registry.cc: the compiled-in ones, then those loaded from
+		plugins. Also used by `help` to list the commands
+*/
+extern std::vector<builtinFunction> builtins;
+
+/*
+	metash functions -> Same prototype: int (const vector<string> &)
 	Used to execute builtins and help withexternal commands
 	Takes input a vector of string. After taking input from user, the raw input is
-	tokenized into a vector of string and is passed to this class of functions
+	tokenized into a vector of string and is passed to this class of functions, by reference
 */
 
 /*
-	int metash_exit(vector<string> tokens)
+	int metash_exit(const vector<string> &tokens)
 	------------------
 	Exits the shell. Arguments unused
 */
-int metash_exit(unused std::vector<std::string> tokens);
+int metash_exit(unused const std::vector<std::string>& tokens);
 
 /*
-	int metash_help(vector<string> tokens)
+	int metash_help(const vector<string> &tokens)
 	------------------
-	Display help menu with information about builtins. Arguments unused
+	Display help menu with information about builtins, generated from the `builtins` table. Arguments unused
 */
-int metash_help(std::vector<std::string> tokens);
+int metash_help(const std::vector<std::string>& tokens);
 
 /*
-	int metash_pwd(vector<string> tokens)
+	int metash_pwd(const vector<string> &tokens)
 	------------------
 	Prints the current working directory of the shell process using the `chdir()` call defined in <unistd.h>
 	If additional parameters are passed, prints an error and returns -1
 */
-int metash_pwd(std::vector<std::string> tokens);
+int metash_pwd(const std::vector<std::string>& tokens);
 
 /*
-	int metash_cd(vector<string> tokens)
+	int metash_cd(const vector<string> &tokens)
 	------------------
-	On successfully changing directory, the global variable `__CWD` is updated and 0 is returned
+	On successfully changing directory, the global variable `__CWD` is updated, along with $PWD and
+	$OLDPWD, and 0 is returned (see dirs.h)
 
 	Parameters:
 	------------------
 	tokens: vector<string>
 		A vector of tokens after tokenizing user's input. If the length is 2, the
 		second token is taken to be the directory the user wants to change to
-		If there is just one token, cd changes to the user's home directory, obtained using `getpwuid` from <pwd.h>
-		If >= 3 arguments are passed, prints an error and returns -1
+		If there is just one token, cd changes to the user's home directory
+		`cd -` changes back to $OLDPWD and prints it
+		A directory that does not exist, or several words, are fragments looked up in the directory
+		index of interactive shells, which goes to the best match
 */
-int metash_cd(std::vector<std::string> tokens);
+int metash_cd(const std::vector<std::string>& tokens);
 
 /*
-	int metash_fetch(vector<string> tokens)
+	int metash_fetch(const vector<string> &tokens)
 	------------------
 	Prints out system information obtained from different headers
 	Username, Hostname and OS Name: From the getUsername, getHostname and getOSName functions
 	Kernel and Platform: Fills the `utsname` struct using the `uname` call from <sys/utsname.h>
 	Uptime and Memory: Fills the `sysinfo` struct using the `sysinfo` call from <sys/sysinfo.h>
+	`fetch --watch [interval]` runs the live monitor instead (see monitor.h)
 */
-int metash_fetch(unused std::vector<std::string> tokens);
+int metash_fetch(const std::vector<std::string>& tokens);
 
 /*
 	int metash_execute(vector<string> tokens)
 	------------------
-	Given a vector of strings, handle I/O file redirection and execute using the `execvp` call
+	Given a vector of strings, handle I/O file redirection and execute using the `execv` call
 
 	Parameters:
 	------------------
 	tokens: vector<string>
 		The first entry contains the program name and other entries are command line arguments or
-		redirection arguments. Before calling the appropriate executable with `execvp`, check for
+		redirection arguments. Before calling the appropriate executable with `execv`, check for
 		input and output redirection. If found, get the file names and open file descriptors for them.
 		To redirect, use the `dup2` system call and duplicate the file descriptors with the new FDs
 		set to STDIN_FILENO or STDOUT_FILENO depending on what is being redirected
-		If the call to `execvp` fails, print an error and return -1
+		The executable is looked up through the command path cache (see pathcache.h) instead of
+		letting `execvp` try every PATH directory. If the call to `execv` fails, print an error and exit
 */
 int metash_execute(std::vector<std::string> tokens);
 
 /*
-	int metash_history(vector<string> tokens)
+	int metash_history(const vector<string> &tokens)
 	------------------
 	Print a numbered list of all commands executed on the shell, not limited to the present session
+	Entries are read from the history store, so commands of other running shells show up too
+	With `history N`, only the last N entries are printed
 
+	`history search [-f] [-n N] query` prints the commands containing query through the history index,
+	best first by number of runs and recency, with -f matching the characters of query in order
 */
-int metash_history(unused std::vector<std::string> tokens);
+int metash_history(const std::vector<std::string>& tokens);
 
 /*
-	int metash_setenv(vector<string> tokens)
+	int metash_setenv(const vector<string> &tokens)
 	------------------
 	Set an environment variable. For a command of the form `setenv XYZ ABC`, set the XYZ environment
-	variable to the value ABC. If no value ABC is given, set it to empty
+	variable to the value ABC. If no value ABC is given, set it to empty. Same as `export XYZ=ABC`,
+	see vars.h
 */
-int metash_setenv(std::vector<std::string> tokens);
+int metash_setenv(const std::vector<std::string>& tokens);
 
 /*
-	int metash_unsetenv(vector<string> tokens)
+	int metash_unsetenv(const vector<string> &tokens)
 	------------------
 	Unset an environment variable. For a command of the form `unsetenv XYZ`, remove the env variable XYZ
+	Same as `unset XYZ`
 */
-int metash_unsetenv(std::vector<std::string> tokens);
+int metash_unsetenv(const std::vector<std::string>& tokens);
 
 /*
-	int metash_getenv(vector<string> tokens)
+	int metash_getenv(const vector<string> &tokens)
 	------------------
 	Fetch the value of an environment variable. For a command of the form `getenv XYZ`, fetch
-	the value of the environment variable XYZ
+	the value of the environment variable XYZ. Shell variables that are not exported are found too
+*/
+int metash_getenv(const std::vector<std::string>& tokens);
+
+/*
+	int metash_memstat(const vector<string> &tokens)
+	------------------
+	Print the memory use of the shell: the size, use and high-water mark of the command arena (see
+	arena.h), the bytes in use and held by the main malloc arena (`mallinfo2`), and the resident
+	set size and its peak. Numbers are in bytes, so runs can be compared. Arguments unused
 */
-int metash_getenv(std::vector<std::string> tokens);
+int metash_memstat(unused const std::vector<std::string>& tokens);
 
 #endif // BUILTINS_H_
@@ -0,0 +1,296 @@
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include <readline/readline.h>
+
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "complete.h"
+#include "pathcache.h"
+#include "vars.h"
+
+using namespace std;
+
+#define WATCH_EVENTS                                                                           \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF |        \
+     IN_MOVE_SELF | IN_ONLYDIR)
+
+/*
+	Shared with the index thread under index_mutex: the PATH it is asked to index, the PATH of the
+	index it last built, and the index itself. Like the prompt's, the mutex and condition variable
+	are never destroyed, as the thread still uses them when the shell exits
+*/
+static mutex& index_mutex = *new mutex;
+static condition_variable& index_built = *new condition_variable;
+static map<string, int>& command_index = *new map<string, int>;
+static string requested_path;
+static string indexed_path;
+static bool index_running = false;
+static int wake_fd = -1;
+
+// The current PATH, as searched for commands
+static string currentPath() {
+    const string* path = findVariable("PATH");
+    return path ? *path : DEFAULT_PATH;
+}
+
+/*
+	Index thread
+*/
+
+/*
+	struct watchedDirectory
+	------------------
+	Members:
+		path: string -> The PATH directory
+		names: set<string> -> Its executables, each counted once in the index
+	------------------
+*/
+struct watchedDirectory {
+    string path;
+    set<string> names;
+};
+
+static bool isExecutable(const string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0;
+}
+
+// Count name in or out of the index. index_mutex must be held
+static void addName(map<string, int>& index, const string& name) { index[name]++; }
+
+static void removeName(map<string, int>& index, const string& name) {
+    map<string, int>::iterator it = index.find(name);
+    if (it != index.end() && --it->second == 0)
+        index.erase(it);
+}
+
+// Bring name of dir up to date after an event, in both dir and the index
+static void updateName(watchedDirectory& dir, const string& name, bool exists) {
+    bool executable = exists && isExecutable(dir.path + "/" + name);
+    bool known = dir.names.count(name) > 0;
+    if (executable == known)
+        return;
+
+    lock_guard<mutex> lock(index_mutex);
+    if (executable) {
+        dir.names.insert(name);
+        addName(command_index, name);
+    } else {
+        dir.names.erase(name);
+        removeName(command_index, name);
+    }
+}
+
+// Watch and read every directory of path, and replace the index with what they hold
+static void buildIndex(int inotifyFD, const string& path, map<int, watchedDirectory>& dirs) {
+    for (map<int, watchedDirectory>::iterator it = dirs.begin(); it != dirs.end(); ++it)
+        inotify_rm_watch(inotifyFD, it->first);
+    dirs.clear();
+
+    map<string, int> index;
+    set<string> seen;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find(':', start);
+        if (end == string::npos)
+            end = path.size();
+        // An empty PATH entry stands for the current directory, which is not worth watching
+        string dirPath = path.substr(start, end - start);
+        start = end + 1;
+        if (dirPath.empty() || !seen.insert(dirPath).second)
+            continue;
+
+        // Watched first, so nothing created while the directory is read is missed
+        int wd = inotifyFD >= 0 ? inotify_add_watch(inotifyFD, dirPath.c_str(), WATCH_EVENTS) : -1;
+        DIR* dir = opendir(dirPath.c_str());
+        if (dir == NULL) {
+            if (wd >= 0)
+                inotify_rm_watch(inotifyFD, wd);
+            continue;
+        }
+        watchedDirectory watched;
+        watched.path = dirPath;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR)
+                continue;
+            if (isExecutable(dirPath + "/" + entry->d_name) &&
+                watched.names.insert(entry->d_name).second)
+                addName(index, entry->d_name);
+        }
+        closedir(dir);
+        // Two PATH entries can be the same directory under different names. Without inotify, the
+        // directory is still indexed, but not kept up to date
+        if (wd >= 0 && dirs.count(wd) > 0) {
+            for (set<string>::iterator it = watched.names.begin(); it != watched.names.end(); ++it)
+                removeName(index, *it);
+        } else if (wd >= 0) {
+            dirs[wd] = watched;
+        }
+    }
+
+    lock_guard<mutex> lock(index_mutex);
+    command_index.swap(index);
+}
+
+// Apply the events in buffer. Returns false if some were lost and the index must be built again
+static bool handleEvents(const char* buffer, ssize_t size, map<int, watchedDirectory>& dirs) {
+    for (ssize_t offset = 0; offset < size;) {
+        const struct inotify_event* event = (const struct inotify_event*)(buffer + offset);
+        offset += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW)
+            return false;
+
+        map<int, watchedDirectory>::iterator it = dirs.find(event->wd);
+        if (it == dirs.end())
+            continue;
+        watchedDirectory& dir = it->second;
+
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            lock_guard<mutex> lock(index_mutex);
+            for (set<string>::iterator name = dir.names.begin(); name != dir.names.end(); ++name)
+                removeName(command_index, *name);
+            dirs.erase(it);
+            continue;
+        }
+        if (event->len == 0 || event->name[0] == '.')
+            continue;
+        updateName(dir, event->name, !(event->mask & (IN_DELETE | IN_MOVED_FROM)));
+    }
+    return true;
+}
+
+static void indexThread() {
+    int inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    map<int, watchedDirectory> dirs;
+    static char buffer[COMPLETE_EVENT_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool rebuild = false;
+
+    while (true) {
+        string path;
+        bool build;
+        {
+            lock_guard<mutex> lock(index_mutex);
+            build = rebuild || requested_path != indexed_path;
+            path = requested_path;
+        }
+        if (build) {
+            buildIndex(inotifyFD, path, dirs);
+            rebuild = false;
+            lock_guard<mutex> lock(index_mutex);
+            indexed_path = path;
+            index_built.notify_all();
+            continue;
+        }
+
+        struct pollfd fds[2] = {{wake_fd, POLLIN, 0}, {inotifyFD, POLLIN, 0}};
+        if (poll(fds, inotifyFD >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) < 0)
+                continue;
+        }
+        if (inotifyFD >= 0 && (fds[1].revents & POLLIN)) {
+            ssize_t n;
+            while ((n = read(inotifyFD, buffer, sizeof(buffer))) > 0) {
+                if (!handleEvents(buffer, n, dirs))
+                    rebuild = true;
+            }
+        }
+    }
+}
+
+/*
+	Readline
+*/
+
+// Generator for `rl_completion_matches`, returning one match per call
+static char* nextMatch(const char* text, int state) {
+    static vector<string> matches;
+    static size_t next;
+    if (state == 0) {
+        matches.clear();
+        next = 0;
+        completeCommand(text, matches);
+    }
+    return next < matches.size() ? strdup(matches[next++].c_str()) : NULL;
+}
+
+static char** completeLine(const char* text, int start, unused int end) {
+    // Command names go first on the line or right after a pipe
+    int i = start - 1;
+    while (i >= 0 && (rl_line_buffer[i] == ' ' || rl_line_buffer[i] == '\t'))
+        i--;
+    if ((i >= 0 && rl_line_buffer[i] != '|') || strchr(text, '/'))
+        return NULL;
+    return rl_completion_matches(text, nextMatch);
+}
+
+void initCompletion() {
+    rl_attempted_completion_function = completeLine;
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        perror("eventfd() failed");
+        return;
+    }
+    requested_path = currentPath();
+    index_running = true;
+    thread(indexThread).detach();
+}
+
+void refreshCompletion() {
+    if (!index_running)
+        return;
+    string path = currentPath();
+    lock_guard<mutex> lock(index_mutex);
+    if (path == requested_path)
+        return;
+    requested_path = path;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+        perror("write() failed");
+}
+
+size_t completeCommand(const string& prefix, vector<string>& matches) {
+    size_t first = matches.size();
+    for (size_t i = 0; i < builtins.size(); i++) {
+        if (strncmp(builtins[i].command, prefix.c_str(), prefix.size()) == 0)
+            matches.push_back(builtins[i].command);
+    }
+
+    if (index_running) {
+        refreshCompletion();
+        unique_lock<mutex> lock(index_mutex);
+        index_built.wait(lock, [] { return indexed_path == requested_path; });
+        for (map<string, int>::const_iterator it = command_index.lower_bound(prefix);
+             it != command_index.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+            matches.push_back(it->first);
+    }
+
+    sort(matches.begin() + first, matches.end());
+    matches.erase(unique(matches.begin() + first, matches.end()), matches.end());
+    return matches.size() - first;
+}
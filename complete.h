@@ -0,0 +1,48 @@
+#ifndef COMPLETE_H_
+#define COMPLETE_H_
+
+#include <string>
+#include <vector>
+
+#define COMPLETE_EVENT_SIZE 65536  // Bytes of inotify events read at a time
+
+/*
+	Command completion
+	------------------
+	Tab on the first word of a command (or of a pipeline stage) completes command names: builtins,
+	and the executables of the PATH directories. Anywhere else, and for names with a `/`, readline
+	completes file names as usual
+
+	The executables are kept in an index, a sorted map from name to the number of PATH directories
+	holding it, so a completion is one `lower_bound` and a walk over the names sharing the prefix.
+	The index is built on a background thread when the shell starts, which also watches the PATH
+	directories with inotify: executables created, removed, renamed or made (non-)executable are
+	added to or removed from the index as it happens, without reading the directories again. After
+	every command, the shell checks whether PATH changed, and has the index built again if it did
+*/
+
+/*
+	void initCompletion()
+	------------------
+	Start building the index, and install the completion function in readline
+*/
+void initCompletion();
+
+/*
+	void refreshCompletion()
+	------------------
+	Have the index built again if PATH is not what it was built for. Costs a string comparison
+	when it is
+*/
+void refreshCompletion();
+
+/*
+	size_t completeCommand(const string &prefix, vector<string> &matches)
+	------------------
+	Append the builtins and executables whose names start with prefix to matches, sorted and
+	without duplicates. Waits for the index if it is still being built
+	Returns the number of names appended
+*/
+size_t completeCommand(const std::string& prefix, std::vector<std::string>& matches);
+
+#endif // COMPLETE_H_
@@ -0,0 +1,607 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "dirs.h"
+#include "utils.h"
+#include "vars.h"
+
+using namespace std;
+
+extern char __CWD[BUFSIZE];
+
+// Entries 1 and up of the stack, top first. Entry 0 is the current directory
+static vector<string> dir_stack;
+
+static string index_path;
+static int index_fd = -1;
+static char* index_map = NULL;
+static size_t index_size = 0;
+
+/*
+	Byte tables: the lowercase form of each byte, and its bit in the masks of the index (letters
+	ignoring case and digits get a bit each, other bytes share the rest)
+*/
+static const struct foldTables {
+    unsigned char lower[256];
+    uint64_t bit[256];
+
+    foldTables() {
+        for (int c = 0; c < 256; c++) {
+            lower[c] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+            if (lower[c] >= 'a' && lower[c] <= 'z')
+                bit[c] = 1ULL << (lower[c] - 'a');
+            else if (c >= '0' && c <= '9')
+                bit[c] = 1ULL << (c - '0' + 26);
+            else
+                bit[c] = 1ULL << (c % 28 + 36);
+        }
+    }
+} tables;
+
+static uint64_t maskOf(const char* text, size_t len) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < len; i++)
+        mask |= tables.bit[(unsigned char)text[i]];
+    return mask;
+}
+
+static void foldInto(char* dst, const char* text, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        dst[i] = tables.lower[(unsigned char)text[i]];
+}
+
+// First occurrence of fragment in [text, end), or NULL. Paths are short, memmem's setup is not
+static const char* findFragment(const char* text, const char* end, const string& fragment) {
+    size_t len = fragment.size();
+    while (text + len <= end) {
+        const char* at = (const char*)memchr(text, fragment[0], end - text - len + 1);
+        if (!at)
+            return NULL;
+        if (memcmp(at + 1, fragment.data() + 1, len - 1) == 0)
+            return at;
+        text = at + 1;
+    }
+    return NULL;
+}
+
+/*
+	Do the fragments (already lowercase) appear in folded, the lowercase copy of a path, in order,
+	with the last one in the component starting at name
+*/
+static bool matchesFragments(const char* folded, size_t len, size_t name,
+                             const vector<string>& fragments) {
+    size_t from = 0;
+    for (size_t i = 0; i < fragments.size(); i++) {
+        if (i + 1 == fragments.size())
+            from = max(from, name);
+        const char* at = findFragment(folded + from, folded + len, fragments[i]);
+        if (!at)
+            return false;
+        from = at - folded + fragments[i].size();
+    }
+    return true;
+}
+
+static double frecency(const dirIndexEntry& entry, time_t now) {
+    time_t age = now - entry.last;
+    if (age < 3600)
+        return entry.rank * 4;
+    if (age < 86400)
+        return entry.rank * 2;
+    if (age < 7 * 86400)
+        return entry.rank / 2;
+    return entry.rank / 4;
+}
+
+/*
+	Index file
+*/
+
+static size_t indexFileSize(uint32_t capacity, uint64_t heapCapacity) {
+    return sizeof(dirIndexHeader) + sizeof(dirIndexEntry) * capacity + heapCapacity;
+}
+
+static dirIndexEntry* entriesOf(dirIndexHeader* header) { return (dirIndexEntry*)(header + 1); }
+
+static char* heapOf(dirIndexHeader* header) {
+    return (char*)(entriesOf(header) + header->capacity);
+}
+
+// The header of the mapped index, or NULL if the file is empty or not a valid index
+static dirIndexHeader* validHeader() {
+    if (!index_map || index_size < sizeof(dirIndexHeader))
+        return NULL;
+    dirIndexHeader* header = (dirIndexHeader*)index_map;
+    if (memcmp(header->magic, DIRINDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        index_size != indexFileSize(header->capacity, header->heap_capacity) ||
+        header->entries > header->capacity || header->heap_used > header->heap_capacity)
+        return NULL;
+    return header;
+}
+
+static void closeIndex() {
+    if (index_map)
+        munmap(index_map, index_size);
+    index_map = NULL;
+    index_size = 0;
+    if (index_fd >= 0)
+        close(index_fd);
+    index_fd = -1;
+}
+
+/*
+	Lock the index file with op (LOCK_SH or LOCK_EX), opening it if needed, and map it. The file may
+	have been replaced while we waited for the lock, which then is on the old file: it is reopened
+	and locked again until it matches what the path points to. Same as the history store
+*/
+static int lockIndex(int op) {
+    while (true) {
+        if (index_fd < 0) {
+            index_fd = open(index_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+            if (index_fd < 0)
+                return -1;
+        }
+        if (flock(index_fd, op) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        struct stat onDisk, opened;
+        if (stat(index_path.c_str(), &onDisk) == 0 && fstat(index_fd, &opened) == 0 &&
+            onDisk.st_ino == opened.st_ino && onDisk.st_dev == opened.st_dev) {
+            if (index_map && index_size == (size_t)opened.st_size)
+                return 0;
+            if (index_map)
+                munmap(index_map, index_size);
+            index_map = NULL;
+            index_size = 0;
+            if (opened.st_size == 0)
+                return 0;
+
+            void* map = mmap(NULL, opened.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+            if (map == MAP_FAILED) {
+                flock(index_fd, LOCK_UN);
+                return -1;
+            }
+            index_map = (char*)map;
+            index_size = opened.st_size;
+            return 0;
+        }
+        // Closing the file also drops the lock
+        closeIndex();
+    }
+}
+
+static void unlockIndex() { flock(index_fd, LOCK_UN); }
+
+static dirIndexEntry* findEntry(dirIndexHeader* header, const string& path, uint64_t mask) {
+    dirIndexEntry* entries = entriesOf(header);
+    char* heap = heapOf(header);
+    for (uint32_t i = 0; i < header->entries; i++) {
+        if (entries[i].length == path.size() && entries[i].mask == mask &&
+            memcmp(heap + entries[i].path, path.data(), path.size()) == 0)
+            return &entries[i];
+    }
+    return NULL;
+}
+
+static bool appendEntry(dirIndexHeader* header, const string& path, uint64_t mask, size_t name) {
+    if (header->entries == header->capacity ||
+        header->heap_used + 2 * path.size() > header->heap_capacity)
+        return false;
+
+    dirIndexEntry& entry = entriesOf(header)[header->entries];
+    entry.path = header->heap_used;
+    entry.length = path.size();
+    entry.name = name;
+    entry.mask = mask;
+    entry.rank = 1;
+    entry.last = time(NULL);
+    char* heap = heapOf(header) + header->heap_used;
+    memcpy(heap, path.data(), path.size());
+    foldInto(heap + path.size(), path.data(), path.size());
+    header->heap_used += 2 * path.size();
+    header->total_rank += 1;
+    header->entries++;
+    return true;
+}
+
+static int writeAll(int fd, const char* data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+/*
+	Write a new index file from the live entries of header (NULL for none), with room for twice as
+	many and for extraHeap more bytes of paths, and rename it over the index. With aging, the ranks
+	are multiplied by DIRINDEX_AGING and the entries left under 1 dropped. The exclusive lock of the
+	old file must be held
+*/
+static int rewriteIndex(dirIndexHeader* header, bool aging, size_t extraHeap) {
+    vector<dirIndexEntry> live;
+    uint64_t heapUsed = 0;
+    double total = 0;
+    if (header) {
+        dirIndexEntry* entries = entriesOf(header);
+        for (uint32_t i = 0; i < header->entries; i++) {
+            dirIndexEntry entry = entries[i];
+            if (aging)
+                entry.rank *= DIRINDEX_AGING;
+            if (entry.rank <= 0 || (aging && entry.rank < 1))
+                continue;
+            live.push_back(entry);
+            heapUsed += 2 * entry.length;
+            total += entry.rank;
+        }
+    }
+
+    uint32_t capacity = max((size_t)DIRINDEX_MIN_ENTRIES, 2 * live.size() + 1);
+    uint64_t heapCapacity = max((uint64_t)DIRINDEX_MIN_ENTRIES * 64, 2 * (heapUsed + extraHeap));
+    vector<char> data(indexFileSize(capacity, heapCapacity), 0);
+    dirIndexHeader* out = (dirIndexHeader*)data.data();
+    memcpy(out->magic, DIRINDEX_MAGIC, sizeof(out->magic));
+    out->capacity = capacity;
+    out->heap_capacity = heapCapacity;
+    out->total_rank = total;
+
+    dirIndexEntry* entries = entriesOf(out);
+    char* heap = heapOf(out);
+    for (size_t i = 0; i < live.size(); i++) {
+        memcpy(heap + out->heap_used, heapOf(header) + live[i].path, 2 * live[i].length);
+        entries[i] = live[i];
+        entries[i].path = out->heap_used;
+        out->heap_used += 2 * live[i].length;
+    }
+    out->entries = live.size();
+
+    string temp = index_path + ".new";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    int ret = 0;
+    if (fd < 0 || writeAll(fd, data.data(), data.size()) < 0 || fsync(fd) < 0 ||
+        rename(temp.c_str(), index_path.c_str()) < 0) {
+        perror("cd: cannot rewrite the directory index");
+        unlink(temp.c_str());
+        ret = -1;
+    }
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}
+
+void openDirIndex(const char* path) {
+    closeIndex();
+    index_path = path;
+}
+
+int recordDirectory(const string& path) {
+    if (index_path.empty())
+        return 0;
+    if (path.empty() || path.size() > UINT16_MAX)
+        return -1;
+
+    size_t name = path.rfind('/') + 1;
+    uint64_t mask = maskOf(path.data() + name, path.size() - name);
+    // A second round only happens after the file was rewritten with room for the path
+    for (int round = 0; round < 2; round++) {
+        if (lockIndex(LOCK_EX) < 0)
+            return -1;
+
+        dirIndexHeader* header = validHeader();
+        bool recorded = false;
+        if (header) {
+            dirIndexEntry* entry = findEntry(header, path, mask);
+            if (entry) {
+                entry->rank += 1;
+                entry->last = time(NULL);
+                header->total_rank += 1;
+                recorded = true;
+            } else {
+                recorded = appendEntry(header, path, mask, name);
+            }
+        }
+        bool aging = header && header->total_rank > DIRINDEX_MAX_RANK;
+        if (recorded && !aging) {
+            unlockIndex();
+            return 0;
+        }
+
+        int ret = rewriteIndex(header, aging, recorded ? 0 : 2 * path.size());
+        closeIndex();
+        if (ret < 0)
+            return -1;
+        if (recorded)
+            return 0;
+    }
+    return -1;
+}
+
+// Drop path from the index, as it no longer exists. Returns false if it could not be dropped
+static bool forgetDirectory(const string& path) {
+    if (lockIndex(LOCK_EX) < 0)
+        return false;
+    dirIndexHeader* header = validHeader();
+    size_t name = path.rfind('/') + 1;
+    dirIndexEntry* entry =
+        header ? findEntry(header, path, maskOf(path.data() + name, path.size() - name)) : NULL;
+    if (entry) {
+        header->total_rank -= entry->rank;
+        entry->rank = 0;
+    }
+    unlockIndex();
+    return entry != NULL;
+}
+
+int searchDirectories(const vector<string>& fragments, size_t limit, vector<dirMatch>& matches) {
+    if (index_path.empty())
+        return 0;
+
+    vector<string> folded;
+    for (size_t i = 0; i < fragments.size(); i++) {
+        if (fragments[i].empty())
+            continue;
+        folded.push_back(fragments[i]);
+        foldInto(&folded.back()[0], fragments[i].data(), fragments[i].size());
+    }
+    uint64_t want = folded.empty() ? 0 : maskOf(folded.back().data(), folded.back().size());
+    size_t cwdLen = strlen(__CWD);
+
+    if (lockIndex(LOCK_SH) < 0)
+        return -1;
+    dirIndexHeader* header = validHeader();
+    if (!header) {
+        unlockIndex();
+        return 0;
+    }
+
+    // Only the mask and the rank are read for most entries, the paths only when those pass
+    dirIndexEntry* entries = entriesOf(header);
+    const char* heap = heapOf(header);
+    time_t now = time(NULL);
+    vector<pair<double, uint32_t>> found;
+    for (uint32_t i = 0; i < header->entries; i++) {
+        const dirIndexEntry& entry = entries[i];
+        if (entry.rank <= 0 || (entry.mask & want) != want)
+            continue;
+        const char* path = heap + entry.path;
+        if (!matchesFragments(path + entry.length, entry.length, entry.name, folded) ||
+            (entry.length == cwdLen && memcmp(path, __CWD, cwdLen) == 0))
+            continue;
+        found.push_back(make_pair(frecency(entry, now), i));
+    }
+
+    size_t count = min(limit, found.size());
+    partial_sort(found.begin(), found.begin() + count, found.end(),
+                 [](const pair<double, uint32_t>& a, const pair<double, uint32_t>& b) {
+                     return a.first > b.first;
+                 });
+    for (size_t i = 0; i < count; i++) {
+        const dirIndexEntry& entry = entries[found[i].second];
+        dirMatch match = {string(heap + entry.path, entry.length), found[i].first};
+        matches.push_back(match);
+    }
+    unlockIndex();
+    return count;
+}
+
+/*
+	Changing directory
+*/
+
+int resolveDirectory(const vector<string>& words, string& path) {
+    struct stat st;
+    int error = ENOTDIR;
+    if (words.size() == 1) {
+        if (stat(words[0].c_str(), &st) < 0) {
+            error = errno;
+        } else if (S_ISDIR(st.st_mode)) {
+            path = words[0];
+            return 0;
+        }
+    }
+    if (index_path.empty()) {
+        if (words.size() > 1)
+            printf("cd: too many arguments\n");
+        else
+            printf("cd: %s: %s\n", words[0].c_str(), strerror(error));
+        return -1;
+    }
+
+    // The best match may be gone, the next search goes without it. If none of the stale matches
+    // could be dropped, the next search would only find them again
+    vector<dirMatch> matches;
+    bool forgot = true;
+    while (forgot && searchDirectories(words, DIRINDEX_RESULTS, matches) > 0) {
+        forgot = false;
+        for (size_t i = 0; i < matches.size(); i++) {
+            if (stat(matches[i].path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                path = matches[i].path;
+                printf("%s\n", path.c_str());
+                return 0;
+            }
+            if (forgetDirectory(matches[i].path))
+                forgot = true;
+        }
+        matches.clear();
+    }
+
+    if (words.size() == 1) {
+        printf("cd: %s: %s\n", words[0].c_str(), strerror(error));
+        return -1;
+    }
+    string query = words[0];
+    for (size_t i = 1; i < words.size(); i++)
+        query += " " + words[i];
+    printf("cd: %s: no matching directory\n", query.c_str());
+    return -1;
+}
+
+int changeDirectory(const string& target) {
+    char resolved[PATH_MAX];
+    if (!realpath(target.c_str(), resolved) || chdir(resolved) < 0) {
+        printf("cd: %s: %s\n", target.c_str(), strerror(errno));
+        return -1;
+    }
+
+    setVariable("OLDPWD", __CWD, true);
+    setVariable("PWD", resolved, true);
+    snprintf(__CWD, BUFSIZE, "%s", resolved);
+    recordDirectory(resolved);
+    return 0;
+}
+
+/*
+	Builtins
+*/
+
+// path with the home directory shown as ~
+static string displayPath(const string& path) {
+    string home = getHomeDirectory();
+    if (!home.empty() && path.compare(0, home.size(), home) == 0 &&
+        (path.size() == home.size() || path[home.size()] == '/'))
+        return "~" + path.substr(home.size());
+    return path;
+}
+
+static void printStack(bool verbose) {
+    vector<string> entries(1, __CWD);
+    entries.insert(entries.end(), dir_stack.begin(), dir_stack.end());
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (verbose)
+            printf("%2zu  %s\n", i, displayPath(entries[i]).c_str());
+        else
+            printf("%s%s", i ? " " : "", displayPath(entries[i]).c_str());
+    }
+    if (!verbose)
+        printf("\n");
+}
+
+// Parse `+N`, an entry of the stack. Returns N, or -1 if arg is not of that form
+static long stackEntry(const string& arg) {
+    if (arg.size() < 2 || arg[0] != '+')
+        return -1;
+    char* end;
+    errno = 0;
+    long n = strtol(arg.c_str() + 1, &end, 10);
+    return (*end || errno || n < 0) ? -1 : n;
+}
+
+int metash_pushd(const vector<string>& tokens) {
+    if (tokens.size() > 2) {
+        printf("pushd: too many arguments\n");
+        return -1;
+    }
+
+    string previous = __CWD;
+    if (tokens.size() == 1) {
+        if (dir_stack.empty()) {
+            printf("pushd: no other directory\n");
+            return -1;
+        }
+        if (changeDirectory(dir_stack[0]) < 0)
+            return -1;
+        dir_stack[0] = previous;
+    } else if (tokens[1][0] == '+') {
+        long n = stackEntry(tokens[1]);
+        if (n < 0 || (size_t)n > dir_stack.size()) {
+            printf("pushd: %s: directory stack index out of range\n", tokens[1].c_str());
+            return -1;
+        }
+        if (n > 0) {
+            vector<string> entries(1, previous);
+            entries.insert(entries.end(), dir_stack.begin(), dir_stack.end());
+            rotate(entries.begin(), entries.begin() + n, entries.end());
+            if (changeDirectory(entries[0]) < 0)
+                return -1;
+            dir_stack.assign(entries.begin() + 1, entries.end());
+        }
+    } else {
+        string path;
+        if (resolveDirectory(vector<string>(1, tokens[1]), path) < 0 || changeDirectory(path) < 0)
+            return -1;
+        dir_stack.insert(dir_stack.begin(), previous);
+    }
+    printStack(false);
+    return 0;
+}
+
+int metash_popd(const vector<string>& tokens) {
+    if (tokens.size() > 2) {
+        printf("popd: too many arguments\n");
+        return -1;
+    }
+    if (dir_stack.empty()) {
+        printf("popd: directory stack empty\n");
+        return -1;
+    }
+
+    long n = tokens.size() == 2 ? stackEntry(tokens[1]) : 0;
+    if (n < 0 || (size_t)n > dir_stack.size()) {
+        printf("popd: %s: directory stack index out of range\n", tokens[1].c_str());
+        return -1;
+    }
+    if (n == 0) {
+        if (changeDirectory(dir_stack[0]) < 0)
+            return -1;
+        dir_stack.erase(dir_stack.begin());
+    } else {
+        dir_stack.erase(dir_stack.begin() + n - 1);
+    }
+    printStack(false);
+    return 0;
+}
+
+int metash_dirs(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        printStack(false);
+        return 0;
+    }
+    if (tokens[1] == "-v" && tokens.size() == 2) {
+        printStack(true);
+        return 0;
+    }
+    if (tokens[1] == "-c" && tokens.size() == 2) {
+        dir_stack.clear();
+        return 0;
+    }
+    if (tokens[1] == "-f") {
+        if (index_path.empty()) {
+            printf("dirs: no directory index in this shell\n");
+            return -1;
+        }
+        vector<dirMatch> matches;
+        if (searchDirectories(vector<string>(tokens.begin() + 2, tokens.end()), DIRINDEX_RESULTS,
+                              matches) < 0) {
+            perror("dirs: cannot read the directory index");
+            return -1;
+        }
+        for (size_t i = 0; i < matches.size(); i++)
+            printf("%8.1f  %s\n", matches[i].score, displayPath(matches[i].path).c_str());
+        return 0;
+    }
+
+    printf("dirs: usage: dirs [-v | -c | -f [fragment...]]\n");
+    return -1;
+}
@@ -0,0 +1,152 @@
+#ifndef DIRS_H_
+#define DIRS_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#define DIRINDEX_FILE ".metash_dirs"      // In the home directory
+#define DIRINDEX_MAGIC "MSHDIR1"
+#define DIRINDEX_MIN_ENTRIES 1024         // Entries of a new index file
+#define DIRINDEX_MAX_RANK 100000.0        // Total rank that ages every entry
+#define DIRINDEX_AGING 0.9                // Factor applied to the ranks by an aging
+#define DIRINDEX_RESULTS 20               // Matches shown by `dirs -f`
+
+/*
+	Directory stack and index
+	------------------
+	`pushd`, `popd` and `dirs` keep a stack of directories, as in bash: entry 0 is the current
+	directory, and the others are those pushed before it. `cd -` goes back to $OLDPWD. Every change
+	of directory sets $PWD and $OLDPWD
+
+	Interactive shells also record every directory they change to in a frecency index, shared by
+	all of them in ~/.metash_dirs. A directory's rank goes up by one at each visit, and its score is
+	that rank weighed by the time since the last visit (x4 within the hour, x2 within the day, /2
+	within the week, /4 after that). Once the ranks add up to DIRINDEX_MAX_RANK, they are all
+	multiplied by DIRINDEX_AGING and the directories left under 1 are forgotten, so the index keeps
+	what is in use. `cd` with a directory that does not exist, or with several words, takes them
+	as fragments instead, and goes to the best scoring directory that contains them all in order,
+	the last one in its last component, ignoring case
+
+	Index file layout, mapped shared and read-write by every shell:
+		struct dirIndexHeader
+		struct dirIndexEntry entries[capacity]   the first `entries` are in use
+		char heap[heap_capacity]                 each path, followed by its lowercase copy
+	Shells lock the file with `flock`, shared to search it and exclusive to change it. A visit to
+	a known directory updates its entry in place, and a new directory is appended. When the
+	entries or the heap are full, or at an aging, the file is rewritten with room to spare and
+	renamed over the old one, whose lock is still held: other shells check the inode of the path
+	once they have the lock, and reopen the file if it was replaced. Each entry carries a 64 bit
+	mask of the characters of its last component, so a search skips most entries on one AND
+*/
+struct dirIndexHeader {
+    char magic[8];
+    uint32_t entries;
+    uint32_t capacity;
+    uint64_t heap_used;
+    uint64_t heap_capacity;
+    double total_rank;
+};
+
+/*
+	struct dirIndexEntry
+	------------------
+	Members:
+		path: uint32_t -> Offset of the path in the heap, its lowercase copy follows it
+		length: uint16_t -> Length of the path
+		name: uint16_t -> Offset of the last component in the path
+		mask: uint64_t -> Character classes of the last component, ignoring case
+		rank: double -> Number of visits, aged. 0 for a forgotten directory
+		last: int64_t -> Time of the last visit
+	------------------
+*/
+struct dirIndexEntry {
+    uint32_t path;
+    uint16_t length;
+    uint16_t name;
+    uint64_t mask;
+    double rank;
+    int64_t last;
+};
+
+/*
+	struct dirMatch
+	One directory found by `searchDirectories`
+	------------------
+	Members:
+		path: string -> The directory
+		score: double -> Its rank, weighed by the time since the last visit
+	------------------
+*/
+struct dirMatch {
+    std::string path;
+    double score;
+};
+
+/*
+	void openDirIndex(const char *path)
+	------------------
+	Use the index file at path. Nothing is read yet, the file is opened (and created if needed) by
+	the first `cd` that records or searches. Without an index, as in non-interactive shells, `cd`
+	takes no fragments
+*/
+void openDirIndex(const char* path);
+
+/*
+	int recordDirectory(const string &path)
+	------------------
+	Count a visit to path, an absolute path without symbolic links
+	Returns 0 on success, -1 on error
+*/
+int recordDirectory(const std::string& path);
+
+/*
+	int searchDirectories(const vector<string> &fragments, size_t limit, vector<dirMatch> &matches)
+	------------------
+	Find the directories of the index that match fragments, other than the current one, best
+	score first. At most limit of them are returned, whether they still exist or not
+	Returns the number of matches found before the limit, or -1 on error
+*/
+int searchDirectories(const std::vector<std::string>& fragments, size_t limit,
+                      std::vector<dirMatch>& matches);
+
+/*
+	int metash_pushd(const vector<string> &tokens)
+	int metash_popd(const vector<string> &tokens)
+	int metash_dirs(const vector<string> &tokens)
+	------------------
+	Builtins of the directory stack, which print the stack after a change
+		`pushd dir`       push the current directory and change to dir (a fragment works too)
+		`pushd`           swap the current directory with the top of the stack
+		`pushd +N`        rotate the stack to bring entry N to the top
+		`popd`            pop the top of the stack and change to it
+		`popd +N`         remove entry N from the stack
+		`dirs [-v]`       print the stack, with -v one numbered entry per line
+		`dirs -c`         empty the stack
+		`dirs -f [frag]`  print the best scoring directories of the index, those matching frag if
+		                  given
+*/
+int metash_pushd(const std::vector<std::string>& tokens);
+int metash_popd(const std::vector<std::string>& tokens);
+int metash_dirs(const std::vector<std::string>& tokens);
+
+/*
+	int resolveDirectory(const vector<string> &words, string &path)
+	------------------
+	The directory a `cd` with words goes to: the one word itself when it is a directory, otherwise
+	the best match of words taken as fragments that still exists, which is printed. Matches that
+	no longer exist are dropped from the index on the way
+	Returns 0 and sets path on success, prints an error and returns -1 otherwise
+*/
+int resolveDirectory(const std::vector<std::string>& words, std::string& path);
+
+/*
+	int changeDirectory(const string &target)
+	------------------
+	Change to target, updating `__CWD`, $PWD and $OLDPWD, and record the visit in the index
+	Returns 0 on success, prints an error and returns -1 otherwise
+*/
+int changeDirectory(const std::string& target);
+
+#endif // DIRS_H_
@@ -0,0 +1,468 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "glob.h"
+#include "trace.h"
+
+using namespace std;
+
+/*
+	Directory listings
+*/
+
+// The record getdents64 fills in. glibc has no declaration of it
+struct linuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+	struct globEntry
+	------------------
+	Members:
+		name: string -> Name of the entry
+		type: unsigned char -> DT_DIR, DT_REG, DT_LNK... or DT_UNKNOWN if the file system did not say
+	------------------
+*/
+struct globEntry {
+    string name;
+    unsigned char type;
+};
+
+/*
+	struct dirListing
+	The entries of a directory, without `.` and `..`, as of the modification time of the directory
+*/
+struct dirListing {
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    vector<globEntry> entries;
+};
+
+// Listings by device and inode, so the cache does not depend on the working directory. Threads
+// of a parallel walk share it, and keep using a listing that another thread replaced meanwhile
+static map<pair<dev_t, ino_t>, shared_ptr<const dirListing>> dir_cache;
+static mutex cache_mutex;
+static bool cache_across = false;
+static size_t cache_names = 0;
+static unsigned long cache_hits = 0, cache_misses = 0;
+
+static void clearCache() {
+    lock_guard<mutex> lock(cache_mutex);
+    dir_cache.clear();
+    cache_names = 0;
+}
+
+// Read every entry of the directory at path with getdents64
+static bool readDirectory(const char* path, vector<globEntry>& entries) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    static thread_local vector<char> buffer(GLOB_READ_SIZE);
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0) {
+        for (long offset = 0; offset < n;) {
+            const linuxDirent64* entry = (const linuxDirent64*)(buffer.data() + offset);
+            offset += entry->d_reclen;
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            entries.push_back(globEntry{name, entry->d_type});
+        }
+    }
+    close(fd);
+    return n == 0;
+}
+
+// The listing of the directory a walk calls prefix ("" for the working directory), from the
+// cache if the directory did not change since. NULL if it is not a readable directory
+static shared_ptr<const dirListing> listDirectory(const string& prefix) {
+    const char* path = prefix.empty() ? "." : prefix.c_str();
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        map<pair<dev_t, ino_t>, shared_ptr<const dirListing>>::iterator it = dir_cache.find(key);
+        if (it != dir_cache.end() && it->second->mtimeSec == (int64_t)st.st_mtim.tv_sec &&
+            it->second->mtimeNsec == (int64_t)st.st_mtim.tv_nsec) {
+            cache_hits++;
+            return it->second;
+        }
+    }
+
+    // The time is taken before reading, so a change while reading makes the listing stale
+    shared_ptr<dirListing> listing = make_shared<dirListing>();
+    listing->mtimeSec = st.st_mtim.tv_sec;
+    listing->mtimeNsec = st.st_mtim.tv_nsec;
+    if (!readDirectory(path, listing->entries))
+        return NULL;
+
+    lock_guard<mutex> lock(cache_mutex);
+    cache_misses++;
+    if (cache_names + listing->entries.size() > GLOB_CACHE_MAX_ENTRIES) {
+        dir_cache.clear();
+        cache_names = 0;
+    }
+    shared_ptr<const dirListing>& slot = dir_cache[key];
+    if (slot)
+        cache_names -= slot->entries.size();
+    slot = listing;
+    cache_names += listing->entries.size();
+    return listing;
+}
+
+// Whether the entry at path is a directory. The type from getdents64 answers without a stat,
+// except for symbolic links (followed if follow is set) and unknown types
+static bool isDirectory(const string& path, unsigned char type, bool follow) {
+    if (type == DT_DIR)
+        return true;
+    if (type != DT_LNK && type != DT_UNKNOWN)
+        return false;
+    if (type == DT_LNK && !follow)
+        return false;
+    struct stat st;
+    int ret = type == DT_LNK ? stat(path.c_str(), &st) : lstat(path.c_str(), &st);
+    return ret == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+	Matching
+*/
+
+// Match c against the pattern element at p (a character, `?` or a `[...]` class), and set next
+// to the index after it
+static bool matchOne(const char* pattern, size_t patternLen, size_t p, unsigned char c,
+                     size_t& next) {
+    if (pattern[p] == '?') {
+        next = p + 1;
+        return true;
+    }
+    if (pattern[p] == '[') {
+        size_t q = p + 1;
+        bool negate = q < patternLen && (pattern[q] == '!' || pattern[q] == '^');
+        if (negate)
+            q++;
+        // A `]` right after the opening bracket is one of the characters
+        size_t first = q;
+        bool matched = false;
+        while (q < patternLen && (pattern[q] != ']' || q == first)) {
+            unsigned char low = pattern[q];
+            if (q + 2 < patternLen && pattern[q + 1] == '-' && pattern[q + 2] != ']') {
+                matched = matched || (c >= low && c <= (unsigned char)pattern[q + 2]);
+                q += 3;
+            } else {
+                matched = matched || c == low;
+                q++;
+            }
+        }
+        // Without a closing bracket, `[` is an ordinary character
+        if (q < patternLen) {
+            next = q + 1;
+            return matched != negate;
+        }
+    }
+    next = p + 1;
+    return (unsigned char)pattern[p] == c;
+}
+
+bool globMatch(const char* pattern, size_t patternLen, const char* name) {
+    // On a mismatch, go back to the last `*` and let it take one more character
+    size_t p = 0, n = 0, starP = string::npos, starN = 0;
+    size_t nameLen = strlen(name);
+    while (n < nameLen) {
+        if (p < patternLen && pattern[p] == '*') {
+            starP = ++p;
+            starN = n;
+            continue;
+        }
+        size_t next;
+        if (p < patternLen && matchOne(pattern, patternLen, p, name[n], next)) {
+            p = next;
+            n++;
+            continue;
+        }
+        if (starP == string::npos)
+            return false;
+        p = starP;
+        n = ++starN;
+    }
+    while (p < patternLen && pattern[p] == '*')
+        p++;
+    return p == patternLen;
+}
+
+// Whether a component holds anything but ordinary characters
+static bool hasGlob(const string& component) {
+    for (size_t i = 0; i < component.size(); i++) {
+        if (component[i] == '*' || component[i] == '?')
+            return true;
+        if (component[i] == '[' && component.find(']', i + 2) != string::npos)
+            return true;
+    }
+    return false;
+}
+
+/*
+	Walking
+*/
+
+/*
+	struct globPattern
+	------------------
+	Members:
+		components: vector<string> -> The pattern split at each `/`
+		isGlob: vector<bool> -> Whether each component needs a directory listing
+		dirOnly: bool -> The pattern ended with `/`, so only directories match
+	------------------
+*/
+struct globPattern {
+    vector<string> components;
+    vector<bool> isGlob;
+    bool dirOnly;
+};
+
+/*
+	struct globItem
+	A directory to match part of the pattern in
+	------------------
+	Members:
+		prefix: string -> The directory as it starts the paths of the matches ("", "/" or ending in `/`)
+		component: size_t -> Index of the first component left to match
+		descended: bool -> Reached by `**` going down from a directory it already matched in
+	------------------
+*/
+struct globItem {
+    string prefix;
+    size_t component;
+    bool descended;
+};
+
+static void addMatch(const globPattern& pattern, const string& path, vector<string>& matches) {
+    matches.push_back(pattern.dirOnly ? path + "/" : path);
+}
+
+// Match the next component of the pattern in one directory. Matches of the last component go to
+// matches, directories to go on with go to pending
+static void walkItem(const globPattern& pattern, const globItem& item, vector<globItem>& pending,
+                     vector<string>& matches) {
+    const string& component = pattern.components[item.component];
+    bool last = item.component + 1 == pattern.components.size();
+
+    if (!pattern.isGlob[item.component]) {
+        string path = item.prefix + component;
+        struct stat st;
+        if (!last)
+            pending.push_back(globItem{path + "/", item.component + 1, false});
+        else if (pattern.dirOnly ? stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)
+                                 : lstat(path.c_str(), &st) == 0)
+            addMatch(pattern, path, matches);
+        return;
+    }
+
+    shared_ptr<const dirListing> listing = listDirectory(item.prefix);
+    if (!listing)
+        return;
+
+    if (component == "**") {
+        // No directory at all: the rest of the pattern applies right here. A trailing `**` matches
+        // the directory itself
+        if (!last)
+            pending.push_back(globItem{item.prefix, item.component + 1, false});
+        else if (!item.descended && !item.prefix.empty())
+            matches.push_back(item.prefix);
+        for (size_t i = 0; i < listing->entries.size(); i++) {
+            const globEntry& entry = listing->entries[i];
+            if (entry.name[0] == '.')
+                continue;
+            string path = item.prefix + entry.name;
+            // Links to directories match, but are not walked into
+            bool directory = isDirectory(path, entry.type, false);
+            if (last && (!pattern.dirOnly || directory || isDirectory(path, entry.type, true)))
+                addMatch(pattern, path, matches);
+            if (directory)
+                pending.push_back(globItem{path + "/", item.component, true});
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < listing->entries.size(); i++) {
+        const globEntry& entry = listing->entries[i];
+        if (entry.name[0] == '.' && component[0] != '.')
+            continue;
+        if (!globMatch(component.data(), component.size(), entry.name.c_str()))
+            continue;
+        string path = item.prefix + entry.name;
+        if (last) {
+            if (!pattern.dirOnly || isDirectory(path, entry.type, true))
+                addMatch(pattern, path, matches);
+        } else if (isDirectory(path, entry.type, true)) {
+            pending.push_back(globItem{path + "/", item.component + 1, false});
+        }
+    }
+}
+
+/*
+	struct parallelWalk
+	The queue shared by the threads of a parallel walk. A thread that finds it empty waits while
+	others are busy, as they may add to it. The walk is over when it is empty and nobody is busy
+*/
+struct parallelWalk {
+    mutex lock;
+    condition_variable changed;
+    deque<globItem> queue;
+    int busy = 0;
+};
+
+static void walkWorker(const globPattern& pattern, parallelWalk& walk, vector<string>& matches) {
+    vector<globItem> pending;
+    unique_lock<mutex> lock(walk.lock);
+    while (true) {
+        walk.changed.wait(lock, [&walk] { return !walk.queue.empty() || walk.busy == 0; });
+        if (walk.queue.empty())
+            break;
+        globItem item = walk.queue.front();
+        walk.queue.pop_front();
+        walk.busy++;
+        lock.unlock();
+
+        pending.clear();
+        walkItem(pattern, item, pending, matches);
+
+        lock.lock();
+        walk.queue.insert(walk.queue.end(), pending.begin(), pending.end());
+        walk.busy--;
+        if (!pending.empty() || walk.busy == 0)
+            walk.changed.notify_all();
+    }
+}
+
+// Walk the rest of queue on several threads
+static void walkParallel(const globPattern& pattern, deque<globItem>& queue,
+                         vector<string>& matches) {
+    TRACE_SPAN("glob.parallel");
+    unsigned threads = min((unsigned)GLOB_MAX_THREADS, max(1u, thread::hardware_concurrency()));
+
+    parallelWalk walk;
+    walk.queue.swap(queue);
+    vector<vector<string>> found(threads);
+    vector<thread> workers;
+    for (unsigned i = 1; i < threads; i++)
+        workers.push_back(thread(walkWorker, cref(pattern), ref(walk), ref(found[i])));
+    walkWorker(pattern, walk, found[0]);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    for (unsigned i = 0; i < threads; i++)
+        matches.insert(matches.end(), found[i].begin(), found[i].end());
+}
+
+size_t expandGlob(const string& text, vector<string>& matches) {
+    TRACE_SPAN_DETAIL("glob", text.c_str());
+    globPattern pattern;
+    pattern.dirOnly = !text.empty() && text[text.size() - 1] == '/';
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('/', start);
+        if (end == string::npos)
+            end = text.size();
+        if (end > start) {
+            pattern.components.push_back(text.substr(start, end - start));
+            pattern.isGlob.push_back(hasGlob(pattern.components.back()));
+        }
+        start = end + 1;
+    }
+    if (pattern.components.empty())
+        return 0;
+
+    vector<string> found;
+    deque<globItem> queue;
+    queue.push_back(globItem{text[0] == '/' ? "/" : "", 0, false});
+    vector<globItem> pending;
+    size_t walked = 0;
+    while (!queue.empty()) {
+        if (walked >= GLOB_PARALLEL_DIRS && queue.size() > 1) {
+            walkParallel(pattern, queue, found);
+            break;
+        }
+        globItem item = queue.front();
+        queue.pop_front();
+        pending.clear();
+        walkItem(pattern, item, pending, found);
+        queue.insert(queue.end(), pending.begin(), pending.end());
+        walked++;
+    }
+
+    sort(found.begin(), found.end());
+    matches.insert(matches.end(), found.begin(), found.end());
+    return found.size();
+}
+
+void globStrings(const tokenizedLine& parsed, vector<string>& tokens,
+                 vector<vector<string>>& stages) {
+    tokens.clear();
+    stages.clear();
+    if (parsed.numStages > 1)
+        stages.resize(parsed.numStages);
+
+    size_t stage = 0;
+    for (size_t i = 0; i < parsed.numTokens; i++) {
+        string token = tokenString(parsed, i);
+        if (parsed.tokens[i].flags & TOKEN_PIPE) {
+            tokens.push_back(token);
+            stage++;
+            continue;
+        }
+        size_t first = tokens.size();
+        if (!(parsed.tokens[i].flags & TOKEN_GLOB) || expandGlob(token, tokens) == 0)
+            tokens.push_back(token);
+        if (!stages.empty())
+            stages[stage].insert(stages[stage].end(), tokens.begin() + first, tokens.end());
+    }
+
+    if (!cache_across)
+        clearCache();
+}
+
+int metash_globcache(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        lock_guard<mutex> lock(cache_mutex);
+        printf("glob cache is %s: %zu directories, %zu names, %lu hits, %lu misses\n",
+               cache_across ? "on" : "off", dir_cache.size(), cache_names, cache_hits,
+               cache_misses);
+        return 0;
+    }
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off" && tokens[1] != "clear")) {
+        printf("usage: globcache [on|off|clear]\n");
+        return -1;
+    }
+    if (tokens[1] == "clear") {
+        clearCache();
+        return 0;
+    }
+    cache_across = tokens[1] == "on";
+    if (!cache_across)
+        clearCache();
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef GLOB_H_
+#define GLOB_H_
+
+#include <string>
+#include <vector>
+
+#include "tokenizer.h"
+
+#define GLOB_READ_SIZE 65536         // Bytes of directory entries read by one getdents64 call
+#define GLOB_PARALLEL_DIRS 256       // Directories read alone before a walk goes parallel
+#define GLOB_MAX_THREADS 8           // Threads of a parallel walk, the shell's included
+#define GLOB_CACHE_MAX_ENTRIES (1 << 20) // Names kept by the cache across commands
+
+/*
+	Globbing
+	------------------
+	A token with an unquoted `*`, `?` or `[` (see TOKENIZE_GLOB in tokenizer.h) is a pattern, and is
+	replaced by the paths it matches, sorted. A pattern that matches nothing is left as it is
+		*        any string, including the empty one
+		?        any one character
+		[abc]    one of the characters, [a-z] a range, [!abc] or [^abc] any other character
+		**       as a whole path component: any number of directories, including none
+	A leading `.` of a name must be matched by a `.` in the pattern, and `.` and `..` never match.
+	`**` does not descend into hidden directories or follow symbolic links
+
+	Directories are read with getdents64, GLOB_READ_SIZE bytes at a time, and the type that comes
+	with each entry saves a stat call for everything but symbolic links (and file systems that do
+	not fill it in). Each listing is cached by the device, inode and modification time of its
+	directory, so a line like `ls *.c *.h` reads the directory once. The cache is dropped after
+	each command, unless `globcache on` keeps it across commands
+
+	A walk is a queue of directories, each with the part of the pattern left to match in it. Once
+	a walk has read GLOB_PARALLEL_DIRS directories and has more to go, as a `**` over a large tree
+	does, it is finished by up to GLOB_MAX_THREADS threads, one per core. The result is sorted, so
+	it does not depend on the order the threads finish in
+*/
+
+/*
+	bool globMatch(const char *pattern, size_t patternLen, const char *name)
+	------------------
+	Match one path component against one component of a pattern, without the special treatment of
+	a leading `.`
+*/
+bool globMatch(const char* pattern, size_t patternLen, const char* name);
+
+/*
+	size_t expandGlob(const string &pattern, vector<string> &matches)
+	------------------
+	Append the sorted paths that pattern matches to matches
+	Returns the number of paths appended
+*/
+size_t expandGlob(const std::string& pattern, std::vector<std::string>& matches);
+
+/*
+	void globStrings(const tokenizedLine &parsed, vector<string> &tokens,
+	                 vector<vector<string>> &stages)
+	------------------
+	Like `tokenStrings` and `stageStrings` (stages are only filled for a pipeline), with the
+	tokens flagged TOKEN_GLOB replaced by their matches. Ends the command's use of the cache
+*/
+void globStrings(const tokenizedLine& parsed, std::vector<std::string>& tokens,
+                 std::vector<std::vector<std::string>>& stages);
+
+/*
+	int metash_globcache(const vector<string> &tokens)
+	------------------
+	Builtin to show or set the directory cache of globbing
+		`globcache`         shows whether the cache is kept across commands, and its size
+		`globcache on|off`  keeps the listings across commands (checked against the modification
+		                    time of their directory each time), or only within a command
+		`globcache clear`   drops every listing
+*/
+int metash_globcache(const std::vector<std::string>& tokens);
+
+#endif // GLOB_H_
@@ -0,0 +1,495 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
+#include <readline/readline.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "histindex.h"
+
+using namespace std;
+
+#define TRIGRAM_SPACE (64 * 64 * 64)
+
+static string history_path;
+static string index_path;
+static atomic<bool> rebuilding(false);
+
+// Inode and size of the history file the index on disk was built from, 0 if there is no index
+static atomic<uint64_t> indexed_inode(0);
+static atomic<uint64_t> indexed_size(0);
+
+/*
+	Byte tables: the trigram class of each byte (1-26 letters ignoring case, 27-36 digits, 37-61
+	common shell punctuation, 63 for anything else), and its lowercase form for matching
+*/
+static const struct byteTables {
+    unsigned char trigram_class[256];
+    unsigned char lower[256];
+
+    byteTables() {
+        const char* punct = " -_./~|&$'\"*=:,;<>(){}[]";
+        for (int c = 0; c < 256; c++) {
+            lower[c] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+            if (lower[c] >= 'a' && lower[c] <= 'z')
+                trigram_class[c] = lower[c] - 'a' + 1;
+            else if (c >= '0' && c <= '9')
+                trigram_class[c] = c - '0' + 27;
+            else if (c != 0 && strchr(punct, c))
+                trigram_class[c] = 37 + (strchr(punct, c) - punct);
+            else
+                trigram_class[c] = 63;
+        }
+    }
+} tables;
+
+// Distinct trigrams of text, sorted
+static void trigrams(const char* text, size_t len, vector<uint32_t>& grams) {
+    grams.clear();
+    const unsigned char* bytes = (const unsigned char*)text;
+    for (size_t i = 0; i + 2 < len; i++)
+        grams.push_back(tables.trigram_class[bytes[i]] << 12 |
+                        tables.trigram_class[bytes[i + 1]] << 6 |
+                        tables.trigram_class[bytes[i + 2]]);
+    sort(grams.begin(), grams.end());
+    grams.erase(unique(grams.begin(), grams.end()), grams.end());
+}
+
+// Does text contain query (already lowercase), ignoring case
+static bool containsFolded(const char* text, size_t len, const string& query) {
+    size_t qlen = query.size();
+    for (size_t i = 0; i + qlen <= len; i++) {
+        size_t j = 0;
+        while (j < qlen && tables.lower[(unsigned char)text[i + j]] == (unsigned char)query[j])
+            j++;
+        if (j == qlen)
+            return true;
+    }
+    return false;
+}
+
+// Does text contain the characters of query (already lowercase) in order, ignoring case
+static bool fuzzyFolded(const char* text, size_t len, const string& query) {
+    size_t j = 0;
+    for (size_t i = 0; i < len && j < query.size(); i++) {
+        if (tables.lower[(unsigned char)text[i]] == (unsigned char)query[j])
+            j++;
+    }
+    return j == query.size();
+}
+
+static uint64_t hashText(const char* text, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// End of the entry starting at start: its newline, or the end of the mapped data
+static const char* entryEnd(const char* start, const char* end) {
+    const char* newline = (const char*)memchr(start, '\n', end - start);
+    return newline ? newline : end;
+}
+
+/*
+	struct mappedFile
+	A file mapped read-only, with the index tables inside it when it is an index
+*/
+struct mappedFile {
+    const char* data;
+    size_t size;
+    const histIndexHeader* header;
+    const uint64_t* offsets;
+    const uint32_t* counts;
+    const uint32_t* starts;
+    const uint32_t* postings;
+};
+
+static bool mapFile(const string& path, mappedFile& file, struct stat* st) {
+    file.data = NULL;
+    file.size = 0;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat local;
+    if (!st)
+        st = &local;
+    if (fstat(fd, st) == 0 && st->st_size > 0) {
+        void* map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            file.data = (const char*)map;
+            file.size = st->st_size;
+        }
+    }
+    close(fd);
+    return file.data != NULL;
+}
+
+static void unmapFile(mappedFile& file) {
+    if (file.data)
+        munmap((void*)file.data, file.size);
+    file.data = NULL;
+}
+
+static size_t indexFileSize(uint32_t entries, uint64_t postings) {
+    return sizeof(histIndexHeader) + sizeof(uint64_t) * (entries + 1) + sizeof(uint32_t) * entries +
+           sizeof(uint32_t) * (TRIGRAM_SPACE + 1) + sizeof(uint32_t) * postings;
+}
+
+// Point the tables of an index into its mapping. Fails if the file is not a valid index
+static bool openIndex(mappedFile& index) {
+    if (!index.data || index.size < sizeof(histIndexHeader))
+        return false;
+    index.header = (const histIndexHeader*)index.data;
+    uint32_t entries = index.header->entries;
+    if (memcmp(index.header->magic, HISTINDEX_MAGIC, sizeof(index.header->magic)) != 0 ||
+        index.size != indexFileSize(entries, index.header->postings))
+        return false;
+
+    index.offsets = (const uint64_t*)(index.header + 1);
+    index.counts = (const uint32_t*)(index.offsets + entries + 1);
+    index.starts = index.counts + entries;
+    index.postings = index.starts + TRIGRAM_SPACE + 1;
+    return true;
+}
+
+/*
+	Build the index of the history file into a temporary file and rename it into place. Every entry
+	is recorded, but only the latest copy of each text gets a count and goes in the posting lists
+*/
+static void buildIndex() {
+    mappedFile history;
+    struct stat st;
+    bool mapped = mapFile(history_path, history, &st);
+    if (!mapped && access(history_path.c_str(), F_OK) < 0)
+        return;
+
+    const char* data = history.data;
+    const char* end = data + history.size;
+    vector<uint64_t> offsets;
+    for (const char* pos = data; pos < end;) {
+        const char* stop = entryEnd(pos, end);
+        if (stop > pos)
+            offsets.push_back(pos - data);
+        pos = stop + 1;
+    }
+    uint32_t entries = offsets.size();
+
+    // Newest first, so the first copy of a text seen is its latest
+    vector<uint32_t> counts(entries, 0);
+    unordered_map<uint64_t, uint32_t> latest;
+    latest.reserve(entries);
+    for (uint32_t i = entries; i-- > 0;) {
+        const char* text = data + offsets[i];
+        size_t len = entryEnd(text, end) - text;
+        pair<unordered_map<uint64_t, uint32_t>::iterator, bool> slot =
+            latest.insert(make_pair(hashText(text, len), i));
+        if (slot.second) {
+            counts[i] = 1;
+            continue;
+        }
+        const char* other = data + offsets[slot.first->second];
+        if ((size_t)(entryEnd(other, end) - other) == len && memcmp(other, text, len) == 0)
+            counts[slot.first->second]++;
+        else
+            counts[i] = 1;  // Hash collision: keep it as a command of its own
+    }
+
+    // Count the postings of every trigram, then fill the lists in entry order
+    vector<uint32_t> starts(TRIGRAM_SPACE + 1, 0);
+    vector<uint32_t> grams;
+    for (uint32_t i = 0; i < entries; i++) {
+        if (!counts[i])
+            continue;
+        const char* text = data + offsets[i];
+        trigrams(text, entryEnd(text, end) - text, grams);
+        for (size_t g = 0; g < grams.size(); g++)
+            starts[grams[g] + 1]++;
+    }
+    for (size_t t = 0; t < TRIGRAM_SPACE; t++)
+        starts[t + 1] += starts[t];
+    uint64_t postings = starts[TRIGRAM_SPACE];
+
+    // Each shell writes its own file, so two rebuilding at once never truncate each other's
+    // mapping. The last rename wins, and either index is complete
+    string temp = index_path + ".tmp." + to_string(getpid());
+    size_t size = indexFileSize(entries, postings);
+    int fd = open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    void* map = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, size) == 0)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (map == MAP_FAILED) {
+        perror("history: cannot write index");
+        unlink(temp.c_str());
+        unmapFile(history);
+        return;
+    }
+
+    histIndexHeader* header = (histIndexHeader*)map;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, HISTINDEX_MAGIC, sizeof(header->magic));
+    header->inode = st.st_ino;
+    header->indexed_size = history.size;
+    header->entries = entries;
+    header->postings = postings;
+
+    uint64_t* outOffsets = (uint64_t*)(header + 1);
+    uint32_t* outCounts = (uint32_t*)(outOffsets + entries + 1);
+    uint32_t* outStarts = outCounts + entries;
+    uint32_t* outPostings = outStarts + TRIGRAM_SPACE + 1;
+    copy(offsets.begin(), offsets.end(), outOffsets);
+    outOffsets[entries] = history.size;
+    copy(counts.begin(), counts.end(), outCounts);
+    copy(starts.begin(), starts.end(), outStarts);
+
+    for (uint32_t i = 0; i < entries; i++) {
+        if (!counts[i])
+            continue;
+        const char* text = data + offsets[i];
+        trigrams(text, entryEnd(text, end) - text, grams);
+        for (size_t g = 0; g < grams.size(); g++)
+            outPostings[starts[grams[g]]++] = i;
+    }
+
+    munmap(map, size);
+    unmapFile(history);
+    if (rename(temp.c_str(), index_path.c_str()) < 0) {
+        perror("history: cannot write index");
+        unlink(temp.c_str());
+        return;
+    }
+    indexed_inode = st.st_ino;
+    indexed_size = history.size;
+}
+
+static void rebuildIndex() {
+    buildIndex();
+    rebuilding = false;
+}
+
+void historyIndexUpdated(uint64_t inode, long size) {
+    if (history_path.empty())
+        return;
+    if (inode == indexed_inode && (uint64_t)size >= indexed_size &&
+        size - indexed_size <= HISTINDEX_TAIL_LIMIT)
+        return;
+
+    bool expected = false;
+    if (rebuilding.compare_exchange_strong(expected, true))
+        thread(rebuildIndex).detach();
+}
+
+void initHistoryIndex(const char* historyPath) {
+    history_path = historyPath;
+    index_path = history_path + HISTINDEX_SUFFIX;
+
+    mappedFile index;
+    if (mapFile(index_path, index, NULL) && openIndex(index)) {
+        indexed_inode = index.header->inode;
+        indexed_size = index.header->indexed_size;
+    }
+    unmapFile(index);
+
+    struct stat st;
+    if (stat(history_path.c_str(), &st) == 0)
+        historyIndexUpdated(st.st_ino, st.st_size);
+}
+
+// Entries of the posting lists that hold every trigram of query, ascending
+static void candidates(const mappedFile& index, const string& query, vector<uint32_t>& result) {
+    vector<uint32_t> grams;
+    trigrams(query.data(), query.size(), grams);
+
+    // Intersect starting from the shortest list, so the work is bounded by the rarest trigram
+    vector<pair<uint32_t, uint32_t>> lists;
+    for (size_t g = 0; g < grams.size(); g++)
+        lists.push_back(make_pair(index.starts[grams[g]], index.starts[grams[g] + 1]));
+    sort(lists.begin(), lists.end(), [](const pair<uint32_t, uint32_t>& a,
+                                        const pair<uint32_t, uint32_t>& b) {
+        return a.second - a.first < b.second - b.first;
+    });
+
+    result.assign(index.postings + lists[0].first, index.postings + lists[0].second);
+    for (size_t l = 1; l < lists.size() && !result.empty(); l++) {
+        const uint32_t* list = index.postings + lists[l].first;
+        const uint32_t* listEnd = index.postings + lists[l].second;
+        size_t kept = 0;
+        for (size_t i = 0; i < result.size(); i++) {
+            list = lower_bound(list, listEnd, result[i]);
+            if (list == listEnd)
+                break;
+            if (*list == result[i])
+                result[kept++] = result[i];
+        }
+        result.resize(kept);
+    }
+}
+
+/*
+	struct candidate
+	A match while searching, still pointing into the mapped history file. Strings are only made
+	for the matches that end up in the results
+*/
+struct candidate {
+    const char* text;
+    size_t len;
+    unsigned long count;
+    unsigned long last;
+    double score;
+};
+
+/*
+	Searches keep the history file and the index mapped, so pages faulted in by one search are
+	still there for the next. A file is mapped again when it was replaced or has grown
+*/
+static mappedFile search_history = {NULL, 0, NULL, NULL, NULL, NULL, NULL};
+static mappedFile search_index = {NULL, 0, NULL, NULL, NULL, NULL, NULL};
+static struct stat search_history_stat;
+static struct stat search_index_stat;
+
+static bool refreshMapping(const string& path, mappedFile& file, struct stat& mapped) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+        unmapFile(file);
+        return false;
+    }
+    if (file.data && st.st_ino == mapped.st_ino && st.st_dev == mapped.st_dev &&
+        st.st_size == mapped.st_size)
+        return true;
+
+    unmapFile(file);
+    return mapFile(path, file, &mapped);
+}
+
+int searchHistory(const string& query, bool fuzzy, size_t limit, vector<historyMatch>& matches) {
+    matches.clear();
+    if (history_path.empty())
+        return 0;
+
+    string folded = query;
+    for (size_t i = 0; i < folded.size(); i++)
+        folded[i] = tables.lower[(unsigned char)folded[i]];
+
+    // An empty or missing history has nothing to find
+    if (!refreshMapping(history_path, search_history, search_history_stat))
+        return 0;
+    mappedFile& history = search_history;
+    mappedFile& index = search_index;
+    const struct stat& st = search_history_stat;
+    const char* data = history.data;
+    const char* end = data + history.size;
+
+    bool indexed = refreshMapping(index_path, index, search_index_stat) && openIndex(index) &&
+                   index.header->inode == (uint64_t)st.st_ino &&
+                   index.header->indexed_size <= history.size;
+    uint32_t entries = indexed ? index.header->entries : 0;
+    size_t tailStart = indexed ? index.header->indexed_size : 0;
+
+    // The tail is scanned first. Its copies of a command are merged by hash, as it is small
+    vector<candidate> found;
+    unordered_map<uint64_t, size_t> tailFound;
+    unsigned long number = entries;
+    for (const char* pos = data + tailStart; pos < end;) {
+        const char* stop = entryEnd(pos, end);
+        size_t len = stop - pos;
+        if (len > 0) {
+            number++;
+            if (fuzzy ? fuzzyFolded(pos, len, folded) : containsFolded(pos, len, folded)) {
+                pair<unordered_map<uint64_t, size_t>::iterator, bool> slot =
+                    tailFound.insert(make_pair(hashText(pos, len), found.size()));
+                if (slot.second) {
+                    found.push_back(candidate{pos, len, 1, number, 0});
+                } else {
+                    found[slot.first->second].count++;
+                    found[slot.first->second].last = number;
+                }
+            }
+        }
+        pos = stop + 1;
+    }
+    size_t tailMatches = found.size();
+
+    // Indexed entries are distinct already, and only need merging with the tail
+    if (indexed) {
+        vector<uint32_t> ids;
+        bool scanAll = fuzzy || folded.size() < 3;
+        if (!scanAll)
+            candidates(index, folded, ids);
+
+        size_t numIds = scanAll ? entries : ids.size();
+        for (size_t k = 0; k < numIds; k++) {
+            uint32_t id = scanAll ? k : ids[k];
+            if (!index.counts[id])
+                continue;
+            const char* text = data + index.offsets[id];
+            size_t len = entryEnd(text, end) - text;
+            if (!(fuzzy ? fuzzyFolded(text, len, folded) : containsFolded(text, len, folded)))
+                continue;
+
+            if (tailMatches > 0) {
+                unordered_map<uint64_t, size_t>::iterator it = tailFound.find(hashText(text, len));
+                if (it != tailFound.end()) {
+                    found[it->second].count += index.counts[id];
+                    continue;
+                }
+            }
+            found.push_back(candidate{text, len, index.counts[id], id + 1UL, 0});
+        }
+    }
+
+    if (!indexed || history.size - tailStart > HISTINDEX_TAIL_LIMIT)
+        historyIndexUpdated(st.st_ino, history.size);
+
+    for (size_t k = 0; k < found.size(); k++)
+        found[k].score = found[k].count / (1.0 + (number - found[k].last) / HISTINDEX_RECENCY);
+
+    size_t shown = min(limit, found.size());
+    partial_sort(found.begin(), found.begin() + shown, found.end(),
+                 [](const candidate& a, const candidate& b) {
+                     return a.score > b.score || (a.score == b.score && a.last > b.last);
+                 });
+    for (size_t k = 0; k < shown; k++)
+        matches.push_back(historyMatch{string(found[k].text, found[k].len), found[k].count,
+                                       found[k].last, found[k].score});
+
+    return found.size();
+}
+
+// Ctrl-R state: the query typed, its matches, and the one shown on the line
+static string search_query;
+static vector<historyMatch> search_matches;
+static size_t search_position = 0;
+
+int historySearchKey(unused int count, unused int key) {
+    string line(rl_line_buffer, rl_end);
+
+    // The line was edited since the last Ctrl-R, so it is a new query
+    if (search_matches.empty() || line != search_matches[search_position].command) {
+        search_query = line;
+        search_position = 0;
+        searchHistory(search_query, false, HISTINDEX_RESULTS, search_matches);
+    } else {
+        search_position = (search_position + 1) % search_matches.size();
+    }
+
+    if (search_matches.empty()) {
+        rl_ding();
+        return 0;
+    }
+    rl_replace_line(search_matches[search_position].command.c_str(), 0);
+    rl_point = rl_end;
+    return 0;
+}
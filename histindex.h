@@ -0,0 +1,94 @@
+#ifndef HISTINDEX_H_
+#define HISTINDEX_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#define HISTINDEX_SUFFIX ".idx"
+#define HISTINDEX_MAGIC "MSHIDX1"
+#define HISTINDEX_TAIL_LIMIT (256 * 1024)  // Unindexed bytes that start a rebuild
+#define HISTINDEX_RESULTS 20               // Matches shown by `history search` and Ctrl-R
+#define HISTINDEX_RECENCY 1000.0           // Entries after which a match weighs half as much
+
+/*
+	History index
+	------------------
+	An on-disk trigram index of the history file, kept next to it (~/.shell_history.idx) and mapped
+	with `mmap` by every search. Bytes are folded to 64 classes (letters ignore case), so there are
+	64^3 possible trigrams and the directory is one flat array of offsets into the posting lists
+
+	Index file layout, after struct histIndexHeader:
+		uint64_t offsets[entries + 1]    start of each entry in the history file, then indexed_size
+		uint32_t counts[entries]         times the text of the entry occurs, on its latest copy only
+		uint32_t starts[64^3 + 1]        start of each trigram's list in postings
+		uint32_t postings[]              entries containing the trigram, ascending
+
+	Only the latest copy of a text is in the posting lists, so a command typed a thousand times is
+	checked once. Entries appended after the index was built (the tail of the history file) are
+	scanned directly. When the tail passes HISTINDEX_TAIL_LIMIT, or the history file was replaced by
+	a compaction, the index is rebuilt on a background thread and renamed into place
+*/
+struct histIndexHeader {
+    char magic[8];
+    uint64_t inode;
+    uint64_t indexed_size;
+    uint32_t entries;
+    uint32_t reserved;
+    uint64_t postings;
+};
+
+/*
+	struct historyMatch
+	One command found by `searchHistory`
+	------------------
+	Members:
+		command: string -> The command line
+		count: unsigned long -> How many times it was run
+		last: unsigned long -> History number of its latest run, as printed by `history`
+		score: double -> Rank of the match: count, weighed down by the age of the latest run
+	------------------
+*/
+struct historyMatch {
+    std::string command;
+    unsigned long count;
+    unsigned long last;
+    double score;
+};
+
+/*
+	void initHistoryIndex(const char *historyPath)
+	------------------
+	Set the history file to index, and start building the index if it is missing or out of date
+*/
+void initHistoryIndex(const char* historyPath);
+
+/*
+	void historyIndexUpdated(uint64_t inode, long size)
+	------------------
+	Tell the index the history file grew to size bytes, or was replaced by a file with another
+	inode. Starts a rebuild in the background if the index lags too far behind
+*/
+void historyIndexUpdated(uint64_t inode, long size);
+
+/*
+	int searchHistory(const string &query, bool fuzzy, size_t limit, vector<historyMatch> &matches)
+	------------------
+	Find the commands containing query (ignoring case), or with fuzzy set, the ones containing the
+	characters of query in order. Every distinct command appears once, and at most limit of them
+	are returned, best score first
+	Returns the number of matches found before the limit, or -1 on error
+*/
+int searchHistory(const std::string& query, bool fuzzy, size_t limit,
+                  std::vector<historyMatch>& matches);
+
+/*
+	int historySearchKey(int count, int key)
+	------------------
+	readline command bound to Ctrl-R, replacing its incremental search. The line typed so far is the
+	query: the line is replaced by the best match, and each further Ctrl-R moves to the next one
+*/
+int historySearchKey(int count, int key);
+
+#endif // HISTINDEX_H_
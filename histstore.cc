@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_set>
+
+#include <readline/history.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "histindex.h"
+#include "histstore.h"
+
+using namespace std;
+
+static string history_path;
+static int history_fd = -1;
+static bool history_loaded = false;
+
+// Size the file must reach before the next compaction, raised after each one
+static atomic<long> compact_at(HISTORY_COMPACT_SIZE);
+static atomic<bool> compacting(false);
+
+/*
+	Lock the history file with op (LOCK_SH or LOCK_EX), opening it into fd if needed. A compaction
+	may have replaced the file while we waited for the lock, which then is on the old file: fd is
+	reopened and locked again until it matches what the path points to
+*/
+static int lockHistory(int& fd, int op) {
+    while (true) {
+        if (fd < 0) {
+            fd = open(history_path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC,
+                      S_IRUSR | S_IWUSR);
+            if (fd < 0)
+                return -1;
+        }
+        if (flock(fd, op) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        struct stat onDisk, opened;
+        if (stat(history_path.c_str(), &onDisk) == 0 && fstat(fd, &opened) == 0 &&
+            onDisk.st_ino == opened.st_ino && onDisk.st_dev == opened.st_dev)
+            return 0;
+        // Closing the file also drops the lock
+        close(fd);
+        fd = -1;
+    }
+}
+
+// Map the locked file read-only. Returns NULL (with size 0) for an empty file
+static const char* mapHistory(int fd, size_t& size) {
+    struct stat st;
+    size = 0;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+        return NULL;
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    size = st.st_size;
+    return (const char*)map;
+}
+
+// Split [start, end) into lines, skipping empty ones
+static void splitLines(const char* start, const char* end, vector<string>& entries) {
+    while (start < end) {
+        const char* newline = (const char*)memchr(start, '\n', end - start);
+        if (!newline)
+            newline = end;
+        if (newline > start)
+            entries.push_back(string(start, newline - start));
+        start = newline + 1;
+    }
+}
+
+static int writeAll(int fd, const string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+/*
+	Rewrite the history file without duplicates, keeping the last HISTORY_MAX_ENTRIES entries.
+	Runs on its own thread with its own descriptor, holding the exclusive lock, so appends from this
+	and other shells wait and then go to the new file
+*/
+static void compactHistory() {
+    int fd = -1;
+    if (lockHistory(fd, LOCK_EX) < 0) {
+        compacting = false;
+        return;
+    }
+
+    size_t size;
+    const char* map = mapHistory(fd, size);
+    vector<string> entries;
+    splitLines(map, map + size, entries);
+    if (map)
+        munmap((void*)map, size);
+
+    // Walk from the newest entry, so the latest copy of a duplicate is the one kept
+    vector<string*> kept;
+    unordered_set<string> seen;
+    for (size_t i = entries.size(); i > 0 && kept.size() < HISTORY_MAX_ENTRIES; i--) {
+        if (seen.insert(entries[i - 1]).second)
+            kept.push_back(&entries[i - 1]);
+    }
+
+    string data;
+    for (size_t i = kept.size(); i > 0; i--)
+        data.append(*kept[i - 1]).append("\n");
+
+    string temp = history_path + ".compact";
+    int out = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (out < 0 || writeAll(out, data) < 0 || fsync(out) < 0 ||
+        rename(temp.c_str(), history_path.c_str()) < 0) {
+        perror("history: compaction failed");
+        unlink(temp.c_str());
+    } else {
+        compact_at = max((long)HISTORY_COMPACT_SIZE, 2 * (long)data.size());
+        // The index points into the old file
+        struct stat st;
+        if (fstat(out, &st) == 0)
+            historyIndexUpdated(st.st_ino, st.st_size);
+    }
+
+    if (out >= 0)
+        close(out);
+    close(fd);
+    compacting = false;
+}
+
+static void startCompaction() {
+    bool expected = false;
+    if (compacting.compare_exchange_strong(expected, true))
+        thread(compactHistory).detach();
+}
+
+int openHistory(const char* path) {
+    history_path = path;
+    history_loaded = false;
+    return 0;
+}
+
+bool historyLoaded() { return history_loaded || history_path.empty(); }
+
+int loadHistory() {
+    if (historyLoaded())
+        return 0;
+    history_loaded = true;
+
+    initHistoryIndex(history_path.c_str());
+    if (lockHistory(history_fd, LOCK_SH) < 0) {
+        perror("history: cannot open history file");
+        return -1;
+    }
+
+    size_t size;
+    const char* map = mapHistory(history_fd, size);
+    flock(history_fd, LOCK_UN);
+    if (!map)
+        return 0;
+
+    // Find where the last HISTORY_LOAD_ENTRIES lines start, without looking at the rest
+    const char* end = map + size;
+    const char* start = end;
+    if (start > map && start[-1] == '\n')
+        start--;
+    int count = 0;
+    while (start > map) {
+        if (start[-1] == '\n' && ++count == HISTORY_LOAD_ENTRIES)
+            break;
+        start--;
+    }
+
+    vector<string> entries;
+    splitLines(start, end, entries);
+    for (size_t i = 0; i < entries.size(); i++)
+        add_history(entries[i].c_str());
+    // Browsing starts after the newest entry, as readline was set up before they were added
+    using_history();
+
+    munmap((void*)map, size);
+    if ((long)size > compact_at)
+        startCompaction();
+    return 0;
+}
+
+int appendHistory(const char* line) {
+    // The entries of the file go before this one
+    loadHistory();
+    add_history(line);
+    if (history_path.empty())
+        return 0;
+
+    if (lockHistory(history_fd, LOCK_EX) < 0) {
+        perror("history: cannot lock history file");
+        return -1;
+    }
+
+    // With O_APPEND, the entry lands at the end of the file as written by any other shell
+    string entry = string(line) + "\n";
+    replace(entry.begin(), entry.end() - 1, '\n', ' ');
+    int ret = writeAll(history_fd, entry);
+
+    struct stat st;
+    bool tooLarge = false;
+    if (fstat(history_fd, &st) == 0) {
+        tooLarge = st.st_size > compact_at;
+        historyIndexUpdated(st.st_ino, st.st_size);
+    }
+    flock(history_fd, LOCK_UN);
+
+    if (ret < 0) {
+        perror("history: write failed");
+        return -1;
+    }
+    if (tooLarge)
+        startCompaction();
+    return 0;
+}
+
+int readHistory(vector<string>& entries) {
+    if (history_path.empty())
+        return 0;
+
+    int fd = -1;
+    if (lockHistory(fd, LOCK_SH) < 0) {
+        perror("history: cannot open history file");
+        return -1;
+    }
+
+    size_t size;
+    const char* map = mapHistory(fd, size);
+    close(fd);
+    if (!map)
+        return 0;
+
+    splitLines(map, map + size, entries);
+    munmap((void*)map, size);
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef HISTSTORE_H_
+#define HISTSTORE_H_
+
+#include <string>
+#include <vector>
+
+#define HISTORY_LOAD_ENTRIES 1000       // Entries handed to readline at startup
+#define HISTORY_MAX_ENTRIES 10000       // Entries kept by a compaction
+#define HISTORY_COMPACT_SIZE (1 << 20)  // File size that starts a compaction
+
+/*
+	History store
+	------------------
+	The history file is a log with one entry per line, the same format `write_history` used, so
+	old files keep working. Entries are only ever appended, with O_APPEND and under an exclusive
+	`flock`, so every command costs one small write no matter how long the history is, and shells
+	running at the same time add to the file instead of overwriting each other
+
+	Readers map the file with `mmap`. Only its tail is parsed, for the last HISTORY_LOAD_ENTRIES
+	entries that readline needs for the arrow keys and searches, and only once the first prompt is
+	on the screen (see `loadHistory`)
+
+	Once the file grows past HISTORY_COMPACT_SIZE, a background thread rewrites it: duplicate
+	entries are dropped (keeping the latest), and only the last HISTORY_MAX_ENTRIES remain. The new
+	file is renamed over the old one while the old one is locked. Writers check the inode of the
+	path after taking the lock, and reopen the file if it was replaced
+
+	The search index of the file (see histindex.h) is told about every append and compaction
+*/
+
+/*
+	int openHistory(const char *path)
+	------------------
+	Use the history file at path. Nothing is read yet: the file is opened (and created if needed)
+	and its tail loaded into readline's history by `loadHistory`, once the first prompt is up
+	Returns 0
+*/
+int openHistory(const char* path);
+
+/*
+	int loadHistory()
+	bool historyLoaded()
+	------------------
+	loadHistory opens the history file, loads its tail into readline's history and opens the search
+	index, the first time it is called. `appendHistory` calls it, so entries keep their order.
+	historyLoaded tells whether that was done (or there is no history file)
+	Returns 0 on success, -1 on error
+*/
+int loadHistory();
+bool historyLoaded();
+
+/*
+	int appendHistory(const char *line)
+	------------------
+	Add line to readline's history and append it to the history file, starting a compaction if the
+	file got too large
+	Returns 0 on success, -1 on error
+*/
+int appendHistory(const char* line);
+
+/*
+	int readHistory(vector<string> &entries)
+	------------------
+	Read every entry of the history file, including the ones added by other shells
+	Returns 0 on success, -1 on error
+*/
+int readHistory(std::vector<std::string>& entries);
+
+#endif // HISTSTORE_H_
@@ -0,0 +1,525 @@
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <list>
+
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "jobs.h"
+#include "timing.h"
+#include "trace.h"
+
+using namespace std;
+
+// The terminal the shell reads from, and the process group it gives back the terminal to
+int shell_terminal = STDIN_FILENO;
+pid_t shell_pgid = getpid();
+
+bool job_control = false;
+int job_signal_fd = -1;
+
+// A list, so references handed out by addJob stay valid while other jobs come and go
+static list<job> job_table;
+
+/*
+	Signal names understood by `kill`, in the order `kill -l` prints them
+*/
+static const struct {
+    const char* name;
+    int number;
+} signal_names[] = {
+    {"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+    {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH},
+};
+
+int initJobControl() {
+    // The shell itself must never be stopped from the terminal
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    // Lead our own process group and own the terminal, so jobs can be moved in and out of it
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid)
+        setpgid(0, shell_pgid);
+    tcsetpgrp(shell_terminal, shell_pgid);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGWINCH);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        perror("sigprocmask() failed");
+        return -1;
+    }
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        perror("signalfd() failed");
+        return -1;
+    }
+    job_control = true;
+    job_signal_fd = fd;
+    return fd;
+}
+
+job& addJob(const string& command, bool background) {
+    int id = 1;
+    for (list<job>::iterator it = job_table.begin(); it != job_table.end(); ++it)
+        id = max(id, it->id + 1);
+
+    job j;
+    j.id = id;
+    j.pgid = -1;
+    j.command = command;
+    j.background = background;
+    j.timing = TIME_OFF;
+    clock_gettime(CLOCK_MONOTONIC, &j.started);
+    job_table.push_back(j);
+    return job_table.back();
+}
+
+void addStage(job& j, pid_t pid, const string& command) {
+    if (j.pgid < 0 && job_control)
+        j.pgid = pid;
+    jobStage stage;
+    stage.pid = pid;
+    stage.command = command;
+    stage.state = JOB_RUNNING;
+    stage.status = 0;
+    memset(&stage.usage, 0, sizeof(stage.usage));
+    clock_gettime(CLOCK_MONOTONIC, &stage.started);
+    stage.finished = stage.started;
+    j.stages.push_back(stage);
+}
+
+int jobStatus(const job& j) {
+    bool stopped = false, running = false;
+    for (size_t i = 0; i < j.stages.size(); i++) {
+        if (j.stages[i].state == JOB_STOPPED)
+            stopped = true;
+        else if (j.stages[i].state == JOB_RUNNING)
+            running = true;
+    }
+    if (stopped)
+        return JOB_STOPPED;
+    return running ? JOB_RUNNING : JOB_DONE;
+}
+
+static job* findJob(int id) {
+    for (list<job>::iterator it = job_table.begin(); it != job_table.end(); ++it) {
+        if (it->id == id)
+            return &*it;
+    }
+    return NULL;
+}
+
+// Record the lifetime of every stage of a finished job, each on the track of its pid
+static void traceStages(const job& j) {
+    if (!trace_enabled.load(memory_order_relaxed))
+        return;
+    for (size_t i = 0; i < j.stages.size(); i++) {
+        const jobStage& stage = j.stages[i];
+        traceComplete("stage", stage.started.tv_sec * 1000000000ULL + stage.started.tv_nsec,
+                      stage.finished.tv_sec * 1000000000ULL + stage.finished.tv_nsec,
+                      stage.command.c_str(), stage.pid);
+    }
+}
+
+static void removeJob(int id) {
+    for (list<job>::iterator it = job_table.begin(); it != job_table.end(); ++it) {
+        if (it->id == id) {
+            traceStages(*it);
+            if (it->timing != TIME_OFF)
+                reportTiming(*it, it->timing);
+            job_table.erase(it);
+            return;
+        }
+    }
+}
+
+// Apply a status and resource usage returned by wait4 to a stage
+static void updateStage(jobStage& stage, int status, const struct rusage& usage) {
+    if (WIFSTOPPED(status)) {
+        stage.state = JOB_STOPPED;
+    } else if (WIFCONTINUED(status)) {
+        stage.state = JOB_RUNNING;
+    } else {
+        stage.state = JOB_DONE;
+        stage.status = status;
+        stage.usage = usage;
+        clock_gettime(CLOCK_MONOTONIC, &stage.finished);
+    }
+}
+
+// Exit status of a finished job: the status of its last stage, like other shells
+static int exitCode(const job& j) {
+    if (j.stages.empty())
+        return 127;
+    int status = j.stages.back().status;
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 0;
+}
+
+static const char* stateName(int state) {
+    if (state == JOB_RUNNING)
+        return "Running";
+    if (state == JOB_STOPPED)
+        return "Stopped";
+    return "Done";
+}
+
+bool giveTerminal(const job& j) {
+    // Once every stage is reaped the process group is gone, and there is nothing to hand over
+    if (!job_control || j.pgid <= 0 || jobStatus(j) == JOB_DONE)
+        return false;
+    if (tcsetpgrp(shell_terminal, j.pgid) != 0)
+        perror("tcsetpgrp() failed");
+    return true;
+}
+
+void reclaimTerminal() {
+    if (tcsetpgrp(shell_terminal, shell_pgid) != 0)
+        perror("tcsetpgrp() failed");
+}
+
+int waitForJob(int id, bool foreground) {
+    job* j = findJob(id);
+    if (!j)
+        return 127;
+    TRACE_SPAN_DETAIL("wait", j->command.c_str());
+
+    bool takeTerminal = foreground && giveTerminal(*j);
+
+    // Wait on one running stage at a time, until the job finishes or something in it stops
+    while (jobStatus(*j) == JOB_RUNNING) {
+        for (size_t i = 0; i < j->stages.size(); i++) {
+            jobStage& stage = j->stages[i];
+            if (stage.state != JOB_RUNNING)
+                continue;
+
+            int status;
+            struct rusage usage;
+            pid_t ret = wait4(stage.pid, &status, WUNTRACED, &usage);
+            if (ret < 0 && errno == EINTR)
+                break;
+            if (ret < 0) {
+                stage.state = JOB_DONE;
+                stage.status = 0;
+                clock_gettime(CLOCK_MONOTONIC, &stage.finished);
+            } else {
+                updateStage(stage, status, usage);
+            }
+            break;
+        }
+    }
+    // A Ctrl-Z stops every stage, pick up the others without blocking
+    reapJobs();
+
+    if (takeTerminal)
+        reclaimTerminal();
+
+    if (jobStatus(*j) == JOB_STOPPED) {
+        j->background = true;
+        printf("\n[%d]+  Stopped                 %s\n", j->id, j->command.c_str());
+        return 128 + SIGTSTP;
+    }
+
+    int code = exitCode(*j);
+    // The terminal echoed ^C without a newline, so the next prompt would start right after it
+    if (foreground && job_control && code == 128 + SIGINT)
+        printf("\n");
+    removeJob(id);
+    return code;
+}
+
+void reapJobs() {
+    for (list<job>::iterator it = job_table.begin(); it != job_table.end(); ++it) {
+        for (size_t i = 0; i < it->stages.size(); i++) {
+            jobStage& stage = it->stages[i];
+            if (stage.state == JOB_DONE)
+                continue;
+
+            int status;
+            struct rusage usage;
+            pid_t ret = wait4(stage.pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+            if (ret > 0) {
+                updateStage(stage, status, usage);
+            } else if (ret < 0 && errno == ECHILD) {
+                stage.state = JOB_DONE;
+                stage.status = 0;
+                clock_gettime(CLOCK_MONOTONIC, &stage.finished);
+            }
+        }
+    }
+}
+
+const list<job>& jobList() { return job_table; }
+
+int finishedJobs() {
+    int count = 0;
+    for (list<job>::iterator it = job_table.begin(); it != job_table.end(); ++it) {
+        if (it->background && jobStatus(*it) == JOB_DONE)
+            count++;
+    }
+    return count;
+}
+
+int notifyJobs(bool print) {
+    int removed = 0;
+    list<job>::iterator it = job_table.begin();
+    while (it != job_table.end()) {
+        if (!it->background || jobStatus(*it) != JOB_DONE) {
+            ++it;
+            continue;
+        }
+
+        if (print) {
+            int code = exitCode(*it);
+            if (code == 0)
+                printf("[%d]+  Done                    %s\n", it->id, it->command.c_str());
+            else
+                printf("[%d]+  Exit %-3d                %s\n", it->id, code, it->command.c_str());
+        }
+        traceStages(*it);
+        if (it->timing != TIME_OFF)
+            reportTiming(*it, it->timing);
+        it = job_table.erase(it);
+        removed++;
+    }
+    return removed;
+}
+
+/*
+	Parse a job spec: `%n`, `%+` or `%%` for the current job, or no argument at all for the current
+	job. Prints an error and returns NULL if there is no such job
+*/
+static job* parseJobSpec(const char* builtin, const string* spec) {
+    if (job_table.empty()) {
+        printf("%s: no current job\n", builtin);
+        return NULL;
+    }
+    if (!spec || *spec == "%+" || *spec == "%%")
+        return &job_table.back();
+
+    job* j = NULL;
+    if ((*spec)[0] == '%')
+        j = findJob(atoi(spec->c_str() + 1));
+    if (!j)
+        printf("%s: %s: no such job\n", builtin, spec->c_str());
+    return j;
+}
+
+static void continueJob(job& j) {
+    for (size_t i = 0; i < j.stages.size(); i++) {
+        if (j.stages[i].state == JOB_STOPPED)
+            j.stages[i].state = JOB_RUNNING;
+    }
+    if (j.pgid > 0)
+        kill(-j.pgid, SIGCONT);
+    else
+        for (size_t i = 0; i < j.stages.size(); i++)
+            kill(j.stages[i].pid, SIGCONT);
+}
+
+int metash_jobs(const vector<string>& tokens) {
+    bool longFormat = tokens.size() >= 2 && tokens[1] == "-l";
+    reapJobs();
+
+    for (list<job>::iterator it = job_table.begin(); it != job_table.end(); ++it) {
+        char current = (&*it == &job_table.back()) ? '+' : ' ';
+        printf("[%d]%c  %-24s%s\n", it->id, current, stateName(jobStatus(*it)),
+               it->command.c_str());
+
+        if (!longFormat)
+            continue;
+        for (size_t i = 0; i < it->stages.size(); i++) {
+            const jobStage& stage = it->stages[i];
+            if (stage.state == JOB_DONE)
+                printf("      %-8d Done (%d)      %s\n", stage.pid,
+                       WIFEXITED(stage.status) ? WEXITSTATUS(stage.status)
+                                               : 128 + WTERMSIG(stage.status),
+                       stage.command.c_str());
+            else
+                printf("      %-8d %-15s%s\n", stage.pid, stateName(stage.state),
+                       stage.command.c_str());
+        }
+    }
+    notifyJobs(false);
+    return 0;
+}
+
+int metash_fg(const vector<string>& tokens) {
+    if (tokens.size() >= 3) {
+        printf("fg: too many arguments\n");
+        return -1;
+    }
+
+    job* j = parseJobSpec("fg", tokens.size() == 2 ? &tokens[1] : NULL);
+    if (!j)
+        return -1;
+
+    printf("%s\n", j->command.c_str());
+    j->background = false;
+
+    // Hand over the terminal before waking the job, so it does not stop again on its first read
+    if (job_control && j->pgid > 0)
+        tcsetpgrp(shell_terminal, j->pgid);
+    continueJob(*j);
+
+    return waitForJob(j->id, true) == 0 ? 0 : -1;
+}
+
+int metash_bg(const vector<string>& tokens) {
+    if (tokens.size() >= 3) {
+        printf("bg: too many arguments\n");
+        return -1;
+    }
+
+    job* j = parseJobSpec("bg", tokens.size() == 2 ? &tokens[1] : NULL);
+    if (!j)
+        return -1;
+
+    if (jobStatus(*j) != JOB_STOPPED) {
+        printf("bg: job %d already in background\n", j->id);
+        return 0;
+    }
+
+    j->background = true;
+    continueJob(*j);
+    printf("[%d]+ %s &\n", j->id, j->command.c_str());
+    return 0;
+}
+
+int metash_wait(const vector<string>& tokens) {
+    int ret = 0;
+
+    // Every job that is running now. Stopped jobs would never finish, so like bash they are left
+    // alone, and a job that stops while it is waited for is reported once and left too
+    if (tokens.size() == 1) {
+        vector<int> ids;
+        for (list<job>::iterator it = job_table.begin(); it != job_table.end(); ++it) {
+            if (jobStatus(*it) != JOB_STOPPED)
+                ids.push_back(it->id);
+        }
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (findJob(ids[i]))
+                ret = waitForJob(ids[i], false);
+        }
+        return ret == 0 ? 0 : -1;
+    }
+
+    for (size_t i = 1; i < tokens.size(); i++) {
+        job* j = NULL;
+        if (tokens[i][0] == '%') {
+            j = parseJobSpec("wait", &tokens[i]);
+        } else {
+            pid_t pid = atoi(tokens[i].c_str());
+            for (list<job>::iterator it = job_table.begin(); it != job_table.end() && !j; ++it) {
+                for (size_t k = 0; k < it->stages.size(); k++) {
+                    if (it->stages[k].pid == pid)
+                        j = &*it;
+                }
+            }
+            if (!j)
+                printf("wait: pid %s is not a child of this shell\n", tokens[i].c_str());
+        }
+        if (!j) {
+            ret = 127;
+            continue;
+        }
+        ret = waitForJob(j->id, false);
+    }
+    return ret == 0 ? 0 : -1;
+}
+
+// Parse `-9`, `-KILL`, `-SIGKILL` or the argument of `-s`. Returns -1 if unknown
+static int parseSignal(const string& name) {
+    if (name.empty())
+        return -1;
+    if (isdigit(name[0]))
+        return atoi(name.c_str());
+
+    const char* bare = name.c_str();
+    if (strncmp(bare, "SIG", 3) == 0)
+        bare += 3;
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (strcmp(bare, signal_names[i].name) == 0)
+            return signal_names[i].number;
+    }
+    return -1;
+}
+
+int metash_kill(const vector<string>& tokens) {
+    size_t num_tokens = tokens.size();
+    int sig = SIGTERM;
+    size_t i = 1;
+
+    if (num_tokens >= 2 && tokens[1] == "-l") {
+        for (size_t k = 0; k < sizeof(signal_names) / sizeof(signal_names[0]); k++)
+            printf("%2d) SIG%s\n", signal_names[k].number, signal_names[k].name);
+        return 0;
+    }
+
+    if (num_tokens >= 3 && tokens[1] == "-s") {
+        sig = parseSignal(tokens[2]);
+        i = 3;
+    } else if (num_tokens >= 2 && tokens[1][0] == '-') {
+        sig = parseSignal(tokens[1].substr(1));
+        i = 2;
+    }
+
+    if (sig < 0) {
+        printf("kill: invalid signal specification\n");
+        return -1;
+    }
+    if (i >= num_tokens) {
+        printf("kill: usage: kill [-s sigspec | -signum] %%n | pid ...\n");
+        return -1;
+    }
+
+    int ret = 0;
+    for (; i < num_tokens; i++) {
+        if (tokens[i][0] == '%') {
+            job* j = parseJobSpec("kill", &tokens[i]);
+            if (!j) {
+                ret = -1;
+                continue;
+            }
+            // Signal the whole process group, so every stage of a pipeline gets it
+            int status = j->pgid > 0 ? kill(-j->pgid, sig) : kill(j->stages[0].pid, sig);
+            if (status < 0) {
+                perror("kill");
+                ret = -1;
+            } else if (sig == SIGKILL || sig == SIGTERM) {
+                // A stopped job only acts on the signal once it runs again
+                kill(j->pgid > 0 ? -j->pgid : j->stages[0].pid, SIGCONT);
+            }
+        } else {
+            pid_t pid = atoi(tokens[i].c_str());
+            if (pid <= 0) {
+                printf("kill: %s: arguments must be process or job IDs\n", tokens[i].c_str());
+                ret = -1;
+            } else if (kill(pid, sig) < 0) {
+                perror("kill");
+                ret = -1;
+            }
+        }
+    }
+    return ret;
+}
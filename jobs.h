@@ -0,0 +1,187 @@
+#ifndef JOBS_H_
+#define JOBS_H_
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+
+/*
+	struct jobStage
+	One process of a job. A job started from a pipeline has one stage per command
+	------------------
+	Members:
+		pid: pid_t -> Process id of the stage
+		command: string -> The command line of this stage, for `jobs -l`
+		state: int -> JOB_RUNNING, JOB_STOPPED or JOB_DONE
+		status: int -> Wait status of the stage once it is done, as filled by `wait4`
+		usage: rusage -> Resources used by the stage, as filled by `wait4` once it is done
+		started, finished: timespec -> CLOCK_MONOTONIC times the stage was started and reaped at
+	------------------
+*/
+struct jobStage {
+    pid_t pid;
+    std::string command;
+    int state;
+    int status;
+    struct rusage usage;
+    struct timespec started;
+    struct timespec finished;
+};
+
+/*
+	struct job
+	A command or pipeline started by the shell, tracked until all of its stages are done
+	------------------
+	Members:
+		id: int -> Job number, as used in `%n` job specs
+		pgid: pid_t -> Process group shared by all stages (the pid of the first stage), or -1
+			when the shell has no job control and the stages stay in the shell's group
+		command: string -> The whole command line, for messages and `jobs`
+		stages: vector<jobStage> -> The processes of the job, in pipeline order
+		background: bool -> Set for jobs running in the background, whose completion is reported
+		timing: int -> TIME_OFF, or the format of the report printed when the job is done
+			(see timing.h)
+		started: timespec -> CLOCK_MONOTONIC time the job was created at
+	------------------
+*/
+struct job {
+    int id;
+    pid_t pgid;
+    std::string command;
+    std::vector<jobStage> stages;
+    bool background;
+    int timing;
+    struct timespec started;
+};
+
+/*
+	job_control: bool
+		Set by an interactive shell. Every job then gets its own process group, and the foreground
+		job gets the terminal. Without it, stages are simply waited for
+*/
+extern bool job_control;
+
+/*
+	job_signal_fd: int
+		The signalfd returned by `initJobControl`, or -1 without job control. Code that waits on
+		its own while a job runs, like the splice relay, polls it to notice Ctrl-C and stages that
+		exit or stop
+*/
+extern int job_signal_fd;
+
+/*
+	int initJobControl()
+	------------------
+	Set up the signals of an interactive shell: SIGCHLD, SIGINT and SIGWINCH are blocked and
+	delivered through a signalfd, which the main loop polls next to the terminal, so finished jobs are noticed without
+	ever blocking input. The job control stop signals are ignored by the shell itself
+	Returns the signalfd, or -1 on error
+*/
+int initJobControl();
+
+/*
+	job &addJob(const string &command, bool background)
+	------------------
+	Create a new, empty job in the table. Stages are added with `addStage` as they are started
+*/
+job& addJob(const std::string& command, bool background);
+
+/*
+	void addStage(job &j, pid_t pid, const string &command)
+	------------------
+	Record a started process as the next stage of j. The first stage sets the process group
+*/
+void addStage(job& j, pid_t pid, const std::string& command);
+
+/*
+	int jobStatus(const job &j)
+	------------------
+	State of the job as a whole: JOB_DONE when every stage is done, JOB_STOPPED if any stage is
+	stopped, JOB_RUNNING otherwise
+*/
+int jobStatus(const job& j);
+
+/*
+	bool giveTerminal(const job &j)
+	------------------
+	With job control on, make the process group of j the foreground group of the terminal, so
+	Ctrl-C and Ctrl-Z reach it and its stages can read the terminal. Nothing is done for a job whose
+	stages are all done. Returns true if the terminal was handed over, and must then be taken back
+	with `reclaimTerminal`
+*/
+bool giveTerminal(const job& j);
+
+/*
+	void reclaimTerminal()
+	------------------
+	Make the shell's process group the foreground group of the terminal again
+*/
+void reclaimTerminal();
+
+/*
+	int waitForJob(int id, bool foreground)
+	------------------
+	Wait until the job stops or finishes. With foreground set and job control on, the job gets the
+	terminal while it runs and the shell takes it back afterwards. A finished job is removed from
+	the table (printing its timing report if it was started with `time`) and a stopped one is
+	reported and kept
+	Returns the exit status of the last stage, 128 + signal if it was killed, or 128 + SIGTSTP if
+	the job was stopped
+*/
+int waitForJob(int id, bool foreground);
+
+/*
+	void reapJobs()
+	------------------
+	Collect the status of every stage that changed state, without blocking. Only processes in the
+	job table are waited for, so children started by builtins like `parallel` are left alone
+*/
+void reapJobs();
+
+/*
+	const list<job> &jobList()
+	------------------
+	The job table, oldest job first. Used by `fetch --watch` to show the processes of every job
+*/
+const std::list<job>& jobList();
+
+/*
+	int finishedJobs()
+	------------------
+	Number of background jobs that are done but not reported yet
+*/
+int finishedJobs();
+
+/*
+	int notifyJobs(bool print)
+	------------------
+	Remove the background jobs that are done, printing `[n]+ Done  command` for each if print is set
+	Returns the number of jobs removed
+*/
+int notifyJobs(bool print);
+
+/*
+	Job control builtins
+	------------------
+	jobs [-l]              list the jobs, with -l the pid and state of every stage
+	fg [%n]                bring a job to the foreground, continuing it if it was stopped
+	bg [%n]                continue a stopped job in the background
+	wait [%n|pid ...]      wait for the given jobs, or for all of them but the stopped ones
+	kill [-SIG] %n|pid ... send a signal (SIGTERM by default) to whole jobs or to single processes
+	Without a job spec, fg and bg use the most recently started job
+*/
+int metash_jobs(const std::vector<std::string>& tokens);
+int metash_fg(const std::vector<std::string>& tokens);
+int metash_bg(const std::vector<std::string>& tokens);
+int metash_wait(const std::vector<std::string>& tokens);
+int metash_kill(const std::vector<std::string>& tokens);
+
+#endif // JOBS_H_
@@ -0,0 +1,61 @@
+#ifndef METASH_PLUGIN_H_
+#define METASH_PLUGIN_H_
+
+/*
+	Plugin interface
+	------------------
+	A plugin is a shared object loaded with the `load` builtin. It adds builtins that run inside the
+	shell, without the fork and exec an external command costs. Only this header is shared with the
+	shell, and it is plain C, so a plugin can be built with any compiler and does not depend on the
+	C++ types of the shell
+
+	The plugin exports one function, named by METASH_PLUGIN_INIT:
+
+		int metash_plugin_init(const struct metash_plugin_api *api);
+
+	It is called once after the object is loaded, and registers builtins with
+	api->register_builtin. It returns 0 on success. Anything else unloads the plugin, and removes
+	the builtins it registered
+
+	The interface only ever grows: new members are added at the end of metash_plugin_api, and
+	abi_version goes up when they are. A plugin checks that abi_version is at least the version it
+	was written for
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METASH_PLUGIN_ABI 1
+#define METASH_PLUGIN_INIT "metash_plugin_init"
+
+/*
+	int metash_builtin_fn(int argc, const char *const *argv)
+	------------------
+	A builtin from a plugin. argv[0] is the name of the builtin, and argv[argc] is NULL. The strings
+	are only valid during the call. Returns 0 on success, like the builtins of the shell
+*/
+typedef int (*metash_builtin_fn)(int argc, const char* const* argv);
+
+/*
+	struct metash_plugin_api
+	------------------
+	Members:
+		abi_version: int -> METASH_PLUGIN_ABI of the shell
+		register_builtin: int (*)(const char *, const char *, metash_builtin_fn) -> Add a builtin
+			with a name and a one line help text, both copied. Returns 0 on success, -1 if a
+			builtin with that name already exists
+	------------------
+*/
+struct metash_plugin_api {
+    int abi_version;
+    int (*register_builtin)(const char* name, const char* help, metash_builtin_fn fn);
+};
+
+typedef int (*metash_plugin_init_fn)(const struct metash_plugin_api* api);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // METASH_PLUGIN_H_
@@ -0,0 +1,415 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+
+#include <map>
+
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "jobs.h"
+#include "monitor.h"
+#include "utils.h"
+
+using namespace std;
+
+#define INVERSE "\x1b[7m"
+
+/*
+	The system wide /proc files. They are opened by the first `fetch --watch` and stay open for
+	the next ones
+*/
+#define PROC_STAT 0
+#define PROC_MEMINFO 1
+#define PROC_LOADAVG 2
+#define PROC_UPTIME 3
+static const char* system_paths[] = {"/proc/stat", "/proc/meminfo", "/proc/loadavg",
+                                     "/proc/uptime"};
+static int system_fds[] = {-1, -1, -1, -1};
+
+/*
+	struct systemSample
+	One reading of the system wide files
+	------------------
+	Members:
+		cpu: unsigned long long [8] -> Ticks of all CPUs in user, nice, system, idle, iowait, irq,
+			softirq and steal time, the first fields of the `cpu` line of /proc/stat
+		memTotal, memAvailable, swapTotal, swapFree: long -> From /proc/meminfo, in bytes
+		load: double [3] -> 1, 5 and 15 minute load averages
+		running, processes: int -> Runnable and total scheduling entities, from /proc/loadavg
+		uptime: double -> Seconds since boot
+	------------------
+*/
+struct systemSample {
+    unsigned long long cpu[8];
+    long memTotal, memAvailable, swapTotal, swapFree;
+    double load[3];
+    int running, processes;
+    double uptime;
+};
+
+/*
+	struct processSample
+	A process shown by the monitor, with the /proc/PID/stat file kept open across samples
+	------------------
+	Members:
+		fd: int -> The open /proc/PID/stat, or -1 once the process is gone
+		state: char -> Process state letter (R, S, D, T, Z...), or 0 if it could not be read
+		ticks: unsigned long long -> User and system CPU time, in clock ticks
+		previous: unsigned long long -> ticks at the previous sample, for the CPU use in between
+		rss: long -> Resident memory, in bytes
+		seen: bool -> Still shown in the last sample. Processes that are not get their file closed
+	------------------
+*/
+struct processSample {
+    int fd;
+    char state;
+    unsigned long long ticks;
+    unsigned long long previous;
+    long rss;
+    bool seen;
+};
+
+static map<pid_t, processSample> processes;
+
+static double monotonicNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read a /proc file from its start into buffer, NUL terminated. Returns false if it failed
+static bool readProc(int fd, char* buffer, size_t size) {
+    ssize_t n = pread(fd, buffer, size - 1, 0);
+    if (n < 0) {
+        buffer[0] = '\0';
+        return false;
+    }
+    buffer[n] = '\0';
+    return true;
+}
+
+// Value of a `Name:   1234 kB` line of /proc/meminfo, in bytes
+static long meminfoValue(const char* meminfo, const char* name) {
+    const char* line = strstr(meminfo, name);
+    return line ? strtol(line + strlen(name), NULL, 10) * 1024 : 0;
+}
+
+static bool sampleSystem(systemSample& sample) {
+    for (int i = 0; i < 4; i++) {
+        if (system_fds[i] < 0)
+            system_fds[i] = open(system_paths[i], O_RDONLY | O_CLOEXEC);
+        if (system_fds[i] < 0)
+            return false;
+    }
+
+    char buffer[MONITOR_READ_SIZE];
+    memset(&sample, 0, sizeof(sample));
+
+    if (readProc(system_fds[PROC_STAT], buffer, sizeof(buffer))) {
+        unsigned long long* c = sample.cpu;
+        sscanf(buffer, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &c[0], &c[1], &c[2], &c[3],
+               &c[4], &c[5], &c[6], &c[7]);
+    }
+    if (readProc(system_fds[PROC_MEMINFO], buffer, sizeof(buffer))) {
+        sample.memTotal = meminfoValue(buffer, "MemTotal:");
+        sample.memAvailable = meminfoValue(buffer, "MemAvailable:");
+        sample.swapTotal = meminfoValue(buffer, "SwapTotal:");
+        sample.swapFree = meminfoValue(buffer, "SwapFree:");
+    }
+    if (readProc(system_fds[PROC_LOADAVG], buffer, sizeof(buffer)))
+        sscanf(buffer, "%lf %lf %lf %d/%d", &sample.load[0], &sample.load[1], &sample.load[2],
+               &sample.running, &sample.processes);
+    if (readProc(system_fds[PROC_UPTIME], buffer, sizeof(buffer)))
+        sscanf(buffer, "%lf", &sample.uptime);
+    return true;
+}
+
+static void sampleProcess(pid_t pid, processSample& p) {
+    p.seen = true;
+    p.previous = p.ticks;
+    if (p.fd < 0) {
+        p.state = 0;
+        return;
+    }
+
+    // The command name in parentheses may hold spaces, the fields are counted after it
+    char buffer[MONITOR_READ_SIZE];
+    const char* fields = readProc(p.fd, buffer, sizeof(buffer)) ? strrchr(buffer, ')') : NULL;
+    unsigned long long utime, stime;
+    long rss;
+    if (!fields || sscanf(fields + 2,
+                          "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d "
+                          "%*d %*d %*u %*u %ld",
+                          &p.state, &utime, &stime, &rss) != 4) {
+        // The process was reaped: its file now fails with ESRCH, and stays that way
+        close(p.fd);
+        p.fd = -1;
+        p.state = 0;
+        return;
+    }
+    p.ticks = utime + stime;
+    p.rss = rss * sysconf(_SC_PAGESIZE);
+}
+
+// The sample of pid, opening its /proc/PID/stat the first time it is seen
+static processSample& processFor(pid_t pid) {
+    map<pid_t, processSample>::iterator it = processes.find(pid);
+    if (it != processes.end())
+        return it->second;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    processSample p = {open(path, O_RDONLY | O_CLOEXEC), 0, 0, 0, 0, false};
+    sampleProcess(pid, p);
+    p.previous = p.ticks;
+    return processes[pid] = p;
+}
+
+// Close the files of the processes that are no longer in the job table
+static void dropUnseen() {
+    map<pid_t, processSample>::iterator it = processes.begin();
+    while (it != processes.end()) {
+        if (it->second.seen) {
+            it->second.seen = false;
+            ++it;
+            continue;
+        }
+        if (it->second.fd >= 0)
+            close(it->second.fd);
+        processes.erase(it++);
+    }
+}
+
+// text cut or padded with spaces to exactly width columns
+static string fit(const string& text, int width) {
+    if ((int)text.size() >= width)
+        return text.substr(0, width);
+    return text + string(width - text.size(), ' ');
+}
+
+static string percent(double part, double whole) {
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%5.1f%%", whole > 0 ? 100.0 * part / whole : 0.0);
+    return buffer;
+}
+
+static string processLine(const char* job, pid_t pid, const processSample& p, double elapsed,
+                          const string& command) {
+    char buffer[128];
+    long ticksPerSecond = sysconf(_SC_CLK_TCK);
+    double seconds = (double)p.ticks / ticksPerSecond;
+    if (!p.state) {
+        snprintf(buffer, sizeof(buffer), "%-5s %-8d %-5s %6s %8s %10s  ", job, pid, "done", "",
+                 "", "");
+    } else {
+        double cpu = elapsed > 0 ? 100.0 * (p.ticks - p.previous) / ticksPerSecond / elapsed : 0;
+        snprintf(buffer, sizeof(buffer), "%-5s %-8d %-5c %6.1f %8s %4d:%05.2f  ", job, pid,
+                 p.state, cpu, parse_memory(p.rss).c_str(), (int)(seconds / 60),
+                 seconds - 60 * (int)(seconds / 60));
+    }
+    return buffer + command;
+}
+
+// Build the lines of one frame from the current sample and the previous one
+static vector<string> renderFrame(const systemSample& now, const systemSample* before,
+                                  double interval, double elapsed, int width) {
+    vector<string> lines;
+    char buffer[256];
+
+    time_t clock = time(NULL);
+    char timeBuffer[16];
+    strftime(timeBuffer, sizeof(timeBuffer), "%H:%M:%S", localtime(&clock));
+    snprintf(buffer, sizeof(buffer), "%s monitor, every %gs, q to quit", SHELL, interval);
+    string title = buffer;
+    int gap = width - (int)title.size() - (int)strlen(timeBuffer);
+    title += string(gap > 1 ? gap : 1, ' ') + timeBuffer;
+    lines.push_back(INVERSE + fit(title, width) + NORM);
+
+    if (before) {
+        unsigned long long delta[8], total = 0;
+        for (int i = 0; i < 8; i++) {
+            delta[i] = now.cpu[i] - before->cpu[i];
+            total += delta[i];
+        }
+        double busy = total - delta[3] - delta[4];
+        snprintf(buffer, sizeof(buffer), "CPU   %s   user %s   sys %s   iowait %s   (%ld CPUs)",
+                 percent(busy, total).c_str(), percent(delta[0] + delta[1], total).c_str(),
+                 percent(delta[2] + delta[5] + delta[6], total).c_str(),
+                 percent(delta[4], total).c_str(), sysconf(_SC_NPROCESSORS_ONLN));
+        lines.push_back(fit(buffer, width));
+    } else {
+        lines.push_back(fit("CPU   measuring...", width));
+    }
+
+    long used = now.memTotal - now.memAvailable;
+    snprintf(buffer, sizeof(buffer), "Mem   %s / %s (%s)   swap %s / %s",
+             parse_memory(used).c_str(), parse_memory(now.memTotal).c_str(),
+             percent(used, now.memTotal).c_str(),
+             parse_memory(now.swapTotal - now.swapFree).c_str(),
+             parse_memory(now.swapTotal).c_str());
+    lines.push_back(fit(buffer, width));
+
+    snprintf(buffer, sizeof(buffer), "Load  %.2f %.2f %.2f   tasks %d/%d   up %s", now.load[0],
+             now.load[1], now.load[2], now.running, now.processes,
+             parse_time((long)now.uptime).c_str());
+    lines.push_back(fit(buffer, width));
+    lines.push_back("");
+
+    snprintf(buffer, sizeof(buffer), "%-5s %-8s %-5s %6s %8s %10s  %s", "JOB", "PID", "STATE",
+             "CPU%", "RSS", "TIME", "COMMAND");
+    lines.push_back(INVERSE + fit(buffer, width) + NORM);
+
+    pid_t self = getpid();
+    processSample& shell = processFor(self);
+    sampleProcess(self, shell);
+    lines.push_back(fit(processLine("-", self, shell, elapsed, SHELL " (this monitor)"), width));
+
+    const list<job>& jobs = jobList();
+    for (list<job>::const_iterator j = jobs.begin(); j != jobs.end(); ++j) {
+        for (size_t i = 0; i < j->stages.size(); i++) {
+            const jobStage& stage = j->stages[i];
+            processSample& p = processFor(stage.pid);
+            sampleProcess(stage.pid, p);
+            string id = i == 0 ? "[" + to_string(j->id) + "]" : "";
+            string line = processLine(id.c_str(), stage.pid, p, elapsed, stage.command);
+            lines.push_back(fit(line, width));
+        }
+    }
+    dropUnseen();
+    return lines;
+}
+
+// Rewrite the lines that differ from what is on the screen, and clear what is left below
+static void drawFrame(const vector<string>& lines, vector<string>& shown, int height) {
+    string out;
+    size_t count = min(lines.size(), (size_t)max(height, 1));
+    for (size_t i = 0; i < count; i++) {
+        if (i < shown.size() && shown[i] == lines[i])
+            continue;
+        out += "\x1b[" + to_string(i + 1) + ";1H" + lines[i] + "\x1b[K";
+    }
+    if (count < shown.size())
+        out += "\x1b[" + to_string(count + 1) + ";1H\x1b[J";
+    shown.assign(lines.begin(), lines.begin() + count);
+
+    while (!out.empty()) {
+        ssize_t n = write(STDOUT_FILENO, out.data(), out.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        out.erase(0, n);
+    }
+}
+
+// Wait until deadline, or until a quitting key is pressed. Returns true to quit
+static bool waitForKey(double deadline) {
+    while (true) {
+        double left = deadline - monotonicNow();
+        if (left <= 0)
+            return false;
+        struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+        int ret = poll(&fd, 1, (int)(left * 1000) + 1);
+        if (ret < 0 && errno != EINTR)
+            return true;
+        if (ret <= 0)
+            continue;
+
+        char keys[64];
+        ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+        if (n <= 0)
+            return true;
+        // q, or Ctrl-C and Ctrl-D since the terminal does not turn them into signals here
+        for (ssize_t i = 0; i < n; i++) {
+            if (keys[i] == 'q' || keys[i] == 'Q' || keys[i] == 3 || keys[i] == 4)
+                return true;
+        }
+    }
+}
+
+int metash_watch(const vector<string>& tokens) {
+    double interval = MONITOR_INTERVAL;
+    if (tokens.size() > 3 || tokens[1] != "--watch") {
+        printf("usage: fetch [--watch [interval]]\n");
+        return -1;
+    }
+    if (tokens.size() == 3) {
+        char* end;
+        interval = strtod(tokens[2].c_str(), &end);
+        if (*end || interval < MONITOR_MIN_INTERVAL) {
+            printf("fetch: interval must be a number of seconds, at least %g\n",
+                   MONITOR_MIN_INTERVAL);
+            return -1;
+        }
+    }
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+        printf("fetch: --watch needs a terminal\n");
+        return -1;
+    }
+
+    systemSample samples[2];
+    if (!sampleSystem(samples[0])) {
+        perror("fetch: /proc");
+        return -1;
+    }
+
+    // Keys are read one at a time without echo, and Ctrl-C is read as a key too
+    struct termios saved, raw;
+    tcgetattr(STDIN_FILENO, &saved);
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    // The alternate screen leaves the scrollback as it was once the monitor quits
+    fflush(stdout);
+    const char enter[] = "\x1b[?1049h\x1b[?25l\x1b[H\x1b[2J";
+    if (write(STDOUT_FILENO, enter, sizeof(enter) - 1) < 0)
+        perror("write() failed");
+
+    vector<string> shown;
+    int width = -1, current = 0;
+    const systemSample* before = NULL;
+    double sampled = monotonicNow(), deadline = sampled;
+    while (true) {
+        struct winsize size;
+        int height = 24;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+            // A resized terminal is drawn again from scratch
+            if (size.ws_col != width)
+                shown.clear();
+            width = size.ws_col;
+            height = size.ws_row;
+        } else if (width < 0) {
+            width = 80;
+        }
+
+        double now = monotonicNow();
+        reapJobs();
+        drawFrame(renderFrame(samples[current], before, interval, now - sampled, width), shown,
+                  height);
+        sampled = now;
+
+        // After a stop (Ctrl-Z of the whole shell, a suspended laptop) do not catch up
+        deadline = max(deadline + interval, now);
+        if (waitForKey(deadline))
+            break;
+        before = &samples[current];
+        current = 1 - current;
+        sampleSystem(samples[current]);
+    }
+
+    const char leave[] = "\x1b[?25h\x1b[?1049l";
+    if (write(STDOUT_FILENO, leave, sizeof(leave) - 1) < 0)
+        perror("write() failed");
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef MONITOR_H_
+#define MONITOR_H_
+
+#include <string>
+#include <vector>
+
+#define MONITOR_INTERVAL 1.0      // Default seconds between samples of `fetch --watch`
+#define MONITOR_MIN_INTERVAL 0.05 // Fastest sampling allowed, 20 Hz
+#define MONITOR_READ_SIZE 4096    // Bytes read from each /proc file, /proc/stat may be longer
+
+/*
+	Live monitor
+	------------------
+	`fetch --watch [interval]` samples the system every interval seconds and shows, until `q` or
+	Ctrl-C is pressed:
+		CPU use (user, system, iowait) across all CPUs, from /proc/stat
+		memory and swap, from /proc/meminfo
+		load average and uptime, from /proc/loadavg and /proc/uptime
+		every process of the shell's jobs, and the shell itself: state, CPU use, resident memory
+			and CPU time, from /proc/PID/stat
+
+	The /proc files are opened once and read again with `pread` at offset 0, which /proc answers
+	with fresh contents, so a sample costs one system call per file. The file of a process is
+	closed when the process is gone. The screen is only redrawn where a line changed
+*/
+
+/*
+	int metash_watch(const vector<string> &tokens)
+	------------------
+	Run the monitor for `fetch --watch [interval]`. Needs a terminal on stdin and stdout
+	Returns 0 when the user quits, -1 on a usage error
+*/
+int metash_watch(const std::vector<std::string>& tokens);
+
+#endif // MONITOR_H_
@@ -0,0 +1,1081 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "native.h"
+#include "spawner.h"
+#include "tee.h"
+#include "vars.h"
+
+using namespace std;
+
+static bool nativeDefault() {
+    const char* value = getenv("METASH_NATIVE");
+    return value == NULL || strcmp(value, "0") != 0;
+}
+
+bool native_builtins = nativeDefault();
+
+#define LOCALE_C 0
+#define LOCALE_UTF8 1
+#define LOCALE_OTHER 2
+
+// The character set the external commands would use, from the environment they would get
+static int nativeLocale() {
+    const char* names[] = {"LC_ALL", "LC_CTYPE", "LANG"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const string* variable = findVariable(names[i]);
+        if (variable == NULL || variable->empty())
+            continue;
+        const char* value = variable->c_str();
+        if (strcmp(value, "C") == 0 || strcmp(value, "POSIX") == 0)
+            return LOCALE_C;
+        if (strcasestr(value, "utf-8") || strcasestr(value, "utf8"))
+            return LOCALE_UTF8;
+        return LOCALE_OTHER;
+    }
+    return LOCALE_C;
+}
+
+/*
+	Kernels
+*/
+
+size_t countNewlines(const char* data, size_t size) {
+    size_t count = 0, i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (i + 16 <= size) {
+        // Matches are counted per byte lane, which overflows after 255 blocks
+        __m128i lanes = _mm_setzero_si128();
+        size_t blocks = min((size - i) / 16, (size_t)255);
+        for (size_t b = 0; b < blocks; b++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(v, newline));
+        }
+        __m128i sums = _mm_sad_epu8(lanes, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+#endif
+    for (; i < size; i++)
+        count += data[i] == '\n';
+    return count;
+}
+
+const char* findFixed(const char* data, size_t size, const char* needle, size_t length) {
+    if (length == 0)
+        return data;
+    if (length > size)
+        return NULL;
+    if (length == 1)
+        return (const char*)memchr(data, needle[0], size);
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[length - 1]);
+    for (; i + length - 1 + 16 <= size; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i*)(data + i + length - 1));
+        int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(data + at + 1, needle + 1, length - 2) == 0)
+                return data + at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    const char* found = (const char*)memmem(data + i, size - i, needle, length);
+    return found;
+}
+
+// Start of the last n lines of data. A last line without a newline counts as a line
+static size_t lastLinesStart(const char* data, size_t size, size_t n) {
+    if (n == 0)
+        return size;
+    size_t p = size;
+    if (p > 0 && data[p - 1] == '\n')
+        p--;
+    while (p > 0) {
+        const char* newline = (const char*)memrchr(data, '\n', p);
+        if (!newline)
+            return 0;
+        if (--n == 0)
+            return newline - data + 1;
+        p = newline - data;
+    }
+    return 0;
+}
+
+// Accepts the encodings GNU grep does not consider errors: UTF-8 without overlongs or surrogates
+static bool validUTF8(const unsigned char* s, size_t size) {
+    size_t i = 0;
+    while (i < size) {
+        if (s[i] < 0x80) {
+            i++;
+            continue;
+        }
+        size_t extra;
+        uint32_t c;
+        if ((s[i] & 0xe0) == 0xc0) {
+            extra = 1;
+            c = s[i] & 0x1f;
+        } else if ((s[i] & 0xf0) == 0xe0) {
+            extra = 2;
+            c = s[i] & 0x0f;
+        } else if ((s[i] & 0xf8) == 0xf0) {
+            extra = 3;
+            c = s[i] & 0x07;
+        } else {
+            return false;
+        }
+        if (i + extra >= size)
+            return false;
+        for (size_t k = 1; k <= extra; k++) {
+            if ((s[i + k] & 0xc0) != 0x80)
+                return false;
+            c = (c << 6) | (s[i + k] & 0x3f);
+        }
+        static const uint32_t minimum[] = {0, 0x80, 0x800, 0x10000};
+        if (c < minimum[extra] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+            return false;
+        i += extra + 1;
+    }
+    return true;
+}
+
+/*
+	Input and output
+*/
+
+#define READ_DONE 0
+#define READ_STOPPED 1     // The consumer asked to stop
+#define READ_INTERRUPTED 2 // Ctrl-C
+#define READ_FAILED 3      // errno is set
+
+struct nativeInput {
+    string name;
+    int fd;
+    const char* map;
+    size_t size;
+    void* mapping;
+    size_t mappingSize;
+};
+
+/*
+	The shell blocks SIGINT and reads it from a signalfd. While a native command runs in its place,
+	a Ctrl-C stays pending: take it here, so the prompt does not see it again
+*/
+bool nativeInterrupted() {
+    sigset_t pending;
+    if (sigpending(&pending) < 0 || !sigismember(&pending, SIGINT))
+        return false;
+
+    sigset_t interrupt;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    struct timespec now = {0, 0};
+    sigtimedwait(&interrupt, NULL, &now);
+    return true;
+}
+
+// Open name ("-" is stdin), mapping it if it is a regular file. Returns 0, or an errno value
+static int openInput(const string& name, nativeInput& in) {
+    in.name = name;
+    in.map = NULL;
+    in.size = 0;
+    in.mapping = NULL;
+    in.fd = name == "-" ? STDIN_FILENO : open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in.fd < 0)
+        return errno;
+
+    // Files in /proc claim to be empty, they are read like pipes
+    struct stat st;
+    if (fstat(in.fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return 0;
+    off_t offset = lseek(in.fd, 0, SEEK_CUR);
+    if (offset < 0 || offset >= st.st_size)
+        return 0;
+
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in.fd, 0);
+    if (mapping == MAP_FAILED)
+        return 0;
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    in.mapping = mapping;
+    in.mappingSize = st.st_size;
+    in.map = (const char*)mapping + offset;
+    in.size = st.st_size - offset;
+    return 0;
+}
+
+static void closeInput(nativeInput& in) {
+    if (in.mapping)
+        munmap(in.mapping, in.mappingSize);
+    if (in.fd != STDIN_FILENO)
+        close(in.fd);
+}
+
+static char read_buffer[NATIVE_CHUNK];
+
+/*
+	Hand the input to consume in pieces: NATIVE_CHUNK slices of the mapping, or what each read
+	returns. consume returns false to stop
+*/
+template <typename F>
+static int forEachBlock(nativeInput& in, F consume) {
+    if (in.map) {
+        for (size_t pos = 0; pos < in.size; pos += NATIVE_CHUNK) {
+            if (nativeInterrupted())
+                return READ_INTERRUPTED;
+            if (!consume(in.map + pos, min((size_t)NATIVE_CHUNK, in.size - pos)))
+                return READ_STOPPED;
+        }
+        return READ_DONE;
+    }
+
+    while (true) {
+        if (nativeInterrupted())
+            return READ_INTERRUPTED;
+        ssize_t n = read(in.fd, read_buffer, NATIVE_CHUNK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return READ_FAILED;
+        if (n == 0)
+            return READ_DONE;
+        if (!consume(read_buffer, n))
+            return READ_STOPPED;
+    }
+}
+
+static bool writeOut(const char* data, size_t size) {
+    return fwrite(data, 1, size, stdout) == size;
+}
+
+// Write data in NATIVE_CHUNK pieces, checking for Ctrl-C in between
+static int writeBlocks(const char* data, size_t size) {
+    for (size_t pos = 0; pos < size; pos += NATIVE_CHUNK) {
+        if (nativeInterrupted())
+            return READ_INTERRUPTED;
+        if (!writeOut(data + pos, min((size_t)NATIVE_CHUNK, size - pos)))
+            return READ_STOPPED;
+    }
+    return READ_DONE;
+}
+
+static int finishOutput(const char* command, int status) {
+    if (fflush(stdout) == 0 && !ferror(stdout))
+        return status;
+    fprintf(stderr, "%s: write error: %s\n", command, strerror(errno));
+    clearerr(stdout);
+    return 1;
+}
+
+// A count argument: decimal digits only, saturating instead of overflowing
+static bool parseCount(const string& value, size_t& count) {
+    if (value.empty() || value.size() > 19 || value.find_first_not_of("0123456789") != string::npos)
+        return false;
+    count = strtoull(value.c_str(), NULL, 10);
+    return true;
+}
+
+static bool readsStdin(const vector<string>& files) {
+    return files.empty() || find(files.begin(), files.end(), "-") != files.end();
+}
+
+/*
+	cat
+*/
+
+static bool parseCat(const vector<string>& args, vector<string>& files) {
+    bool options = true;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (options && args[i] == "--")
+            options = false;
+        else if (options && args[i].size() > 1 && args[i][0] == '-')
+            return false;
+        else
+            files.push_back(args[i]);
+    }
+    if (files.empty())
+        files.push_back("-");
+    return true;
+}
+
+static int nativeCat(const vector<string>& args) {
+    vector<string> files;
+    parseCat(args, files);
+
+    int status = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        nativeInput in;
+        int err = openInput(files[i], in);
+        if (err) {
+            fprintf(stderr, "cat: %s: %s\n", files[i].c_str(), strerror(err));
+            status = 1;
+            continue;
+        }
+        int ret = forEachBlock(in, writeOut);
+        err = errno;
+        closeInput(in);
+
+        if (ret == READ_INTERRUPTED)
+            return 130;
+        if (ret == READ_STOPPED)
+            break;
+        if (ret == READ_FAILED) {
+            fprintf(stderr, "cat: %s: %s\n", files[i].c_str(), strerror(err));
+            status = 1;
+        }
+    }
+    return finishOutput("cat", status);
+}
+
+/*
+	wc
+*/
+
+struct wcOptions {
+    bool lines = false, words = false, bytes = false;
+    vector<string> files;
+};
+
+struct wcCounts {
+    size_t lines = 0, words = 0, bytes = 0;
+};
+
+static bool parseWc(const vector<string>& args, wcOptions& opt) {
+    bool options = true;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (options && arg == "--") {
+            options = false;
+        } else if (options && arg.size() > 1 && arg[0] == '-') {
+            for (size_t k = 1; k < arg.size(); k++) {
+                if (arg[k] == 'l')
+                    opt.lines = true;
+                else if (arg[k] == 'w')
+                    opt.words = true;
+                else if (arg[k] == 'c')
+                    opt.bytes = true;
+                else
+                    return false;
+            }
+        } else {
+            opt.files.push_back(arg);
+        }
+    }
+    if (!opt.lines && !opt.words && !opt.bytes)
+        opt.lines = opt.words = opt.bytes = true;
+
+    // What counts as a word depends on the locale. In the C locale it is a run of bytes with at
+    // least one printable character, between whitespace
+    return !opt.words || nativeLocale() == LOCALE_C;
+}
+
+// Same column width as coreutils: enough for the total size of the regular files, at least 7 if
+// there is anything else. Only one number to print for one file needs no padding at all
+static int wcWidth(const wcOptions& opt) {
+    vector<string> files = opt.files.empty() ? vector<string>{"-"} : opt.files;
+    if (files.size() == 1 && opt.lines + opt.words + opt.bytes == 1)
+        return 1;
+
+    int width = 1, minimum = 1;
+    uintmax_t total = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        struct stat st;
+        int ret = files[i] == "-" ? fstat(STDIN_FILENO, &st) : stat(files[i].c_str(), &st);
+        if (ret < 0) {
+            if (i == 0)
+                return 1;
+            continue;
+        }
+        if (S_ISREG(st.st_mode))
+            total += st.st_size;
+        else
+            minimum = 7;
+    }
+    for (; total >= 10; total /= 10)
+        width++;
+    return max(width, minimum);
+}
+
+static void printCounts(const wcOptions& opt, const wcCounts& counts, int width, const char* name) {
+    const char* separator = "";
+    if (opt.lines) {
+        printf("%s%*zu", separator, width, counts.lines);
+        separator = " ";
+    }
+    if (opt.words) {
+        printf("%s%*zu", separator, width, counts.words);
+        separator = " ";
+    }
+    if (opt.bytes)
+        printf("%s%*zu", separator, width, counts.bytes);
+    if (name)
+        printf(" %s", name);
+    printf("\n");
+}
+
+// 1 for the whitespace that ends a word, 2 for the printable characters that make one
+static unsigned char wc_class[256];
+
+static int nativeWc(const vector<string>& args) {
+    wcOptions opt;
+    parseWc(args, opt);
+    int width = wcWidth(opt);
+
+    if (wc_class['a'] == 0) {
+        for (int c = 0; c < 256; c++)
+            wc_class[c] = c == ' ' || (c >= '\t' && c <= '\r') ? 1 : (c > ' ' && c < 0x7f ? 2 : 0);
+    }
+
+    vector<string> files = opt.files.empty() ? vector<string>{"-"} : opt.files;
+    wcCounts total;
+    int status = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        const char* name = opt.files.empty() ? NULL : files[i].c_str();
+        nativeInput in;
+        int err = openInput(files[i], in);
+        if (err) {
+            fprintf(stderr, "wc: %s: %s\n", files[i].c_str(), strerror(err));
+            status = 1;
+            continue;
+        }
+
+        wcCounts counts;
+        int ret = READ_DONE;
+        if (in.map && !opt.lines && !opt.words) {
+            // Nothing to read for a byte count
+            counts.bytes = in.size;
+        } else {
+            bool inWord = false;
+            ret = forEachBlock(in, [&](const char* data, size_t size) {
+                counts.bytes += size;
+                if (opt.lines || opt.words)
+                    counts.lines += countNewlines(data, size);
+                if (opt.words) {
+                    const unsigned char* p = (const unsigned char*)data;
+                    for (size_t k = 0; k < size; k++) {
+                        unsigned char type = wc_class[p[k]];
+                        if (type == 1) {
+                            counts.words += inWord;
+                            inWord = false;
+                        } else if (type == 2) {
+                            inWord = true;
+                        }
+                    }
+                }
+                return true;
+            });
+            counts.words += inWord;
+        }
+        err = errno;
+        closeInput(in);
+
+        if (ret == READ_INTERRUPTED)
+            return 130;
+        if (ret == READ_FAILED) {
+            fprintf(stderr, "wc: %s: %s\n", files[i].c_str(), strerror(err));
+            status = 1;
+        }
+        printCounts(opt, counts, width, name);
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    }
+    if (files.size() > 1)
+        printCounts(opt, total, width, "total");
+    return finishOutput("wc", status);
+}
+
+/*
+	head and tail
+*/
+
+struct headTailOptions {
+    size_t count = 10;
+    bool bytes = false;
+    bool fromStart = false; // tail -n +N
+    int headers = -1;       // -1 for more than one file, 0 with -q, 1 with -v
+    vector<string> files;
+};
+
+static bool parseHeadTail(const vector<string>& args, bool tail, headTailOptions& opt) {
+    bool options = true;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (!options || arg.size() < 2 || arg[0] != '-') {
+            opt.files.push_back(arg);
+            continue;
+        }
+        if (arg == "--") {
+            options = false;
+        } else if (arg == "-q") {
+            opt.headers = 0;
+        } else if (arg == "-v") {
+            opt.headers = 1;
+        } else if (arg[1] == 'n' || arg[1] == 'c') {
+            string value = arg.size() > 2 ? arg.substr(2) : (i + 1 < args.size() ? args[++i] : "");
+            opt.bytes = arg[1] == 'c';
+            // head -n -N (all but the last N) is left to coreutils
+            if (tail && !value.empty() && value[0] == '+') {
+                opt.fromStart = true;
+                value = value.substr(1);
+            }
+            if (!parseCount(value, opt.count))
+                return false;
+        } else if (!parseCount(arg.substr(1), opt.count)) {
+            return false;
+        }
+    }
+    if (opt.files.empty())
+        opt.files.push_back("-");
+    return true;
+}
+
+static const char* displayName(const string& name) {
+    return name == "-" ? "standard input" : name.c_str();
+}
+
+static int nativeHead(const vector<string>& args) {
+    headTailOptions opt;
+    parseHeadTail(args, false, opt);
+    bool headers = opt.headers == 1 || (opt.headers == -1 && opt.files.size() > 1);
+
+    int status = 0;
+    bool first = true;
+    for (size_t i = 0; i < opt.files.size(); i++) {
+        nativeInput in;
+        int err = openInput(opt.files[i], in);
+        if (err) {
+            fprintf(stderr, "head: cannot open '%s' for reading: %s\n", opt.files[i].c_str(),
+                    strerror(err));
+            status = 1;
+            continue;
+        }
+        if (headers)
+            printf("%s==> %s <==\n", first ? "" : "\n", displayName(opt.files[i]));
+        first = false;
+
+        size_t remaining = opt.count;
+        int ret = READ_DONE;
+        if (remaining > 0) {
+            ret = forEachBlock(in, [&](const char* data, size_t size) {
+                size_t take = min(size, remaining);
+                if (!opt.bytes) {
+                    const char* p = data;
+                    const char* end = data + size;
+                    const char* newline;
+                    while (remaining > 0 && (newline = (const char*)memchr(p, '\n', end - p))) {
+                        remaining--;
+                        p = newline + 1;
+                    }
+                    take = remaining == 0 ? p - data : size;
+                } else {
+                    remaining -= take;
+                }
+                return writeOut(data, take) && remaining > 0;
+            });
+        }
+        err = errno;
+        closeInput(in);
+
+        if (ret == READ_INTERRUPTED)
+            return 130;
+        if (ret == READ_STOPPED && ferror(stdout))
+            break;
+        if (ret == READ_FAILED) {
+            fprintf(stderr, "head: error reading '%s': %s\n", opt.files[i].c_str(),
+                    strerror(err));
+            status = 1;
+        }
+    }
+    return finishOutput("head", status);
+}
+
+// Offset in data where tail output starts
+static size_t tailStart(const headTailOptions& opt, const char* data, size_t size) {
+    if (!opt.fromStart) {
+        if (opt.bytes)
+            return size - min(size, opt.count);
+        return lastLinesStart(data, size, opt.count);
+    }
+
+    // +N starts at byte or line N, counting from 1 (+0 is the same as +1)
+    size_t skip = opt.count > 0 ? opt.count - 1 : 0;
+    if (opt.bytes)
+        return min(size, skip);
+    const char* p = data;
+    const char* end = data + size;
+    for (; skip > 0 && p < end; skip--) {
+        const char* newline = (const char*)memchr(p, '\n', end - p);
+        if (!newline)
+            return size;
+        p = newline + 1;
+    }
+    return p - data;
+}
+
+static int tailStream(const headTailOptions& opt, nativeInput& in) {
+    if (opt.fromStart) {
+        // Skip up to the start, then copy everything
+        size_t skip = opt.count > 0 ? opt.count - 1 : 0;
+        return forEachBlock(in, [&](const char* data, size_t size) {
+            size_t start = 0;
+            if (skip > 0 && opt.bytes) {
+                start = min(size, skip);
+                skip -= start;
+            } else if (skip > 0) {
+                const char* p = data;
+                const char* end = data + size;
+                const char* newline;
+                while (skip > 0 && (newline = (const char*)memchr(p, '\n', end - p))) {
+                    skip--;
+                    p = newline + 1;
+                }
+                start = skip > 0 ? size : p - data;
+            }
+            return writeOut(data + start, size - start);
+        });
+    }
+
+    // Keep the end of the input, trimming what can no longer be part of the output
+    string kept;
+    int ret = forEachBlock(in, [&](const char* data, size_t size) {
+        kept.append(data, size);
+        if (kept.size() > 4 * NATIVE_CHUNK) {
+            size_t start = tailStart(opt, kept.data(), kept.size());
+            kept.erase(0, start);
+        }
+        return true;
+    });
+    if (ret != READ_DONE)
+        return ret;
+    size_t start = tailStart(opt, kept.data(), kept.size());
+    return writeBlocks(kept.data() + start, kept.size() - start);
+}
+
+static int nativeTail(const vector<string>& args) {
+    headTailOptions opt;
+    parseHeadTail(args, true, opt);
+    bool headers = opt.headers == 1 || (opt.headers == -1 && opt.files.size() > 1);
+
+    int status = 0;
+    bool first = true;
+    for (size_t i = 0; i < opt.files.size(); i++) {
+        nativeInput in;
+        int err = openInput(opt.files[i], in);
+        if (err) {
+            fprintf(stderr, "tail: cannot open '%s' for reading: %s\n", opt.files[i].c_str(),
+                    strerror(err));
+            status = 1;
+            continue;
+        }
+        if (headers)
+            printf("%s==> %s <==\n", first ? "" : "\n", displayName(opt.files[i]));
+        first = false;
+
+        int ret;
+        if (in.map) {
+            size_t start = tailStart(opt, in.map, in.size);
+            ret = writeBlocks(in.map + start, in.size - start);
+        } else {
+            ret = tailStream(opt, in);
+        }
+        err = errno;
+        closeInput(in);
+
+        if (ret == READ_INTERRUPTED)
+            return 130;
+        if (ret == READ_STOPPED)
+            break;
+        if (ret == READ_FAILED) {
+            fprintf(stderr, "tail: error reading '%s': %s\n", opt.files[i].c_str(),
+                    strerror(err));
+            status = 1;
+        }
+    }
+    return finishOutput("tail", status);
+}
+
+/*
+	grep -F
+*/
+
+struct grepOptions {
+    string pattern;
+    bool fixed = false, invert = false, count = false, number = false, quiet = false;
+    bool suppress = false;
+    bool discard = false; // Standard output is /dev/null: like GNU grep, stop at the first match
+    int names = -1; // -1 for more than one file, 0 with -h, 1 with -H
+    vector<string> files;
+};
+
+static bool parseGrep(const vector<string>& args, grepOptions& opt) {
+    bool options = true, havePattern = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (!options || arg.size() < 2 || arg[0] != '-') {
+            if (havePattern) {
+                opt.files.push_back(arg);
+            } else {
+                opt.pattern = arg;
+                havePattern = true;
+            }
+            continue;
+        }
+        if (arg == "--") {
+            options = false;
+        } else if (arg == "-e") {
+            // A second pattern makes a pattern list, left to grep
+            if (havePattern || i + 1 == args.size())
+                return false;
+            opt.pattern = args[++i];
+            havePattern = true;
+        } else {
+            for (size_t k = 1; k < arg.size(); k++) {
+                switch (arg[k]) {
+                case 'F': opt.fixed = true; break;
+                case 'v': opt.invert = true; break;
+                case 'c': opt.count = true; break;
+                case 'n': opt.number = true; break;
+                case 'q': opt.quiet = true; break;
+                case 's': opt.suppress = true; break;
+                case 'h': opt.names = 0; break;
+                case 'H': opt.names = 1; break;
+                default: return false;
+                }
+            }
+        }
+    }
+    if (opt.files.empty())
+        opt.files.push_back("-");
+    return opt.fixed && havePattern && !opt.pattern.empty() &&
+           opt.pattern.find('\n') == string::npos && nativeLocale() != LOCALE_OTHER;
+}
+
+struct grepState {
+    const grepOptions* opt;
+    const char* name; // NULL without file name prefixes
+    bool utf8;
+    size_t lines = 0;    // Lines before the current position
+    size_t selected = 0; // Lines selected so far
+    bool binary = false;     // The input has a NUL byte
+    bool suppressed = false; // A selected line was not printed, for a NUL or an encoding error
+    bool done = false;       // Nothing more to find in this file
+};
+
+static void grepSelect(grepState& st, const char* start, const char* end) {
+    st.selected++;
+    if (st.opt->quiet || st.opt->discard) {
+        st.done = true;
+        return;
+    }
+    if (st.opt->count)
+        return;
+    // Like GNU grep, a binary file gets a message at the end instead of its lines. In UTF-8, lines
+    // with encoding errors are left out, and get the same message
+    if (st.binary) {
+        st.suppressed = true;
+        st.done = true;
+        return;
+    }
+    if (st.utf8 && !validUTF8((const unsigned char*)start, end - start)) {
+        st.suppressed = true;
+        return;
+    }
+    if (st.name)
+        printf("%s:", st.name);
+    if (st.opt->number)
+        printf("%zu:", st.lines);
+    fwrite(start, 1, end - start, stdout);
+    putchar('\n');
+}
+
+// Select every line of [start, end), for -v
+static void grepRange(grepState& st, const char* start, const char* end) {
+    if (start == end)
+        return;
+    if (st.opt->count && !st.opt->quiet) {
+        size_t n = countNewlines(start, end - start) + (end[-1] != '\n');
+        st.lines += n;
+        st.selected += n;
+        return;
+    }
+    while (start < end && !st.done) {
+        const char* newline = (const char*)memchr(start, '\n', end - start);
+        const char* lineEnd = newline ? newline : end;
+        st.lines++;
+        grepSelect(st, start, lineEnd);
+        start = lineEnd + 1;
+    }
+}
+
+// Search data, made of whole lines (only the end of the input may lack a newline)
+static void grepLines(grepState& st, const char* data, size_t size) {
+    const grepOptions& opt = *st.opt;
+    const char* pos = data;
+    const char* end = data + size;
+
+    while (pos < end && !st.done) {
+        const char* hit = findFixed(pos, end - pos, opt.pattern.data(), opt.pattern.size());
+        const char* lineStart = end;
+        const char* lineEnd = end;
+        if (hit) {
+            lineStart = (const char*)memrchr(pos, '\n', hit - pos);
+            lineStart = lineStart ? lineStart + 1 : pos;
+            lineEnd = (const char*)memchr(hit, '\n', end - hit);
+            lineEnd = lineEnd ? lineEnd : end;
+        }
+
+        if (opt.invert)
+            grepRange(st, pos, lineStart);
+        else if (opt.number)
+            st.lines += countNewlines(pos, lineStart - pos);
+        if (!hit || st.done)
+            break;
+
+        st.lines++;
+        if (!opt.invert)
+            grepSelect(st, lineStart, lineEnd);
+        pos = lineEnd + 1;
+    }
+}
+
+static int grepInput(grepState& st, nativeInput& in) {
+    if (in.map) {
+        for (size_t pos = 0; pos < in.size && !st.done;) {
+            if (nativeInterrupted())
+                return READ_INTERRUPTED;
+            size_t end = min(pos + NATIVE_CHUNK, in.size);
+            const char* newline = (const char*)memchr(in.map + end, '\n', in.size - end);
+            end = newline ? newline - in.map + 1 : in.size;
+            // Checked a chunk at a time like GNU grep, which reads in buffers, while it is cached
+            if (!st.binary && memchr(in.map + pos, '\0', end - pos))
+                st.binary = true;
+            grepLines(st, in.map + pos, end - pos);
+            pos = end;
+        }
+        return READ_DONE;
+    }
+
+    // Lines are carried over from one read to the next until they are complete
+    vector<char> buffer(NATIVE_CHUNK);
+    size_t used = 0;
+    while (!st.done) {
+        if (nativeInterrupted())
+            return READ_INTERRUPTED;
+        if (used == buffer.size())
+            buffer.resize(2 * buffer.size());
+        ssize_t n = read(in.fd, buffer.data() + used, buffer.size() - used);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return READ_FAILED;
+        if (n == 0) {
+            grepLines(st, buffer.data(), used);
+            break;
+        }
+        if (memchr(buffer.data() + used, '\0', n))
+            st.binary = true;
+        used += n;
+
+        const char* newline = (const char*)memrchr(buffer.data(), '\n', used);
+        if (!newline)
+            continue;
+        size_t complete = newline - buffer.data() + 1;
+        grepLines(st, buffer.data(), complete);
+        memmove(buffer.data(), buffer.data() + complete, used - complete);
+        used -= complete;
+    }
+    return READ_DONE;
+}
+
+static int nativeGrep(const vector<string>& args) {
+    grepOptions opt;
+    parseGrep(args, opt);
+    bool names = opt.names == 1 || (opt.names == -1 && opt.files.size() > 1);
+    bool utf8 = nativeLocale() == LOCALE_UTF8;
+
+    struct stat out, null;
+    opt.discard = fstat(STDOUT_FILENO, &out) == 0 && S_ISCHR(out.st_mode) &&
+                  stat("/dev/null", &null) == 0 && out.st_rdev == null.st_rdev;
+
+    bool selected = false, error = false;
+    for (size_t i = 0; i < opt.files.size(); i++) {
+        const char* name = opt.files[i] == "-" ? "(standard input)" : opt.files[i].c_str();
+        nativeInput in;
+        int err = openInput(opt.files[i], in);
+        if (err) {
+            if (!opt.suppress)
+                fprintf(stderr, "grep: %s: %s\n", name, strerror(err));
+            error = true;
+            continue;
+        }
+
+        grepState st;
+        st.opt = &opt;
+        st.name = names ? name : NULL;
+        st.utf8 = utf8;
+        int ret = grepInput(st, in);
+        err = errno;
+        closeInput(in);
+
+        if (ret == READ_INTERRUPTED)
+            return 130;
+        if (ret == READ_FAILED) {
+            if (!opt.suppress)
+                fprintf(stderr, "grep: %s: %s\n", name, strerror(err));
+            error = true;
+        }
+        if (opt.count && !opt.quiet) {
+            if (st.name)
+                printf("%s:", st.name);
+            printf("%zu\n", st.selected);
+        } else if (st.suppressed && !opt.quiet && !opt.discard) {
+            fflush(stdout);
+            fprintf(stderr, "grep: %s: binary file matches\n", name);
+        }
+        selected = selected || st.selected > 0;
+        if (selected && opt.quiet)
+            break;
+    }
+
+    // A write error is an error like any other for grep
+    int status = selected && opt.quiet ? 0 : (error ? 2 : (selected ? 0 : 1));
+    return finishOutput("grep", status) != status ? 2 : status;
+}
+
+/*
+	Builtins
+*/
+
+// Run a native command with the shell's `<` and `>` applied around it
+static int runNative(const vector<string>& tokens, int (*command)(const vector<string>&)) {
+    if (find(tokens.begin(), tokens.end(), "<") == tokens.end() &&
+        find(tokens.begin(), tokens.end(), ">") == tokens.end())
+        return command(tokens);
+
+    vector<string> args = tokens;
+    string inputFile, outputFile;
+    if (parseRedirections(args, inputFile, outputFile) < 0)
+        return 1;
+
+    int savedIn = -1, savedOut = -1;
+    if (!inputFile.empty()) {
+        int fd = open(inputFile.c_str(), O_CLOEXEC | READ_FLAGS);
+        if (fd < 0) {
+            perror(inputFile.c_str());
+            return 1;
+        }
+        savedIn = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    if (!outputFile.empty()) {
+        int fd = open(outputFile.c_str(), O_CLOEXEC | WRITE_FLAGS);
+        if (fd < 0) {
+            perror(outputFile.c_str());
+        } else {
+            fflush(stdout);
+            savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+    }
+
+    int ret = outputFile.empty() || savedOut >= 0 ? command(args) : 1;
+
+    fflush(stdout);
+    if (savedOut >= 0) {
+        dup2(savedOut, STDOUT_FILENO);
+        close(savedOut);
+    }
+    if (savedIn >= 0) {
+        dup2(savedIn, STDIN_FILENO);
+        close(savedIn);
+    }
+    return ret;
+}
+
+int metash_cat(const vector<string>& tokens) { return runNative(tokens, nativeCat); }
+int metash_wc(const vector<string>& tokens) { return runNative(tokens, nativeWc); }
+int metash_head(const vector<string>& tokens) { return runNative(tokens, nativeHead); }
+int metash_tail(const vector<string>& tokens) { return runNative(tokens, nativeTail); }
+int metash_grep(const vector<string>& tokens) { return runNative(tokens, nativeGrep); }
+int metash_tee(const vector<string>& tokens) { return runNative(tokens, nativeTee); }
+
+bool nativeAccepts(const vector<string>& tokens, bool inProcess) {
+    if (!native_builtins || tokens.back() == "&")
+        return false;
+
+    // The arguments the command will see, once the shell took its redirections out
+    vector<string> args;
+    bool stdinRedirected = false;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens[i] == "<" || tokens[i] == ">") {
+            stdinRedirected = stdinRedirected || tokens[i] == "<";
+            i++;
+            continue;
+        }
+        args.push_back(tokens[i]);
+    }
+
+    const string& command = args[0];
+    vector<string> files;
+    bool ok = false;
+    if (command == "cat") {
+        ok = parseCat(args, files);
+    } else if (command == "wc") {
+        wcOptions opt;
+        ok = parseWc(args, opt);
+        files = opt.files;
+    } else if (command == "head" || command == "tail") {
+        headTailOptions opt;
+        ok = parseHeadTail(args, command == "tail", opt);
+        files = opt.files;
+    } else if (command == "grep") {
+        grepOptions opt;
+        ok = parseGrep(args, opt);
+        files = opt.files;
+    } else if (command == "tee") {
+        // The files are outputs, tee always reads stdin
+        teeOptions opt;
+        ok = parseTee(args, opt);
+    }
+
+    // Reading the terminal in the shell could not be interrupted with Ctrl-C
+    return ok && !(inProcess && readsStdin(files) && !stdinRedirected && isatty(STDIN_FILENO));
+}
+
+int metash_native(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        printf("native commands are %s\n", native_builtins ? "on" : "off");
+        return 0;
+    }
+    if (tokens.size() != 2 || (tokens[1] != "on" && tokens[1] != "off")) {
+        printf("usage: native [on|off]\n");
+        return -1;
+    }
+    native_builtins = tokens[1] == "on";
+    return 0;
+}
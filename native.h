@@ -0,0 +1,80 @@
+#ifndef NATIVE_H_
+#define NATIVE_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#define NATIVE_CHUNK (1 << 20) // Read size for pipes, and how much is handled between Ctrl-C checks
+
+/*
+	Native commands
+	------------------
+	`cat`, `wc`, `head`, `tail`, `grep -F` and `tee` (see tee.h) run inside the shell instead of
+	forking and exec'ing coreutils and grep. Regular files are mapped with `mmap`. Pipes, terminals and files whose
+	size is unknown (like the ones in /proc) are read in NATIVE_CHUNK pieces. Lines are counted and
+	fixed strings searched 16 bytes at a time with SSE2
+
+	A native command is only used for the flags it implements, which print the same bytes as the
+	GNU tools (see `nativeAccepts`). Anything else, e.g. `cat -n` or `grep` without -F, runs the
+	external command from PATH as before. Output that depends on the locale (`wc -w`, `grep`) is
+	only produced natively in the C and UTF-8 locales
+
+	In an interactive shell the command runs in the foreground of the shell itself, so it checks
+	for Ctrl-C between chunks and stops with status 130
+*/
+
+/*
+	native_builtins: bool
+		Whether native commands replace the external ones. On by default, off if the shell starts
+		with METASH_NATIVE=0. Switched at runtime with the `native` builtin
+*/
+extern bool native_builtins;
+
+/*
+	bool nativeAccepts(const vector<string> &tokens, bool inProcess)
+	------------------
+	True if native commands are on and the native tokens[0] implements every flag in tokens. Also
+	false for a command run in the background, and for one that would run inProcess (not as a
+	stage of a pipeline) reading from the terminal, where Ctrl-C could not reach it
+*/
+bool nativeAccepts(const std::vector<std::string>& tokens, bool inProcess);
+
+/*
+	bool nativeInterrupted()
+	------------------
+	True if Ctrl-C was pressed since the last call. Native commands check it between chunks
+*/
+bool nativeInterrupted();
+
+/*
+	size_t countNewlines(const char *data, size_t size)
+	const char *findFixed(const char *data, size_t size, const char *needle, size_t length)
+	------------------
+	The vectorized kernels. countNewlines counts '\n' bytes. findFixed returns the first occurrence
+	of needle in data, or NULL. It compares the first and the last byte of needle at 16 positions at
+	once, and only calls memcmp where both match
+*/
+size_t countNewlines(const char* data, size_t size);
+const char* findFixed(const char* data, size_t size, const char* needle, size_t length);
+
+/*
+	Native command builtins -> Same prototype as the other builtins
+	Return the exit status of the command they replace
+*/
+int metash_cat(const std::vector<std::string>& tokens);
+int metash_wc(const std::vector<std::string>& tokens);
+int metash_head(const std::vector<std::string>& tokens);
+int metash_tail(const std::vector<std::string>& tokens);
+int metash_grep(const std::vector<std::string>& tokens);
+int metash_tee(const std::vector<std::string>& tokens);
+
+/*
+	int metash_native(const vector<string> &tokens)
+	------------------
+	`native on` or `native off` switches native commands, `native` shows whether they are on
+*/
+int metash_native(const std::vector<std::string>& tokens);
+
+#endif // NATIVE_H_
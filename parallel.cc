@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "parallel.h"
+#include "pipes.h"
+#include "spawner.h"
+#include "vars.h"
+
+using namespace std;
+
+/*
+	struct parallelJob
+	A running job of `parallel`, with the output it produced so far
+	------------------
+	Members:
+		pid: pid_t -> Process running the job
+		outFD, errFD: int -> Read ends of the job's stdout and stderr pipes, -1 once closed
+		out, err: string -> Output read from the pipes, printed when the job finishes
+	------------------
+*/
+struct parallelJob {
+    pid_t pid;
+    int outFD;
+    int errFD;
+    string out;
+    string err;
+};
+
+// Bytes available for the arguments of one command: ARG_MAX minus what the environment takes
+static long argumentSpace() {
+    long space = sysconf(_SC_ARG_MAX);
+    if (space <= 0)
+        space = 128 * 1024;
+
+    for (char** env = exportedEnvironment(); *env != NULL; env++)
+        space -= strlen(*env) + 1 + sizeof(char*);
+
+    // Leave some headroom, as execve also counts the pointers and the executable name
+    return space - 2048;
+}
+
+// Each argument costs its bytes, the terminating NUL and a pointer in argv
+static long argumentCost(const string& arg) { return arg.size() + 1 + sizeof(char*); }
+
+// Replace every `{}` in text by value
+static string substitute(const string& text, const string& value) {
+    string result;
+    size_t start = 0, pos;
+    while ((pos = text.find(PARALLEL_PLACEHOLDER, start)) != string::npos) {
+        result.append(text, start, pos - start);
+        result += value;
+        start = pos + 2;
+    }
+    result.append(text, start, string::npos);
+    return result;
+}
+
+/*
+	Build the command for the next job, starting from args[next]. Without batching one argument is
+	used, with batching as many as fit in space. next is moved past the arguments used
+*/
+static vector<string> buildCommand(const vector<string>& command, const vector<string>& args,
+                                   size_t& next, bool batch, long space) {
+    bool hasPlaceholder = false;
+    for (size_t i = 0; i < command.size(); i++) {
+        if (command[i].find(PARALLEL_PLACEHOLDER) != string::npos)
+            hasPlaceholder = true;
+        space -= argumentCost(command[i]);
+    }
+
+    vector<string> batchArgs;
+    do {
+        space -= argumentCost(args[next]);
+        // A single argument that is too long still gets its own job, and execve reports it
+        if (space < 0 && !batchArgs.empty())
+            break;
+        batchArgs.push_back(args[next++]);
+    } while (batch && next < args.size());
+
+    vector<string> job;
+    for (size_t i = 0; i < command.size(); i++) {
+        if (command[i] == PARALLEL_PLACEHOLDER) {
+            job.insert(job.end(), batchArgs.begin(), batchArgs.end());
+        } else if (hasPlaceholder && command[i].find(PARALLEL_PLACEHOLDER) != string::npos) {
+            string joined = batchArgs[0];
+            for (size_t j = 1; j < batchArgs.size(); j++)
+                joined += " " + batchArgs[j];
+            job.push_back(substitute(command[i], joined));
+        } else {
+            job.push_back(command[i]);
+        }
+    }
+    if (!hasPlaceholder)
+        job.insert(job.end(), batchArgs.begin(), batchArgs.end());
+    return job;
+}
+
+static void writeAll(int fd, const string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        written += n;
+    }
+}
+
+// Start one job with its stdout and stderr going to fresh pipes
+static bool startJob(const vector<string>& command, parallelJob& job) {
+    int outPipe[2], errPipe[2];
+    if (makePipe(outPipe) < 0)
+        return false;
+    if (makePipe(errPipe) < 0) {
+        close(outPipe[0]);
+        close(outPipe[1]);
+        return false;
+    }
+
+    spawnAttributes attr;
+    attr.outputFD = outPipe[1];
+    attr.errorFD = errPipe[1];
+    attr.closeFDs.push_back(outPipe[0]);
+    attr.closeFDs.push_back(errPipe[0]);
+
+    job.pid = metash_spawn(command, attr);
+    close(outPipe[1]);
+    close(errPipe[1]);
+
+    if (job.pid < 0) {
+        close(outPipe[0]);
+        close(errPipe[0]);
+        return false;
+    }
+    job.outFD = outPipe[0];
+    job.errFD = errPipe[0];
+    return true;
+}
+
+// Read whatever is available on fd into buffer, closing fd at end of file
+static void drain(int& fd, string& buffer) {
+    char chunk[BATCH_BUFSIZE];
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n > 0) {
+        buffer.append(chunk, n);
+    } else if (n == 0 || errno != EINTR) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+int metash_parallel(const vector<string>& tokens) {
+    size_t num_tokens = tokens.size();
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    bool batch = false;
+
+    size_t i = 1;
+    for (; i < num_tokens; i++) {
+        if (tokens[i] == "-j") {
+            if (i + 1 == num_tokens || (slots = atol(tokens[i + 1].c_str())) <= 0) {
+                printf("parallel: -j expects a positive number of jobs\n");
+                return -1;
+            }
+            i++;
+        } else if (tokens[i] == "-X") {
+            batch = true;
+        } else {
+            break;
+        }
+    }
+    if (slots <= 0)
+        slots = 1;
+
+    vector<string> command, args;
+    bool hasSeparator = false;
+    for (; i < num_tokens; i++) {
+        if (tokens[i] == PARALLEL_SEPARATOR) {
+            hasSeparator = true;
+            args.assign(tokens.begin() + i + 1, tokens.end());
+            break;
+        }
+        command.push_back(tokens[i]);
+    }
+
+    if (command.empty()) {
+        printf("parallel: no command given\n");
+        return -1;
+    }
+
+    // No ::: means the arguments are fed on stdin, one per line
+    if (!hasSeparator) {
+        batchReader reader;
+        batchFromFD(reader, STDIN_FILENO);
+        string line;
+        while (batchReadLine(reader, line)) {
+            if (!line.empty())
+                args.push_back(line);
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long space = argumentSpace();
+    size_t next = 0;
+    vector<parallelJob> running;
+    map<int, unsigned long> exitCodes;
+    unsigned long numJobs = 0, failed = 0;
+
+    fflush(stdout);
+    while (next < args.size() || !running.empty()) {
+        // Fill every free slot
+        while ((long)running.size() < slots && next < args.size()) {
+            vector<string> job = buildCommand(command, args, next, batch, space);
+            parallelJob entry;
+            numJobs++;
+            if (startJob(job, entry)) {
+                running.push_back(entry);
+            } else {
+                exitCodes[127]++;
+                failed++;
+            }
+        }
+        if (running.empty())
+            continue;
+
+        vector<struct pollfd> fds;
+        vector<int*> fdOwner;
+        vector<string*> fdBuffer;
+        for (size_t j = 0; j < running.size(); j++) {
+            if (running[j].outFD >= 0) {
+                fds.push_back({running[j].outFD, POLLIN, 0});
+                fdOwner.push_back(&running[j].outFD);
+                fdBuffer.push_back(&running[j].out);
+            }
+            if (running[j].errFD >= 0) {
+                fds.push_back({running[j].errFD, POLLIN, 0});
+                fdOwner.push_back(&running[j].errFD);
+                fdBuffer.push_back(&running[j].err);
+            }
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll() failed");
+            break;
+        }
+
+        for (size_t j = 0; j < fds.size(); j++) {
+            if (fds[j].revents)
+                drain(*fdOwner[j], *fdBuffer[j]);
+        }
+
+        for (size_t j = 0; j < running.size();) {
+            parallelJob& job = running[j];
+            if (job.outFD >= 0 || job.errFD >= 0) {
+                j++;
+                continue;
+            }
+
+            // Both pipes are closed, so the job is done: print its output in one piece
+            int status = 0;
+            waitpid(job.pid, &status, 0);
+            int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            exitCodes[code]++;
+            if (code != 0)
+                failed++;
+
+            writeAll(STDOUT_FILENO, job.out);
+            writeAll(STDERR_FILENO, job.err);
+            running.erase(running.begin() + j);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    fprintf(stderr, "parallel: %lu jobs, %lu succeeded, %lu failed in %.3fs", numJobs,
+            numJobs - failed, failed, elapsed);
+    if (failed > 0) {
+        fprintf(stderr, " (");
+        for (map<int, unsigned long>::iterator it = exitCodes.begin(); it != exitCodes.end(); ++it)
+            fprintf(stderr, "%sexit %d: %lu", it == exitCodes.begin() ? "" : ", ", it->first,
+                    it->second);
+        fprintf(stderr, ")");
+    }
+    fprintf(stderr, "\n");
+
+    return failed == 0 ? 0 : -1;
+}
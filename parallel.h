@@ -0,0 +1,32 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <string>
+#include <vector>
+
+#define PARALLEL_SEPARATOR ":::"
+#define PARALLEL_PLACEHOLDER "{}"
+
+/*
+	int metash_parallel(const vector<string> &tokens)
+	------------------
+	Run a command once per argument, keeping a fixed number of jobs running at the same time
+
+		parallel [-j N] [-X] command [args] [::: arg...]
+
+	The arguments come after `:::`, or one per line from stdin if there is no `:::` (so it can be
+	the last stage of a pipeline). Each `{}` in the command is replaced by the argument, and the
+	argument is appended if there is no `{}`. With -X, each job gets as many arguments as fit in
+	ARG_MAX instead of one, like `xargs`
+
+	-j N sets the number of job slots (default: number of online CPUs). A new job starts as soon
+	as a slot frees up. The stdout and stderr of every job are kept in their own buffers and
+	printed when the job finishes, so the output of different jobs never interleaves. Jobs are
+	started with `metash_spawn`, so `<` and `>` in the command work as usual
+
+	Prints a summary of the exit codes and the wall time to stderr once all jobs are done
+	Returns 0 if every job exited with status 0, -1 otherwise
+*/
+int metash_parallel(const std::vector<std::string>& tokens);
+
+#endif // PARALLEL_H_
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "pathcache.h"
+#include "trace.h"
+#include "vars.h"
+
+using namespace std;
+
+static unordered_map<string, pathCacheEntry> path_cache;
+
+// Check that path is a regular file we are allowed to execute
+static bool isExecutable(const string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+        return false;
+    return access(path.c_str(), X_OK) == 0;
+}
+
+// Walk the PATH directories in order and return the first match, like execvp does
+static string searchPath(const string& name) {
+    const string* variable = findVariable("PATH");
+    const char* path = variable ? variable->c_str() : DEFAULT_PATH;
+
+    const char* start = path;
+    while (true) {
+        const char* end = strchr(start, ':');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+
+        // An empty PATH entry stands for the current directory
+        string candidate = len ? string(start, len) : string(".");
+        candidate += "/" + name;
+        if (isExecutable(candidate))
+            return candidate;
+
+        if (!end)
+            break;
+        start = end + 1;
+    }
+    return "";
+}
+
+string resolveCommand(const string& name, bool countHit) {
+    if (name.empty() || name.find('/') != string::npos)
+        return name;
+    TRACE_SPAN_DETAIL("resolve", name.c_str());
+
+    unordered_map<string, pathCacheEntry>::iterator it = path_cache.find(name);
+    if (it != path_cache.end()) {
+        // A single access() is enough to notice that a cached binary was removed
+        if (access(it->second.path.c_str(), X_OK) == 0) {
+            if (countHit)
+                it->second.hits++;
+            return it->second.path;
+        }
+        path_cache.erase(it);
+    }
+
+    string path = searchPath(name);
+    if (!path.empty())
+        path_cache[name] = pathCacheEntry{path, countHit ? 1UL : 0UL};
+    return path;
+}
+
+void clearPathCache() { path_cache.clear(); }
+
+int metash_hash(const vector<string>& tokens) {
+    size_t num_tokens = tokens.size();
+
+    if (num_tokens == 1) {
+        if (path_cache.empty()) {
+            printf("hash: hash table empty\n");
+            return 0;
+        }
+
+        // Print in name order so the listing is stable between runs
+        vector<string> names;
+        for (unordered_map<string, pathCacheEntry>::iterator it = path_cache.begin();
+             it != path_cache.end(); ++it)
+            names.push_back(it->first);
+        sort(names.begin(), names.end());
+
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < names.size(); i++) {
+            pathCacheEntry& entry = path_cache[names[i]];
+            printf("%4lu\t%s\n", entry.hits, entry.path.c_str());
+        }
+        return 0;
+    }
+
+    if (tokens[1] == "-r") {
+        if (num_tokens > 2) {
+            printf("hash: too many arguments\n");
+            return -1;
+        }
+        clearPathCache();
+        return 0;
+    }
+
+    if (tokens[1] == "-d") {
+        if (num_tokens == 2) {
+            printf("hash: too few arguments\n");
+            return -1;
+        }
+        int ret = 0;
+        for (size_t i = 2; i < num_tokens; i++) {
+            if (path_cache.erase(tokens[i]) == 0) {
+                printf("hash: %s: not found\n", tokens[i].c_str());
+                ret = -1;
+            }
+        }
+        return ret;
+    }
+
+    // Prewarm: resolve each name now, so the first real run is already a cache hit
+    int ret = 0;
+    for (size_t i = 1; i < num_tokens; i++) {
+        if (resolveCommand(tokens[i], false).empty()) {
+            printf("hash: %s: not found\n", tokens[i].c_str());
+            ret = -1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,53 @@
+#ifndef PATHCACHE_H_
+#define PATHCACHE_H_
+
+#include <string>
+#include <vector>
+
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+/*
+	struct pathCacheEntry
+	A command name remembered by the shell, like the bash `hash` table
+	------------------
+	Members:
+		path: string -> Absolute path of the executable found in PATH
+		hits: unsigned long -> Number of times the entry was used to run the command
+	------------------
+*/
+struct pathCacheEntry {
+    std::string path;
+    unsigned long hits;
+};
+
+/*
+	string resolveCommand(const string &name, bool countHit)
+	------------------
+	Find the executable that would run for name and return its path, or an empty string if there
+	is none. Names containing a `/` are returned unchanged, as `execv` uses them directly
+	countHit is false for lookups that only check a command exists, so `hash` counts real runs
+
+	A name is searched through the PATH directories only once, after which the absolute path comes
+	from the cache. A cached entry is dropped and searched again if its binary is no longer executable
+*/
+std::string resolveCommand(const std::string& name, bool countHit = true);
+
+/*
+	void clearPathCache()
+	------------------
+	Forget every remembered path. Called whenever PATH is set or unset (see vars.h)
+*/
+void clearPathCache();
+
+/*
+	int metash_hash(const vector<string> &tokens)
+	------------------
+	Builtin to inspect the command path cache
+		`hash`            lists the cached commands with their hit counts
+		`hash -r`         clears the cache
+		`hash -d name...` forgets the given commands
+		`hash name...`    looks the commands up now, so later runs are already cached
+*/
+int metash_hash(const std::vector<std::string>& tokens);
+
+#endif // PATHCACHE_H_
@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "pipes.h"
+
+using namespace std;
+
+#define RELAY_CHUNK (1 << 20)
+
+long pipe_size = 0;
+bool splice_relay = false;
+
+long pipeMaxSize() {
+    static long max_size = -1;
+    if (max_size > 0)
+        return max_size;
+
+    max_size = 1024 * 1024;
+    FILE* fp = fopen(PIPE_MAX_SIZE_FILE, "re");
+    if (fp) {
+        long value;
+        if (fscanf(fp, "%ld", &value) == 1 && value > 0)
+            max_size = value;
+        fclose(fp);
+    }
+    return max_size;
+}
+
+int makePipe(int fds[2]) {
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe2() failed");
+        return -1;
+    }
+
+    if (pipe_size > 0) {
+        // The kernel rounds the size up to a power of two pages, and refuses anything over the max
+        long size = min(pipe_size, pipeMaxSize());
+        fcntl(fds[1], F_SETPIPE_SZ, (int)size);
+    }
+    return 0;
+}
+
+string takeRedirection(vector<string>& tokens, const char* op) {
+    vector<string>::iterator it = find(tokens.begin(), tokens.end(), op);
+    if (it == tokens.end() || it + 1 == tokens.end())
+        return "";
+
+    string file = *(it + 1);
+    tokens.erase(it, it + 2);
+    return file;
+}
+
+/*
+	One direction of the relay. Data normally moves with `splice`. If the file does not support it,
+	data is read into buffer and written out from there, since the pipe end may only take part of it
+*/
+struct relaySide {
+    int from;
+    int to;
+    bool useSplice;
+    bool done;
+    vector<char> buffer;
+    size_t bufStart;
+    size_t bufEnd;
+};
+
+// Move as much data as possible without blocking. Returns 0 at end of input, -1 on error
+static ssize_t relayStep(relaySide& side) {
+    if (side.bufStart == side.bufEnd && side.useSplice) {
+        ssize_t n = splice(side.from, NULL, side.to, NULL, RELAY_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n >= 0 || errno != EINVAL)
+            return n;
+        side.useSplice = false;
+    }
+
+    if (side.bufStart == side.bufEnd) {
+        if (side.buffer.empty())
+            side.buffer.resize(RELAY_CHUNK);
+        ssize_t n = read(side.from, side.buffer.data(), side.buffer.size());
+        if (n <= 0)
+            return n;
+        side.bufStart = 0;
+        side.bufEnd = n;
+    }
+
+    ssize_t n = write(side.to, side.buffer.data() + side.bufStart, side.bufEnd - side.bufStart);
+    if (n > 0)
+        side.bufStart += n;
+    return n;
+}
+
+int relayFiles(int inFile, int inPipe, int outPipe, int outFile, int wakeFD,
+               bool (*stopRelay)(int wakeFD)) {
+    relaySide sides[2] = {{inFile, inPipe, true, inFile < 0, {}, 0, 0},
+                          {outPipe, outFile, true, outFile < 0, {}, 0, 0}};
+
+    // The shell owns these pipe ends alone, so making them non-blocking does not affect the stages
+    if (inPipe >= 0)
+        fcntl(inPipe, F_SETFL, fcntl(inPipe, F_GETFL) | O_NONBLOCK);
+    if (outPipe >= 0)
+        fcntl(outPipe, F_SETFL, fcntl(outPipe, F_GETFL) | O_NONBLOCK);
+
+    // A stage that exits early must not kill the shell with SIGPIPE
+    void (*oldHandler)(int) = signal(SIGPIPE, SIG_IGN);
+    int ret = 0;
+    bool stopping = false;
+
+    while (!sides[0].done || !sides[1].done) {
+        struct pollfd fds[3];
+        int nfds = 0;
+        int index[3];
+        if (!sides[0].done) {
+            fds[nfds] = {inPipe, POLLOUT, 0};
+            index[nfds++] = 0;
+        }
+        if (!sides[1].done) {
+            fds[nfds] = {outPipe, POLLIN, 0};
+            index[nfds++] = 1;
+        }
+        if (wakeFD >= 0 && stopRelay) {
+            fds[nfds] = {wakeFD, POLLIN, 0};
+            index[nfds++] = 2;
+        }
+
+        // Once stopping, only what is already in outPipe is moved, so poll does not wait
+        if (poll(fds, nfds, stopping ? 0 : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll() failed");
+            ret = -1;
+            break;
+        }
+
+        bool moved = false;
+        for (int i = 0; i < nfds; i++) {
+            if (!fds[i].revents)
+                continue;
+
+            if (index[i] == 2) {
+                if (!stopping && stopRelay(wakeFD)) {
+                    stopping = true;
+                    // Nothing may read the rest of inFile anymore
+                    if (!sides[0].done) {
+                        sides[0].done = true;
+                        close(inPipe);
+                    }
+                }
+                continue;
+            }
+
+            relaySide& side = sides[index[i]];
+            if (side.done)
+                continue;
+            ssize_t n = relayStep(side);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            moved = true;
+
+            if (n < 0 && errno != EPIPE) {
+                perror("splice() failed");
+                ret = -1;
+            }
+            if (n <= 0) {
+                side.done = true;
+                // Closing our write end is what tells the first stage its input is over
+                if (index[i] == 0)
+                    close(inPipe);
+            }
+        }
+        if (stopping && !moved)
+            break;
+    }
+
+    if (!sides[0].done)
+        close(inPipe);
+    signal(SIGPIPE, oldHandler);
+    return ret;
+}
+
+// Parse a size such as 65536, 256K or 1M
+static long parseSize(const string& text) {
+    char* end;
+    long size = strtol(text.c_str(), &end, 10);
+    if (end == text.c_str() || size <= 0)
+        return -1;
+
+    if (*end == 'K' || *end == 'k') {
+        size *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        size *= 1024 * 1024;
+        end++;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+int metash_pipeconf(const vector<string>& tokens) {
+    size_t num_tokens = tokens.size();
+
+    if (num_tokens == 1) {
+        if (pipe_size > 0)
+            printf("size:   %ld bytes (max %ld)\n", min(pipe_size, pipeMaxSize()), pipeMaxSize());
+        else
+            printf("size:   default (max %ld)\n", pipeMaxSize());
+        printf("splice: %s\n", splice_relay ? "on" : "off");
+        return 0;
+    }
+
+    if (num_tokens != 3) {
+        printf("pipeconf: expected `pipeconf size N|default` or `pipeconf splice on|off`\n");
+        return -1;
+    }
+
+    if (tokens[1] == "size") {
+        if (tokens[2] == "default") {
+            pipe_size = 0;
+            return 0;
+        }
+        long size = parseSize(tokens[2]);
+        if (size < 0) {
+            printf("pipeconf: invalid size %s\n", tokens[2].c_str());
+            return -1;
+        }
+        if (size > pipeMaxSize())
+            printf("pipeconf: %ld is over the system maximum, pipes will use %ld\n", size,
+                   pipeMaxSize());
+        pipe_size = size;
+        return 0;
+    }
+
+    if (tokens[1] == "splice") {
+        if (tokens[2] == "on") {
+            splice_relay = true;
+        } else if (tokens[2] == "off") {
+            splice_relay = false;
+        } else {
+            printf("pipeconf: expected on or off\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    printf("pipeconf: unknown setting %s\n", tokens[1].c_str());
+    return -1;
+}
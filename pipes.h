@@ -0,0 +1,72 @@
+#ifndef PIPES_H_
+#define PIPES_H_
+
+#include <string>
+#include <vector>
+
+#define PIPE_MAX_SIZE_FILE "/proc/sys/fs/pipe-max-size"
+
+/*
+	pipe_size: long
+		Capacity requested for every pipe the shell creates, in bytes. 0 keeps the kernel default
+		(64 KiB). Larger pipes mean fewer context switches between the stages of bulk pipelines
+	splice_relay: bool
+		When set, a `<` redirection on the first stage of a pipeline and a `>` redirection on its
+		last stage are served by the shell itself, moving data between the file and the pipe with
+		`splice` instead of handing the file to the command
+	Both are set for the session with the `pipeconf` builtin
+*/
+extern long pipe_size;
+extern bool splice_relay;
+
+/*
+	long pipeMaxSize()
+	------------------
+	Largest pipe capacity an unprivileged process may request, read once from
+	/proc/sys/fs/pipe-max-size. Returns 1 MiB if the file cannot be read
+*/
+long pipeMaxSize();
+
+/*
+	int makePipe(int fds[2])
+	------------------
+	Create a pipe with `pipe2(O_CLOEXEC)`, so neither end leaks into commands started later, and
+	grow it to pipe_size with F_SETPIPE_SZ. Failing to resize is not an error, the pipe just keeps
+	the default capacity. Returns 0 on success and -1 if the pipe could not be created
+*/
+int makePipe(int fds[2]);
+
+/*
+	string takeRedirection(vector<string> &tokens, const char *op)
+	------------------
+	Remove the redirection operator op (`<` or `>`) and its file name from tokens and return the
+	file name. Returns an empty string if there is no such redirection
+*/
+std::string takeRedirection(std::vector<std::string>& tokens, const char* op);
+
+/*
+	int relayFiles(int inFile, int inPipe, int outPipe, int outFile, int wakeFD, bool (*stopRelay)(int wakeFD))
+	------------------
+	Move data from inFile into the write end inPipe, and from the read end outPipe into outFile,
+	at the same time, until both sides reach end of file. Either pair may be -1 when unused
+	Data moves with `splice`, so it never goes through a userspace buffer. Filesystems without
+	splice support fall back to read/write. inPipe is closed once inFile is exhausted, so the first
+	stage sees end of file
+	If wakeFD is given, stopRelay is called whenever it is readable. Once it returns true, inPipe is
+	closed, what is already in outPipe is still written to outFile, and the relay returns without
+	waiting for more. Returns 0 on success and -1 on error
+*/
+int relayFiles(int inFile, int inPipe, int outPipe, int outFile, int wakeFD = -1,
+               bool (*stopRelay)(int wakeFD) = NULL);
+
+/*
+	int metash_pipeconf(const vector<string> &tokens)
+	------------------
+	Builtin to configure the pipes created by the shell
+		`pipeconf`                  shows the current settings
+		`pipeconf size N|default`   sets the pipe capacity, N in bytes with an optional K or M suffix
+		`pipeconf splice on|off`    enables or disables the splice relay for pipeline redirections
+*/
+int metash_pipeconf(const std::vector<std::string>& tokens);
+
+#endif // PIPES_H_
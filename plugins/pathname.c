@@ -0,0 +1,76 @@
+/*
+	pathname plugin
+	------------------
+	`basename` and `dirname` as builtins, for scripts that call them in loops. Follows POSIX for
+	both, including the optional suffix of basename
+
+	Build with `make plugins/pathname.so`, then `load plugins/pathname.so` in the shell
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "../metash_plugin.h"
+
+// Length of path without its trailing slashes, keeping a lone "/"
+static size_t trimSlashes(const char* path, size_t len) {
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    return len;
+}
+
+static int pathnameBasename(int argc, const char* const* argv) {
+    if (argc < 2 || argc > 3) {
+        printf("usage: basename path [suffix]\n");
+        return -1;
+    }
+
+    const char* path = argv[1];
+    size_t len = trimSlashes(path, strlen(path));
+    if (len == 0 || (len == 1 && path[0] == '/')) {
+        printf("%.*s\n", (int)len, path);
+        return 0;
+    }
+
+    size_t start = len;
+    while (start > 0 && path[start - 1] != '/')
+        start--;
+    len -= start;
+
+    // The suffix is only removed if something is left
+    if (argc == 3) {
+        size_t suffix = strlen(argv[2]);
+        if (suffix < len && memcmp(path + start + len - suffix, argv[2], suffix) == 0)
+            len -= suffix;
+    }
+    printf("%.*s\n", (int)len, path + start);
+    return 0;
+}
+
+static int pathnameDirname(int argc, const char* const* argv) {
+    if (argc != 2) {
+        printf("usage: dirname path\n");
+        return -1;
+    }
+
+    const char* path = argv[1];
+    size_t len = trimSlashes(path, strlen(path));
+    while (len > 0 && path[len - 1] != '/')
+        len--;
+    if (len == 0) {
+        printf(".\n");
+        return 0;
+    }
+    len = trimSlashes(path, len);
+    printf("%.*s\n", (int)len, path);
+    return 0;
+}
+
+int metash_plugin_init(const struct metash_plugin_api* api) {
+    if (api->abi_version < 1)
+        return -1;
+    if (api->register_builtin("basename", "Strip the directory (and a suffix) from a path",
+                              pathnameBasename) < 0)
+        return -1;
+    return api->register_builtin("dirname", "Strip the last component from a path",
+                                 pathnameDirname);
+}
@@ -0,0 +1,226 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "prompt.h"
+#include "trace.h"
+#include "utils.h"
+
+using namespace std;
+
+extern char __CWD[BUFSIZE];
+
+// Static segments
+static string user_segment;
+static string host_segment;
+
+// Fast segments, and the state the cached prompt was rendered from
+static int width = PROMPT_DEFAULT_WIDTH;
+static string rendered;
+static string rendered_cwd;
+static string rendered_branch;
+static string rendered_load;
+static int rendered_width = -1;
+static time_t rendered_time = -1;
+
+/*
+	Slow segments, shared with the background thread under slow_mutex. Requests and results are
+	numbered, so a result always matches the latest request it covers. The mutex and condition
+	variables are never destroyed, as the thread is still waiting on them when the shell exits
+*/
+static mutex& slow_mutex = *new mutex;
+static condition_variable& slow_request = *new condition_variable;
+static condition_variable& slow_done = *new condition_variable;
+static bool slow_running = false;
+static unsigned long requested_seq = 0;
+static unsigned long done_seq = 0;
+static string requested_dir;
+static string branch_dir;
+static string branch;
+static string load_average;
+static time_t load_time = 0;
+static bool prompt_waiting = false;
+static int event_fd = -1;
+
+// Read the branch from the .git/HEAD of dir or of its closest parent, "" outside of a repository
+static string readBranch(string dir) {
+    while (true) {
+        string head = dir + (dir == "/" ? "" : "/") + ".git/HEAD";
+        FILE* fp = fopen(head.c_str(), "re");
+        if (fp) {
+            char line[256] = "";
+            bool ok = fgets(line, sizeof(line), fp) != NULL;
+            fclose(fp);
+            if (!ok)
+                return "";
+
+            line[strcspn(line, "\n")] = '\0';
+            const char* ref = "ref: refs/heads/";
+            if (strncmp(line, ref, strlen(ref)) == 0)
+                return line + strlen(ref);
+            // Detached HEAD: show the short hash
+            return string(line).substr(0, 7);
+        }
+
+        if (dir == "/" || dir.empty())
+            return "";
+        size_t slash = dir.rfind('/');
+        dir = slash == 0 ? "/" : dir.substr(0, slash);
+    }
+}
+
+static string readLoad() {
+    char load[32] = "";
+    FILE* fp = fopen("/proc/loadavg", "re");
+    if (fp) {
+        if (fscanf(fp, "%31s", load) != 1)
+            load[0] = '\0';
+        fclose(fp);
+    }
+    return load;
+}
+
+static void slowSegments() {
+    unique_lock<mutex> lock(slow_mutex);
+    while (true) {
+        slow_request.wait(lock, [] { return done_seq != requested_seq; });
+        unsigned long seq = requested_seq;
+        string dir = requested_dir;
+        bool needLoad = time(NULL) - load_time >= PROMPT_LOAD_REFRESH;
+        lock.unlock();
+
+        uint64_t start = trace_enabled.load(memory_order_relaxed) ? traceClock() : 0;
+        string newBranch = readBranch(dir);
+        string newLoad = needLoad ? readLoad() : "";
+        if (start)
+            traceComplete("prompt.slow", start, traceClock(), dir.c_str());
+
+        lock.lock();
+        branch_dir = dir;
+        branch = newBranch;
+        if (needLoad) {
+            load_average = newLoad;
+            load_time = time(NULL);
+        }
+        done_seq = seq;
+        slow_done.notify_all();
+
+        // Nobody is waiting, so the prompt was drawn without this result
+        if (!prompt_waiting) {
+            uint64_t one = 1;
+            if (write(event_fd, &one, sizeof(one)) < 0)
+                perror("write() failed");
+        }
+    }
+}
+
+void initPrompt() {
+    user_segment = getUsername();
+    host_segment = getHostname();
+    promptResized();
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        perror("eventfd() failed");
+        return;
+    }
+    thread(slowSegments).detach();
+    slow_running = true;
+}
+
+void promptResized() {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0)
+        width = size.ws_col;
+    else
+        width = PROMPT_DEFAULT_WIDTH;
+}
+
+int promptEventFD() { return event_fd; }
+
+// Slow segments to show for cwd. The branch of another directory is never shown
+static void currentSlowSegments(const string& cwd, string& currentBranch, string& currentLoad) {
+    currentBranch = branch_dir == cwd ? branch : "";
+    currentLoad = load_average;
+}
+
+bool promptChanged() {
+    uint64_t count;
+    if (event_fd >= 0 && read(event_fd, &count, sizeof(count)) < 0)
+        return false;
+
+    lock_guard<mutex> lock(slow_mutex);
+    string currentBranch, currentLoad;
+    currentSlowSegments(rendered_cwd, currentBranch, currentLoad);
+    return currentBranch != rendered_branch || currentLoad != rendered_load;
+}
+
+const char* getShellPrompt() {
+    TRACE_SPAN("prompt");
+    string cwd = __CWD;
+    string currentBranch, currentLoad;
+
+    if (slow_running) {
+        unique_lock<mutex> lock(slow_mutex);
+        unsigned long seq = ++requested_seq;
+        requested_dir = cwd;
+        slow_request.notify_one();
+
+        // Without a result for this directory yet, wait a little for one instead of drawing the
+        // prompt twice. Otherwise the cached segments are drawn now and refreshed if they changed
+        if (branch_dir != cwd) {
+            prompt_waiting = true;
+            slow_done.wait_for(lock, chrono::milliseconds(PROMPT_DEADLINE_MS),
+                               [seq] { return done_seq >= seq; });
+            prompt_waiting = false;
+        }
+        currentSlowSegments(cwd, currentBranch, currentLoad);
+    }
+
+    time_t now = time(NULL);
+    if (now == rendered_time && width == rendered_width && cwd == rendered_cwd &&
+        currentBranch == rendered_branch && currentLoad == rendered_load)
+        return rendered.c_str();
+
+    char timeBuffer[12];
+    struct tm* ltime = localtime(&now);
+    strftime(timeBuffer, sizeof(timeBuffer), "%H:%M:%S", ltime);
+
+    // Some part of the prompt is on the right end, fill the space in between to the terminal width
+    int used = host_segment.size() + 2 + cwd.size() + strlen(timeBuffer);
+    if (!currentBranch.empty())
+        used += currentBranch.size() + 3;
+    if (!currentLoad.empty())
+        used += currentLoad.size() + 1;
+    int numSpaces = width - used > 0 ? width - used : 1;
+
+    rendered.clear();
+    rendered.append(YELLOW).append(host_segment).append(NORM ": " GREENIT).append(cwd);
+    rendered.append(NORM);
+    if (!currentBranch.empty())
+        rendered.append(" " PURPLE "(").append(currentBranch).append(")" NORM);
+    rendered.append(numSpaces, ' ');
+    if (!currentLoad.empty())
+        rendered.append(GRAY).append(currentLoad).append(" " NORM);
+    rendered.append(GRAY).append(timeBuffer).append(NORM "\n" CYAN).append(user_segment);
+    rendered.append(NORM " " RED "@" NORM " ");
+
+    rendered_time = now;
+    rendered_width = width;
+    rendered_cwd = cwd;
+    rendered_branch = currentBranch;
+    rendered_load = currentLoad;
+    return rendered.c_str();
+}
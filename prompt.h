@@ -0,0 +1,60 @@
+#ifndef PROMPT_H_
+#define PROMPT_H_
+
+#define PROMPT_DEADLINE_MS 15    // How long a prompt waits for the slow segments
+#define PROMPT_LOAD_REFRESH 5    // Seconds before the load average is read again
+#define PROMPT_DEFAULT_WIDTH 80  // Used when the terminal size is unknown
+
+/*
+	Prompt engine
+	------------------
+	The prompt is made of segments:
+		static: user and host, read once by `initPrompt`
+		fast: working directory, terminal width and clock, checked on every prompt
+		slow: VCS branch of the working directory and load average, computed on a background
+			thread, since reading them can block on a slow filesystem
+
+	The rendered prompt is cached, and only rebuilt when a segment changed. Each prompt asks the
+	thread for fresh slow segments and waits at most PROMPT_DEADLINE_MS for them. When they arrive
+	later, `promptEventFD` becomes readable, and the main loop redraws the prompt
+*/
+
+/*
+	void initPrompt()
+	------------------
+	Read the static segments and the terminal width, and start the slow segment thread
+*/
+void initPrompt();
+
+/*
+	const char *getShellPrompt()
+	------------------
+	Return the prompt for the current state of the shell. The string is owned by the prompt engine
+	and stays valid until the next call
+*/
+const char* getShellPrompt();
+
+/*
+	void promptResized()
+	------------------
+	Read the terminal width again. To be called when the shell gets SIGWINCH
+*/
+void promptResized();
+
+/*
+	int promptEventFD()
+	------------------
+	Returns an eventfd that becomes readable when slow segments were computed after their prompt
+	was drawn, or -1 if the prompt engine is not running
+*/
+int promptEventFD();
+
+/*
+	bool promptChanged()
+	------------------
+	Clear the event on `promptEventFD` and tell if the prompt would now render differently from the
+	one last returned by `getShellPrompt`
+*/
+bool promptChanged();
+
+#endif // PROMPT_H_
@@ -0,0 +1,445 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "rc.h"
+#include "registry.h"
+#include "tokenizer.h"
+#include "utils.h"
+#include "vars.h"
+
+using namespace std;
+
+/*
+	struct alias
+	------------------
+	Members:
+		value: string -> The value as it was given, for listing
+		tokens: vector<string> -> The value split into tokens, which replace the alias name
+	------------------
+*/
+struct alias {
+    string value;
+    vector<string> tokens;
+};
+
+// Kept sorted by name, the order `alias` lists them in
+static map<string, alias> aliases;
+
+/*
+	struct rcSnapshotHeader
+	Start of the snapshot file. It is followed by the strings of the config, each as a uint32_t
+	length and its bytes: for every alias its name, value, number of tokens and tokens, then every
+	variable name and value, then every plugin
+*/
+struct rcSnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint32_t numAliases;
+    uint32_t numVariables;
+    uint32_t numPlugins;
+};
+
+// Split value like a command line. Returns false if it holds more than one pipeline stage
+static bool splitValue(const string& value, vector<string>& tokens) {
+    arena mem;
+    vector<char> line(value.begin(), value.end());
+    line.push_back('\0');
+    tokenizedLine parsed;
+    tokenizeLine(line.data(), value.size(), mem, parsed);
+    bool simple = parsed.numStages <= 1;
+    if (simple)
+        tokens = tokenStrings(parsed);
+    arenaFree(mem);
+    return simple;
+}
+
+/*
+	Split line at unquoted whitespace, into the words as written (quotes and backslashes kept, so a
+	value can be expanded later with the quoting it was written with) and the same words unquoted.
+	A `$(...)` or backquoted command stays whole and as written in both, whatever it holds. Returns
+	false if the line holds a pipe outside of quotes and commands
+*/
+static bool splitWords(const string& line, vector<string>& raw, vector<string>& words) {
+    string rawWord, word;
+    bool inWord = false, simple = true;
+    char quote = 0;
+    size_t len = line.size();
+    for (size_t i = 0; i < len; i++) {
+        char c = line[i];
+        if (!quote && (c == ' ' || (c >= '\t' && c <= '\r'))) {
+            if (inWord) {
+                raw.push_back(rawWord);
+                words.push_back(word);
+            }
+            rawWord.clear();
+            word.clear();
+            inWord = false;
+            continue;
+        }
+        inWord = true;
+
+        if (quote != '\'' && (c == '`' || (c == '$' && i + 1 < len && line[i + 1] == '('))) {
+            size_t end = c == '`' ? line.find('`', i + 1) : closingParen(line.data(), i + 2, len);
+            end = min(end, len - 1);
+            rawWord.append(line, i, end - i + 1);
+            word.append(line, i, end - i + 1);
+            i = end;
+            continue;
+        }
+
+        rawWord += c;
+        if (c == '\\') {
+            if (i + 1 < len) {
+                rawWord += line[++i];
+                word += line[i];
+            }
+        } else if (quote && c == quote) {
+            quote = 0;
+        } else if (!quote && (c == '\'' || c == '"')) {
+            quote = c;
+        } else {
+            if (!quote && c == '|')
+                simple = false;
+            word += c;
+        }
+    }
+    if (inWord) {
+        raw.push_back(rawWord);
+        words.push_back(word);
+    }
+    return simple;
+}
+
+// Expand variables (and command substitutions) in a value as written in the startup file. Words
+// it expands to are joined by single spaces
+static string expandValue(const string& value) {
+    arena mem;
+    vector<char> line(value.begin(), value.end());
+    line.push_back('\0');
+    tokenizedLine parsed;
+    tokenizeLine(line.data(), value.size(), mem, parsed, TOKENIZE_EXPAND);
+    string expanded;
+    for (size_t i = 0; i < parsed.numTokens; i++) {
+        if (i > 0)
+            expanded += ' ';
+        expanded += tokenString(parsed, i);
+    }
+    arenaFree(mem);
+    return expanded;
+}
+
+// Define an alias from a NAME=VALUE token. Prints an error for context and returns false if invalid
+static bool defineAlias(const string& definition, const string& context) {
+    size_t equals = definition.find('=');
+    if (equals == 0 || equals == string::npos) {
+        printf("%s: expected NAME=VALUE: %s\n", context.c_str(), definition.c_str());
+        return false;
+    }
+
+    alias a;
+    a.value = definition.substr(equals + 1);
+    if (!splitValue(a.value, a.tokens)) {
+        printf("%s: an alias cannot hold a pipe: %s\n", context.c_str(), definition.c_str());
+        return false;
+    }
+    aliases[definition.substr(0, equals)] = a;
+    return true;
+}
+
+bool expandAlias(vector<string>& tokens) {
+    if (tokens.empty() || aliases.empty())
+        return false;
+    map<string, alias>::const_iterator it = aliases.find(tokens[0]);
+    if (it == aliases.end())
+        return false;
+
+    const vector<string>& replacement = it->second.tokens;
+    tokens.erase(tokens.begin());
+    tokens.insert(tokens.begin(), replacement.begin(), replacement.end());
+    return true;
+}
+
+/*
+	Parsing
+*/
+
+// Parse the startup file into config. Returns the number of lines with errors, -1 if unreadable
+static int parseRC(const string& path, rcConfig& config) {
+    ifstream file(path.c_str());
+    if (!file.good())
+        return -1;
+
+    int errors = 0, number = 0;
+    string line;
+    while (getline(file, line)) {
+        number++;
+        // Comments are skipped before tokenizing, so a `|` in one is not taken for a pipe
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#')
+            continue;
+        vector<string> raw, tokens;
+        if (!splitWords(line, raw, tokens)) {
+            fprintf(stderr, "%s:%d: unexpected pipe\n", path.c_str(), number);
+            errors++;
+            continue;
+        }
+        if (tokens.empty())
+            continue;
+
+        const string& directive = tokens[0];
+        size_t equals = tokens.size() == 2 ? tokens[1].find('=') : string::npos;
+        if (directive == "alias" && equals != string::npos && equals > 0) {
+            rcAlias a;
+            a.name = tokens[1].substr(0, equals);
+            a.value = tokens[1].substr(equals + 1);
+            if (!splitValue(a.value, a.tokens)) {
+                fprintf(stderr, "%s:%d: an alias cannot hold a pipe\n", path.c_str(), number);
+                errors++;
+                continue;
+            }
+            config.aliases.push_back(a);
+        } else if (directive == "export" && equals != string::npos && equals > 0) {
+            // Values are kept as written, and expanded by `applyRC`
+            config.variables.push_back(make_pair(tokens[1].substr(0, equals),
+                                                 raw[1].substr(raw[1].find('=') + 1)));
+        } else if (directive == "setenv" && (tokens.size() == 2 || tokens.size() == 3)) {
+            config.variables.push_back(make_pair(tokens[1], tokens.size() == 3 ? raw[2] : ""));
+        } else if (directive == "load" && tokens.size() == 2) {
+            config.plugins.push_back(tokens[1]);
+        } else {
+            fprintf(stderr, "%s:%d: expected alias, export, setenv or load: %s\n", path.c_str(),
+                    number, line.c_str());
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/*
+	Snapshot
+*/
+
+static void putString(string& out, const string& s) {
+    uint32_t length = s.size();
+    out.append((const char*)&length, sizeof(length));
+    out.append(s);
+}
+
+static bool getString(const char*& pos, const char* end, string& s) {
+    uint32_t length;
+    if (end - pos < (long)sizeof(length))
+        return false;
+    memcpy(&length, pos, sizeof(length));
+    pos += sizeof(length);
+    if ((size_t)(end - pos) < length)
+        return false;
+    s.assign(pos, length);
+    pos += length;
+    return true;
+}
+
+static bool matches(const rcSnapshotHeader& header, const struct stat& st) {
+    return header.magic == RC_SNAPSHOT_MAGIC && header.version == RC_SNAPSHOT_VERSION &&
+           header.inode == (uint64_t)st.st_ino && header.size == (uint64_t)st.st_size &&
+           header.mtimeSec == (int64_t)st.st_mtim.tv_sec &&
+           header.mtimeNsec == (int64_t)st.st_mtim.tv_nsec;
+}
+
+// Load config from the snapshot at path if it was made from the file described by st
+static bool readSnapshot(const string& path, const struct stat& st, rcConfig& config) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat snapshot;
+    string data;
+    if (fstat(fd, &snapshot) == 0 && snapshot.st_size >= (off_t)sizeof(rcSnapshotHeader)) {
+        data.resize(snapshot.st_size);
+        if (read(fd, &data[0], data.size()) != (ssize_t)data.size())
+            data.clear();
+    }
+    close(fd);
+    if (data.empty())
+        return false;
+
+    rcSnapshotHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    if (!matches(header, st))
+        return false;
+
+    const char* pos = data.data() + sizeof(header);
+    const char* end = data.data() + data.size();
+    rcConfig loaded;
+    string name, value;
+    for (uint32_t i = 0; i < header.numAliases; i++) {
+        rcAlias a;
+        uint32_t count;
+        if (!getString(pos, end, a.name) || !getString(pos, end, a.value) ||
+            end - pos < (long)sizeof(count))
+            return false;
+        memcpy(&count, pos, sizeof(count));
+        pos += sizeof(count);
+        a.tokens.resize(min<size_t>(count, end - pos));
+        for (uint32_t t = 0; t < count; t++) {
+            if (t >= a.tokens.size() || !getString(pos, end, a.tokens[t]))
+                return false;
+        }
+        loaded.aliases.push_back(a);
+    }
+    for (uint32_t i = 0; i < header.numVariables; i++) {
+        if (!getString(pos, end, name) || !getString(pos, end, value))
+            return false;
+        loaded.variables.push_back(make_pair(name, value));
+    }
+    for (uint32_t i = 0; i < header.numPlugins; i++) {
+        if (!getString(pos, end, name))
+            return false;
+        loaded.plugins.push_back(name);
+    }
+    config = loaded;
+    return true;
+}
+
+// Write the snapshot of config next to the file described by st. A failure is not an error,
+// the file is just parsed again next time
+static void writeSnapshot(const string& path, const struct stat& st, const rcConfig& config) {
+    rcSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = RC_SNAPSHOT_MAGIC;
+    header.version = RC_SNAPSHOT_VERSION;
+    header.inode = st.st_ino;
+    header.size = st.st_size;
+    header.mtimeSec = st.st_mtim.tv_sec;
+    header.mtimeNsec = st.st_mtim.tv_nsec;
+    header.numAliases = config.aliases.size();
+    header.numVariables = config.variables.size();
+    header.numPlugins = config.plugins.size();
+
+    string data((const char*)&header, sizeof(header));
+    for (size_t i = 0; i < config.aliases.size(); i++) {
+        const rcAlias& a = config.aliases[i];
+        putString(data, a.name);
+        putString(data, a.value);
+        uint32_t count = a.tokens.size();
+        data.append((const char*)&count, sizeof(count));
+        for (size_t t = 0; t < a.tokens.size(); t++)
+            putString(data, a.tokens[t]);
+    }
+    for (size_t i = 0; i < config.variables.size(); i++) {
+        putString(data, config.variables[i].first);
+        putString(data, config.variables[i].second);
+    }
+    for (size_t i = 0; i < config.plugins.size(); i++)
+        putString(data, config.plugins[i]);
+
+    // Written aside and renamed, so another shell starting now never reads half of it
+    string temporary = path + "." + to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    bool written = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+    close(fd);
+    if (!written || rename(temporary.c_str(), path.c_str()) < 0)
+        unlink(temporary.c_str());
+}
+
+int readRC(const string& home, rcConfig& config, bool& fromSnapshot) {
+    fromSnapshot = false;
+    string path = home + "/" RC_FILE;
+    string snapshot = home + "/" RC_SNAPSHOT;
+
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+        return errno == ENOENT ? 1 : -1;
+
+    if (readSnapshot(snapshot, st, config)) {
+        fromSnapshot = true;
+        return 0;
+    }
+
+    int errors = parseRC(path, config);
+    if (errors < 0) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    if (errors == 0)
+        writeSnapshot(snapshot, st, config);
+    return 0;
+}
+
+void applyRC(const rcConfig& config) {
+    for (size_t i = 0; i < config.aliases.size(); i++) {
+        alias& a = aliases[config.aliases[i].name];
+        a.value = config.aliases[i].value;
+        a.tokens = config.aliases[i].tokens;
+    }
+    // Expanded here rather than when parsing, so the snapshot stays valid whatever the
+    // environment of the next shell. In file order, so a line can use the variables set above it
+    for (size_t i = 0; i < config.variables.size(); i++)
+        setVariable(config.variables[i].first, expandValue(config.variables[i].second), true);
+    for (size_t i = 0; i < config.plugins.size(); i++)
+        loadPlugin(config.plugins[i].c_str());
+}
+
+/*
+	Builtins
+*/
+
+static void printAlias(const string& name, const alias& a) {
+    printf("alias %s=%s\n", name.c_str(), shellQuote(a.value).c_str());
+}
+
+int metash_alias(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        for (map<string, alias>::const_iterator it = aliases.begin(); it != aliases.end(); ++it)
+            printAlias(it->first, it->second);
+        return 0;
+    }
+
+    int ret = 0;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        if (tokens[i].find('=') != string::npos) {
+            if (!defineAlias(tokens[i], "alias"))
+                ret = -1;
+            continue;
+        }
+        map<string, alias>::const_iterator it = aliases.find(tokens[i]);
+        if (it == aliases.end()) {
+            printf("alias: %s: not found\n", tokens[i].c_str());
+            ret = -1;
+        } else {
+            printAlias(it->first, it->second);
+        }
+    }
+    return ret;
+}
+
+int metash_unalias(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        printf("usage: unalias name...\n");
+        return -1;
+    }
+    int ret = 0;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        if (aliases.erase(tokens[i]) == 0) {
+            printf("unalias: %s: not found\n", tokens[i].c_str());
+            ret = -1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,95 @@
+#ifndef RC_H_
+#define RC_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#define RC_FILE ".metashrc"            // In the home directory
+#define RC_SNAPSHOT ".metashrc.snap"   // Parsed form of RC_FILE, next to it
+#define RC_SNAPSHOT_MAGIC 0x4352534dU  // "MSRC"
+#define RC_SNAPSHOT_VERSION 2
+
+/*
+	Startup file
+	------------------
+	An interactive shell reads ~/.metashrc before its first prompt. Each line is one of:
+		alias NAME=VALUE     define an alias (see `metash_alias`)
+		export NAME=VALUE    set an environment variable
+		setenv NAME VALUE    same, in the form of the `setenv` builtin
+		load PLUGIN.so       load a plugin (see registry.h)
+	Empty lines and lines starting with `#` are skipped. Lines are split by the shell's tokenizer,
+	so quoting works as on the command line. The values of export and setenv are expanded like a
+	command line (`export PATH=$HOME/bin:$PATH`) each time the file is applied, in file order
+
+	The parsed form, with the values of aliases already split into tokens, is kept in
+	~/.metashrc.snap, a binary snapshot that also records the inode, size and modification time of
+	~/.metashrc. As long as those match, the next startup reads the snapshot instead of tokenizing
+	the file again. A file with errors gets no snapshot, so the errors are shown at every startup
+	until they are fixed
+*/
+
+/*
+	struct rcAlias
+	An alias of the startup file, already split into the tokens that replace its name
+*/
+struct rcAlias {
+    std::string name;
+    std::string value;
+    std::vector<std::string> tokens;
+};
+
+/*
+	struct rcConfig
+	The contents of the startup file
+	------------------
+	Members:
+		aliases: vector<rcAlias> -> Aliases, in file order
+		variables: vector<pair<string, string>> -> Environment variables and their values, as
+			written in the file, quotes included. They are expanded by `applyRC`
+		plugins: vector<string> -> Plugins to load, in file order
+	------------------
+*/
+struct rcConfig {
+    std::vector<rcAlias> aliases;
+    std::vector<std::pair<std::string, std::string>> variables;
+    std::vector<std::string> plugins;
+};
+
+/*
+	int readRC(const string &home, rcConfig &config, bool &fromSnapshot)
+	------------------
+	Read the startup file of the home directory into config, from its snapshot when it is still
+	valid, otherwise by parsing it and writing a new snapshot. fromSnapshot tells which happened
+	Returns 0 on success, 1 if there is no startup file, -1 if it could not be read
+*/
+int readRC(const std::string& home, rcConfig& config, bool& fromSnapshot);
+
+/*
+	void applyRC(const rcConfig &config)
+	------------------
+	Define the aliases, set and export the variables and load the plugins of config
+*/
+void applyRC(const rcConfig& config);
+
+/*
+	bool expandAlias(vector<string> &tokens)
+	------------------
+	Replace tokens[0] with the tokens of its alias, if it has one. An alias is only expanded once,
+	so `alias ls='ls -F'` works. Returns true if tokens changed
+*/
+bool expandAlias(std::vector<std::string>& tokens);
+
+/*
+	Alias builtins
+	------------------
+	alias                 list the aliases
+	alias NAME=VALUE...   define aliases. VALUE is split into tokens like a command line, and may
+	                      not hold a pipe
+	alias NAME...         show the given aliases
+	unalias NAME...       remove aliases
+*/
+int metash_alias(const std::vector<std::string>& tokens);
+int metash_unalias(const std::vector<std::string>& tokens);
+
+#endif // RC_H_
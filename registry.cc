@@ -0,0 +1,260 @@
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "builtins.h"
+#include "dirs.h"
+#include "glob.h"
+#include "jobs.h"
+#include "metash_plugin.h"
+#include "native.h"
+#include "parallel.h"
+#include "pathcache.h"
+#include "pipes.h"
+#include "rc.h"
+#include "registry.h"
+#include "spawner.h"
+#include "trace.h"
+#include "vars.h"
+
+using namespace std;
+
+/*
+	builtin_table: builtinFunction[]
+		The builtins compiled into the shell, in the order `help` lists them
+*/
+static constexpr builtinFunction builtin_table[] = {
+    {metash_cd, "cd", "Changes working directory to the one specified"},
+    {metash_pwd, "pwd", "Shows current working directory "},
+    {metash_pushd, "pushd", "Push a directory on the stack and change to it"},
+    {metash_popd, "popd", "Pop a directory off the stack and change to it"},
+    {metash_dirs, "dirs", "Show the directory stack, or the most used directories"},
+    {metash_help, "help", "Shows this help text"},
+    {metash_exit, "exit", "Cleanly exits the shell"},
+    {metash_fetch, "fetch", "Show system information"},
+    {metash_history, "history", "Show all commands executed on the shell"},
+    {metash_setenv, "setenv", "Set an environment variable to specified value"},
+    {metash_getenv, "getenv", "Fetch the value of an environment variable"},
+    {metash_unsetenv, "unsetenv", "Unset the given environment variable"},
+    {metash_spawnmode, "spawnmode", "Show or set the launch engine (posix or fork)"},
+    {metash_hash, "hash", "List, clear (-r) or prewarm the path cache"},
+    {metash_pipeconf, "pipeconf", "Set pipe capacity and the splice relay"},
+    {metash_parallel, "parallel", "Run a command per argument, N jobs at a time"},
+    {metash_jobs, "jobs", "List background and stopped jobs"},
+    {metash_fg, "fg", "Bring a job to the foreground"},
+    {metash_bg, "bg", "Continue a stopped job in the background"},
+    {metash_wait, "wait", "Wait for jobs to finish"},
+    {metash_kill, "kill", "Send a signal to a job or process"},
+    {metash_load, "load", "Load builtins from a plugin (.so)"},
+    {metash_native, "native", "Switch the native cat, wc, head, tail, grep and tee"},
+    {metash_trace, "trace", "Record a trace of the shell, for chrome://tracing"},
+    {metash_alias, "alias", "Define or list aliases"},
+    {metash_unalias, "unalias", "Remove aliases"},
+    {metash_export, "export", "Export variables to the commands the shell runs"},
+    {metash_unset, "unset", "Remove shell variables"},
+    {metash_vars, "vars", "List the shell variables"},
+    {metash_globcache, "globcache", "Show or set the directory cache of globbing"},
+    {metash_memstat, "memstat", "Show arena, heap and resident memory of the shell"},
+    {metash_cat, "cat", "Print files (native)", NULL, true},
+    {metash_wc, "wc", "Count lines, words and bytes (native)", NULL, true},
+    {metash_head, "head", "Print the first lines of files (native)", NULL, true},
+    {metash_tail, "tail", "Print the last lines of files (native)", NULL, true},
+    {metash_grep, "grep", "Print lines containing a string, with -F (native)", NULL, true},
+    {metash_tee, "tee", "Copy stdin to stdout and files (native)", NULL, true},
+};
+
+static constexpr size_t num_compiled = sizeof(builtin_table) / sizeof(builtin_table[0]);
+
+static_assert(num_compiled <= BUILTIN_SLOTS / 4, "BUILTIN_SLOTS is too small for the builtins");
+
+vector<builtinFunction> builtins(builtin_table, builtin_table + num_compiled);
+
+/*
+	FNV-1a, with the seed mixed into the offset basis. The constexpr version picks the seed, and
+	the loop below must compute the same slots at run time
+*/
+static constexpr uint32_t fnv1a(const char* name, uint32_t hash) {
+    return *name ? fnv1a(name + 1, (hash ^ (unsigned char)*name) * 16777619u) : hash;
+}
+
+static constexpr uint32_t slotOf(const char* name, uint32_t seed) {
+    return fnv1a(name, 2166136261u ^ seed) & (BUILTIN_SLOTS - 1);
+}
+
+static inline uint32_t slotOf(const string& name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < name.size(); i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash & (BUILTIN_SLOTS - 1);
+}
+
+// True if no builtin after j in the table shares the slot of builtin i
+static constexpr bool slotFree(uint32_t seed, size_t i, size_t j) {
+    return j >= num_compiled ||
+           (slotOf(builtin_table[i].command, seed) != slotOf(builtin_table[j].command, seed) &&
+            slotFree(seed, i, j + 1));
+}
+
+static constexpr bool isPerfect(uint32_t seed, size_t i) {
+    return i >= num_compiled || (slotFree(seed, i, i + 1) && isPerfect(seed, i + 1));
+}
+
+static constexpr uint32_t findSeed(uint32_t seed) {
+    return isPerfect(seed, 0) ? seed : findSeed(seed + 1);
+}
+
+static constexpr uint32_t builtin_seed = findSeed(0);
+
+// Index in builtin_table of the builtin in each slot, or -1
+static struct builtinSlots {
+    int index[BUILTIN_SLOTS];
+
+    builtinSlots() {
+        for (size_t i = 0; i < BUILTIN_SLOTS; i++)
+            index[i] = -1;
+        for (size_t i = 0; i < num_compiled; i++)
+            index[slotOf(string(builtin_table[i].command), builtin_seed)] = i;
+    }
+} builtin_slots;
+
+int checkBuiltin(const string& command) {
+    int index = builtin_slots.index[slotOf(command, builtin_seed)];
+    if (index >= 0 && strcmp(command.c_str(), builtin_table[index].command) == 0)
+        return index;
+
+    // Builtins from plugins come after the compiled-in ones
+    for (size_t i = num_compiled; i < builtins.size(); i++) {
+        if (strcmp(command.c_str(), builtins[i].command) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int selectBuiltin(const vector<string>& tokens, bool inProcess) {
+    TRACE_SPAN_DETAIL("dispatch", tokens[0].c_str());
+    int index = checkBuiltin(tokens[0]);
+    if (index >= 0 && builtins[index].native && !nativeAccepts(tokens, inProcess))
+        return -1;
+    return index;
+}
+
+int runBuiltin(int index, const vector<string>& tokens) {
+    TRACE_SPAN_DETAIL("builtin", builtins[index].command);
+    int ret;
+    if (builtins[index].builtin_fp) {
+        ret = builtins[index].builtin_fp(tokens);
+    } else {
+        const char** argv = arenaArray<const char*>(command_arena, tokens.size() + 1);
+        for (size_t i = 0; i < tokens.size(); i++)
+            argv[i] = tokens[i].c_str();
+        argv[tokens.size()] = NULL;
+        ret = builtins[index].plugin_fp(tokens.size(), argv);
+    }
+    return ret < 0 ? 1 : ret;
+}
+
+/*
+	struct plugin
+	A plugin loaded by `load`. Plugins are never unloaded once their init succeeded, their
+	builtins may be running in a stage of a pipeline
+*/
+struct plugin {
+    string path;
+    void* handle;
+    vector<string> names;
+};
+
+static vector<plugin> plugins;
+
+// The plugin whose init function is running, which the builtins it registers are recorded in
+static plugin* loading = NULL;
+
+static int registerBuiltin(const char* name, const char* help, metash_builtin_fn fn) {
+    if (!loading || !name || !*name || !fn) {
+        printf("load: invalid builtin\n");
+        return -1;
+    }
+    if (checkBuiltin(name) >= 0) {
+        printf("load: %s: a builtin with this name already exists\n", name);
+        return -1;
+    }
+
+    // The strings of the plugin may not outlive its init function
+    builtinFunction builtin = {NULL, strdup(name), strdup(help ? help : ""), fn};
+    builtins.push_back(builtin);
+    loading->names.push_back(name);
+    return 0;
+}
+
+static const metash_plugin_api plugin_api = {METASH_PLUGIN_ABI, registerBuiltin};
+
+int loadPlugin(const char* path) {
+    // dlopen only looks in the library paths for a name without a slash
+    string file = path;
+    struct stat st;
+    if (file.find('/') == string::npos && stat(path, &st) == 0)
+        file = "./" + file;
+
+    void* handle = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        printf("load: %s\n", dlerror());
+        return -1;
+    }
+    for (size_t i = 0; i < plugins.size(); i++) {
+        if (plugins[i].handle == handle) {
+            printf("load: %s: already loaded\n", path);
+            dlclose(handle);
+            return -1;
+        }
+    }
+
+    metash_plugin_init_fn init = (metash_plugin_init_fn)dlsym(handle, METASH_PLUGIN_INIT);
+    if (!init) {
+        printf("load: %s: no %s function\n", path, METASH_PLUGIN_INIT);
+        dlclose(handle);
+        return -1;
+    }
+
+    plugin p = {path, handle, {}};
+    size_t before = builtins.size();
+    loading = &p;
+    int ret = init(&plugin_api);
+    loading = NULL;
+
+    if (ret != 0) {
+        printf("load: %s: init failed (%d)\n", path, ret);
+        for (size_t i = before; i < builtins.size(); i++) {
+            free((void*)builtins[i].command);
+            free((void*)builtins[i].help);
+        }
+        builtins.resize(before);
+        dlclose(handle);
+        return -1;
+    }
+    plugins.push_back(p);
+    return 0;
+}
+
+int metash_load(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        for (size_t i = 0; i < plugins.size(); i++) {
+            printf("%s:", plugins[i].path.c_str());
+            for (size_t j = 0; j < plugins[i].names.size(); j++)
+                printf(" %s", plugins[i].names[j].c_str());
+            printf("\n");
+        }
+        return 0;
+    }
+
+    int ret = 0;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        if (loadPlugin(tokens[i].c_str()) < 0)
+            ret = -1;
+    }
+    return ret;
+}
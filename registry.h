@@ -0,0 +1,63 @@
+#ifndef REGISTRY_H_
+#define REGISTRY_H_
+
+#include <string>
+#include <vector>
+
+#define BUILTIN_SLOTS 256 // Size of the hash table of the compiled-in builtins, a power of two
+
+/*
+	Builtin registry
+	------------------
+	The builtins compiled into the shell are a constexpr table. A seed for FNV-1a is searched for
+	at compile time so that every name of the table lands in its own slot of a BUILTIN_SLOTS table:
+	finding a builtin costs one hash and one string comparison, and a name that hashes to an empty
+	slot is known not to be a builtin without comparing anything
+
+	Builtins loaded from plugins (see metash_plugin.h) are added after the compiled-in ones in the
+	`builtins` table, and are compared one by one after a miss
+*/
+
+/*
+	int checkBuiltin(const string &command)
+	------------------
+	Returns the index of the builtin named command in the `builtins` table, or -1
+*/
+int checkBuiltin(const std::string& command);
+
+/*
+	int selectBuiltin(const vector<string> &tokens, bool inProcess)
+	------------------
+	The builtin to run for the command in tokens, or -1 to run an external command. A native
+	builtin (see native.h) is only selected if it implements the flags in tokens. inProcess is
+	false for a stage of a pipeline, which runs in a forked copy of the shell
+*/
+int selectBuiltin(const std::vector<std::string>& tokens, bool inProcess);
+
+/*
+	int runBuiltin(int index, const vector<string> &tokens)
+	------------------
+	Run the builtin at index with tokens as its arguments, tokens[0] being its name. Builtins from
+	plugins are given a C argv pointing into tokens
+	Returns the exit status: 0 on success, 1 if the builtin returned a negative value, else what it
+	returned (native builtins return the status of the command they replace)
+*/
+int runBuiltin(int index, const std::vector<std::string>& tokens);
+
+/*
+	int loadPlugin(const char *path)
+	------------------
+	Load the plugin at path with `dlopen` and run its init function. A path without a `/` is
+	looked up in the current directory first, then where `dlopen` looks
+	Returns 0 on success, -1 on error
+*/
+int loadPlugin(const char* path);
+
+/*
+	int metash_load(const vector<string> &tokens)
+	------------------
+	`load plugin.so...` loads plugins. Without arguments, lists the loaded plugins and their builtins
+*/
+int metash_load(const std::vector<std::string>& tokens);
+
+#endif // REGISTRY_H_
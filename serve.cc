@@ -0,0 +1,438 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "serve.h"
+#include "vars.h"
+
+using namespace std;
+
+extern char** environ;
+extern char __CWD[BUFSIZE];
+
+static volatile sig_atomic_t stop_serving = 0;
+
+static void stopServing(unused int sig) { stop_serving = 1; }
+
+static int writeAll(int fd, const char* data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = send(fd, data + written, size - written, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+static int readAll(int fd, char* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/*
+	Send size bytes of data with count descriptors attached. Returns 0 on success, -1 on error
+*/
+static int sendWithFDs(int socket, const void* data, size_t size, const int* fds, int count) {
+    struct iovec iov = {(void*)data, size};
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    while (true) {
+        ssize_t n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        // The descriptors went with the first byte, the rest is plain data
+        return writeAll(socket, (const char*)data + n, size - n);
+    }
+}
+
+/*
+	Receive up to size bytes into data, and the descriptors attached to them into fds (at most
+	count, opened close-on-exec). Returns the number of bytes, 0 at the end of the stream or -1 on
+	error, and sets received to the number of descriptors
+*/
+static ssize_t receiveWithFDs(int socket, void* data, size_t size, int* fds, int count,
+                              int& received) {
+    struct iovec iov = {data, size};
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    received = 0;
+    ssize_t n;
+    do {
+        n = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return n;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int* passed = (int*)CMSG_DATA(cmsg);
+        int num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < num; i++) {
+            if (received < count)
+                fds[received++] = passed[i];
+            else
+                close(passed[i]);
+        }
+    }
+    return n;
+}
+
+/*
+	Session
+*/
+
+// Read the request on conn and run it. Never returns
+static void runSession(int conn, int (*run)(batchReader&)) {
+    serveRequest request;
+    int fds[3];
+    int received;
+    ssize_t n = receiveWithFDs(conn, &request, sizeof(request), fds, 3, received);
+    bool valid = n > 0 && received == 3 &&
+                 readAll(conn, (char*)&request + n, sizeof(request) - n) == 0 &&
+                 memcmp(request.magic, SERVE_MAGIC, sizeof(request.magic)) == 0 &&
+                 (uint64_t)request.cwd_len + request.env_len + request.command_len <=
+                     SERVE_MAX_REQUEST;
+
+    string body;
+    if (valid) {
+        body.resize(request.cwd_len + request.env_len + request.command_len);
+        valid = readAll(conn, &body[0], body.size()) == 0;
+    }
+    close(conn);
+    // A connection closed without a word is a probe, like the one of `listenOn`
+    if (!valid) {
+        if (n != 0)
+            fprintf(stderr, "%s: --serve: invalid request\n", SHELL);
+        _exit(2);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    // The environment strings are NUL terminated, and environ points into body from now on
+    vector<char*> envp;
+    char* env = &body[request.cwd_len];
+    for (size_t i = 0; i < request.env_len; i += strlen(env + i) + 1)
+        envp.push_back(env + i);
+    envp.push_back(NULL);
+    environ = envp.data();
+    reloadVariables();
+
+    string cwd = body.substr(0, request.cwd_len);
+    if (chdir(cwd.c_str()) < 0) {
+        fprintf(stderr, "%s: %s: %s\n", SHELL, cwd.c_str(), strerror(errno));
+        _exit(1);
+    }
+    if (!getcwd(__CWD, BUFSIZE))
+        snprintf(__CWD, BUFSIZE, "%s", cwd.c_str());
+
+    batchReader reader;
+    string command = body.substr(request.cwd_len + request.env_len);
+    batchFromString(reader, command.c_str());
+    exit(run(reader));
+}
+
+/*
+	Helper
+*/
+
+// Accept connections passed by the daemon on channel, and run a session for each. Never returns
+static void helperLoop(int channel, int (*run)(batchReader&)) {
+    prctl(PR_SET_NAME, "metash-helper");
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0) {
+        perror("signalfd() failed");
+        _exit(1);
+    }
+
+    // The connection of each running session, where its status goes
+    map<pid_t, int> sessions;
+    bool open = true;
+    while (open || !sessions.empty()) {
+        struct pollfd fds[2] = {{sigfd, POLLIN, 0}, {open ? channel : -1, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll() failed");
+            _exit(1);
+        }
+
+        if (fds[1].revents) {
+            char byte;
+            int conn, received;
+            if (receiveWithFDs(channel, &byte, 1, &conn, 1, received) <= 0) {
+                // The daemon is gone: finish the sessions that are running
+                open = false;
+                close(channel);
+            } else if (received == 1) {
+                pid_t pid = fork();
+                if (pid == 0) {
+                    close(sigfd);
+                    close(channel);
+                    for (map<pid_t, int>::iterator it = sessions.begin(); it != sessions.end();
+                         ++it)
+                        close(it->second);
+                    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+                    runSession(conn, run);
+                }
+                if (pid < 0) {
+                    perror("fork() failed");
+                    close(conn);
+                } else {
+                    sessions[pid] = conn;
+                }
+            }
+        }
+
+        if (fds[0].revents) {
+            struct signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info))
+                ;
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                map<pid_t, int>::iterator it = sessions.find(pid);
+                if (it == sessions.end())
+                    continue;
+                int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                writeAll(it->second, (const char*)&code, sizeof(code));
+                close(it->second);
+                sessions.erase(it);
+            }
+        }
+    }
+    _exit(0);
+}
+
+// Fork a helper, and return the daemon's end of its channel, or -1
+static int startHelper(pid_t& helper, int listener, int (*run)(batchReader&)) {
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channel) < 0) {
+        perror("socketpair() failed");
+        return -1;
+    }
+    helper = fork();
+    if (helper == 0) {
+        close(listener);
+        close(channel[0]);
+        helperLoop(channel[1], run);
+    }
+    close(channel[1]);
+    if (helper < 0) {
+        perror("fork() failed");
+        close(channel[0]);
+        return -1;
+    }
+    return channel[0];
+}
+
+/*
+	Daemon
+*/
+
+// Bind and listen on path, replacing a socket file that no daemon answers on. Returns -1 on error
+static int listenOn(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: %s: socket path too long\n", SHELL, path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket() failed");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        bool stale = false;
+        if (errno == EADDRINUSE) {
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            stale = connect(probe, (struct sockaddr*)&addr, sizeof(addr)) < 0;
+            close(probe);
+            errno = stale ? errno : EADDRINUSE;
+        }
+        if (!stale || unlink(path) < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "%s: %s: %s\n", SHELL, path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "%s: %s: %s\n", SHELL, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serveSocket(const char* path, int (*run)(batchReader&)) {
+    int listener = listenOn(path);
+    if (listener < 0)
+        return 1;
+
+    pid_t helper;
+    int channel = startHelper(helper, listener, run);
+    if (channel < 0) {
+        close(listener);
+        unlink(path);
+        return 1;
+    }
+
+    // No SA_RESTART, so accept() returns when the daemon is asked to stop
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServing;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    char byte = 0;
+    while (!stop_serving) {
+        int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("accept() failed");
+            continue;
+        }
+        // A helper that died is replaced, and gets the connection instead
+        if (sendWithFDs(channel, &byte, 1, &conn, 1) < 0) {
+            close(channel);
+            waitpid(helper, NULL, 0);
+            channel = startHelper(helper, listener, run);
+            if (channel < 0 || sendWithFDs(channel, &byte, 1, &conn, 1) < 0) {
+                fprintf(stderr, "%s: --serve: no helper to run requests\n", SHELL);
+                close(conn);
+                break;
+            }
+        }
+        close(conn);
+    }
+
+    close(listener);
+    unlink(path);
+    // The helper finishes the running sessions once the channel is closed
+    if (channel >= 0)
+        close(channel);
+    waitpid(helper, NULL, 0);
+    return 0;
+}
+
+/*
+	Client
+*/
+
+int connectSocket(const char* path, const char* command) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: %s: socket path too long\n", SHELL, path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "%s: %s: %s\n", SHELL, path, strerror(errno));
+        return 1;
+    }
+
+    // Descriptors that are closed here are /dev/null for the command
+    int fds[3];
+    for (int i = 0; i < 3; i++) {
+        fds[i] = i;
+        if (fcntl(i, F_GETFD) < 0)
+            fds[i] = open("/dev/null", O_RDWR | O_CLOEXEC);
+    }
+
+    char cwd[BUFSIZE];
+    if (!getcwd(cwd, sizeof(cwd)))
+        strcpy(cwd, "/");
+    string env;
+    for (char** entry = environ; *entry != NULL; entry++)
+        env.append(*entry, strlen(*entry) + 1);
+
+    serveRequest request;
+    memset(&request, 0, sizeof(request));
+    memcpy(request.magic, SERVE_MAGIC, sizeof(request.magic));
+    request.cwd_len = strlen(cwd);
+    request.env_len = env.size();
+    request.command_len = strlen(command);
+    string body = string(cwd) + env + command;
+    if (body.size() > SERVE_MAX_REQUEST) {
+        fprintf(stderr, "%s: --connect: request too large\n", SHELL);
+        return 1;
+    }
+
+    int32_t status;
+    if (sendWithFDs(fd, &request, sizeof(request), fds, 3) < 0 ||
+        writeAll(fd, body.data(), body.size()) < 0) {
+        fprintf(stderr, "%s: %s: %s\n", SHELL, path, strerror(errno));
+        return 1;
+    }
+    if (readAll(fd, (char*)&status, sizeof(status)) < 0) {
+        fprintf(stderr, "%s: %s: connection closed before the command finished\n", SHELL, path);
+        return 1;
+    }
+    close(fd);
+    return status;
+}
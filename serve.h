@@ -0,0 +1,65 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include <stdint.h>
+
+#include "batch.h"
+
+#define SERVE_MAGIC "MSHSRV1"
+#define SERVE_MAX_REQUEST (16 << 20)  // Bytes of directory, environment and command of a request
+
+/*
+	Server mode
+	------------------
+	`shell --serve /path/to.sock` runs the shell as a daemon on a Unix socket, for callers that
+	would otherwise start a shell per command. Each client sends one request: its working
+	directory, its environment, the command lines to run, and its stdin, stdout and stderr as
+	SCM_RIGHTS. The lines run as in `shell -c` with the client's descriptors, directory and
+	environment, and the exit status of the last one is sent back. `shell --connect
+	/path/to.sock -c 'command'` is a client that exits with that status
+
+	Three kinds of processes take part:
+		daemon    binds the socket and accepts clients, passing each connection to the helper
+		helper    forked by the daemon before it serves anyone, so it stays small. It forks one
+		          session per connection, reaps them and writes their status to the connection
+		session   a fork of the helper. It reads the request, takes over the client's descriptors,
+		          directory and environment, and runs the lines with the tokenizer and builtins of
+		          the shell. The last external command is exec'd in place of the session, so a
+		          plain command costs the helper one fork of a small process
+	Sessions are separate processes, so requests run at the same time, and a `cd` or `export` in
+	one does not leak into the next. If the helper dies, the daemon starts another
+
+	Protocol, on a SOCK_STREAM connection:
+		client -> server: struct serveRequest, sent with the three descriptors attached, then
+		                  cwd_len bytes of directory, env_len bytes of NUL terminated NAME=value
+		                  strings, and command_len bytes of command lines
+		server -> client: int32_t, the exit status (128 + the signal number for a killed command)
+*/
+struct serveRequest {
+    char magic[8];
+    uint32_t cwd_len;
+    uint32_t env_len;
+    uint32_t command_len;
+    uint32_t reserved;
+};
+
+/*
+	int serveSocket(const char *path, int (*run)(batchReader &))
+	------------------
+	Serve requests on the Unix socket at path until SIGINT or SIGTERM. run is called in each session
+	with a reader over the command lines, and returns their status. A stale socket file left by a
+	daemon that is gone is replaced
+	Returns 0 once stopped, or 1 if the socket could not be set up
+*/
+int serveSocket(const char* path, int (*run)(batchReader&));
+
+/*
+	int connectSocket(const char *path, const char *command)
+	------------------
+	Send command to the daemon on the socket at path, with this process's descriptors 0 to 2,
+	directory and environment, and wait for it to run
+	Returns the exit status of command, or 1 if the daemon could not be reached
+*/
+int connectSocket(const char* path, const char* command);
+
+#endif // SERVE_H_
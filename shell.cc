@@ -1,25 +1,49 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <time.h>
 
 #include <algorithm>
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
-#include <sys/ioctl.h>
+#include <sys/signalfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "batch.h"
 #include "builtins.h"
+#include "complete.h"
+#include "dirs.h"
+#include "glob.h"
+#include "parallel.h"
+#include "histindex.h"
+#include "histstore.h"
+#include "jobs.h"
+#include "pathcache.h"
+#include "pipes.h"
+#include "prompt.h"
+#include "rc.h"
+#include "registry.h"
+#include "serve.h"
+#include "spawner.h"
+#include "subst.h"
+#include "timing.h"
 #include "tokenizer.h"
+#include "trace.h"
 #include "utils.h"
+#include "vars.h"
 
 using namespace std;
 
+extern char** environ;
+
 #define unused __attribute__((unused)) /* Silence compiler warnings about unused variables */
 #define BUFSIZE 4096
 
@@ -40,230 +64,647 @@ using namespace std;
 */
 extern char __CWD[BUFSIZE];
 
-int shell_terminal = STDIN_FILENO;
-pid_t shell_pgid = getpid();
+// False when running `-c`, a script file or piped stdin. Disables prompt, history and job control
+bool interactive = true;
 
-// Check if a command is a builtin
-int checkBuiltin(vector<string> tokens);
+// Rebuild a command line from its tokens, for job messages
+static string joinTokens(const vector<string>& tokens) {
+    string command;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (i > 0)
+            command += " ";
+        command += tokens[i];
+    }
+    return command;
+}
 
-// Generate a prompt for the shell
-const char* getShellPrompt();
+// The pipeline whose files the shell is relaying, for `relaySignalled`
+static job* relay_job = NULL;
 
 /*
-	builtins: vector<builtinFunctions>
-		Vector of all builtin functions implemented by the shell
-		When a command is to be executed, compares with this list to check if builtin
+	Called by the relay when the job control signalfd has something. Reaps the stages that changed
+	state and returns true to stop relaying on Ctrl-C, or once no stage of the job is running
 */
-vector<builtinFunction> builtins = {
-    {metash_cd, "cd", "Changes working directory to the one specified"},
-    {metash_pwd, "pwd", "Shows current working directory "},
-    {metash_help, "help", "Shows this help text"},
-    {metash_exit, "exit", "Cleanly exits the shell"},
-    {metash_fetch, "fetch", "Show system information"},
-    {metash_history, "history", "Show all commands executed on the shell"},
-    {metash_setenv, "setenv", "Set an environment variable to specified value"},
-    {metash_getenv, "getenv", "Fetch the value of the given environment variable"},
-    {metash_unsetenv, "unsetenv", "Unset the given environment variable"},
-
-};
-
-int checkBuiltin(vector<string> tokens) {
-    // Iterate over builtins and check if the command is same as the first token. If found, return index else -1
-    string command = tokens[0];
-    size_t n = builtins.size();
-
-    for (size_t i = 0; i < n; i++) {
-        if (builtins[i].command == command)
-            return i;
+static bool relaySignalled(int sigfd) {
+    struct signalfd_siginfo info;
+    bool child = false, interrupted = false, resized = false;
+
+    while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD)
+            child = true;
+        else if (info.ssi_signo == SIGINT)
+            interrupted = true;
+        else if (info.ssi_signo == SIGWINCH)
+            resized = true;
     }
-    return -1;
-}
 
-const char* getShellPrompt() {
-    string username = getUsername();
-    string hostname = getHostname();
-    char timeBuffer[12];
-
-    auto t = time(nullptr);
-    struct tm* ltime = localtime(&t);
-    strftime(timeBuffer, sizeof(timeBuffer), "%H:%M:%S", ltime);
-
-    char* prompt = (char*)malloc(BUFSIZE * sizeof(char));
-
-    // Check width of terminal
-    // Needed because some part of the prompt is on the right end and need to fill with correct num spaces in between
-    struct winsize size;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
-    int width = size.ws_col;
-    int numSpaces = width - (strlen(__CWD) + 2) - (hostname.size()) - (strlen(timeBuffer));
-
-    string spaces(numSpaces, ' ');
-    sprintf(prompt, ": %s%s%s%s%s%s%s [%s%s@%s%s] \n%s@%s ", GREEN, __CWD, NORM, spaces.c_str(),
-            GRAY, timeBuffer, NORM, CYAN, username.c_str(), hostname.c_str(), NORM, RED, NORM);
-    sprintf(prompt, "%s%s%s: %s%s%s%s%s%s%s\n%s%s%s %s@%s ", YELLOW, hostname.c_str(), NORM,
-            GREENIT, __CWD, NORM, spaces.c_str(), GRAY, timeBuffer, NORM, CYAN, username.c_str(),
-            NORM, RED, NORM);
-    return prompt;
+    if (resized) {
+        promptResized();
+        rl_resize_terminal();
+    }
+    if (child)
+        reapJobs();
+    return interrupted || jobStatus(*relay_job) != JOB_RUNNING;
 }
 
-int main(int argc, char** argv) {
-    metash_help(vector<string>{});
-    getcwd(__CWD, BUFSIZE);
-    const char* HISTORYFILE = getHistoryFilename();
+/*
+	int executeLine(char *line, bool tailExec)
+	------------------
+	Tokenize one input line and run it, either as a builtin, a single command or a pipeline
+	Returns the exit status of the command (for a pipeline, the status of its last stage)
 
-    read_history(HISTORYFILE);
-    using_history();
+	If tailExec is set, the line is the last one a non-interactive shell will run. A plain external
+	command is then exec'd in place of the shell, as there is nothing left to come back to
+*/
+int executeLine(char* line, bool tailExec) {
+    TRACE_SPAN_DETAIL("command", line);
+
+    // The tokenizer finds the pipeline stages, expands variables and flags glob patterns in the
+    // same pass. Its spans only live until the tokens are copied out, with the patterns expanded
+    uint64_t tokenizeStart = trace_enabled.load(memory_order_relaxed) ? traceClock() : 0;
+    unsigned long substitutions = substitutions_run;
+    arenaMark mark = arenaSave(command_arena);
+    tokenizedLine parsed;
+    tokenizeLine(line, strlen(line), command_arena, parsed, TOKENIZE_EXPAND | TOKENIZE_GLOB);
+    vector<string> tokens;
+    vector<vector<string>> parsedTokens;
+    globStrings(parsed, tokens, parsedTokens);
+    // If there is an unquoted pipe character, set isPipe to true. Piped inputs are handled differently
+    bool isPipe = parsed.numStages > 1;
+    arenaRestore(command_arena, mark);
+    if (tokenizeStart)
+        traceComplete("tokenize", tokenizeStart, traceClock());
+
+    if (tokens.empty())
+        return last_status;
+
+    // Aliases replace the command name of each stage, before anything else looks at it
+    if (isPipe) {
+        for (size_t i = 0; i < parsedTokens.size(); i++)
+            expandAlias(parsedTokens[i]);
+    } else {
+        expandAlias(tokens);
+    }
 
-    char* line;
+    // `time` prefixes a whole command or pipeline, and its report is printed when the job is done
+    size_t numTokens = tokens.size();
+    int timing = parseTimePrefix(tokens);
+    if (timing != TIME_OFF && tokens.empty()) {
+        printf("time: expected a command\n");
+        return 1;
+    }
+    if (isPipe) {
+        parsedTokens[0].erase(parsedTokens[0].begin(),
+                              parsedTokens[0].begin() + (numTokens - tokens.size()));
+        // A `time` prefix hides the command name from the alias expansion above
+        if (timing != TIME_OFF)
+            expandAlias(parsedTokens[0]);
+    } else if (timing != TIME_OFF) {
+        expandAlias(tokens);
+    }
 
-    while ((line = readline(getShellPrompt())) != nullptr) {
-        if (strlen(line) > 0) {
-            add_history(line);
-            write_history(HISTORYFILE);
-        } else {
-            free(line);
-            continue;
+    // Leading NAME=value tokens go to the environment of their command only. On their own, they
+    // set shell variables
+    vector<string> assignments;
+    vector<vector<string>> stageAssignments(parsedTokens.size());
+    if (isPipe) {
+        for (size_t i = 0; i < parsedTokens.size(); i++) {
+            if (takeAssignments(parsedTokens[i], stageAssignments[i]) > 0)
+                expandAlias(parsedTokens[i]);
         }
+    } else if (takeAssignments(tokens, assignments) > 0) {
+        if (tokens.empty()) {
+            for (size_t i = 0; i < assignments.size(); i++) {
+                size_t equals = assignments[i].find('=');
+                setVariable(assignments[i].substr(0, equals), assignments[i].substr(equals + 1));
+            }
+            // `x=$(command)` tells whether command succeeded
+            return substitutions_run != substitutions ? last_status : 0;
+        }
+        expandAlias(tokens);
+    }
 
-        vector<string> tokens = tokenize(line);
+    // Check if command is a builtin using the `checkBuiltin` call. If yes, execute it
+    // A builtin that is part of a pipeline runs as one of its stages instead
+    int isBuiltin = isPipe ? -1 : selectBuiltin(tokens, true);
 
-        free(line);
+    if (isBuiltin >= 0) {
+        if (timing != TIME_OFF)
+            return timeBuiltin(isBuiltin, tokens, timing);
+        return runBuiltin(isBuiltin, tokens);
+    }
 
-        // Check if command is a builtin using the `checkBuiltin` call. If yes, execute it
-        int isBuiltin = checkBuiltin(tokens);
+    // If the last token of the input is &, the command is to be run in background
+    // Set the bool isBackground and remove the token because execvp does not need it
+    bool isBackground = false;
+    if (tokens[tokens.size() - 1] == "&") {
+        isBackground = true;
+        tokens.pop_back();
+        if (isPipe && !parsedTokens.back().empty())
+            parsedTokens.back().pop_back();
+        if (tokens.empty())
+            return last_status;
+    }
 
-        if (isBuiltin >= 0) {
-            builtinFunction builtin = builtins[isBuiltin];
-            builtin.builtin_fp(tokens);
-        } else {
-            // If the last token of the input is &, the command is to be run in background
-            // Set the bool isBackground and remove the token because execvp does not need it
-            unused bool isBackground = false;
-            if (tokens[tokens.size() - 1] == "&") {
-                isBackground = true;
-                tokens.pop_back();
+    if (!isPipe) {
+        // Tail-exec: nothing runs after this command, so replace the shell instead of forking
+        // (unless it is traced, the trace is written when the shell exits)
+        if (tailExec && !isBackground && timing == TIME_OFF && !trace_enabled.load()) {
+            if (resolveCommand(tokens[0]).empty()) {
+                printf("%s: command not found: %s\n", SHELL, tokens[0].c_str());
+                return 127;
             }
+            fflush(stdout);
+            vector<char*> envp = commandEnvironment(assignments);
+            environ = envp.data();
+            metash_execute(tokens);
+        }
 
-            // If there is a pipe character, set isPipe to true. Piped inputs are handled differently
-            bool isPipe = false;
-            vector<string>::iterator it = find(tokens.begin(), tokens.end(), "|");
-            if (it != tokens.end()) {
-                isPipe = true;
+        /*
+			Execute all commands that don't have any pipe in them
+
+			To execute a command, `metash_spawn` starts the child, in its own process group when the
+			shell has job control. By default this is a posix_spawn (no copy of the shell is made),
+			and the `spawnmode` builtin can switch back to the usual fork/exec through `metash_execute`
+
+			The child is recorded as a job. In the parent, if the process was not a background
+			process, wait for the job to finish (or be stopped) before issuing a prompt again
+		*/
+        job& j = addJob(joinTokens(tokens), isBackground);
+        j.timing = timing;
+
+        spawnAttributes attr;
+        if (job_control)
+            attr.pgid = 0;
+        attr.assignments = assignments;
+        pid_t pid = metash_spawn(tokens, attr);
+        if (pid > 0)
+            addStage(j, pid, j.command);
+
+        if (isBackground && pid > 0) {
+            if (interactive)
+                printf("[%d] %d\n", j.id, pid);
+            return 0;
+        }
+        return waitForJob(j.id, true);
+    } else {
+        /*
+			Execute all commands that have pipes in them
+
+			The tokenizer has already split the tokens into token groups, with each group
+			representing one command in the pipe. We iterate over each of these commands
+			We use the `pipe2` system call (through `makePipe`) to create a pipe. Then the correct file
+			descriptors are set. For a command of form `a | b | c`, the output of a is
+			set as the input of b, the output of b is set as input of c and so on
+
+			The descriptors are handed to `metash_spawn`, which applies them as posix_spawn
+			file actions (or dup2s them in a forked child in fork mode). The parent closes file
+			descriptors as we progress to the next command in the pipe call
+
+			All stages form one job, sharing one process group. Once all pipes have been set, we
+			wait for every stage of the job to finish execution
+		*/
+        size_t num_commands = parsedTokens.size();
+
+        // Resolve every stage up front, so `a | missing | b` starts no process at all
+        // Builtin stages run in a forked copy of the shell and need no lookup
+        vector<int> stageBuiltin(num_commands, -1);
+        for (size_t i = 0; i < num_commands; i++) {
+            if (!parsedTokens[i].empty())
+                stageBuiltin[i] = selectBuiltin(parsedTokens[i], false);
+            if (stageBuiltin[i] >= 0)
+                continue;
+            if (parsedTokens[i].empty() || resolveCommand(parsedTokens[i][0], false).empty()) {
+                printf("%s: command not found: %s\n", SHELL,
+                       parsedTokens[i].empty() ? "" : parsedTokens[i][0].c_str());
+                return 127;
             }
+        }
 
-            if (!isPipe) {
-                /*
-					Execute all commands that don't have any pipe in them
-
-					To execute a command, use the usual fork/exec method. A child process
-					is spawned and then we pass the tokens to `metash_execute` which runs `execvp`
-					in the child, replacing it with the desired program
-
-					In the parent, if the process was not a background process, wait for the
-					child to finish executing before issuing a prompt again
-				*/
-                pid_t pid = fork();
-                int status;
-
-                if (pid == 0) {
-                    if (isBackground)
-                        setpgid(0, 0);
-                    metash_execute(tokens);
-                } else if (pid > 0) {
-                    if (!isBackground) {
-                        if (setpgid(pid, pid) == -1)
-                            perror("setpgid() failed");
-
-                        if (tcsetpgrp(shell_terminal, pid) == 0) {
-                            if ((waitpid(pid, &status, WUNTRACED)) < 0) {
-                                perror("wait() failed");
-                                exit(EXIT_FAILURE);
-                            }
-
-                            signal(SIGTTOU, SIG_IGN);
-                            if (tcsetpgrp(shell_terminal, shell_pgid) != 0)
-                                perror("tcsetpgrp() failed");
-                            signal(SIGTTOU, SIG_DFL);
-                        } else {
-                            perror("tcsetpgrp() failed");
-                        }
-                    }
-                } else {
-                    perror("fork() failed");
-                }
-            } else {
-                /*
-					Execute all commands that have pipes in them
-
-					Firstly we split the tokens into token groups, with each group representing
-					one command in the pipe. Then we iterate over each of these commands
-					We use the `pipe` system call to create a pipe. Then the correct file
-					descriptors are set. For a command of form `a | b | c`, the output of a is
-					set as the input of b, the output of b is set as input of c and so on
-
-					After setting descriptors, the usual fork/exec method is called and the function
-					`metash_execute` is called. The parent closes file descriptors as we progress to
-					the next command in the pipe call
-
-					Once all pipes have been set, we wait for all children to finish execution
-				*/
-                vector<vector<string>> parsedTokens = parsePipeTokens(tokens);
-
-                size_t num_commands = parsedTokens.size();
-                int pipeFD[2];
-                int tempFD[2];
-
-                for (size_t i = 0; i < num_commands; i++) {
-                    if (i != num_commands - 1)
-                        pipe(pipeFD);
-
-                    pid_t pid = fork();
-
-                    if (pid == 0) {
-                        if (i != 0) {
-                            int dupStatus = dup2(tempFD[0], STDIN_FILENO);
-                            if (dupStatus == -1)
-                                perror("dup2() failed");
-
-                            close(tempFD[0]);
-                            close(tempFD[1]);
-                        }
-
-                        if (i != num_commands - 1) {
-                            int dupStatus = dup2(pipeFD[1], STDOUT_FILENO);
-                            if (dupStatus == -1)
-                                perror("dup2() failed");
-
-                            close(pipeFD[0]);
-                            close(pipeFD[1]);
-                        }
-
-                        metash_execute(parsedTokens[i]);
-                    } else if (pid > 0) {
-
-                        if (i != 0) {
-                            close(tempFD[0]);
-                            close(tempFD[1]);
-                        }
-
-                        if (i != num_commands - 1) {
-                            tempFD[0] = pipeFD[0];
-                            tempFD[1] = pipeFD[1];
-                        }
-                    } else {
-                        perror("fork() failed");
-                    }
-                }
-                if (!isBackground) {
-                    int ret;
-                    do {
-                        ret = wait(NULL);
-                    } while (ret > 0);
-                }
+        /*
+			With the splice relay on, a `<` on the first stage and a `>` on the last stage are
+			served by the shell: the stage gets one more pipe, and the shell moves the data between
+			that pipe and the file with `splice` while the pipeline runs
+		*/
+        int relayIn[2] = {-1, -1}, relayOut[2] = {-1, -1};
+        int inFile = -1, outFile = -1;
+        if (splice_relay && !isBackground) {
+            string inputFile = takeRedirection(parsedTokens[0], "<");
+            string outputFile = takeRedirection(parsedTokens[num_commands - 1], ">");
+
+            if (!inputFile.empty() &&
+                (inFile = open(inputFile.c_str(), O_CLOEXEC | READ_FLAGS)) < 0) {
+                perror(inputFile.c_str());
+                return 1;
+            }
+            if (!outputFile.empty() &&
+                (outFile = open(outputFile.c_str(), O_CLOEXEC | WRITE_FLAGS)) < 0) {
+                perror(outputFile.c_str());
+                if (inFile >= 0)
+                    close(inFile);
+                return 1;
             }
+            if (inFile >= 0)
+                makePipe(relayIn);
+            if (outFile >= 0)
+                makePipe(relayOut);
+        }
+
+        job& j = addJob(joinTokens(tokens), isBackground);
+        j.timing = timing;
+
+        int pipeFD[2];
+        int tempFD[2];
+
+        for (size_t i = 0; i < num_commands; i++) {
+            if (i != num_commands - 1)
+                makePipe(pipeFD);
+
+            spawnAttributes attr;
+            if (i != 0) {
+                attr.inputFD = tempFD[0];
+                attr.closeFDs.push_back(tempFD[0]);
+                attr.closeFDs.push_back(tempFD[1]);
+            } else if (relayIn[0] >= 0) {
+                attr.inputFD = relayIn[0];
+            }
+            if (i != num_commands - 1) {
+                attr.outputFD = pipeFD[1];
+                attr.closeFDs.push_back(pipeFD[0]);
+                attr.closeFDs.push_back(pipeFD[1]);
+            } else if (relayOut[1] >= 0) {
+                attr.outputFD = relayOut[1];
+            }
+            // A builtin stage is forked without exec, so O_CLOEXEC does not keep the relay ends
+            // out of it, and a stage reading from the relay would never see end of file
+            int relayFDs[] = {relayIn[0], relayIn[1], relayOut[0], relayOut[1], inFile, outFile};
+            for (size_t k = 0; k < sizeof(relayFDs) / sizeof(relayFDs[0]); k++) {
+                if (relayFDs[k] >= 0)
+                    attr.closeFDs.push_back(relayFDs[k]);
+            }
+
+            // The first stage leads a new process group and the others join it
+            if (job_control)
+                attr.pgid = j.pgid > 0 ? j.pgid : 0;
+            attr.assignments = stageAssignments[i];
+
+            pid_t pid;
+            if (stageBuiltin[i] >= 0)
+                pid = spawnBuiltin(stageBuiltin[i], parsedTokens[i], attr);
+            else
+                pid = metash_spawn(parsedTokens[i], attr);
+            if (pid > 0)
+                addStage(j, pid, joinTokens(parsedTokens[i]));
+
+            if (i != 0) {
+                close(tempFD[0]);
+                close(tempFD[1]);
+            }
+
+            if (i != num_commands - 1) {
+                tempFD[0] = pipeFD[0];
+                tempFD[1] = pipeFD[1];
+            }
+        }
+
+        // Keep only our ends of the relay pipes, then move the data until both files are done
+        if (inFile >= 0 || outFile >= 0) {
+            if (relayIn[0] >= 0)
+                close(relayIn[0]);
+            if (relayOut[1] >= 0)
+                close(relayOut[1]);
+
+            // The pipeline gets the terminal while the shell relays, so Ctrl-C and Ctrl-Z reach
+            // it and a stage reading the terminal is not stopped
+            bool tookTerminal = giveTerminal(j);
+            relay_job = &j;
+            relayFiles(inFile, relayIn[1], relayOut[0], outFile, job_signal_fd, relaySignalled);
+            relay_job = NULL;
+            if (tookTerminal)
+                reclaimTerminal();
+
+            if (inFile >= 0)
+                close(inFile);
+            if (outFile >= 0) {
+                close(relayOut[0]);
+                close(outFile);
+            }
+        }
+
+        if (isBackground && !j.stages.empty()) {
+            if (interactive)
+                printf("[%d] %d\n", j.id, j.stages.back().pid);
+            return 0;
+        }
+        return waitForJob(j.id, true);
+    }
+}
+
+// Blank lines and `#` comments (including a `#!` line) are skipped in non-interactive input
+static bool isCommandLine(const string& line) {
+    size_t first = line.find_first_not_of(" \t\r");
+    return first != string::npos && line[first] != '#';
+}
+
+/*
+	int runBatch(batchReader &reader)
+	------------------
+	Run every line of a non-interactive input: no banner, prompt, readline or history
+	One line of lookahead is kept so that the final command can be tail-exec'd
+	Returns the exit status of the last command
+*/
+int runBatch(batchReader& reader) {
+    string line, next;
+    bool hasLine = false;
+
+    while (batchReadLine(reader, line)) {
+        if (isCommandLine(line)) {
+            hasLine = true;
+            break;
+        }
+    }
+
+    while (hasLine) {
+        bool hasNext = false;
+        while (batchReadLine(reader, next)) {
+            if (isCommandLine(next)) {
+                hasNext = true;
+                break;
+            }
+        }
+
+        // No job control here, just collect background jobs so they do not linger as zombies
+        reapJobs();
+        notifyJobs(false);
+
+        last_status = executeLine(&line[0], !hasNext);
+        arenaReset(command_arena);
+
+        line.swap(next);
+        hasLine = hasNext;
+    }
+    return last_status;
+}
+
+static bool input_done = false;
+
+// When the current prompt was drawn, for the readline span of the trace
+static uint64_t prompt_shown = 0;
+
+// Called by readline with each complete line, or NULL on Ctrl-D
+static void handleLine(char* line) {
+    // Put the terminal back in its normal mode while the command runs
+    rl_callback_handler_remove();
+
+    if (line == NULL) {
+        input_done = true;
+        printf("\n");
+        return;
+    }
+
+    traceComplete("readline", prompt_shown, traceClock());
+    if (strlen(line) > 0) {
+        appendHistory(line);
+        last_status = executeLine(line, false);
+        arenaReset(command_arena);
+        // The command may have changed PATH
+        refreshCompletion();
+    }
+    free(line);
+
+    reapJobs();
+    notifyJobs(true);
+    rl_callback_handler_install(getShellPrompt(), handleLine);
+    prompt_shown = traceClock();
+}
+
+// Print messages under the line being edited, then draw a fresh prompt with the same text
+static void redrawAfter(bool interrupted) {
+    char* saved = rl_copy_text(0, rl_end);
+    int point = rl_point;
+    rl_callback_handler_remove();
+
+    printf(interrupted ? "^C\n" : "\n");
+    notifyJobs(true);
+
+    rl_callback_handler_install(getShellPrompt(), handleLine);
+    // Ctrl-C at the prompt drops the line being typed, like other shells
+    if (!interrupted) {
+        rl_insert_text(saved);
+        rl_point = point;
+        rl_redisplay();
+    }
+    free(saved);
+}
+
+static void handleSignals(int sigfd) {
+    struct signalfd_siginfo info;
+    bool child = false, interrupted = false, resized = false;
+
+    while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD)
+            child = true;
+        else if (info.ssi_signo == SIGINT)
+            interrupted = true;
+        else if (info.ssi_signo == SIGWINCH)
+            resized = true;
+    }
+
+    if (resized) {
+        promptResized();
+        rl_resize_terminal();
+    }
+
+    if (child)
+        reapJobs();
+    if (interrupted || finishedJobs() > 0)
+        redrawAfter(interrupted);
+}
+
+/*
+	Startup profile
+	------------------
+	With --startup-profile, each step between the start of `main` and the first prompt is timed,
+	and the steps are printed to stderr just before the prompt. History loading is not one of them,
+	as it waits until the prompt is up (see histstore.h)
+*/
+static bool startup_profile = false;
+static vector<pair<const char*, double>> startup_phases;
+static struct timespec startup_last;
+
+static double elapsedMs(const struct timespec& from, const struct timespec& to) {
+    return (to.tv_sec - from.tv_sec) * 1e3 + (to.tv_nsec - from.tv_nsec) / 1e6;
+}
+
+// Record the time since the previous phase (or the start of main) under name
+static void startupPhase(const char* name) {
+    if (!startup_profile)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    startup_phases.push_back(make_pair(name, elapsedMs(startup_last, now)));
+    startup_last = now;
+}
+
+static void printStartupProfile() {
+    double total = 0;
+    for (size_t i = 0; i < startup_phases.size(); i++)
+        total += startup_phases[i].second;
+    fprintf(stderr, "startup profile (ms since main):\n");
+    for (size_t i = 0; i < startup_phases.size(); i++)
+        fprintf(stderr, "  %-14s %8.3f  %5.1f%%\n", startup_phases[i].first,
+                startup_phases[i].second,
+                total > 0 ? 100 * startup_phases[i].second / total : 0.0);
+    fprintf(stderr, "  %-14s %8.3f\n", "first prompt", total);
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "--startup-profile") == 0) {
+        startup_profile = true;
+        clock_gettime(CLOCK_MONOTONIC, &startup_last);
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+
+    getcwd(__CWD, BUFSIZE);
+    initTrace();
+    enableSubstitution(executeLine);
+    startupPhase("init");
+
+    /*
+		Non-interactive modes, used when the shell is glue in scripts and job runners
+			shell -c 'command'   runs the given command line(s)
+			shell script.msh     runs the lines of a script file
+			... | shell          runs the lines read from a non-terminal stdin
+		and server mode, for job runners that would start a shell per command (see serve.h)
+			shell --serve /path/to.sock                 serves requests on the socket
+			shell --connect /path/to.sock -c 'command'  runs the command line(s) through it
+	*/
+    if (argc >= 2 && strcmp(argv[1], "--serve") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "%s: usage: --serve SOCKET\n", SHELL);
+            return 2;
+        }
+        interactive = false;
+        return serveSocket(argv[2], runBatch);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--connect") == 0) {
+        if (argc != 5 || strcmp(argv[3], "-c") != 0) {
+            fprintf(stderr, "%s: usage: --connect SOCKET -c COMMAND\n", SHELL);
+            return 2;
+        }
+        return connectSocket(argv[2], argv[4]);
+    }
+
+    batchReader reader;
+    if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "%s: -c: option requires an argument\n", SHELL);
+            return 2;
+        }
+        interactive = false;
+        batchFromString(reader, argv[2]);
+        return runBatch(reader);
+    }
+
+    if (argc >= 2) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s: %s\n", SHELL, argv[1], strerror(errno));
+            return 127;
+        }
+        interactive = false;
+        batchFromFD(reader, fd);
+        return runBatch(reader);
+    }
+
+    if (!isatty(STDIN_FILENO)) {
+        interactive = false;
+        batchFromFD(reader, STDIN_FILENO);
+        return runBatch(reader);
+    }
+
+    // The startup file is only for interactive shells, scripts get the environment they are given
+    rcConfig config;
+    bool fromSnapshot = false;
+    string home = getHomeDirectory();
+    int rc = home.empty() ? 1 : readRC(home, config, fromSnapshot);
+    applyRC(config);
+    startupPhase(fromSnapshot ? "rc (snapshot)" : "rc");
+
+    // The banner greets shells that are not set up yet. Once there is a startup file, `help`
+    // shows it on demand
+    if (rc != 0)
+        metash_help(vector<string>{});
+    startupPhase("banner");
+
+    // Only the path is taken now, the file is read once the first prompt is on the screen
+    char* history_file = getHistoryFilename();
+    if (history_file != NULL)
+        openHistory(history_file);
+    free(history_file);
+    using_history();
+    // Same for the directory index, opened by the first `cd` that needs it
+    if (!home.empty())
+        openDirIndex((home + "/" + DIRINDEX_FILE).c_str());
+    startupPhase("history");
+
+    /*
+		Interactive input goes through readline's callback interface, so that the loop can poll the
+		terminal and the signalfd of the job table at the same time. Finished background jobs are
+		then reported as soon as they exit, instead of at the next command. readline must not
+		install its own SIGINT and SIGWINCH handlers, as the signals are read from the signalfd
+		The prompt engine gets polled too, to redraw the prompt when a slow segment comes in late
+	*/
+    int sigfd = initJobControl();
+    startupPhase("job control");
+    initPrompt();
+    startupPhase("prompt init");
+    rl_catch_signals = 0;
+    rl_catch_sigwinch = 0;
+    rl_bind_key(CTRL('r'), historySearchKey);
+    rl_initialize();
+    startupPhase("readline");
+    initCompletion();
+    startupPhase("completion");
+    const char* prompt = getShellPrompt();
+    startupPhase("prompt");
+    if (startup_profile)
+        printStartupProfile();
+    rl_callback_handler_install(prompt, handleLine);
+    prompt_shown = traceClock();
+
+    while (!input_done) {
+        // poll() skips the descriptors that are -1. Until the history is loaded, the loop only
+        // waits for whatever is already pending, and loads it when there is nothing
+        struct pollfd fds[3] = {
+            {STDIN_FILENO, POLLIN, 0}, {sigfd, POLLIN, 0}, {promptEventFD(), POLLIN, 0}};
+        int ready = poll(fds, 3, historyLoaded() ? -1 : 0);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll() failed");
+            break;
+        }
+        if (ready == 0) {
+            loadHistory();
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN)
+            handleSignals(sigfd);
+        if ((fds[2].revents & POLLIN) && promptChanged()) {
+            // readline prints the line above the input line on its own, so clear both lines first
+            fputs("\r\x1b[A\x1b[J", rl_outstream);
+            rl_set_prompt(getShellPrompt());
+            rl_forced_update_display();
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            // A key may already want the history (arrow keys, Ctrl-R)
+            loadHistory();
+            rl_callback_read_char();
         }
-        tokens.clear();
-        fflush(stdin);
     }
 
     return 0;
@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "builtins.h"
+#include "pathcache.h"
+#include "registry.h"
+#include "spawner.h"
+#include "trace.h"
+#include "vars.h"
+
+using namespace std;
+
+extern char** environ;
+
+int spawn_mode = SPAWN_POSIX;
+
+int parseRedirections(vector<string>& tokens, string& inputFile, string& outputFile) {
+    vector<string>::iterator inpIter = find(tokens.begin(), tokens.end(), "<");
+    if (inpIter != tokens.end()) {
+        if (inpIter + 1 == tokens.end()) {
+            printf("syntax error: expected a file name after <\n");
+            return -1;
+        }
+        inputFile = *(inpIter + 1);
+        tokens.erase(inpIter, inpIter + 2);
+    }
+
+    vector<string>::iterator outIter = find(tokens.begin(), tokens.end(), ">");
+    if (outIter != tokens.end()) {
+        if (outIter + 1 == tokens.end()) {
+            printf("syntax error: expected a file name after >\n");
+            return -1;
+        }
+        outputFile = *(outIter + 1);
+        tokens.erase(outIter, outIter + 2);
+    }
+    return 0;
+}
+
+/*
+	The shell blocks SIGCHLD and SIGINT (they are read from a signalfd) and ignores the job control
+	stop signals. Both the mask and ignored dispositions survive exec, so every child gets them reset
+*/
+static const int reset_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE};
+
+void resetSignals() {
+    for (size_t i = 0; i < sizeof(reset_signals) / sizeof(reset_signals[0]); i++)
+        signal(reset_signals[i], SIG_DFL);
+
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+}
+
+// Classic path: copy the shell with `fork`, set up descriptors by hand and let `metash_execute` exec
+static pid_t forkSpawn(vector<string>& tokens, const spawnAttributes& attr) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        resetSignals();
+        if (attr.pgid >= 0)
+            setpgid(0, attr.pgid);
+
+        if (attr.inputFD != -1 && dup2(attr.inputFD, STDIN_FILENO) == -1)
+            perror("dup2() failed");
+        if (attr.outputFD != -1 && dup2(attr.outputFD, STDOUT_FILENO) == -1)
+            perror("dup2() failed");
+        if (attr.errorFD != -1 && dup2(attr.errorFD, STDERR_FILENO) == -1)
+            perror("dup2() failed");
+        for (size_t i = 0; i < attr.closeFDs.size(); i++)
+            close(attr.closeFDs[i]);
+
+        // execv passes environ on, and this copy of the shell is about to be replaced anyway
+        vector<char*> envp = commandEnvironment(attr.assignments);
+        environ = envp.data();
+        metash_execute(tokens);
+    } else if (pid > 0) {
+        // Also set the group from the parent, so it is in place whichever process runs first
+        if (attr.pgid >= 0)
+            setpgid(pid, attr.pgid == 0 ? pid : attr.pgid);
+    } else {
+        perror("fork() failed");
+    }
+    return pid;
+}
+
+// posix_spawn path: the child shares the shell's memory until it execs, so nothing is copied
+static pid_t posixSpawn(vector<string>& tokens, const string& path, const spawnAttributes& attr) {
+    string inputFile, outputFile;
+    if (parseRedirections(tokens, inputFile, outputFile) < 0 || tokens.empty())
+        return -1;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t spawnattr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&spawnattr);
+
+    // Order matters: pipes first, then files, so `a | b > out` writes to out like the fork path
+    if (attr.inputFD != -1)
+        posix_spawn_file_actions_adddup2(&actions, attr.inputFD, STDIN_FILENO);
+    if (attr.outputFD != -1)
+        posix_spawn_file_actions_adddup2(&actions, attr.outputFD, STDOUT_FILENO);
+    if (attr.errorFD != -1)
+        posix_spawn_file_actions_adddup2(&actions, attr.errorFD, STDERR_FILENO);
+    for (size_t i = 0; i < attr.closeFDs.size(); i++)
+        posix_spawn_file_actions_addclose(&actions, attr.closeFDs[i]);
+
+    if (!inputFile.empty())
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, inputFile.c_str(), READ_FLAGS, 0);
+    if (!outputFile.empty())
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputFile.c_str(), WRITE_FLAGS);
+
+    sigset_t empty, defaults;
+    sigemptyset(&empty);
+    sigemptyset(&defaults);
+    for (size_t i = 0; i < sizeof(reset_signals) / sizeof(reset_signals[0]); i++)
+        sigaddset(&defaults, reset_signals[i]);
+    posix_spawnattr_setsigmask(&spawnattr, &empty);
+    posix_spawnattr_setsigdefault(&spawnattr, &defaults);
+
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (attr.pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&spawnattr, attr.pgid);
+    }
+    posix_spawnattr_setflags(&spawnattr, flags);
+
+    size_t num_tokens = tokens.size();
+    char** args = arenaArray<char*>(command_arena, num_tokens + 1);
+    for (size_t i = 0; i < num_tokens; i++)
+        args[i] = (char*)(tokens[i].c_str());
+    args[num_tokens] = NULL;
+
+    // The cached envp of the exported variables, unless there are assignments for this command
+    vector<char*> envp;
+    if (!attr.assignments.empty())
+        envp = commandEnvironment(attr.assignments);
+    char** env = envp.empty() ? exportedEnvironment() : envp.data();
+
+    pid_t pid;
+    int ret = posix_spawn(&pid, path.c_str(), &actions, &spawnattr, args, env);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&spawnattr);
+
+    if (ret != 0) {
+        if (ret == ENOENT)
+            printf("posix_spawn() failed: Command not found: %s\n", args[0]);
+        else
+            printf("posix_spawn() failed: %s: %s\n", args[0], strerror(ret));
+        return -1;
+    }
+    return pid;
+}
+
+pid_t metash_spawn(vector<string> tokens, const spawnAttributes& attr) {
+    if (tokens.empty())
+        return -1;
+    TRACE_SPAN_DETAIL("spawn", tokens[0].c_str());
+
+    // Resolve in the parent, so a missing command is reported without starting a process at all
+    string path = resolveCommand(tokens[0]);
+    if (path.empty()) {
+        printf("%s: command not found: %s\n", SHELL, tokens[0].c_str());
+        return -1;
+    }
+
+    // Output already printed by builtins must come out before the child's, and not twice after a fork
+    fflush(stdout);
+
+    if (spawn_mode == SPAWN_FORK)
+        return forkSpawn(tokens, attr);
+    return posixSpawn(tokens, path, attr);
+}
+
+pid_t spawnBuiltin(int index, vector<string> tokens, const spawnAttributes& attr) {
+    TRACE_SPAN_DETAIL("spawn", tokens[0].c_str());
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        resetSignals();
+        if (attr.pgid >= 0)
+            setpgid(0, attr.pgid);
+
+        if (attr.inputFD != -1 && dup2(attr.inputFD, STDIN_FILENO) == -1)
+            perror("dup2() failed");
+        if (attr.outputFD != -1 && dup2(attr.outputFD, STDOUT_FILENO) == -1)
+            perror("dup2() failed");
+        if (attr.errorFD != -1 && dup2(attr.errorFD, STDERR_FILENO) == -1)
+            perror("dup2() failed");
+        for (size_t i = 0; i < attr.closeFDs.size(); i++)
+            close(attr.closeFDs[i]);
+
+        // The child is a copy of the shell, so the assignments can simply be made here
+        for (size_t i = 0; i < attr.assignments.size(); i++) {
+            size_t equals = attr.assignments[i].find('=');
+            setVariable(attr.assignments[i].substr(0, equals),
+                        attr.assignments[i].substr(equals + 1), true);
+        }
+
+        string inputFile, outputFile;
+        if (parseRedirections(tokens, inputFile, outputFile) < 0)
+            _exit(EXIT_FAILURE);
+        if (!inputFile.empty()) {
+            int fd = open(inputFile.c_str(), READ_FLAGS);
+            if (fd < 0 || dup2(fd, STDIN_FILENO) == -1) {
+                perror(inputFile.c_str());
+                _exit(EXIT_FAILURE);
+            }
+            close(fd);
+        }
+        if (!outputFile.empty()) {
+            int fd = open(outputFile.c_str(), WRITE_FLAGS);
+            if (fd < 0 || dup2(fd, STDOUT_FILENO) == -1) {
+                perror(outputFile.c_str());
+                _exit(EXIT_FAILURE);
+            }
+            close(fd);
+        }
+
+        int ret = runBuiltin(index, tokens);
+        fflush(stdout);
+        _exit(ret);
+    } else if (pid > 0) {
+        if (attr.pgid >= 0)
+            setpgid(pid, attr.pgid == 0 ? pid : attr.pgid);
+    } else {
+        perror("fork() failed");
+    }
+    return pid;
+}
+
+int metash_spawnmode(const vector<string>& tokens) {
+    size_t num_tokens = tokens.size();
+    if (num_tokens >= 3) {
+        printf("spawnmode: too many arguments\n");
+        return -1;
+    }
+
+    if (num_tokens == 1) {
+        printf("%s\n", spawn_mode == SPAWN_FORK ? "fork" : "posix");
+        return 0;
+    }
+
+    if (tokens[1] == "posix") {
+        spawn_mode = SPAWN_POSIX;
+    } else if (tokens[1] == "fork") {
+        spawn_mode = SPAWN_FORK;
+    } else {
+        printf("spawnmode: unknown mode %s (expected posix or fork)\n", tokens[1].c_str());
+        return -1;
+    }
+    return 0;
+}
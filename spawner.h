@@ -0,0 +1,99 @@
+#ifndef SPAWNER_H_
+#define SPAWNER_H_
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#define SPAWN_POSIX 0
+#define SPAWN_FORK 1
+
+/*
+	spawn_mode: int
+		Selects how external commands are launched. SPAWN_POSIX (the default) uses `posix_spawn`,
+		which glibc implements with clone(CLONE_VM|CLONE_VFORK) so the shell's page tables are never
+		copied. SPAWN_FORK uses the classic fork/exec path through `metash_execute`
+		Switched at runtime with the `spawnmode` builtin
+*/
+extern int spawn_mode;
+
+/*
+	struct spawnAttributes
+	Describe how the child process should be set up before the executable is run
+	------------------
+	Members:
+		inputFD: int -> Duplicated onto STDIN_FILENO in the child. -1 keeps the shell's stdin
+		outputFD: int -> Duplicated onto STDOUT_FILENO in the child. -1 keeps the shell's stdout
+		errorFD: int -> Duplicated onto STDERR_FILENO in the child. -1 keeps the shell's stderr
+		closeFDs: vector<int> -> Descriptors closed in the child (usually the unused pipe ends)
+		pgid: pid_t -> Process group of the child. -1 inherits the shell's group, 0 starts a new
+			group led by the child and anything else joins that group
+		assignments: vector<string> -> NAME=value strings added to the environment of the child,
+			from a `NAME=value command` prefix. The shell's variables are not changed
+	------------------
+*/
+struct spawnAttributes {
+    int inputFD = -1;
+    int outputFD = -1;
+    int errorFD = -1;
+    std::vector<int> closeFDs;
+    pid_t pgid = -1;
+    std::vector<std::string> assignments;
+};
+
+/*
+	int parseRedirections(vector<string> &tokens, string &inputFile, string &outputFile)
+	------------------
+	Remove the `<` and `>` tokens along with their file names from tokens, and store the file names
+	in inputFile and outputFile (left empty if there is no such redirection)
+	Returns 0 on success and -1 if a redirection is missing its file name
+*/
+int parseRedirections(std::vector<std::string>& tokens, std::string& inputFile,
+                      std::string& outputFile);
+
+/*
+	pid_t metash_spawn(vector<string> tokens, const spawnAttributes &attr)
+	------------------
+	Launch the command described by tokens in a new process and return its pid, without waiting
+
+	Parameters:
+	------------------
+	tokens: vector<string>
+		Program name followed by its arguments. `<` and `>` redirections are applied in the child,
+		after the descriptors in attr, so a file redirection wins over a pipe
+	attr: spawnAttributes
+		Descriptors and process group to set up in the child
+
+	With SPAWN_POSIX, the pipe `dup2`s and the redirections are expressed as posix_spawn file actions
+	and no copy of the shell is ever made. With SPAWN_FORK, the child is forked, sets up descriptors
+	by hand and calls `metash_execute`
+	Returns -1 and prints an error if the process could not be started
+*/
+pid_t metash_spawn(std::vector<std::string> tokens, const spawnAttributes& attr);
+
+/*
+	pid_t spawnBuiltin(int index, vector<string> tokens, const spawnAttributes &attr)
+	------------------
+	Run the builtin at index in the `builtins` table in a forked child, set up like `metash_spawn`
+	does for external commands. Used for builtins that are a stage of a pipeline, so `ls | parallel`
+	works. `<` and `>` are applied in the child. The child exits with 0 if the builtin succeeded
+*/
+pid_t spawnBuiltin(int index, std::vector<std::string> tokens, const spawnAttributes& attr);
+
+/*
+	void resetSignals()
+	------------------
+	Give a forked child of the shell the default signal dispositions and an empty signal mask
+*/
+void resetSignals();
+
+/*
+	int metash_spawnmode(const vector<string> &tokens)
+	------------------
+	Builtin to show or switch the process launch engine. `spawnmode` prints the current mode,
+	`spawnmode posix` and `spawnmode fork` select one
+*/
+int metash_spawnmode(const std::vector<std::string>& tokens);
+
+#endif // SPAWNER_H_
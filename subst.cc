@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "jobs.h"
+#include "rc.h"
+#include "registry.h"
+#include "spawner.h"
+#include "subst.h"
+#include "tokenizer.h"
+#include "vars.h"
+
+using namespace std;
+
+unsigned long substitutions_run = 0;
+
+// Runs a line of the shell, set by `enableSubstitution`
+static int (*run_line)(char* line, bool tailExec) = NULL;
+
+// Builtins that only print, and leave the shell as it was. Native commands are added to them
+static const char* const printing_builtins[] = {"pwd", "getenv", "vars", "help", "jobs", "memstat"};
+
+/*
+	struct captureBuffer
+	Output of a command as it is read, in memory from malloc
+	------------------
+	Members:
+		data: char * -> The bytes read so far
+		size: size_t -> Number of bytes read
+		capacity: size_t -> Size of data. Starts at CAPTURE_INITIAL and doubles when full
+	------------------
+*/
+struct captureBuffer {
+    char* data;
+    size_t size;
+    size_t capacity;
+};
+
+// Make room for at least more bytes after the end of the buffer
+static void captureReserve(captureBuffer& buffer, size_t more) {
+    if (buffer.size + more <= buffer.capacity)
+        return;
+    size_t capacity = buffer.capacity ? buffer.capacity : CAPTURE_INITIAL;
+    while (capacity < buffer.size + more)
+        capacity *= 2;
+    char* grown = (char*)realloc(buffer.data, capacity);
+    if (grown == NULL) {
+        perror("Command substitution");
+        exit(EXIT_FAILURE);
+    }
+    buffer.data = grown;
+    buffer.capacity = capacity;
+}
+
+void enableSubstitution(int (*run)(char* line, bool tailExec)) {
+    run_line = run;
+    command_substitution = captureCommand;
+}
+
+// True if the line is a single builtin that can print into the shell's own stdout
+static bool runsInShell(string text) {
+    vector<string> tokens = tokenize(&text[0]);
+    if (tokens.empty() || tokens.back() == "&" || isAssignment(tokens[0]))
+        return false;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens[i] == "|")
+            return false;
+    }
+    expandAlias(tokens);
+    int index = selectBuiltin(tokens, true);
+    if (index < 0)
+        return false;
+    if (builtins[index].native)
+        return true;
+    for (size_t i = 0; i < sizeof(printing_builtins) / sizeof(printing_builtins[0]); i++) {
+        if (strcmp(builtins[index].command, printing_builtins[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Run text in the shell with stdout on a memfd, and read it back. Returns its status, or -1 if the
+// memfd could not be set up
+static int captureInShell(string& text, captureBuffer& buffer) {
+    int fd = memfd_create("metash-capture", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (saved < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+        if (saved >= 0)
+            close(saved);
+        close(fd);
+        return -1;
+    }
+
+    int status = run_line(&text[0], false);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        captureReserve(buffer, st.st_size);
+        ssize_t n;
+        while ((n = pread(fd, buffer.data + buffer.size, st.st_size - buffer.size, buffer.size)) > 0)
+            buffer.size += n;
+    }
+    close(fd);
+    return status;
+}
+
+// Run text in a forked copy of the shell and read its stdout from a pipe until it exits. Returns
+// its status
+static int captureForked(string& text, captureBuffer& buffer) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("Command substitution");
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Command substitution");
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+
+    if (pid == 0) {
+        // The copy only runs commands: it takes no terminal and keeps no job table of its own
+        resetSignals();
+        job_control = false;
+        close(fds[0]);
+        if (dup2(fds[1], STDOUT_FILENO) < 0)
+            _exit(EXIT_FAILURE);
+        close(fds[1]);
+        int status = run_line(&text[0], true);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    close(fds[1]);
+    while (true) {
+        captureReserve(buffer, 1);
+        ssize_t n = read(fds[0], buffer.data + buffer.size, buffer.capacity - buffer.size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        buffer.size += n;
+    }
+    close(fds[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+char* captureCommand(const char* command, size_t len, size_t& outputLen) {
+    string text(command, len);
+    captureBuffer buffer = {NULL, 0, 0};
+    int status = runsInShell(text) ? captureInShell(text, buffer) : -1;
+    if (status < 0)
+        status = captureForked(text, buffer);
+    last_status = status;
+    substitutions_run++;
+
+    // NUL bytes cannot be part of an argument, and trailing newlines are dropped
+    size_t w = 0;
+    for (size_t i = 0; i < buffer.size; i++) {
+        if (buffer.data[i] != '\0')
+            buffer.data[w++] = buffer.data[i];
+    }
+    while (w > 0 && buffer.data[w - 1] == '\n')
+        w--;
+    outputLen = w;
+    if (w == 0) {
+        free(buffer.data);
+        return NULL;
+    }
+    return buffer.data;
+}
@@ -0,0 +1,47 @@
+#ifndef SUBST_H_
+#define SUBST_H_
+
+#include <stddef.h>
+
+#define CAPTURE_INITIAL 4096  // First size of the buffer output is captured in, doubled when full
+
+/*
+	Command substitution
+	------------------
+	`$(command)` and `` `command` `` are replaced by what command prints on stdout, without its
+	trailing newlines (see tokenizer.h for how the output becomes tokens). command is a whole line:
+	it can be a pipeline, and hold substitutions of its own
+
+	When command is a single builtin that only prints, like `pwd` or `getenv`, or a native command
+	(see native.h), it runs in the shell with stdout moved to a memfd, and no process is created.
+	Anything else runs in a forked copy of the shell writing to a pipe, which execs the last
+	external command in its place, as with `shell -c`. The shell reads the pipe into a buffer of
+	CAPTURE_INITIAL bytes that doubles whenever it is full. Either way, a `cd` or an assignment in
+	command does not change the shell
+*/
+
+/*
+	substitutions_run: unsigned long
+		Number of command substitutions run so far. A line of assignments alone that ran one exits
+		with its status, which is also in `last_status` (see vars.h)
+*/
+extern unsigned long substitutions_run;
+
+/*
+	void enableSubstitution(int (*run)(char *line, bool tailExec))
+	------------------
+	Turn on command substitution in the tokenizer, running commands with run (`executeLine`)
+*/
+void enableSubstitution(int (*run)(char* line, bool tailExec));
+
+/*
+	char *captureCommand(const char *command, size_t len, size_t &outputLen)
+	------------------
+	Run the len bytes of command and capture its stdout, for the tokenizer. NUL bytes are dropped,
+	and trailing newlines removed
+	Returns the output in a buffer from malloc, to be freed by the caller, and sets outputLen. NULL
+	if nothing was printed
+*/
+char* captureCommand(const char* command, size_t len, size_t& outputLen);
+
+#endif // SUBST_H_
@@ -0,0 +1,536 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <deque>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "native.h"
+#include "tee.h"
+#include "vars.h"
+
+using namespace std;
+
+/*
+	struct teeTarget
+	------------------
+	Members:
+		name: string -> File name, for messages
+		fd: int -> Descriptor written to
+		ordered: bool -> Written at the current position, one buffer at a time (pipes, terminals,
+			files opened to append). The others are written at offsets from start
+		start: off_t -> Offset of the first byte of input in the file
+		queue: deque<int> -> Buffers waiting to be written, oldest first
+		inflight: int -> Writes submitted and not completed
+		failed: bool -> Dropped after an error
+		bytes: unsigned long long -> Bytes written
+		finished: double -> When the last write completed
+	------------------
+*/
+struct teeTarget {
+    string name;
+    int fd;
+    bool ordered;
+    off_t start;
+    deque<int> queue;
+    int inflight;
+    bool failed;
+    unsigned long long bytes;
+    double finished;
+};
+
+/*
+	struct teeBuffer
+	------------------
+	Members:
+		data: char * -> TEE_BUFFER_SIZE bytes
+		size: size_t -> Bytes of input it holds
+		position: unsigned long long -> Offset of its first byte in the input
+		refs: int -> Targets that have not written all of it yet
+	------------------
+*/
+struct teeBuffer {
+    char* data;
+    size_t size;
+    unsigned long long position;
+    int refs;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool parseTee(const vector<string>& args, teeOptions& opt) {
+    bool options = true;
+    for (size_t i = 1; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (options && arg == "--") {
+            options = false;
+        } else if (options && (arg == "-a" || arg == "--append")) {
+            opt.append = true;
+        } else if (options && arg == "--stats") {
+            opt.stats = true;
+        } else if (arg == "-" || (options && arg[0] == '-')) {
+            return false;
+        } else {
+            opt.files.push_back(arg);
+        }
+    }
+    return true;
+}
+
+static void dropTarget(teeTarget& target, int error) {
+    if (error != EPIPE)
+        fprintf(stderr, "tee: %s: %s\n", target.name.c_str(), strerror(error));
+    target.failed = true;
+}
+
+/*
+	Read stdin into data until it is full, the input ends or nothing more is ready. If block is
+	false, nothing is read unless some input is ready. Returns the bytes read, or -1 on error
+*/
+static ssize_t fillBuffer(char* data, size_t size, bool block, bool& eof) {
+    size_t filled = 0;
+    while (filled < size) {
+        if (filled > 0 || !block) {
+            struct pollfd ready = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&ready, 1, 0) <= 0)
+                break;
+        }
+        ssize_t n = read(STDIN_FILENO, data + filled, size - filled);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return filled > 0 ? (ssize_t)filled : -1;
+        if (n == 0) {
+            eof = true;
+            break;
+        }
+        filled += n;
+    }
+    return filled;
+}
+
+/*
+	io_uring
+	------------------
+	The rings are set up with the raw system calls and mapped by hand, as in the kernel's
+	documentation. The shell only needs writes, which the kernel headers are enough for
+*/
+struct uringQueue {
+    int fd;
+    unsigned entries;
+    unsigned features;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+};
+
+static int uringSetup(uringQueue& ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd < 0)
+        return -1;
+    ring.entries = params.sq_entries;
+    ring.features = params.features;
+
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        ring.sq_ring_size = ring.cq_ring_size = max(ring.sq_ring_size, ring.cq_ring_size);
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_ring = single ? ring.sq_ring
+                          : mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQES);
+    if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring.fd);
+        return -1;
+    }
+
+    char* sq = (char*)ring.sq_ring;
+    char* cq = (char*)ring.cq_ring;
+    ring.sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring.sqes = (struct io_uring_sqe*)sqes;
+    ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uringClose(uringQueue& ring) {
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ring != ring.sq_ring)
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+}
+
+// The next free submission entry, cleared, or NULL if the queue is full
+static struct io_uring_sqe* uringNext(uringQueue& ring) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.entries)
+        return NULL;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+    return sqe;
+}
+
+// Submit the queued entries, and wait for a completion if wait is set. Returns 0, or an errno value
+static int uringEnter(uringQueue& ring, bool wait) {
+    while (true) {
+        int n = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            ring.to_submit -= n;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return errno;
+        if (errno != EINTR)
+            wait = true;
+    }
+}
+
+/*
+	Copy stdin to the targets through the ring. Returns 0, 1 after an error, 130 after Ctrl-C, or
+	-1 if the ring could not be set up, before any input was read
+*/
+static int teeUring(vector<teeTarget>& targets, const char*& engine) {
+    uringQueue ring;
+    if (uringSetup(ring, TEE_RING_ENTRIES) < 0)
+        return -1;
+    // Appends and pipes are written at the current position, offset -1
+    if (!(ring.features & IORING_FEAT_RW_CUR_POS)) {
+        uringClose(ring);
+        return -1;
+    }
+
+    vector<char> memory((size_t)TEE_BUFFERS * TEE_BUFFER_SIZE);
+    vector<teeBuffer> buffers(TEE_BUFFERS);
+    vector<struct iovec> iovecs(TEE_BUFFERS);
+    vector<int> free_buffers;
+    for (int b = TEE_BUFFERS - 1; b >= 0; b--) {
+        buffers[b].data = &memory[(size_t)b * TEE_BUFFER_SIZE];
+        iovecs[b].iov_base = buffers[b].data;
+        iovecs[b].iov_len = TEE_BUFFER_SIZE;
+        free_buffers.push_back(b);
+    }
+
+    // Registering pins the buffers and descriptors once, instead of at every write. Both are
+    // optional, a limit on locked memory only costs the pinning per write
+    bool fixedBuffers = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+                                iovecs.data(), TEE_BUFFERS) == 0;
+    vector<int> fds;
+    for (size_t t = 0; t < targets.size(); t++)
+        fds.push_back(targets[t].fd);
+    bool fixedFiles = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, fds.data(),
+                              fds.size()) == 0;
+    engine = fixedBuffers ? "io_uring, registered buffers" : "io_uring";
+
+    // Bytes of each buffer written to each target so far
+    vector<size_t> progress(targets.size() * TEE_BUFFERS, 0);
+    unsigned long long total = 0;
+    size_t live = targets.size();
+    bool eof = false;
+    int status = 0;
+
+    auto release = [&](int b) {
+        if (--buffers[b].refs == 0)
+            free_buffers.push_back(b);
+    };
+    auto fail = [&](size_t t, int error) {
+        dropTarget(targets[t], error);
+        if (error != EPIPE)
+            status = 1;
+        live--;
+        while (!targets[t].queue.empty()) {
+            release(targets[t].queue.front());
+            targets[t].queue.pop_front();
+        }
+    };
+
+    while (true) {
+        if (!eof && nativeInterrupted()) {
+            eof = true;
+            status = 130;
+        }
+
+        // Read when a buffer is free, and hand it to every target that is still writing
+        if (!eof && live > 0 && !free_buffers.empty()) {
+            int b = free_buffers.back();
+            ssize_t n = fillBuffer(buffers[b].data, TEE_BUFFER_SIZE, true, eof);
+            if (n < 0) {
+                perror("tee: read error");
+                status = 1;
+                eof = true;
+            } else if (n > 0) {
+                free_buffers.pop_back();
+                buffers[b].size = n;
+                buffers[b].position = total;
+                buffers[b].refs = live;
+                total += n;
+                for (size_t t = 0; t < targets.size(); t++) {
+                    if (!targets[t].failed)
+                        targets[t].queue.push_back(b);
+                }
+            }
+        }
+
+        // Queue the writes each target may have in flight
+        bool inflight = false;
+        for (size_t t = 0; t < targets.size(); t++) {
+            teeTarget& target = targets[t];
+            int limit = target.ordered ? 1 : TEE_BUFFERS;
+            while (!target.failed && !target.queue.empty() && target.inflight < limit) {
+                struct io_uring_sqe* sqe = uringNext(ring);
+                if (!sqe)
+                    break;
+                int b = target.queue.front();
+                target.queue.pop_front();
+                size_t done = progress[t * TEE_BUFFERS + b];
+                sqe->opcode = fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                sqe->fd = fixedFiles ? t : target.fd;
+                sqe->flags = fixedFiles ? IOSQE_FIXED_FILE : 0;
+                sqe->addr = (uint64_t)(uintptr_t)(buffers[b].data + done);
+                sqe->len = buffers[b].size - done;
+                sqe->off = target.ordered ? (uint64_t)-1 : target.start + buffers[b].position + done;
+                sqe->buf_index = b;
+                sqe->user_data = t * TEE_BUFFERS + b;
+                target.inflight++;
+            }
+            inflight = inflight || target.inflight > 0;
+        }
+        if (!inflight && (eof || live == 0))
+            break;
+
+        // Only wait for writes when there is nothing to read into, or nothing left to read
+        bool wait = inflight && (eof || live == 0 || free_buffers.empty());
+        int error = uringEnter(ring, wait);
+        if (error) {
+            fprintf(stderr, "tee: io_uring: %s\n", strerror(error));
+            status = 1;
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            size_t t = cqe->user_data / TEE_BUFFERS;
+            int b = cqe->user_data % TEE_BUFFERS;
+            teeTarget& target = targets[t];
+            size_t& done = progress[t * TEE_BUFFERS + b];
+            target.inflight--;
+
+            if (target.failed) {
+                release(b);
+            } else if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                target.queue.push_front(b);
+            } else if (cqe->res <= 0) {
+                release(b);
+                fail(t, cqe->res < 0 ? -cqe->res : EIO);
+            } else {
+                done += cqe->res;
+                target.bytes += cqe->res;
+                target.finished = now();
+                // A short write goes again from where it stopped, before the next buffer
+                if (done < buffers[b].size) {
+                    target.queue.push_front(b);
+                } else {
+                    done = 0;
+                    release(b);
+                }
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uringClose(ring);
+    return status;
+}
+
+/*
+	Copy stdin to the targets with pwritev, the buffers ready at once in one call per target.
+	Returns 0, 1 after an error or 130 after Ctrl-C
+*/
+static int teeVectored(vector<teeTarget>& targets) {
+    vector<char> memory((size_t)TEE_BUFFERS * TEE_BUFFER_SIZE);
+    struct iovec iovecs[TEE_BUFFERS];
+    unsigned long long total = 0;
+    size_t live = targets.size();
+    bool eof = false;
+    int status = 0;
+
+    while (!eof && live > 0) {
+        if (nativeInterrupted())
+            return 130;
+
+        int count = 0;
+        size_t bytes = 0;
+        while (count < TEE_BUFFERS && !eof) {
+            char* data = &memory[(size_t)count * TEE_BUFFER_SIZE];
+            ssize_t n = fillBuffer(data, TEE_BUFFER_SIZE, count == 0, eof);
+            if (n < 0) {
+                perror("tee: read error");
+                status = 1;
+                eof = true;
+            }
+            if (n <= 0)
+                break;
+            iovecs[count].iov_base = data;
+            iovecs[count].iov_len = n;
+            count++;
+            bytes += n;
+            if (n < TEE_BUFFER_SIZE)
+                break;
+        }
+
+        for (size_t t = 0; t < targets.size() && count > 0; t++) {
+            teeTarget& target = targets[t];
+            if (target.failed)
+                continue;
+            struct iovec left[TEE_BUFFERS];
+            memcpy(left, iovecs, sizeof(struct iovec) * count);
+            struct iovec* iov = left;
+            int iovcnt = count;
+            size_t written = 0;
+            while (written < bytes) {
+                ssize_t n = target.ordered
+                                ? writev(target.fd, iov, iovcnt)
+                                : pwritev(target.fd, iov, iovcnt, target.start + total + written);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    dropTarget(target, n < 0 ? errno : EIO);
+                    if (errno != EPIPE)
+                        status = 1;
+                    live--;
+                    break;
+                }
+                written += n;
+                target.bytes += n;
+                while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+                    n -= iov->iov_len;
+                    iov++;
+                    iovcnt--;
+                }
+                if (iovcnt > 0) {
+                    iov->iov_base = (char*)iov->iov_base + n;
+                    iov->iov_len -= n;
+                }
+            }
+            target.finished = now();
+        }
+        total += bytes;
+    }
+    return status;
+}
+
+// From the shell's variables, as `export METASH_IO_URING=0` does not reach the shell's environ
+static bool uringAllowed() {
+    const string* value = findVariable("METASH_IO_URING");
+    return value == NULL || *value != "0";
+}
+
+int nativeTee(const vector<string>& args) {
+    teeOptions opt;
+    if (!parseTee(args, opt)) {
+        fprintf(stderr, "tee: unsupported arguments\n");
+        return 1;
+    }
+
+    // stdout first, then the files in order
+    vector<teeTarget> targets;
+    int status = 0;
+    fflush(stdout);
+    for (size_t i = 0; i <= opt.files.size(); i++) {
+        teeTarget target = {};
+        target.name = i == 0 ? "standard output" : opt.files[i - 1];
+        target.fd = i == 0 ? STDOUT_FILENO
+                           : open(opt.files[i - 1].c_str(),
+                                  O_WRONLY | O_CREAT | O_CLOEXEC | (opt.append ? O_APPEND : O_TRUNC),
+                                  0666);
+        if (target.fd < 0) {
+            fprintf(stderr, "tee: %s: %s\n", target.name.c_str(), strerror(errno));
+            status = 1;
+            continue;
+        }
+        struct stat st;
+        int flags = fcntl(target.fd, F_GETFL);
+        target.start = lseek(target.fd, 0, SEEK_CUR);
+        target.ordered = fstat(target.fd, &st) < 0 || !S_ISREG(st.st_mode) || target.start < 0 ||
+                         flags < 0 || (flags & O_APPEND);
+        targets.push_back(target);
+    }
+
+    double start = now();
+    const char* engine = "pwritev";
+    int ret = uringAllowed() ? teeUring(targets, engine) : -1;
+    if (ret < 0) {
+        engine = "pwritev";
+        ret = teeVectored(targets);
+    }
+    if (ret != 0)
+        status = ret;
+
+    for (size_t t = 0; t < targets.size(); t++) {
+        // Positioned writes leave the file offset alone, others may write to the file after us
+        if (!targets[t].ordered)
+            lseek(targets[t].fd, targets[t].start + targets[t].bytes, SEEK_SET);
+        if (targets[t].fd != STDOUT_FILENO)
+            close(targets[t].fd);
+    }
+
+    if (opt.stats) {
+        fprintf(stderr, "tee: %zu targets, %s\n", targets.size(), engine);
+        for (size_t t = 0; t < targets.size(); t++) {
+            double seconds = targets[t].bytes > 0 ? targets[t].finished - start : 0;
+            fprintf(stderr, "tee: %s: %llu bytes in %.3f s, %.1f MiB/s%s\n",
+                    targets[t].name.c_str(), targets[t].bytes, seconds,
+                    seconds > 0 ? targets[t].bytes / seconds / (1 << 20) : 0.0,
+                    targets[t].failed ? " (dropped)" : "");
+        }
+    }
+    return status;
+}
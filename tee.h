@@ -0,0 +1,65 @@
+#ifndef TEE_H_
+#define TEE_H_
+
+#include <string>
+#include <vector>
+
+#define TEE_BUFFERS 8                  // Buffers of input in flight at once
+#define TEE_BUFFER_SIZE (256 * 1024)   // Bytes of input per buffer
+#define TEE_RING_ENTRIES 256           // Submission queue entries of the io_uring
+
+/*
+	Native tee
+	------------------
+	`tee [-a] [--stats] file...` copies stdin to stdout and to every file, like the GNU tool, and is
+	a native command (see native.h): it runs in the shell, or in a forked shell as a pipeline stage
+
+	Input is read into TEE_BUFFERS buffers of TEE_BUFFER_SIZE bytes. A read takes what the pipe
+	has and goes on reading while more is ready, so a saturated pipe fills whole buffers while a
+	slow producer is copied as it comes. Each buffer is written to every target through io_uring:
+	the buffers and the descriptors are registered with the ring once, and one submission queues a
+	fixed-buffer write per target. Writes to a regular file carry their own offset and go out in any
+	order, several buffers at a time. Writes to pipes, terminals and files opened with -a append at
+	the current position, one at a time per target so the bytes stay in order. A buffer is reused
+	once every target has written all of it, and reading waits when none is free
+
+	When io_uring is not available (old kernels, seccomp, or METASH_IO_URING=0), the buffers that
+	are ready are written to each target in turn with one `pwritev` (`writev` for the targets
+	without offsets)
+
+	A target that fails is reported and dropped, and tee goes on with the others and exits with 1.
+	A closed pipe is dropped without a message. With --stats, the bytes written to each target and
+	the throughput are printed on stderr at the end
+*/
+
+/*
+	struct teeOptions
+	------------------
+	Members:
+		append: bool -> -a, append to the files instead of truncating them
+		stats: bool -> --stats, report bytes and throughput per target
+		files: vector<string> -> The files to write, besides stdout
+	------------------
+*/
+struct teeOptions {
+    bool append = false;
+    bool stats = false;
+    std::vector<std::string> files;
+};
+
+/*
+	bool parseTee(const vector<string> &args, teeOptions &opt)
+	------------------
+	Parse the arguments of `tee` into opt. False for a flag the native tee does not implement, or a
+	file named `-`, which are left to the external command
+*/
+bool parseTee(const std::vector<std::string>& args, teeOptions& opt);
+
+/*
+	int nativeTee(const vector<string> &args)
+	------------------
+	Run `tee` with the shell's stdin and stdout. Returns its exit status
+*/
+int nativeTee(const std::vector<std::string>& args);
+
+#endif // TEE_H_
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "registry.h"
+#include "timing.h"
+
+using namespace std;
+
+/*
+	struct timingRow
+	One line of a timing report, for a single stage or for the whole job
+*/
+struct timingRow {
+    string label;
+    string command;
+    pid_t pid;
+    int status;
+    double real;
+    double user;
+    double sys;
+    long maxrss;
+    long majflt;
+    long minflt;
+    long nvcsw;
+    long nivcsw;
+    long inblock;
+    long oublock;
+};
+
+static double seconds(const struct timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; }
+
+static double elapsed(const struct timespec& start, const struct timespec& end) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static int exitCode(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 0;
+}
+
+static void addUsage(timingRow& row, const struct rusage& usage) {
+    row.user += seconds(usage.ru_utime);
+    row.sys += seconds(usage.ru_stime);
+    row.maxrss = max(row.maxrss, usage.ru_maxrss);
+    row.majflt += usage.ru_majflt;
+    row.minflt += usage.ru_minflt;
+    row.nvcsw += usage.ru_nvcsw;
+    row.nivcsw += usage.ru_nivcsw;
+    row.inblock += usage.ru_inblock;
+    row.oublock += usage.ru_oublock;
+}
+
+static timingRow emptyRow(const string& label, const string& command, pid_t pid) {
+    timingRow row;
+    row.label = label;
+    row.command = command;
+    row.pid = pid;
+    row.status = 0;
+    row.real = row.user = row.sys = 0;
+    row.maxrss = row.majflt = row.minflt = row.nvcsw = row.nivcsw = row.inblock = row.oublock = 0;
+    return row;
+}
+
+// Quote text as a JSON string
+static string jsonString(const string& text) {
+    string quoted = "\"";
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+static void printJSONFields(const timingRow& row) {
+    fprintf(stderr,
+            "\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+            "\"majflt\":%ld,\"minflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,\"inblock\":%ld,"
+            "\"oublock\":%ld",
+            row.status, row.real, row.user, row.sys, row.maxrss, row.majflt, row.minflt, row.nvcsw,
+            row.nivcsw, row.inblock, row.oublock);
+}
+
+static void printHumanRow(const timingRow& row) {
+    char real[16], user[16], sys[16], rss[24];
+    snprintf(real, sizeof(real), "%.3fs", row.real);
+    snprintf(user, sizeof(user), "%.3fs", row.user);
+    snprintf(sys, sizeof(sys), "%.3fs", row.sys);
+    snprintf(rss, sizeof(rss), "%ldK", row.maxrss);
+    fprintf(stderr, "%-6s %4d %9s %9s %9s %9s %7ld %8ld %7ld %7ld %7ld %7ld  %s\n",
+            row.label.c_str(), row.status, real, user, sys, rss, row.majflt, row.minflt, row.nvcsw,
+            row.nivcsw, row.inblock, row.oublock, row.command.c_str());
+}
+
+static void printReport(const vector<timingRow>& stages, const timingRow& total, int format) {
+    // Builtins write to a buffered stdout, and their output comes before the report
+    fflush(stdout);
+    if (format == TIME_JSON) {
+        fprintf(stderr, "{\"command\":%s,", jsonString(total.command).c_str());
+        printJSONFields(total);
+        fprintf(stderr, ",\"stages\":[");
+        for (size_t i = 0; i < stages.size(); i++) {
+            fprintf(stderr, "%s{\"pid\":%d,\"command\":%s,", i == 0 ? "" : ",", stages[i].pid,
+                    jsonString(stages[i].command).c_str());
+            printJSONFields(stages[i]);
+            fprintf(stderr, "}");
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-6s %4s %9s %9s %9s %9s %7s %8s %7s %7s %7s %7s  %s\n", "stage", "exit",
+            "real", "user", "sys", "maxrss", "majflt", "minflt", "vcsw", "ivcsw", "inblk",
+            "oublk", "command");
+    // A single command is its own total
+    if (stages.size() > 1) {
+        for (size_t i = 0; i < stages.size(); i++)
+            printHumanRow(stages[i]);
+    }
+    printHumanRow(total);
+}
+
+void reportTiming(const job& j, int format) {
+    if (j.stages.empty())
+        return;
+
+    vector<timingRow> stages;
+    timingRow total = emptyRow("total", j.command, j.pgid);
+    struct timespec last = j.started;
+
+    for (size_t i = 0; i < j.stages.size(); i++) {
+        const jobStage& stage = j.stages[i];
+        timingRow row = emptyRow(to_string(i + 1), stage.command, stage.pid);
+        row.status = exitCode(stage.status);
+        row.real = elapsed(stage.started, stage.finished);
+        addUsage(row, stage.usage);
+        addUsage(total, stage.usage);
+        stages.push_back(row);
+
+        if (elapsed(last, stage.finished) > 0)
+            last = stage.finished;
+    }
+    total.status = stages.back().status;
+    total.real = elapsed(j.started, last);
+
+    printReport(stages, total, format);
+}
+
+int parseTimePrefix(vector<string>& tokens) {
+    if (tokens.empty() || tokens[0] != "time")
+        return TIME_OFF;
+
+    int format = TIME_HUMAN;
+    size_t skip = 1;
+    if (tokens.size() > 1 && tokens[1] == "-j") {
+        format = TIME_JSON;
+        skip = 2;
+    }
+    tokens.erase(tokens.begin(), tokens.begin() + skip);
+    return format;
+}
+
+int timeBuiltin(int index, vector<string> tokens, int format) {
+    string command;
+    for (size_t i = 0; i < tokens.size(); i++)
+        command += (i > 0 ? " " : "") + tokens[i];
+
+    struct rusage selfBefore, childBefore, selfAfter, childAfter;
+    struct timespec start, end;
+    getrusage(RUSAGE_SELF, &selfBefore);
+    getrusage(RUSAGE_CHILDREN, &childBefore);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int ret = runBuiltin(index, tokens);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &selfAfter);
+    getrusage(RUSAGE_CHILDREN, &childAfter);
+
+    timingRow total = emptyRow("total", command, getpid());
+    total.status = ret;
+    total.real = elapsed(start, end);
+    total.user = seconds(selfAfter.ru_utime) - seconds(selfBefore.ru_utime) +
+                 seconds(childAfter.ru_utime) - seconds(childBefore.ru_utime);
+    total.sys = seconds(selfAfter.ru_stime) - seconds(selfBefore.ru_stime) +
+                seconds(childAfter.ru_stime) - seconds(childBefore.ru_stime);
+    total.maxrss = selfAfter.ru_maxrss;
+    total.majflt = selfAfter.ru_majflt - selfBefore.ru_majflt + childAfter.ru_majflt -
+                   childBefore.ru_majflt;
+    total.minflt = selfAfter.ru_minflt - selfBefore.ru_minflt + childAfter.ru_minflt -
+                   childBefore.ru_minflt;
+    total.nvcsw =
+        selfAfter.ru_nvcsw - selfBefore.ru_nvcsw + childAfter.ru_nvcsw - childBefore.ru_nvcsw;
+    total.nivcsw =
+        selfAfter.ru_nivcsw - selfBefore.ru_nivcsw + childAfter.ru_nivcsw - childBefore.ru_nivcsw;
+    total.inblock = selfAfter.ru_inblock - selfBefore.ru_inblock + childAfter.ru_inblock -
+                    childBefore.ru_inblock;
+    total.oublock = selfAfter.ru_oublock - selfBefore.ru_oublock + childAfter.ru_oublock -
+                    childBefore.ru_oublock;
+
+    vector<timingRow> stages(1, total);
+    stages[0].label = "1";
+    printReport(stages, total, format);
+    return ret;
+}
@@ -0,0 +1,48 @@
+#ifndef TIMING_H_
+#define TIMING_H_
+
+#include <string>
+#include <vector>
+
+#include "jobs.h"
+
+#define TIME_OFF 0
+#define TIME_HUMAN 1
+#define TIME_JSON 2
+
+/*
+	int parseTimePrefix(vector<string> &tokens)
+	------------------
+	Recognize the `time` keyword at the start of a command line
+
+		time [-j] command [| command ...]
+
+	The keyword and its option are removed from tokens, leaving the command to run
+	Returns TIME_OFF if the line does not start with `time`, else TIME_HUMAN, or TIME_JSON with -j
+*/
+int parseTimePrefix(std::vector<std::string>& tokens);
+
+/*
+	void reportTiming(const job &j, int format)
+	------------------
+	Print what a finished job used to stderr: wall, user and sys time, max RSS, page faults,
+	context switches and block I/O. A pipeline gets one row per stage (from the rusage `wait4`
+	returned for it) and a total row, where times and counters are summed, max RSS is that of the
+	largest stage and wall time runs from the start of the job to the end of its last stage
+
+	TIME_HUMAN prints a table, TIME_JSON prints one JSON object on a single line, so reports can be
+	appended to a file and read line by line
+*/
+void reportTiming(const job& j, int format);
+
+/*
+	int timeBuiltin(int index, vector<string> tokens, int format)
+	------------------
+	Run the builtin at index in the shell process and report its usage like `reportTiming`. As the
+	builtin has no process of its own, the usage is the difference of `getrusage` for the shell and
+	its children before and after it ran, and max RSS is that of the shell
+	Returns the exit status of the builtin (0 or 1)
+*/
+int timeBuiltin(int index, std::vector<std::string> tokens, int format);
+
+#endif // TIMING_H_
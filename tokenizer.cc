@@ -1,95 +1,358 @@
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "tokenizer.h"
+#include "vars.h"
 
 using namespace std;
 
-vector<string> tokenize(char* line) {
-    vector<string> tokens;
-    if (line == NULL) {
-        return {};
+static const int MODE_NORMAL = 0, MODE_SQUOTE = 1, MODE_DQUOTE = 2;
+
+char* (*command_substitution)(const char* command, size_t len, size_t& outputLen) = NULL;
+
+// Characters that end a run of ordinary characters. Inside quotes only the closing quote and the
+// backslash do, and `$` and backquotes outside single quotes when variables are expanded. Glob
+// characters do outside quotes when they are flagged
+static inline bool isSpecial(char c, int mode, bool expand, bool glob) {
+    if (c == '\\' || ((c == '$' || c == '`') && expand && mode != MODE_SQUOTE))
+        return true;
+    if (mode == MODE_SQUOTE)
+        return c == '\'';
+    if (mode == MODE_DQUOTE)
+        return c == '"';
+    if (glob && (c == '*' || c == '?' || c == '['))
+        return true;
+    return c == '\'' || c == '"' || c == '|' || c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+#ifdef __SSE2__
+// Bit i is set if byte i of v is special in mode
+static inline int specialMask(__m128i v, int mode, bool expand, bool glob) {
+    __m128i mask = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+    if (expand && mode != MODE_SQUOTE) {
+        mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+        mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('`')));
+    }
+    if (mode == MODE_SQUOTE)
+        return _mm_movemask_epi8(_mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('\''))));
+    if (mode == MODE_DQUOTE)
+        return _mm_movemask_epi8(_mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))));
+
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    if (glob) {
+        mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+        mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+        mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('[')));
+    }
+    // \t to \r: moved to the bottom of the signed range, a single compare finds all five
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8(128 - '\t'));
+    mask = _mm_or_si128(mask, _mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 5)));
+    return _mm_movemask_epi8(mask);
+}
+#endif
+
+// Index of the first special character at or after i, or len
+static inline size_t findSpecial(const char* line, size_t i, size_t len, int mode, bool expand,
+                                 bool glob) {
+#ifdef __SSE2__
+    while (i + 16 <= len) {
+        int mask = specialMask(_mm_loadu_si128((const __m128i*)(line + i)), mode, expand, glob);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+#endif
+    while (i < len && !isSpecial(line[i], mode, expand, glob))
+        i++;
+    return i;
+}
+
+// Append to an arena array, moving it to one twice as large when it is full
+template <typename T>
+static void push(arena& mem, T*& array, size_t& count, size_t& capacity, const T& value) {
+    if (count == capacity) {
+        T* grown = arenaArray<T>(mem, 2 * capacity);
+        memcpy(grown, array, count * sizeof(T));
+        array = grown;
+        capacity *= 2;
+    }
+    array[count++] = value;
+}
+
+static inline bool isNameChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Length of the variable reference after a `$` at line[r], and where its name is. Returns 0 if
+// there is none, and the `$` is an ordinary character
+static size_t parseReference(const char* line, size_t r, size_t len, size_t& name,
+                             size_t& nameLen) {
+    if (r >= len)
+        return 0;
+    if (line[r] == '?' || line[r] == '$') {
+        name = r;
+        nameLen = 1;
+        return 1;
+    }
+    size_t end = r + (line[r] == '{');
+    name = end;
+    while (end < len && isNameChar(line[end]))
+        end++;
+    nameLen = end - name;
+    if (nameLen == 0 || (line[name] >= '0' && line[name] <= '9'))
+        return 0;
+    if (line[r] != '{')
+        return end - r;
+    return end < len && line[end] == '}' ? end + 1 - r : 0;
+}
+
+// True if the n bytes at text start with an assignment, NAME=
+static bool isAssignmentSpan(const char* text, size_t n) {
+    if (n == 0 || (text[0] >= '0' && text[0] <= '9'))
+        return false;
+    for (size_t i = 0; i < n; i++) {
+        if (text[i] == '=')
+            return i > 0;
+        if (!isNameChar(text[i]))
+            return false;
     }
+    return false;
+}
 
-    static char token[MAXTOKEN];
-    memset(token, '\0', MAXTOKEN);
-    size_t n = 0;
-    size_t len = strlen(line);
+// True if the token being written from dst[start] is an assignment, with only assignments before
+// it in its stage. Its value is a single word, as in `x=$(date)`
+static bool inAssignment(const char* dst, size_t start, size_t w, const tokenizedLine& out) {
+    if (!isAssignmentSpan(dst + start, w - start))
+        return false;
+    for (size_t i = out.stages[out.numStages - 1]; i < out.numTokens; i++) {
+        if (!isAssignmentSpan(dst + out.tokens[i].offset, out.tokens[i].length))
+            return false;
+    }
+    return true;
+}
 
-    const int MODE_NORMAL = 0, MODE_SQUOTE = 1, MODE_DQUOTE = 2;
+size_t closingParen(const char* line, size_t r, size_t len) {
+    int depth = 1;
+    for (; r < len; r++) {
+        char c = line[r];
+        if (c == '\\') {
+            r++;
+        } else if (c == '\'' || c == '`') {
+            const char* end = (const char*)memchr(line + r + 1, c, len - r - 1);
+            r = end ? end - line : len;
+        } else if (c == '"') {
+            for (r++; r < len && line[r] != '"'; r++) {
+                if (line[r] == '\\')
+                    r++;
+            }
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            return r;
+        }
+    }
+    return len;
+}
+
+// Index of the backquote that ends a command starting at line[r], or len. The command is stored
+// in command, where `\$`, `\`` and `\\` stand for the character after the backslash
+static size_t closingBackquote(const char* line, size_t r, size_t len, string& command) {
+    for (; r < len && line[r] != '`'; r++) {
+        if (line[r] == '\\' && r + 1 < len &&
+            (line[r + 1] == '$' || line[r + 1] == '`' || line[r + 1] == '\\'))
+            r++;
+        command += line[r];
+    }
+    return r;
+}
+
+size_t tokenizeLine(char* line, size_t len, arena& mem, tokenizedLine& out, int options) {
+    size_t tokenCapacity = 16, stageCapacity = 4;
+    bool expand = options & TOKENIZE_EXPAND;
+    bool glob = options & TOKENIZE_GLOB;
+    out.tokens = arenaArray<tokenSpan>(mem, tokenCapacity);
+    out.numTokens = 0;
+    out.stages = arenaArray<size_t>(mem, stageCapacity);
+    out.stages[0] = 0;
+    out.numStages = 1;
+
+    /*
+		Characters are read from line at r and written to dst at w <= r, leaving quotes and escapes
+		out. dst is the line itself until a variable expands to more than there is room for behind
+		r. The output then moves to a larger buffer in mem, with room for the rest of the line
+	*/
+    char* dst = line;
+    size_t capacity = len;
+    size_t r = 0, w = 0;
+    size_t start = 0;
+    int flags = 0;
+    bool inToken = false;
     int mode = MODE_NORMAL;
 
-    for (size_t i = 0; i < len; i++) {
-        char c = line[i];
-        if (mode == MODE_NORMAL) {
-            if (c == '\'') {
-                mode = MODE_SQUOTE;
-            } else if (c == '"') {
-                mode = MODE_DQUOTE;
-            } else if (c == '\\') {
-                if (i + 1 < len) {
-                    token[n++] = line[++i];
-                }
-            } else if (isspace(c)) {
-                if (n > 0) {
-                    token[n] = '\0';
-                    char* temp = (char*)malloc(n + 1);
-                    strncpy(temp, token, n + 1);
-                    string word = temp;
-                    tokens.push_back(word);
-                    n = 0;
-                    memset(token, '\0', MAXTOKEN);
-                }
-            } else {
-                token[n++] = c;
+    while (r < len) {
+        size_t next = findSpecial(line, r, len, mode, expand, glob);
+        if (next > r) {
+            if (!inToken) {
+                inToken = true;
+                start = w;
+                flags = 0;
+            }
+            if (dst + w != line + r)
+                memmove(dst + w, line + r, next - r);
+            w += next - r;
+            r = next;
+            continue;
+        }
+
+        char c = line[r++];
+        if (c == '\\' || c == '\'' || c == '"') {
+            if (!inToken) {
+                inToken = true;
+                start = w;
+                flags = 0;
             }
-        } else if (mode == MODE_SQUOTE) {
-            if (c == '\'') {
+            flags |= TOKEN_QUOTED;
+            if (c == '\\') {
+                if (r < len)
+                    dst[w++] = line[r++];
+            } else if (mode != MODE_NORMAL) {
                 mode = MODE_NORMAL;
-            } else if (c == '\\') {
-                if (i + 1 < len) {
-                    token[n++] = line[++i];
-                }
             } else {
-                token[n++] = c;
+                mode = c == '\'' ? MODE_SQUOTE : MODE_DQUOTE;
             }
-        } else if (mode == MODE_DQUOTE) {
-            if (c == '"') {
-                mode = MODE_NORMAL;
-            } else if (c == '\\') {
-                if (i + 1 < len) {
-                    token[n++] = line[++i];
-                }
+            continue;
+        }
+
+        // Only found outside quotes
+        if (c == '*' || c == '?' || c == '[') {
+            if (!inToken) {
+                inToken = true;
+                start = w;
+                flags = 0;
+            }
+            flags |= TOKEN_GLOB;
+            dst[w++] = c;
+            continue;
+        }
+
+        if (c == '$' || c == '`') {
+            // The value of a variable, or the output of a command substitution, which runs here
+            // while the rest of the line waits
+            size_t name, nameLen, valueLen = 0;
+            size_t refLen = 0;
+            const char* value;
+            char* output = NULL;
+            if (command_substitution && (c == '`' || (r < len && line[r] == '('))) {
+                string command;
+                size_t end = c == '`' ? closingBackquote(line, r, len, command)
+                                      : closingParen(line, r + 1, len);
+                if (c == '$')
+                    command.assign(line + r + 1, end - r - 1);
+                output = command_substitution(command.data(), command.size(), valueLen);
+                value = output;
+                refLen = (end < len ? end + 1 : len) - r;
             } else {
-                token[n++] = c;
+                refLen = c == '$' ? parseReference(line, r, len, name, nameLen) : 0;
+                if (refLen) {
+                    value = expandVariable(line + name, nameLen, valueLen);
+                } else {
+                    value = c == '$' ? "$" : "`";
+                    valueLen = 1;
+                }
             }
+            r += refLen;
+
+            if (dst == line ? w + valueLen > r : w + valueLen + (len - r) > capacity) {
+                capacity = 2 * (w + valueLen + (len - r));
+                char* grown = arenaArray<char>(mem, capacity + 1);
+                memcpy(grown, dst, w);
+                dst = grown;
+            }
+
+            // Inside double quotes or an assignment the value is part of the token. Outside,
+            // whitespace in the value separates tokens, and an empty value adds none
+            bool split =
+                mode == MODE_NORMAL && refLen && !(inToken && inAssignment(dst, start, w, out));
+            for (size_t i = 0; i < valueLen; i++) {
+                char v = value[i];
+                if (split && (v == ' ' || (v >= '\t' && v <= '\r'))) {
+                    if (inToken && w > start)
+                        push(mem, out.tokens, out.numTokens, tokenCapacity,
+                             tokenSpan{start, w - start, flags});
+                    inToken = false;
+                    continue;
+                }
+                if (!inToken) {
+                    inToken = true;
+                    start = w;
+                    flags = 0;
+                }
+                dst[w++] = v;
+            }
+            free(output);
+            continue;
         }
-        if (n + 1 >= MAXTOKEN)
-            abort();
-    }
 
-    if (n > 0) {
-        string temp = token;
-        tokens.push_back(temp);
-        n = 0;
+        // Whitespace or a pipe, which ends the current token. Empty tokens (like '') are dropped
+        if (inToken && w > start)
+            push(mem, out.tokens, out.numTokens, tokenCapacity, tokenSpan{start, w - start, flags});
+        inToken = false;
+
+        if (c == '|') {
+            dst[w] = '|';
+            push(mem, out.tokens, out.numTokens, tokenCapacity, tokenSpan{w, 1, TOKEN_PIPE});
+            push(mem, out.stages, out.numStages, stageCapacity, out.numTokens);
+            w++;
+        }
     }
+
+    if (inToken && w > start)
+        push(mem, out.tokens, out.numTokens, tokenCapacity, tokenSpan{start, w - start, flags});
+    out.line = dst;
+    return out.numTokens;
+}
+
+string tokenString(const tokenizedLine& parsed, size_t i) {
+    return string(parsed.line + parsed.tokens[i].offset, parsed.tokens[i].length);
+}
+
+vector<string> tokenStrings(const tokenizedLine& parsed) {
+    vector<string> tokens;
+    tokens.reserve(parsed.numTokens);
+    for (size_t i = 0; i < parsed.numTokens; i++)
+        tokens.push_back(tokenString(parsed, i));
     return tokens;
 }
 
-vector<vector<string>> parsePipeTokens(vector<string> tokens) {
-    vector<vector<string>> parsedTokens;
-    // Create a temporary vector for a single token group. Fill it and add it to parsedTokens on pipe character
-    vector<string> temp;
-    size_t num_tokens = tokens.size();
-
-    for (size_t i = 0; i < num_tokens; i++) {
-        if (tokens[i] != "|") {
-            temp.push_back(tokens[i]);
-        } else {
-            parsedTokens.push_back(temp);
-            temp.clear();
-        }
+vector<vector<string>> stageStrings(const tokenizedLine& parsed) {
+    vector<vector<string>> stages(parsed.numStages);
+    for (size_t s = 0; s < parsed.numStages; s++) {
+        // Each stage but the last ends with the pipe that starts the next one
+        size_t end = s + 1 < parsed.numStages ? parsed.stages[s + 1] - 1 : parsed.numTokens;
+        stages[s].reserve(end - parsed.stages[s]);
+        for (size_t i = parsed.stages[s]; i < end; i++)
+            stages[s].push_back(tokenString(parsed, i));
     }
-    parsedTokens.push_back(temp);
+    return stages;
+}
 
-    return parsedTokens;
+vector<string> tokenize(char* line) {
+    if (line == NULL) {
+        return {};
+    }
+
+    static arena mem;
+    arenaMark mark = arenaSave(mem);
+    tokenizedLine parsed;
+    tokenizeLine(line, strlen(line), mem, parsed);
+    vector<string> tokens = tokenStrings(parsed);
+    arenaRestore(mem, mark);
+    return tokens;
 }
@@ -1,38 +1,134 @@
 #ifndef TOKENIZER_H_
 #define TOKENIZER_H_
 
+#include <stddef.h>
+
 #include <vector>
 #include <string>
 
-#define MAXTOKEN 1024
+#include "arena.h"
+
+#define TOKEN_QUOTED 1  // Some of the token was quoted or escaped
+#define TOKEN_PIPE 2    // An unquoted `|`, separating two stages of a pipeline
+#define TOKEN_GLOB 4    // Some of the token is an unquoted `*`, `?` or `[`
+
+#define TOKENIZE_EXPAND 1  // Options of `tokenizeLine`: expand variables
+#define TOKENIZE_GLOB 2    // and flag glob patterns
 
 /*
-	vector<string> tokenize(const char *line)
+	struct tokenSpan
+	One token, as a range of the tokenized line
 	------------------
-	Tokenize the input line into a vector of strings and return
+	Members:
+		offset: size_t -> Index of the first character of the token in the line
+		length: size_t -> Length of the token. Tokens are not NUL terminated
+		flags: int -> TOKEN_QUOTED, TOKEN_PIPE and TOKEN_GLOB
+	------------------
+*/
+struct tokenSpan {
+    size_t offset;
+    size_t length;
+    int flags;
+};
 
-	Parameters:
+/*
+	struct tokenizedLine
+	The result of `tokenizeLine`. The arrays live in the arena given to it
 	------------------
-	line: const char *
-		The input as received by the `readline` function call made in the main shell loop
+	Members:
+		line: char * -> The input line, with quotes and escapes removed in place. With variables
+			expanded, it can be a copy in the arena instead
+		tokens: tokenSpan * -> Every token, pipes included
+		numTokens: size_t -> Number of tokens
+		stages: size_t * -> Index in tokens of the first token of each pipeline stage
+		numStages: size_t -> Number of stages, 1 for a line without pipes
+	------------------
+*/
+struct tokenizedLine {
+    char* line;
+    tokenSpan* tokens;
+    size_t numTokens;
+    size_t* stages;
+    size_t numStages;
+};
 
-	Returns:
+/*
+	command_substitution: char *(*)(const char *command, size_t len, size_t &outputLen)
+		Runs the command of a substitution and returns its output, in memory from malloc that the
+		tokenizer frees, or NULL for no output. Set by the shell to `captureCommand` (see subst.h).
+		While it is NULL, as in the tokenizer benchmark, `$(` and backquotes are ordinary characters
+*/
+extern char* (*command_substitution)(const char* command, size_t len, size_t& outputLen);
+
+/*
+	size_t closingParen(const char *line, size_t r, size_t len)
 	------------------
-	tokens: vector<string>
-		A list of tokens generated from the input line
+	Index of the `)` that closes a `$(` whose command starts at line[r], or len if there is none.
+	Quotes, escapes, backquotes and nested parentheses are skipped
+*/
+size_t closingParen(const char* line, size_t r, size_t len);
 
-	The tokenizer escapes quotes, spaces and the backslash character
+/*
+	size_t tokenizeLine(char *line, size_t len, arena &mem, tokenizedLine &out, int options)
+	------------------
+	Split line into tokens, and the tokens into pipeline stages, in a single pass. Nothing is
+	copied: quotes and backslashes are removed by moving the characters of the line in place, and
+	each token is a span of the result. The spans are allocated in mem, so there is no limit on the
+	length or the number of tokens
 
+	Whitespace separates tokens, single and double quotes keep it in a token, and a backslash
+	escapes the next character in every mode. An unquoted `|` separates stages, with or without
+	whitespace around it
+
+	With TOKENIZE_EXPAND in options, `$NAME`, `${NAME}`, `$?` and `$$` are replaced by their values
+	(see vars.h), except inside single quotes. Outside double quotes and the assignments that start
+	a stage (`x=$y`), whitespace in a value separates tokens. Values are not tokenized again, so quotes and pipes in them are ordinary characters.
+	The line is still rewritten in place, unless a value is longer than its reference and there is
+	no room left behind it
+
+	With TOKENIZE_EXPAND, `$(command)` and `` `command` `` are also replaced by the output of
+	command, through `command_substitution`, and the value is treated like the value of a
+	variable. A `)` or backquote inside quotes, or escaped, does not end the command, and inside
+	backquotes `\$`, `\`` and `\\` stand for the escaped character. An unterminated substitution
+	runs to the end of the line
+
+	With TOKENIZE_GLOB, tokens with an unquoted `*`, `?` or `[` are flagged TOKEN_GLOB, for
+	`globStrings` (see glob.h). The whole token is then a pattern, quoted parts included
+
+	Runs of ordinary characters are skipped 16 bytes at a time with SSE2 when it is available
+	Returns the number of tokens
 */
-std::vector<std::string> tokenize(char* line);
+size_t tokenizeLine(char* line, size_t len, arena& mem, tokenizedLine& out, int options = 0);
 
 /*
-	vector<vector<string>> parsePipeTokens(vector<string> tokens)
+	string tokenString(const tokenizedLine &parsed, size_t i)
+	vector<string> tokenStrings(const tokenizedLine &parsed)
+	vector<vector<string>> stageStrings(const tokenizedLine &parsed)
 	------------------
-	In case the input contains pipes, split around the pipe character into individual
-	token groups. For example the input [cat, a.txt, |, grep, "some text", |, wc] is split as
-	[[cat, a.txt], [grep, "some text"], [wc]]
+	Copy tokens out of a tokenized line: one token, every token (pipes included, as "|"), or
+	the tokens of each stage (pipes excluded). For example the input
+	cat a.txt | grep "some text" | wc has the stages [[cat, a.txt], [grep, some text], [wc]]
 */
+std::string tokenString(const tokenizedLine& parsed, size_t i);
+std::vector<std::string> tokenStrings(const tokenizedLine& parsed);
+std::vector<std::vector<std::string>> stageStrings(const tokenizedLine& parsed);
+
+/*
+	vector<string> tokenize(char *line)
+	------------------
+	Tokenize the input line into a vector of strings and return. The line is modified, see
+	`tokenizeLine`
+
+	Parameters:
+	------------------
+	line: char *
+		The input as received by the `readline` function call made in the main shell loop
+
+	Returns:
+	------------------
+	tokens: vector<string>
+		A list of tokens generated from the input line
+*/
+std::vector<std::string> tokenize(char* line);
 
-std::vector<std::vector<std::string>> parsePipeTokens(std::vector<std::string> tokens);
-#endif // TOKENIZER_H_
\ No newline at end of file
+#endif // TOKENIZER_H_
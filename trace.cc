@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+using namespace std;
+
+atomic<bool> trace_enabled(false);
+
+/*
+	struct traceEvent
+	One span in a ring
+	------------------
+	Members:
+		name: const char * -> A string literal, so it needs no copy
+		start, duration: uint64_t -> traceClock time of the start, and length, in nanoseconds
+		tid: int -> Track of the span: the thread that recorded it, or the pid of a job stage
+		detail: char [] -> What the span was about, truncated to TRACE_DETAIL_SIZE - 1 bytes
+	------------------
+*/
+struct traceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    int tid;
+    char detail[TRACE_DETAIL_SIZE];
+};
+
+/*
+	struct traceRing
+	The events of one thread. Only that thread writes to it: it fills the slot at head, then moves
+	head forward, so a reader only looks at the slots before head. Rings are never freed, the
+	events of a thread that exited are still written out
+*/
+struct traceRing {
+    traceEvent events[TRACE_RING_SIZE];
+    atomic<uint64_t> head;
+    int tid;
+};
+
+// Every ring created so far. The lock is only taken when a thread records its first event
+static mutex rings_mutex;
+static vector<traceRing*> rings;
+static thread_local traceRing* thread_ring = NULL;
+
+static string trace_path;
+// Forked children inherit the rings and the exit handler, but only the shell writes the trace
+static pid_t trace_owner = -1;
+
+uint64_t traceClock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static traceRing* threadRing() {
+    if (!thread_ring) {
+        thread_ring = new traceRing();
+        thread_ring->head.store(0);
+        thread_ring->tid = syscall(SYS_gettid);
+        lock_guard<mutex> lock(rings_mutex);
+        rings.push_back(thread_ring);
+    }
+    return thread_ring;
+}
+
+void traceComplete(const char* name, uint64_t start, uint64_t end, const char* detail, int tid) {
+    if (!trace_enabled.load(memory_order_relaxed))
+        return;
+    traceRing* ring = threadRing();
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    traceEvent& event = ring->events[head % TRACE_RING_SIZE];
+    event.name = name;
+    event.start = start;
+    event.duration = end > start ? end - start : 0;
+    event.tid = tid ? tid : ring->tid;
+    event.detail[0] = '\0';
+    if (detail) {
+        strncpy(event.detail, detail, TRACE_DETAIL_SIZE - 1);
+        event.detail[TRACE_DETAIL_SIZE - 1] = '\0';
+    }
+    ring->head.store(head + 1, memory_order_release);
+}
+
+// Write s as the contents of a JSON string
+static void writeEscaped(FILE* out, const char* s) {
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+}
+
+static int writeTrace(const string& path) {
+    FILE* out = fopen(path.c_str(), "w");
+    if (!out) {
+        fprintf(stderr, "trace: %s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                 "\"args\": {\"name\": \"meta.sh\"}}",
+            trace_owner, trace_owner);
+
+    int count = 0;
+    lock_guard<mutex> lock(rings_mutex);
+    for (size_t r = 0; r < rings.size(); r++) {
+        traceRing* ring = rings[r];
+        uint64_t head = ring->head.load(memory_order_acquire);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (uint64_t i = first; i < head; i++) {
+            const traceEvent& event = ring->events[i % TRACE_RING_SIZE];
+            fprintf(out,
+                    ",\n{\"name\": \"%s\", \"cat\": \"shell\", \"ph\": \"X\", \"ts\": %.3f, "
+                    "\"dur\": %.3f, \"pid\": %d, \"tid\": %d",
+                    event.name, event.start / 1e3, event.duration / 1e3, trace_owner, event.tid);
+            if (event.detail[0]) {
+                fprintf(out, ", \"args\": {\"detail\": \"");
+                writeEscaped(out, event.detail);
+                fprintf(out, "\"}");
+            }
+            fprintf(out, "}");
+            count++;
+        }
+        ring->head.store(0, memory_order_relaxed);
+    }
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "trace: %s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    return count;
+}
+
+static void stopTraceAtExit() { stopTrace(); }
+
+int startTrace(const string& path) {
+    static bool exit_handler = false;
+    if (trace_enabled.load())
+        return -1;
+    if (!exit_handler)
+        exit_handler = atexit(stopTraceAtExit) == 0;
+    trace_path = path;
+    trace_owner = getpid();
+    lock_guard<mutex> lock(rings_mutex);
+    for (size_t r = 0; r < rings.size(); r++)
+        rings[r]->head.store(0, memory_order_relaxed);
+    trace_enabled.store(true);
+    return 0;
+}
+
+int stopTrace() {
+    if (!trace_enabled.load() || getpid() != trace_owner)
+        return 0;
+    // A thread in the middle of an event may still finish it while the rings are written out: at
+    // worst that one event is torn, which is not worth a lock on every event
+    trace_enabled.store(false);
+    return writeTrace(trace_path);
+}
+
+void initTrace() {
+    const char* path = getenv(TRACE_ENV);
+    if (path && *path)
+        startTrace(path);
+}
+
+int metash_trace(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        if (trace_enabled.load())
+            printf("trace is on, writing to %s\n", trace_path.c_str());
+        else
+            printf("trace is off\n");
+        return 0;
+    }
+
+    if (tokens[1] == "on" && tokens.size() <= 3) {
+        string path = "metash-trace." + to_string(getpid()) + ".json";
+        if (tokens.size() == 3)
+            path = tokens[2];
+        // The file is written later, maybe after a `cd`
+        char resolved[PATH_MAX];
+        if (path[0] != '/' && getcwd(resolved, sizeof(resolved)))
+            path = string(resolved) + "/" + path;
+        if (startTrace(path) < 0) {
+            printf("trace: already on, writing to %s\n", trace_path.c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+    if (tokens[1] == "off" && tokens.size() == 2) {
+        if (!trace_enabled.load()) {
+            printf("trace: not on\n");
+            return -1;
+        }
+        int count = stopTrace();
+        if (count < 0)
+            return -1;
+        printf("trace: wrote %d events to %s\n", count, trace_path.c_str());
+        return 0;
+    }
+
+    printf("usage: trace [on [file]|off]\n");
+    return -1;
+}
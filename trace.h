@@ -0,0 +1,124 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define TRACE_RING_SIZE 16384  // Events kept per thread, the oldest are overwritten
+#define TRACE_DETAIL_SIZE 48   // Bytes of the detail string (command name, line) kept per event
+#define TRACE_ENV "METASH_TRACE"
+
+/*
+	Execution tracing
+	------------------
+	When tracing is on, the shell records timestamped spans of what it does with each line:
+		readline     waiting for the user to type the line
+		command      running the whole line
+		tokenize     splitting it into tokens and pipeline stages
+		dispatch     looking up the builtin for a command
+		builtin      running a builtin in the shell
+		resolve      finding the command in PATH (or the path cache)
+		spawn        starting a process: posix_spawn (which returns once the exec is done) or fork
+		wait         waiting for a foreground job
+		stage        lifetime of each process of a job, from its start to its reaping, on a track
+			of its own named after its pid
+		prompt       rendering the prompt, and computing its slow segments on the prompt thread
+
+	Each thread appends to its own ring buffer of TRACE_RING_SIZE events, so recording takes no lock.
+	When tracing is off, a span costs one relaxed load of `trace_enabled`
+
+	The events are written as Chrome trace-event JSON, which chrome://tracing and Perfetto open
+*/
+
+/*
+	trace_enabled: atomic<bool>
+		Whether spans are recorded. Set by `startTrace` and cleared by `stopTrace`
+*/
+extern std::atomic<bool> trace_enabled;
+
+/*
+	uint64_t traceClock()
+	------------------
+	CLOCK_MONOTONIC in nanoseconds, the clock of every event
+*/
+uint64_t traceClock();
+
+/*
+	void traceComplete(const char *name, uint64_t start, uint64_t end, const char *detail, int tid)
+	------------------
+	Record a span from start to end (traceClock times). name must be a string literal. detail is
+	copied, and may be NULL. tid is the track the span is drawn on: 0 for the calling thread
+*/
+void traceComplete(const char* name, uint64_t start, uint64_t end, const char* detail = NULL,
+                   int tid = 0);
+
+/*
+	struct traceSpan
+	Records a span from its construction to the end of its scope, when tracing is on. Used through
+	TRACE_SPAN(name) and TRACE_SPAN_DETAIL(name, detail)
+*/
+struct traceSpan {
+    const char* name;
+    uint64_t start;
+    char detail[TRACE_DETAIL_SIZE];
+
+    traceSpan(const char* spanName, const char* spanDetail = NULL) : name(spanName), start(0) {
+        if (!trace_enabled.load(std::memory_order_relaxed))
+            return;
+        start = traceClock();
+        detail[0] = '\0';
+        if (spanDetail) {
+            strncpy(detail, spanDetail, TRACE_DETAIL_SIZE - 1);
+            detail[TRACE_DETAIL_SIZE - 1] = '\0';
+        }
+    }
+
+    ~traceSpan() {
+        if (start)
+            traceComplete(name, start, traceClock(), detail);
+    }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name) traceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
+#define TRACE_SPAN_DETAIL(name, detail) traceSpan TRACE_CONCAT(trace_span_, __LINE__)(name, detail)
+
+/*
+	int startTrace(const string &path)
+	------------------
+	Drop the events recorded so far and start recording, to be written to path by `stopTrace`
+	Returns 0, or -1 if tracing is already on
+*/
+int startTrace(const std::string& path);
+
+/*
+	int stopTrace()
+	------------------
+	Stop recording and write the events to the file given to `startTrace`. Also called when the
+	shell exits with tracing on
+	Returns the number of events written, or -1 if the file could not be written
+*/
+int stopTrace();
+
+/*
+	void initTrace()
+	------------------
+	Start tracing if METASH_TRACE names a file. The trace is written when the shell exits, or on
+	`trace off`
+*/
+void initTrace();
+
+/*
+	int metash_trace(const vector<string> &tokens)
+	------------------
+	`trace on [file]` starts tracing (to metash-trace.PID.json by default), `trace off` stops and
+	writes the file, `trace` shows whether tracing is on
+*/
+int metash_trace(const std::vector<std::string>& tokens);
+
+#endif // TRACE_H_
@@ -8,11 +8,12 @@
 #include <fstream>
 
 #include "utils.h"
+#include "vars.h"
 
 using namespace std;
 
-char* parse_memory(long int memory) {
-    char* response = (char*)malloc(1024 * sizeof(char));
+string parse_memory(long int memory) {
+    char response[32];
     if (memory <= 1024) {
         int mem = (int)memory;
         sprintf(response, "%dB", mem);
@@ -26,12 +27,12 @@ char* parse_memory(long int memory) {
     return response;
 }
 
-char* parse_time(long int time) {
+string parse_time(long int time) {
     int days = time / (24 * 3600);
-    int hours = (time - (days * 24 * 3600)) / 3600;
-    int minutes = (time - hours * 3600) / 60;
+    int hours = (time % (24 * 3600)) / 3600;
+    int minutes = (time % 3600) / 60;
 
-    char* response = (char*)malloc(1024 * sizeof(char));
+    char response[64];
 
     if (hours == 0) {
         sprintf(response, "%d minutes", minutes);
@@ -49,50 +50,77 @@ char* parse_time(long int time) {
     return response;
 }
 
-char* getHistoryFilename() {
-    char* histfile = (char*)malloc(BUFSIZE * sizeof(char));
-    uid_t uid = geteuid();
-    struct passwd* pw = getpwuid(uid);
-    if (!pw) {
-        histfile = NULL;
+string shellQuote(const string& value) {
+    string quoted = "'";
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value[i] == '\'')
+            quoted += "'\\''";
+        else
+            quoted += value[i];
     }
-    histfile = pw->pw_dir;
+    return quoted + "'";
+}
+
+string getHomeDirectory() {
+    // $HOME needs no passwd lookup, which can go over the network (NSS, LDAP)
+    const string* home = findVariable("HOME");
+    if (home && !home->empty())
+        return *home;
+    struct passwd* pw = getpwuid(geteuid());
+    return pw ? pw->pw_dir : "";
+}
+
+char* getHistoryFilename() {
+    string home = getHomeDirectory();
+    if (home.empty())
+        return NULL;
 
     char* fullFilePath = (char*)malloc(BUFSIZE * sizeof(char));
-    sprintf(fullFilePath, "%s/%s", histfile, HISTORYFILENAME);
+    snprintf(fullFilePath, BUFSIZE, "%s/%s", home.c_str(), HISTORYFILENAME);
     return fullFilePath;
 }
 
 string getUsername() {
-    char* username = (char*)malloc(BUFSIZE * sizeof(char));
+    static string username;
+    static bool cached = false;
+    if (cached)
+        return username;
+
     uid_t uid = geteuid();
     struct passwd* pw = getpwuid(uid);
-    if (!pw) {
-        username = (char*)"";
-    }
-    username = pw->pw_name;
-
-    return string(username);
+    if (pw)
+        username = pw->pw_name;
+    cached = true;
+    return username;
 }
 
 string getHostname() {
-    char* hostname = (char*)malloc(BUFSIZE * sizeof(char));
-    int ret = gethostname(hostname, BUFSIZE);
+    static string hostname;
+    if (!hostname.empty())
+        return hostname;
+
+    char buffer[BUFSIZE];
+    int ret = gethostname(buffer, BUFSIZE);
     if (ret < 0) {
-        hostname = (char*)"";
+        return "";
     }
-    return string(hostname);
+    hostname = buffer;
+    return hostname;
 }
 
 string getOSName() {
-    ifstream infile("/etc/os-release");
+    static string OSName;
+    if (!OSName.empty())
+        return OSName;
 
+    ifstream infile("/etc/os-release");
     if (infile.good()) {
         string temp;
         getline(infile, temp);
-        string OSName = temp.substr(temp.find("=") + 2, temp.size() - 1);
+        OSName = temp.substr(temp.find("=") + 2, temp.size() - 1);
         OSName.pop_back();
-        return OSName;
+    } else {
+        OSName = "Unknown Linux Distribution";
     }
-    return "Unknown Linux Distribution";
+    return OSName;
 }
@@ -7,23 +7,36 @@
 #define HISTORYFILENAME ".shell_history"
 
 /*
-	char *parse_memory(long int memory)
+	string parse_memory(long int memory)
 	------------------
-	Convert a long int memory to a char array with appropriate suffix (KB/MB/GB)
+	Convert a long int memory (in bytes) to a string with appropriate suffix (B/KB/MB)
 */
-char* parse_memory(long int memory);
+std::string parse_memory(long int memory);
 
 /*
-	char *parse_time(long int time)
+	string parse_time(long int time)
 	------------------
-	Convert a long int time to a char array with appropriate formatting (days, hours, minutes)
+	Convert a long int time (in seconds) to a string with appropriate formatting (days, hours,
+	minutes)
 */
-char* parse_time(long int time);
+std::string parse_time(long int time);
 
-// Store history in a file and fill it in a global variable
+/*
+	string shellQuote(const string &value)
+	------------------
+	value in single quotes, with each `'` in it written as `'\''`, so output listing aliases or
+	variables can be pasted back into the shell
+*/
+std::string shellQuote(const std::string& value);
+
+// Home directory of the user: $HOME, or the one in the passwd database
+std::string getHomeDirectory();
+
+// Path of the history file in the home directory (malloc'd), or NULL if there is no home
 char* getHistoryFilename();
 
 // Fetch Username, Hostname and OS Name from appropriate headers
+// They are looked up once and then kept for the session
 std::string getUsername();
 std::string getHostname();
 std::string getOSName();
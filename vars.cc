@@ -0,0 +1,260 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#include "pathcache.h"
+#include "utils.h"
+#include "vars.h"
+
+using namespace std;
+
+extern char** environ;
+
+int last_status = 0;
+
+/*
+	struct shellVariable
+	------------------
+	Members:
+		value: string -> The value
+		exported: bool -> Passed to the commands the shell runs
+	------------------
+*/
+struct shellVariable {
+    string value;
+    bool exported;
+};
+
+static unordered_map<string, shellVariable> variables;
+static bool variables_loaded = false;
+
+// The cached envp: the NAME=value strings of the exported variables, and pointers to them
+static vector<string> env_strings;
+static vector<char*> env_pointers;
+static bool env_dirty = true;
+
+// Fill the table from the environment the shell started with, the first time it is needed
+static unordered_map<string, shellVariable>& table() {
+    if (!variables_loaded) {
+        variables_loaded = true;
+        for (char** entry = environ; *entry != NULL; entry++) {
+            const char* equals = strchr(*entry, '=');
+            if (equals != NULL && equals != *entry)
+                variables[string(*entry, equals - *entry)] = shellVariable{equals + 1, true};
+        }
+    }
+    return variables;
+}
+
+void reloadVariables() {
+    string path;
+    const string* before = variables_loaded ? findVariable("PATH") : NULL;
+    if (before)
+        path = *before;
+    bool hadPath = before != NULL;
+
+    variables.clear();
+    variables_loaded = false;
+    env_dirty = true;
+    // The path cache stays warm for an unchanged PATH
+    const string* after = findVariable("PATH");
+    if (hadPath != (after != NULL) || (after && *after != path))
+        clearPathCache();
+}
+
+const string* findVariable(const string& name) {
+    unordered_map<string, shellVariable>::const_iterator it = table().find(name);
+    return it == variables.end() ? NULL : &it->second.value;
+}
+
+const char* expandVariable(const char* name, size_t len, size_t& valueLen) {
+    static char number[24];
+    if (len == 1 && (name[0] == '?' || name[0] == '$')) {
+        int n = snprintf(number, sizeof(number), "%d", name[0] == '?' ? last_status : getpid());
+        valueLen = n;
+        return number;
+    }
+
+    const string* value = findVariable(string(name, len));
+    if (value == NULL)
+        return NULL;
+    valueLen = value->size();
+    return value->data();
+}
+
+// Note that PATH lookups and the envp cache depend on the variable that changed
+static void changed(const string& name, bool exported) {
+    if (exported)
+        env_dirty = true;
+    if (name == "PATH")
+        clearPathCache();
+}
+
+void setVariable(const string& name, const string& value, bool exported) {
+    shellVariable& variable = table()[name];
+    variable.value = value;
+    variable.exported = variable.exported || exported;
+    changed(name, variable.exported);
+}
+
+void unsetVariable(const string& name) {
+    unordered_map<string, shellVariable>::iterator it = table().find(name);
+    if (it == variables.end())
+        return;
+    bool exported = it->second.exported;
+    variables.erase(it);
+    changed(name, exported);
+}
+
+bool isAssignment(const string& token) {
+    size_t equals = token.find('=');
+    if (equals == 0 || equals == string::npos || isdigit((unsigned char)token[0]))
+        return false;
+    for (size_t i = 0; i < equals; i++) {
+        if (!isalnum((unsigned char)token[i]) && token[i] != '_')
+            return false;
+    }
+    return true;
+}
+
+size_t takeAssignments(vector<string>& tokens, vector<string>& assignments) {
+    size_t count = 0;
+    while (count < tokens.size() && isAssignment(tokens[count]))
+        count++;
+    assignments.insert(assignments.end(), tokens.begin(), tokens.begin() + count);
+    tokens.erase(tokens.begin(), tokens.begin() + count);
+    return count;
+}
+
+char** exportedEnvironment() {
+    unordered_map<string, shellVariable>& all = table();
+    if (env_dirty) {
+        env_strings.clear();
+        for (unordered_map<string, shellVariable>::const_iterator it = all.begin();
+             it != all.end(); ++it) {
+            if (it->second.exported)
+                env_strings.push_back(it->first + "=" + it->second.value);
+        }
+        // The strings do not move once they are all in place
+        env_pointers.clear();
+        for (size_t i = 0; i < env_strings.size(); i++)
+            env_pointers.push_back(&env_strings[i][0]);
+        env_pointers.push_back(NULL);
+        env_dirty = false;
+    }
+    return env_pointers.data();
+}
+
+vector<char*> commandEnvironment(const vector<string>& assignments) {
+    char** base = exportedEnvironment();
+    vector<char*> envp;
+    envp.reserve(env_pointers.size() + assignments.size());
+
+    // Later assignments win over earlier ones and over the exported variables
+    for (char** entry = base; *entry != NULL; entry++) {
+        const char* equals = strchr(*entry, '=');
+        size_t nameLen = equals - *entry;
+        bool replaced = false;
+        for (size_t i = 0; i < assignments.size() && !replaced; i++)
+            replaced = assignments[i].compare(0, nameLen + 1, *entry, nameLen + 1) == 0;
+        if (!replaced)
+            envp.push_back(*entry);
+    }
+    for (size_t i = 0; i < assignments.size(); i++) {
+        size_t nameLen = assignments[i].find('=') + 1;
+        bool replaced = false;
+        for (size_t j = i + 1; j < assignments.size() && !replaced; j++)
+            replaced = assignments[j].compare(0, nameLen, assignments[i], 0, nameLen) == 0;
+        if (!replaced)
+            envp.push_back((char*)assignments[i].c_str());
+    }
+    envp.push_back(NULL);
+    return envp;
+}
+
+/*
+	Builtins
+*/
+
+// Names in order, so listings are stable between runs
+static vector<string> sortedNames(bool exportedOnly) {
+    vector<string> names;
+    unordered_map<string, shellVariable>& all = table();
+    for (unordered_map<string, shellVariable>::const_iterator it = all.begin(); it != all.end();
+         ++it) {
+        if (!exportedOnly || it->second.exported)
+            names.push_back(it->first);
+    }
+    sort(names.begin(), names.end());
+    return names;
+}
+
+static void printVariable(const string& name, bool withExport) {
+    const shellVariable& variable = variables[name];
+    printf("%s%s=%s\n", withExport && variable.exported ? "export " : "", name.c_str(),
+           shellQuote(variable.value).c_str());
+}
+
+int metash_export(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        vector<string> names = sortedNames(true);
+        for (size_t i = 0; i < names.size(); i++)
+            printVariable(names[i], true);
+        return 0;
+    }
+
+    int ret = 0;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        size_t equals = tokens[i].find('=');
+        if (equals != string::npos) {
+            if (!isAssignment(tokens[i])) {
+                printf("export: not a valid name: %s\n", tokens[i].substr(0, equals).c_str());
+                ret = -1;
+                continue;
+            }
+            setVariable(tokens[i].substr(0, equals), tokens[i].substr(equals + 1), true);
+            continue;
+        }
+
+        unordered_map<string, shellVariable>::iterator it = table().find(tokens[i]);
+        if (it == variables.end()) {
+            if (!isAssignment(tokens[i] + "=")) {
+                printf("export: not a valid name: %s\n", tokens[i].c_str());
+                ret = -1;
+                continue;
+            }
+            // Like other shells, exporting an unset name creates it empty
+            setVariable(tokens[i], "", true);
+        } else if (!it->second.exported) {
+            it->second.exported = true;
+            changed(tokens[i], true);
+        }
+    }
+    return ret;
+}
+
+int metash_unset(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        printf("usage: unset name...\n");
+        return -1;
+    }
+    for (size_t i = 1; i < tokens.size(); i++)
+        unsetVariable(tokens[i]);
+    return 0;
+}
+
+int metash_vars(const vector<string>& tokens) {
+    if (tokens.size() > 1) {
+        printf("vars: too many arguments\n");
+        return -1;
+    }
+    vector<string> names = sortedNames(false);
+    for (size_t i = 0; i < names.size(); i++)
+        printVariable(names[i], true);
+    return 0;
+}
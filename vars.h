@@ -0,0 +1,102 @@
+#ifndef VARS_H_
+#define VARS_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+/*
+	Shell variables
+	------------------
+	Variables live in a hash table owned by the shell, filled from the environment the shell was
+	started with. Each one is either exported, and then passed to every command the shell runs, or
+	local to the shell. The process environment (`environ`) is left as it was at startup: children
+	get an envp array built from the exported variables instead. The array is cached and only built
+	again after an exported variable was set, exported or unset, so a spawn does not walk the table
+
+	Variables are expanded by the tokenizer (see tokenizer.h):
+		$NAME, ${NAME}   the value of NAME, empty if it is not set
+		$?               the exit status of the last command
+		$$               the pid of the shell
+	A command can be prefixed with assignments, `NAME=value... command`, which are added to the
+	environment of that command only. Assignments without a command set shell variables
+*/
+
+/*
+	last_status: int
+		Exit status of the last command that was run, for `$?`
+*/
+extern int last_status;
+
+/*
+	const string *findVariable(const string &name)
+	------------------
+	Look up a variable, exported or not
+	Returns a pointer to its value, valid until the variable is next changed, or NULL if it is unset
+*/
+const std::string* findVariable(const std::string& name);
+
+/*
+	void reloadVariables()
+	------------------
+	Forget every variable, and fill the table again from `environ`, for a process that took over
+	another environment. The path cache is cleared if that changed PATH
+*/
+void reloadVariables();
+
+/*
+	const char *expandVariable(const char *name, size_t len, size_t &valueLen)
+	------------------
+	The value that `$name` expands to, for the tokenizer. name is not NUL terminated, and can also
+	be `?` or `$`. The value stays valid until the next call or the next change of the variable
+	Returns the value and sets valueLen, or returns NULL if the variable is unset
+*/
+const char* expandVariable(const char* name, size_t len, size_t& valueLen);
+
+/*
+	void setVariable(const string &name, const string &value, bool exported)
+	void unsetVariable(const string &name)
+	------------------
+	Set or remove a variable. setVariable exports it when exported is true, and otherwise keeps a
+	variable that already exists exported. Changing PATH clears the command path cache
+*/
+void setVariable(const std::string& name, const std::string& value, bool exported = false);
+void unsetVariable(const std::string& name);
+
+/*
+	bool isAssignment(const string &token)
+	size_t takeAssignments(vector<string> &tokens, vector<string> &assignments)
+	------------------
+	isAssignment tells whether token has the form NAME=value, with NAME made of letters, digits and
+	underscores and not starting with a digit. takeAssignments moves the leading assignments of
+	tokens into assignments, and returns how many there were
+*/
+bool isAssignment(const std::string& token);
+size_t takeAssignments(std::vector<std::string>& tokens, std::vector<std::string>& assignments);
+
+/*
+	char **exportedEnvironment()
+	vector<char *> commandEnvironment(const vector<string> &assignments)
+	------------------
+	exportedEnvironment returns the NULL terminated envp array of the exported variables, from the
+	cache when no exported variable changed since it was built. commandEnvironment returns the same
+	array with the NAME=value strings of assignments added, replacing any variable of the same name.
+	Its pointers refer to the cache and to assignments, which must outlive it
+*/
+char** exportedEnvironment();
+std::vector<char*> commandEnvironment(const std::vector<std::string>& assignments);
+
+/*
+	Variable builtins
+	------------------
+	export                     list the exported variables
+	export NAME[=VALUE]...     export variables, setting them first if a value is given
+	unset NAME...              remove variables
+	vars                       list every variable, with `export` in front of the exported ones
+*/
+int metash_export(const std::vector<std::string>& tokens);
+int metash_unset(const std::vector<std::string>& tokens);
+int metash_vars(const std::vector<std::string>& tokens);
+
+#endif // VARS_H_